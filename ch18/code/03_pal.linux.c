@@ -1 +0,0 @@
-../../ch03/code/pal.linux.c
\ No newline at end of file
@@ -1 +0,0 @@
-../../ch04/code/hashtable.c
\ No newline at end of file
@@ -1 +0,0 @@
-../../ch05/code/bitmap.c
\ No newline at end of file
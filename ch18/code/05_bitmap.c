@@ -0,0 +1,276 @@
+#include <gavran/internal.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// tag::bitmap_finalize_match[]
+static bool bitmap_finalize_match(bitmap_search_state_t *search) {
+  if (search->internal.current_set_bit >
+      search->internal.previous_set_bit +
+          search->input.space_required) {
+    // intentionally overflowing here
+    search->output.found_position =
+        search->internal.previous_set_bit + 1;
+    search->output.space_available_at_position =
+        (search->internal.current_set_bit -
+            search->output.found_position);
+    return true;
+  }
+  return false;
+}
+// end::bitmap_finalize_match[]
+
+// tag::bitmap_skip_words[]
+// the first word from i that is different from value, which is all
+// zeros or all ones
+static size_t bitmap_skip_words_scalar(
+    const uint64_t *bitmap, size_t i, size_t end, uint64_t value) {
+  while (i < end && bitmap[i] == value) i++;
+  return i;
+}
+
+#if defined(__x86_64__)
+// 256 bits per compare, only called if the CPU supports it
+__attribute__((target("avx2"))) static size_t bitmap_skip_words_avx2(
+    const uint64_t *bitmap, size_t i, size_t end, uint64_t value) {
+  __m256i v = _mm256_set1_epi64x((long long)value);
+  for (; i + 4 <= end; i += 4) {
+    __m256i eq = _mm256_cmpeq_epi64(
+        _mm256_loadu_si256((const void *)(bitmap + i)), v);
+    if (_mm256_movemask_epi8(eq) != -1) break;
+  }
+  return bitmap_skip_words_scalar(bitmap, i, end, value);
+}
+#endif
+
+static size_t bitmap_skip_words(
+    const uint64_t *bitmap, size_t i, size_t end, uint64_t value) {
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2"))
+    return bitmap_skip_words_avx2(bitmap, i, end, value);
+#endif
+  return bitmap_skip_words_scalar(bitmap, i, end, value);
+}
+// end::bitmap_skip_words[]
+
+// tag::bitmap_search_word_fast[]
+// a gap between the set bits of a word is shorter than 64, only the
+// free bits at its start & end can be part of a match
+static bool bitmap_search_word_large(
+    bitmap_search_state_t *search, uint64_t bitset) {
+  uint64_t base = search->internal.index * 64;
+  search->internal.current_set_bit =
+      base + (uint64_t)__builtin_ctzl(bitset);
+  if (bitmap_finalize_match(search)) {
+    search->internal.previous_set_bit =
+        search->internal.current_set_bit;
+    return true;
+  }
+  search->internal.previous_set_bit =
+      base + 63 - (uint64_t)__builtin_clzl(bitset);
+  search->internal.current_set_bit = base + 64;
+  return bitmap_finalize_match(search);
+}
+
+// any gap will do, the first one is after the run of set bits at
+// the start of the word
+static bool bitmap_search_word_single(
+    bitmap_search_state_t *search, uint64_t bitset) {
+  uint64_t base  = search->internal.index * 64;
+  uint64_t first = (uint64_t)__builtin_ctzl(bitset);
+  search->internal.current_set_bit = base + first;
+  if (bitmap_finalize_match(search)) {
+    search->internal.previous_set_bit =
+        search->internal.current_set_bit;
+    return true;
+  }
+  uint64_t last =
+      first + (uint64_t)__builtin_ctzl(~(bitset >> first)) - 1;
+  uint64_t rest = last < 63 ? bitset >> (last + 1) : 0;
+  search->internal.previous_set_bit = base + last;
+  if (rest) {
+    search->internal.current_set_bit =
+        base + last + 1 + (uint64_t)__builtin_ctzl(rest);
+    bitmap_finalize_match(search);
+    search->internal.previous_set_bit =
+        search->internal.current_set_bit;
+    return true;
+  }
+  search->internal.current_set_bit = base + 64;
+  return bitmap_finalize_match(search);
+}
+// end::bitmap_search_word_fast[]
+
+// tag::bitmap_search_word[]
+static bool bitmap_search_word(bitmap_search_state_t *search) {
+  uint64_t bitset = search->internal.current_word;
+
+  if (bitset == ULONG_MAX) {
+    // all bits are set, can skip whole thing
+    bitmap_finalize_match(search);
+    search->internal.previous_set_bit =
+        (search->internal.index + 1) * 64 - 1;
+    return false;
+  }
+
+  if (bitset == 0) {
+    search->internal.current_set_bit =
+        (search->internal.index + 1) * 64;
+    return bitmap_finalize_match(search);
+  }
+
+  // <1>
+  // no need to go over the set bits one at a time
+  if (search->input.space_required == 1)
+    return bitmap_search_word_single(search, bitset);
+  if (search->input.space_required >= 64)
+    return bitmap_search_word_large(search, bitset);
+
+  while (bitset != 0) {
+    int r = __builtin_ctzl(bitset);
+    search->internal.current_set_bit =
+        (search->internal.index) * 64 + (uint64_t)r;
+    if (search->internal.current_set_bit >
+        search->internal.previous_set_bit +
+            search->input.space_required) {
+      // intentionally overflowing here
+      search->output.found_position =
+          search->internal.previous_set_bit + 1;
+      search->output.space_available_at_position =
+          (search->internal.current_set_bit -
+              search->output.found_position);
+      search->internal.previous_set_bit =
+          search->internal.current_set_bit;
+      return true;
+    }
+    search->internal.previous_set_bit =
+        search->internal.current_set_bit;
+    bitset ^= (bitset & -bitset);
+  }
+
+  search->internal.current_set_bit =
+      (search->internal.index + 1) * 64;
+  return bitmap_finalize_match(search);
+}
+// end::bitmap_search_word[]
+
+// tag::bitmap_search_once[]
+static bool bitmap_search_once(bitmap_search_state_t *search) {
+  uint64_t original_pos = search->output.found_position;
+  do {
+    if (bitmap_search_word(search)) {
+      if (search->internal.current_set_bit % 64) {
+        // mask the already found item
+        uint64_t mask =
+            ~(ULONG_MAX << (search->internal.current_set_bit % 64));
+        search->internal.current_word |= mask;
+      } else {
+        // run out current word, but maybe we have more in the next?
+        uint64_t next = search->internal.index + 1;
+        if (next < search->input.bitmap_size &&
+            (search->input.bitmap[next] & 1) == 0) {
+          // <1>
+          // free words only make the range longer, go to the last one
+          size_t end = bitmap_skip_words(search->input.bitmap, next,
+              search->input.bitmap_size, 0);
+          search->internal.index = MAX(next, end - 1);
+          search->internal.current_word =
+              search->input.bitmap[search->internal.index];
+          continue;
+        } else {
+          search->internal.current_word = ULONG_MAX;
+        }
+      }
+      if (!bitmap_is_acceptable_match(search)) continue;
+      return true;
+    }
+    if (original_pos != search->output.found_position &&
+        bitmap_is_acceptable_match(search))
+      return true;
+    if (search->internal.current_word == ULONG_MAX) {
+      // <2>
+      // and busy words can't start one
+      size_t end = bitmap_skip_words(search->input.bitmap,
+          search->internal.index + 1, search->input.bitmap_size,
+          ULONG_MAX);
+      search->internal.previous_set_bit = end * 64 - 1;
+      search->internal.index            = end - 1;
+    }
+    search->internal.index++;
+    if (search->internal.index >= search->input.bitmap_size)
+      return false;
+    search->internal.current_word =
+        search->input.bitmap[search->internal.index];
+  } while (true);
+}
+// end::bitmap_search_once[]
+
+// tag::bitmap_search_smallest_nearby[]
+#define MAX_SEARCH_DISTANCE 64
+static bool bitmap_search_smallest_nearby(
+    bitmap_search_state_t *search) {
+  uint64_t current_pos  = 0;
+  uint64_t current_size = ULONG_MAX;
+
+  // the bigger the request range, the less we care about locality
+  size_t boundary =
+      (search->input.near_position + MAX_SEARCH_DISTANCE +
+          search->input.space_required);
+  while (bitmap_search_once(search)) {
+    if (search->input.space_required ==
+        search->output.space_available_at_position)
+      return true;  // perfect match!
+    if (current_size > search->output.space_available_at_position) {
+      current_size = search->output.space_available_at_position;
+      current_pos  = search->output.found_position;
+    }
+    if (search->input.near_position &&
+        search->output.found_position > boundary) {
+      // We have gone too far? Stop being choosy
+      if (current_size < search->output.space_available_at_position) {
+        search->output.space_available_at_position = current_size;
+        search->output.found_position              = current_pos;
+      }
+      return true;
+    }
+  }
+
+  search->output.space_available_at_position = current_size;
+  search->output.found_position              = current_pos;
+
+  return current_size != ULONG_MAX;
+}
+// end::bitmap_search_smallest_nearby[]
+
+// tag::bitmap_search[]
+bool bitmap_search(bitmap_search_state_t *search) {
+  if (!search->input.space_required ||
+      search->input.near_position / 64 >= search->input.bitmap_size)
+    return false;
+
+  search->internal.current_word     = search->input.bitmap[0];
+  search->internal.previous_set_bit = ULONG_MAX;
+
+  search->internal.search_offset = search->input.near_position / 64;
+
+  void *old_bitmap  = search->input.bitmap;
+  uint64_t old_size = search->input.bitmap_size;
+
+  search->input.bitmap += search->internal.search_offset;
+  search->input.bitmap_size -= search->internal.search_offset;
+  search->internal.search_offset *= 64;  //  pages instead of words
+
+  if (bitmap_search_smallest_nearby(search)) {
+    search->output.found_position += search->internal.search_offset;
+    return true;
+  }
+  if (!search->internal.search_offset) {
+    return false;  // already scanned it all
+  }
+
+  search->input.bitmap        = old_bitmap;
+  search->input.bitmap_size   = old_size;
+  search->input.near_position = 0;  // search all
+  return bitmap_search(search);
+}
+// end::bitmap_search[]
@@ -1 +0,0 @@
-../../ch06/code/bitmap.range.c
\ No newline at end of file
@@ -1 +0,0 @@
-../../ch10/code/db.c
\ No newline at end of file
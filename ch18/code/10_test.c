@@ -1 +0,0 @@
-../../ch10/code/test.c
\ No newline at end of file
@@ -1 +0,0 @@
-../../ch10/code/txn.alloc.c
\ No newline at end of file
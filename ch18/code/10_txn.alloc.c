@@ -0,0 +1,176 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <gavran/db.h>
+#include <gavran/infrastructure.h>
+#include <gavran/internal.h>
+
+// tag::txn_free_space_mark_range[]
+static result_t txn_free_space_mark_range(
+    txn_t *tx, uint64_t page_num, uint64_t count, bool busy) {
+  page_metadata_t *metadata;
+  ensure(txn_get_metadata(tx, 0, &metadata));
+  // <1>
+  // the bitmap is a single overflow value, its pages can't be
+  // modified on their own
+  page_t bitmap_page = {
+      .page_num = metadata->file_header.free_space_bitmap_start};
+  ensure(txn_modify_page(tx, &bitmap_page));
+  // <2>
+  // the whole range is marked in one go, once per allocation
+  uint64_t changed =
+      bitmap_set_range(bitmap_page.address, page_num, count, busy);
+  free_space_index_update(tx, page_num, count, changed, busy);
+  if (!busy) {
+    free_space_extents_add(tx, bitmap_page.address,
+        (bitmap_page.number_of_pages * PAGE_SIZE) / sizeof(uint64_t),
+        page_num, count);
+  }
+  return success();
+}
+// end::txn_free_space_mark_range[]
+
+result_t txn_is_page_busy(txn_t *tx, uint64_t page_num, bool *busy) {
+  page_metadata_t *metadata;
+  ensure(txn_get_metadata(tx, 0, &metadata));
+  uint64_t bitmap_start =
+      metadata->file_header.free_space_bitmap_start;
+  page_t bitmap_page = {.page_num = bitmap_start};
+  ensure(txn_get_page(tx, &bitmap_page));
+  *busy = bitmap_is_set(bitmap_page.address, page_num);
+  return success();
+}
+
+// tag::txn_allocate_metadata_entry[]
+static result_t txn_allocate_metadata_entry(
+    txn_t *tx, uint64_t page_num, page_metadata_t **entry) {
+  page_t meta_page = {.page_num = page_num & PAGES_IN_METADATA_MASK};
+  bool exists;
+  ensure(txn_is_page_busy(tx, meta_page.page_num, &exists));
+  ensure(txn_raw_modify_page(tx, &meta_page));
+  page_metadata_t *self = meta_page.address;
+  if (!exists) {
+    // first time, need to allocate it all
+    self->common.page_flags = page_flags_metadata;
+    ensure(txn_free_space_mark_range(
+        tx, meta_page.page_num, 1, true));
+  }
+  page_flags_t expected = meta_page.page_num ? page_flags_metadata
+                                             : page_flags_file_header;
+  ensure(self->common.page_flags == expected,
+      msg("Expected page to be metadata page, but wasn't"),
+      with(page_num, "%lu"), with(self->common.page_flags, "%x"));
+
+  page_metadata_t *metadata =
+      &self[page_num & ~PAGES_IN_METADATA_MASK];
+  ensure(!metadata->common.page_flags,
+      msg("Expected metadata entry to be empty, but was in use"),
+      with(page_num, "%lu"), with(metadata->common.page_flags, "%x"));
+
+  memset(metadata, 0, sizeof(page_metadata_t));
+  *entry = metadata;
+  return success();
+}
+// end::txn_allocate_metadata_entry[]
+
+// tag::txn_allocate_page[]
+result_t txn_allocate_page(
+    txn_t *tx, page_t *page, uint64_t nearby_hint) {
+  // end::txn_allocate_page[]
+  page_t zero = {0};
+  ensure(txn_get_page(tx, &zero));
+  uint64_t start = zero.metadata->file_header.free_space_bitmap_start;
+
+  if (!page->number_of_pages) page->number_of_pages = 1;
+
+  page_t bitmap_page = {.page_num = start};
+  ensure(txn_get_page(tx, &bitmap_page));
+  bitmap_search_state_t search = {
+      .input = {.bitmap = bitmap_page.address,
+          .bitmap_size  = (bitmap_page.number_of_pages * PAGE_SIZE) /
+                         sizeof(uint64_t),
+          .space_required = page->number_of_pages,
+          .near_position  = nearby_hint}};
+  if ((search.input.space_required & ~PAGES_IN_METADATA_MASK) == 0) {
+    // we must use one more in this cases, so the first page
+    // would "poke" into an existing range that has metadata pages
+    search.input.space_required++;
+  }
+  bool found;
+  // <1>
+  // a freed range of the right size is reused before the bitmap is
+  // searched
+  ensure(free_space_extents_take(tx, &search, &found));
+  if (!found) ensure(free_space_index_search(tx, &search, &found));
+  if (found) {
+    page->page_num = search.output.found_position;
+    ensure(txn_raw_modify_page(tx, page));
+    memset(page->address, 0, PAGE_SIZE * page->number_of_pages);
+    ensure(txn_free_space_mark_range(
+        tx, page->page_num, page->number_of_pages, true));
+    ensure(txn_allocate_metadata_entry(
+        tx, page->page_num, &page->metadata));
+    return success();
+  }
+  // tag::txn_allocate_page_end[]
+
+  if (flopped(db_try_increase_file_size(tx, page->number_of_pages))) {
+    failed(ENOSPC, msg("No more room left in the file to allocate"),
+        with(tx->state->db->handle->filename, "%s"));
+  }
+  return txn_allocate_page(tx, page, nearby_hint);
+}
+// end::txn_allocate_page_end[]
+
+// tag::txn_free_space_bitmap_metadata_range_is_free[]
+static result_t txn_free_space_bitmap_metadata_range_is_free(
+    txn_t *tx, uint64_t page_num, bool *is_free) {
+  page_t zero = {0};
+  ensure(txn_get_page(tx, &zero));
+  uint64_t start = zero.metadata->file_header.free_space_bitmap_start;
+
+  page_t bitmap_page = {.page_num = start};
+  ensure(txn_get_page(tx, &bitmap_page));
+  uint64_t *bitmap = bitmap_page.address;
+  size_t index     = page_num / 64;
+  *is_free         = bitmap[index] == 1 && bitmap[index + 1] == 0;
+  return success();
+}
+// end::txn_free_space_bitmap_metadata_range_is_free[]
+
+// tag::txn_free_page[]
+result_t txn_free_page(txn_t *tx, page_t *page) {
+  errors_assert_empty();
+
+  if ((page->number_of_pages & ~PAGES_IN_METADATA_MASK) == 0)
+    page->number_of_pages++;  // allocations on 128 pages boundary
+                              // have an extra page tacked on them
+
+  ensure(txn_modify_page(tx, page));
+  memset(page->address, 0, PAGE_SIZE * page->number_of_pages);
+
+  ensure(txn_free_space_mark_range(
+      tx, page->page_num, page->number_of_pages, false));
+
+  // <1>
+  uint64_t metadata_page_num =
+      page->page_num & PAGES_IN_METADATA_MASK;
+  if (metadata_page_num != page->page_num && page->page_num) {
+    // <2>
+    page_metadata_t *metadata;
+    ensure(txn_modify_metadata(tx, page->page_num, &metadata));
+    memset(metadata, 0, sizeof(page_metadata_t));
+
+    bool is_free;
+    ensure(txn_free_space_bitmap_metadata_range_is_free(
+        tx, metadata_page_num, &is_free));
+    if (is_free) {
+      page_t metadata_page = {.page_num = metadata_page_num};
+      ensure(txn_free_page(tx, &metadata_page));
+    }
+  }
+
+  return success();
+}
+// end::txn_free_page[]
@@ -13,6 +13,7 @@ result_t db_create(const char *path, db_options_t *options,
   size_t done = 0;
   ensure(mem_calloc((void *)&db->state, sizeof(db_state_t)));
   try_defer(db_close, *db, done);
+  ensure(pages_pool_create(db->state));
   ensure(pal_create_file(path, &db->state->handle,
                          pal_file_creation_flags_none));
   memcpy(&db->state->options, &owned_options, sizeof(db_options_t));
@@ -22,13 +23,30 @@ result_t db_create(const char *path, db_options_t *options,
   db->state->number_of_pages = db->state->handle->size / PAGE_SIZE;
   // tag::db_create_32_bits[]
   if (!(owned_options.flags & db_flags_avoid_mmap_io)) {
-    ensure(pal_mmap(db->state->handle, 0, &db->state->map));
+    // <1>
+    // the file can grow in place, see db_increase_file_size()
+    ensure(pal_mmap_with_room(db->state->handle,
+                              owned_options.maximum_size,
+                              &db->state->map));
   }
   // end::db_create_32_bits[]
+  ensure(txn_file_key_create(db->state));
   ensure(db_initialize_default_read_tx(db->state));
+  ensure(txn_epoch_create(db->state));
   ensure(wal_open_and_recover(db));
   ensure(db_init(db));
+  ensure(wal_dictionary_open(db));
   ensure(db_setup_page_validation(db));
+  ensure(pages_cache_create(db->state));
+  if (owned_options.commit_threads > 1) {
+    // the committing thread is also finalizing pages
+    ensure(workers_create(owned_options.commit_threads - 1,
+                          &db->state->commit_workers));
+  }
+  if (owned_options.flags & db_flags_wal_group_commit) {
+    // write txns on other threads wait on it, see txn_create()
+    ensure(wal_writer_start(db->state));
+  }
   done = 1;  // no need to do resource cleanup
   return success();
 }
@@ -51,6 +69,27 @@ implementation_detail result_t db_validate_options(
   options->wal_write_callback_state =
       user_options->wal_write_callback_state;
   options->wal_write_callback = user_options->wal_write_callback;
+  if (user_options->wal_group_commit_max_size)
+    options->wal_group_commit_max_size =
+        user_options->wal_group_commit_max_size;
+  if (user_options->wal_group_commit_max_txs)
+    options->wal_group_commit_max_txs =
+        user_options->wal_group_commit_max_txs;
+  if (user_options->write_back_max_io_size)
+    options->write_back_max_io_size =
+        user_options->write_back_max_io_size;
+  options->wal_recovery_threads = user_options->wal_recovery_threads;
+  options->commit_threads = user_options->commit_threads;
+  options->pages_cache_size = user_options->pages_cache_size;
+  if (user_options->wal_compression_min_size)
+    options->wal_compression_min_size =
+        user_options->wal_compression_min_size;
+  options->wal_compression_level =
+      user_options->wal_compression_level;
+  options->wal_dictionary_size = user_options->wal_dictionary_size;
+  if (user_options->wal_segments)
+    options->wal_segments = user_options->wal_segments;
+  options->page_checksum = user_options->page_checksum;
   memcpy(options->encryption_key, user_options->encryption_key,
          crypto_aead_xchacha20poly1305_ietf_KEYBYTES);
   if (!sodium_is_zero(options->encryption_key,
@@ -78,6 +117,16 @@ implementation_detail result_t db_validate_options(
                "value of 128KB"),
            with(options->wal_size, "%lu"));
   }
+  if (options->page_checksum > page_checksum_crc32c) {
+    failed(EINVAL, msg("Unknown page checksum"),
+           with(options->page_checksum, "%d"));
+  }
+  if (options->wal_segments > WAL_MAX_SEGMENTS) {
+    failed(EINVAL,
+           msg("The wal_segments cannot be more than the maximum "
+               "number of WAL segments"),
+           with(options->wal_segments, "%lu"));
+  }
 
   return success();
 }
@@ -90,6 +139,12 @@ implementation_detail void db_initialize_default_options(
   options->minimum_size = 1024 * 1024;
   options->maximum_size = UINT64_MAX;
   options->wal_size = 256 * 1024;
+  options->wal_group_commit_max_size = 128 * 1024;
+  options->wal_group_commit_max_txs = 64;
+  options->write_back_max_io_size = 1024 * 1024;
+  // a single page record can't get any smaller on disk
+  options->wal_compression_min_size = PAGE_SIZE;
+  options->wal_segments = 2;
 }
 // end::db_initialize_default_options[]
 
@@ -98,6 +153,11 @@ result_t db_close(db_t *db) {
   if (!db || !db->state) return success();  // double close?
 
   bool failure = false;
+  // pending async & group commit txs must hit the disk before we
+  // close
+  failure |= !wal_writer_stop(db->state);
+  failure |= !wal_flush(db->state);
+  workers_destroy(db->state->commit_workers);
   failure |= !pal_unmap(&db->state->map);
   failure |= !pal_close_file(db->state->handle);
   failure |= !wal_close(db->state);
@@ -112,6 +172,13 @@ result_t db_close(db_t *db) {
     db->state->last_write_tx = cur->prev_tx;
     txn_free_single_tx_state(cur);
   }
+  txn_versions_destroy(db->state);
+  txn_epoch_destroy(db->state);
+  pages_cache_destroy(db->state);
+  txn_file_key_destroy(db->state);
+  free_space_index_destroy(db->state);
+  free_space_extents_destroy(db->state);
+  pages_pool_destroy(db->state);
   free(db->state->first_read_bitmap);
   free(db->state->default_read_tx);
   free(db->state);
@@ -124,6 +191,22 @@ result_t db_close(db_t *db) {
 }
 // end::db_close[]
 
+// tag::db_flush_wal[]
+result_t db_flush_wal(db_t *db) {
+  errors_assert_empty();
+  if (db->state->wal_writer) {
+    // the writer thread owns the pending buffer
+    ensure(wal_writer_wait(db->state, db->state->last_tx_id));
+    return success();
+  }
+  // a gc on a read txn's thread may be checkpointing the WAL
+  txn_epoch_lock(db->state);
+  defer(txn_epoch_unlock, db->state);
+  ensure(wal_flush(db->state));
+  return success();
+}
+// end::db_flush_wal[]
+
 // tag::db_setup_page_validation[]
 implementation_detail result_t db_setup_page_validation(db_t *db) {
   if (db->state->options.flags & db_flags_page_validation_once) {
@@ -1 +0,0 @@
-../../ch12/code/pages.c
\ No newline at end of file
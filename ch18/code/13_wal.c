@@ -1 +0,0 @@
-../../ch13/code/wal.c
\ No newline at end of file
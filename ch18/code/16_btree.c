@@ -1 +0,0 @@
-../../ch16/code/btree.c
\ No newline at end of file
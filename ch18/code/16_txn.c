@@ -1 +0,0 @@
-../../ch16/code/txn.c
\ No newline at end of file
@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <gavran/internal.h>
+
+#include "bench.h"
+
+#define ALLOC_COUNT 1024
+#define ALLOC_RUNS 3
+
+// tag::allocation_latency[]
+// txn_allocate_page() latency in files of 64MB, 512MB & 2GB that are
+// 50%, 90% & 99% full, with the free pages scattered one by one. A
+// txn allocates single pages or runs of 16 pages near random hints,
+// churn allocates & frees a single page with no hint. Allocations
+// copy & zero their pages, bitmap & index time the search alone
+static uint64_t alloc_next(uint64_t *seed) {
+  *seed = *seed * 6364136223846793005UL + 1442695040888963407UL;
+  return *seed >> 33;
+}
+
+// marks the pages busy in the bitmap directly, allocating them one
+// at a time would take longer than the bench. Each metadata page is
+// set up, the allocator expects to find it when its range is in use
+static result_t alloc_fill(db_t *db, uint64_t fill) {
+  txn_t w;
+  ensure(txn_create(db, TX_WRITE, &w));
+  defer(txn_close, w);
+  page_t zero = {0};
+  ensure(txn_get_page(&w, &zero));
+  page_t bitmap_page = {
+      .page_num = zero.metadata->file_header.free_space_bitmap_start};
+  ensure(txn_modify_page(&w, &bitmap_page));
+  uint64_t *bitmap = bitmap_page.address;
+  uint64_t seed    = 1;
+  for (uint64_t p = 0; p < w.state->number_of_pages; p++) {
+    if (bitmap_is_set(bitmap, p)) continue;
+    if ((p & PAGES_IN_METADATA_MASK) == p) {
+      page_t meta = {.page_num = p};
+      ensure(txn_raw_modify_page(&w, &meta));
+      page_metadata_t *self   = meta.address;
+      self->common.page_flags = page_flags_metadata;
+      bitmap_set_range(bitmap, p, 1, true);
+      continue;
+    }
+    if (alloc_next(&seed) % 100 < fill) {
+      bitmap_set_range(bitmap, p, 1, true);
+    }
+  }
+  ensure(txn_commit(&w));
+  return success();
+}
+
+// the mean & max ns per allocation, the txn is rolled back so each
+// run starts from the same file
+static result_t alloc_run(db_t *db, uint32_t pages, bool churn,
+    double *mean, double *max) {
+  txn_t w;
+  ensure(txn_create(db, TX_WRITE, &w));
+  defer(txn_close, w);
+  uint64_t seed = 1, total = 0, worst = 0;
+  // the first one builds the free space index & extents
+  page_t first = {.number_of_pages = 1};
+  ensure(txn_allocate_page(&w, &first, 0));
+  for (size_t i = 0; i < ALLOC_COUNT; i++) {
+    page_t p = {.number_of_pages = pages};
+    uint64_t hint =
+        churn ? 0 : alloc_next(&seed) % w.state->number_of_pages;
+    uint64_t start = bench_now_ns();
+    ensure(txn_allocate_page(&w, &p, hint));
+    if (churn) {
+      p.metadata->overflow.page_flags      = page_flags_overflow;
+      p.metadata->overflow.number_of_pages = 1;
+      ensure(txn_free_page(&w, &p));
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    total += elapsed;
+    worst = MAX(worst, elapsed);
+  }
+  double run_mean = (double)total / ALLOC_COUNT;
+  if (*mean == 0 || run_mean < *mean) {
+    *mean = run_mean;
+    *max  = (double)worst;
+  }
+  return success();
+}
+
+// <1>
+// the search alone, for the same random hints. bitmap_search() over
+// the whole bitmap is how pages were found before the free space
+// index. Nothing is marked, so the file doesn't change
+static result_t alloc_search(
+    db_t *db, uint32_t pages, bool use_index, double *mean) {
+  txn_t w;
+  ensure(txn_create(db, TX_WRITE, &w));
+  defer(txn_close, w);
+  page_t zero = {0};
+  ensure(txn_get_page(&w, &zero));
+  page_t bitmap_page = {
+      .page_num = zero.metadata->file_header.free_space_bitmap_start};
+  ensure(txn_get_page(&w, &bitmap_page));
+  uint64_t seed = 1, total = 0;
+  for (size_t i = 0; i <= ALLOC_COUNT; i++) {
+    bitmap_search_state_t search = {
+        .input = {.bitmap = bitmap_page.address,
+            .bitmap_size =
+                (bitmap_page.number_of_pages * PAGE_SIZE) /
+                sizeof(uint64_t),
+            .space_required = pages,
+            .near_position =
+                alloc_next(&seed) % w.state->number_of_pages}};
+    bool found;
+    uint64_t start = bench_now_ns();
+    if (use_index) {
+      ensure(free_space_index_search(&w, &search, &found));
+    } else {
+      found = bitmap_search(&search);
+    }
+    // the first one builds the index. Without a free run, the
+    // allocation grows the file instead
+    if (i) total += bench_now_ns() - start;
+    (void)found;
+  }
+  double run_mean = (double)total / ALLOC_COUNT;
+  if (*mean == 0 || run_mean < *mean) *mean = run_mean;
+  return success();
+}
+
+static result_t alloc_file(uint64_t size, uint64_t fill) {
+  db_options_t options = {.minimum_size = size * 1024 * 1024};
+  {
+    db_t db;
+    ensure(db_create(BENCH_DIR "/alloc", &options, &db));
+    defer(db_close, db);
+    ensure(alloc_fill(&db, fill));
+  }
+  // the allocator starts from the bitmap on disk
+  db_t db;
+  ensure(db_create(BENCH_DIR "/alloc", &options, &db));
+  defer(db_close, db);
+  uint32_t pages[] = {1, 16};
+  for (size_t p = 0; p < 2; p++) {
+    double mean = 0, max = 0, bitmap = 0, index = 0, churn = 0;
+    double churn_max = 0;
+    for (size_t r = 0; r < ALLOC_RUNS; r++) {
+      ensure(alloc_run(&db, pages[p], false, &mean, &max));
+      ensure(alloc_search(&db, pages[p], false, &bitmap));
+      ensure(alloc_search(&db, pages[p], true, &index));
+      if (pages[p] == 1) {
+        ensure(alloc_run(&db, 1, true, &churn, &churn_max));
+      }
+    }
+    printf("%4luMB %3lu%% %5u %7.0f / %7.0f %8.0f %8.0f", size, fill,
+        pages[p], mean, max, bitmap, index);
+    if (pages[p] == 1) {
+      printf(" %7.0f\n", churn);
+    } else {
+      printf(" %7s\n", "-");
+    }
+  }
+  return success();
+}
+
+result_t bench_allocation_latency(void) {
+  uint64_t sizes[] = {64, 512, 2048};  // MB
+  uint64_t fills[] = {50, 90, 99};
+  printf("%-6s %-4s %5s %17s %8s %8s %7s\n", "file", "fill", "pages",
+      "alloc mean / max", "bitmap", "index", "churn");
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    for (size_t f = 0; f < sizeof(fills) / sizeof(fills[0]); f++) {
+      ensure(bench_reset_dir());
+      ensure(alloc_file(sizes[s], fills[f]),
+          with(sizes[s], "%lu"), with(fills[f], "%lu"));
+    }
+  }
+  return success();
+}
+// end::allocation_latency[]
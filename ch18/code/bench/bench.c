@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+// tag::benchmarks[]
+static bench_t benchmarks[] = {
+    {"commit_throughput",
+        "write txns/sec with 1, 8 & 64 committer threads",
+        bench_commit_throughput},
+    {"checksum_throughput",
+        "page checksum, commit & validate cost of BLAKE2b & CRC32C",
+        bench_checksum_throughput},
+    {"encrypted_reads",
+        "ns per page read on an encrypted db, with & without the "
+        "pages cache & the file key",
+        bench_encrypted_reads},
+    {"commit_finalize",
+        "commit latency of 1K, 10K & 100K modified pages by commit "
+        "threads",
+        bench_commit_finalize},
+    {"wal_recovery_time",
+        "db_create() time recovering a WAL of 4096 txns by recovery "
+        "threads",
+        bench_wal_recovery_time},
+    {"wal_page_diff",
+        "ns per page to diff btree, hash, container & overflow "
+        "pages, scalar & vectorized",
+        bench_wal_page_diff},
+    {"allocation_latency",
+        "ns per page allocation by file size & fill factor",
+        bench_allocation_latency},
+    {"read_scaling",
+        "read txns/sec with 1 to 64 reader threads & a committing "
+        "writer",
+        bench_read_scaling},
+    {"pending_reads",
+        "ns per page read with 0 to 4096 committed txns not yet in "
+        "the data file",
+        bench_pending_reads},
+};
+// end::benchmarks[]
+
+result_t bench_reset_dir(void) {
+  if (system("rm -rf " BENCH_DIR " && mkdir -p " BENCH_DIR)) {
+    failed(EIO, msg("Unable to reset the bench directory"),
+        with(BENCH_DIR, "%s"));
+  }
+  return success();
+}
+
+static bool bench_selected(int argc, char **argv, const char *name) {
+  if (argc < 2) return true;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], name)) return true;
+  }
+  return false;
+}
+
+int main(int argc, char **argv) {
+  size_t count = sizeof(benchmarks) / sizeof(benchmarks[0]);
+  int rc       = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (!bench_selected(argc, argv, benchmarks[i].name)) continue;
+    printf("\n%s: %s\n", benchmarks[i].name,
+        benchmarks[i].description);
+    if (flopped(benchmarks[i].run())) {
+      errors_print_all();
+      errors_clear();
+      rc = 1;
+    }
+  }
+  return rc;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+#include <gavran/db.h>
+
+// tag::bench_t[]
+// a named measurement, run with `gavran-bench [name...]`. Each one
+// prints its own rows, the numbers are only comparable on the same
+// machine & file system
+typedef struct bench {
+  const char *name;
+  const char *description;
+  result_t (*run)(void);
+} bench_t;
+
+#define BENCH_DIR "/tmp/db-bench"
+
+static inline uint64_t bench_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 * 1000 * 1000 +
+         (uint64_t)ts.tv_nsec;
+}
+
+result_t bench_reset_dir(void);
+// end::bench_t[]
+
+result_t bench_commit_throughput(void);
+result_t bench_encrypted_reads(void);
+result_t bench_commit_finalize(void);
+result_t bench_wal_recovery_time(void);
+result_t bench_wal_page_diff(void);
+result_t bench_allocation_latency(void);
+result_t bench_checksum_throughput(void);
+result_t bench_read_scaling(void);
+result_t bench_pending_reads(void);
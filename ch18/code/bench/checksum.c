@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <gavran/internal.h>
+#include <sodium.h>
+
+#include "bench.h"
+
+#define CHECKSUM_PAGES 1024
+#define CHECKSUM_RUNS 3
+
+// tag::checksum_throughput[]
+// the page checksums of a db created with each page_checksum_t:
+// hash     - checksum_compute() over 8KB pages, in MB/sec
+// commit   - txn_commit() of a txn that modified 1024 pages, which
+//            checksums the pages & the WAL record
+// validate - a read txn that reads the 1024 pages with
+//            db_flags_page_validation_always, per page
+static const char *checksum_names[] = {"BLAKE2b", "CRC32C"};
+
+static result_t checksum_hash(page_checksum_t kind, double *mb_sec) {
+  void *pages;
+  ensure(mem_calloc(&pages, CHECKSUM_PAGES * PAGE_SIZE));
+  defer(free, pages);
+  randombytes_buf(pages, CHECKSUM_PAGES * PAGE_SIZE);
+  uint8_t hash[CHECKSUM_BYTES];
+  for (size_t run = 0; run < CHECKSUM_RUNS; run++) {
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < CHECKSUM_PAGES; i++) {
+      ensure(checksum_compute(
+          kind, (uint8_t *)pages + i * PAGE_SIZE, PAGE_SIZE, hash));
+    }
+    double mb = (double)CHECKSUM_PAGES * PAGE_SIZE / 1024 / 1024;
+    double rate =
+        mb * 1e9 / (double)MAX(bench_now_ns() - start, 1);
+    if (rate > *mb_sec) *mb_sec = rate;
+  }
+  return success();
+}
+
+static result_t checksum_write(
+    db_t *db, uint64_t *pages, bool allocate, double *ms) {
+  txn_t w;
+  ensure(txn_create(db, TX_WRITE, &w));
+  defer(txn_close, w);
+  for (size_t i = 0; i < CHECKSUM_PAGES; i++) {
+    page_t p = {.number_of_pages = 1, .page_num = pages[i]};
+    if (allocate) {
+      ensure(txn_allocate_page(&w, &p, 0));
+      p.metadata->overflow.page_flags      = page_flags_overflow;
+      p.metadata->overflow.number_of_pages = 1;
+      pages[i]                             = p.page_num;
+    } else {
+      ensure(txn_modify_page(&w, &p));
+    }
+    randombytes_buf(p.address, PAGE_SIZE);
+  }
+  uint64_t start = bench_now_ns();
+  ensure(txn_commit(&w));
+  double elapsed = (double)(bench_now_ns() - start) / 1e6;
+  if (*ms == 0 || elapsed < *ms) *ms = elapsed;
+  return success();
+}
+
+static result_t checksum_validate(
+    db_t *db, uint64_t *pages, double *ns_per_page) {
+  txn_t r;
+  ensure(txn_create(db, TX_READ, &r));
+  defer(txn_close, r);
+  uint64_t sum   = 0;
+  uint64_t start = bench_now_ns();
+  for (size_t i = 0; i < CHECKSUM_PAGES; i++) {
+    page_t p = {.page_num = pages[i]};
+    ensure(txn_get_page(&r, &p));
+    sum += *(uint64_t *)p.address;
+  }
+  double ns = (double)(bench_now_ns() - start) / CHECKSUM_PAGES;
+  if (*ns_per_page == 0 || ns < *ns_per_page) *ns_per_page = ns;
+  // keeps the page reads from being optimized away
+  if (sum == 42) printf("\n");
+  return success();
+}
+
+static result_t checksum_run(page_checksum_t kind, uint64_t *pages,
+    double *commit_ms, double *validate_ns) {
+  ensure(bench_reset_dir());
+  db_t db;
+  db_options_t options = {.minimum_size = 64 * 1024 * 1024,
+      .wal_size                         = 64 * 1024 * 1024,
+      .flags         = db_flags_page_validation_always,
+      .page_checksum = kind};
+  ensure(db_create(BENCH_DIR "/checksum", &options, &db));
+  defer(db_close, db);
+  double ignored = 0;
+  ensure(checksum_write(&db, pages, true, &ignored));
+  for (size_t run = 0; run < CHECKSUM_RUNS; run++) {
+    ensure(checksum_write(&db, pages, false, commit_ms));
+    ensure(checksum_validate(&db, pages, validate_ns));
+  }
+  return success();
+}
+
+result_t bench_checksum_throughput(void) {
+  uint64_t *pages;
+  ensure(mem_calloc(
+      (void *)&pages, CHECKSUM_PAGES * sizeof(uint64_t)));
+  defer(free, pages);
+  printf("%-10s %14s %14s %14s\n", "checksum", "hash", "commit",
+      "validate");
+  for (page_checksum_t kind = page_checksum_blake2b;
+       kind <= page_checksum_crc32c; kind++) {
+    double mb_sec = 0, commit_ms = 0, validate_ns = 0;
+    ensure(checksum_hash(kind, &mb_sec));
+    ensure(checksum_run(kind, pages, &commit_ms, &validate_ns),
+        with(checksum_names[kind], "%s"));
+    printf("%-10s %8.0f MB/s %11.2f ms %11.0f ns\n",
+        checksum_names[kind], mb_sec, commit_ms, validate_ns);
+  }
+  return success();
+}
+// end::checksum_throughput[]
@@ -0,0 +1,196 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bench.h"
+
+#define COMMIT_TXS 2048
+
+// tag::commit_throughput[]
+// direct - each txn_commit() writes to the WAL itself
+// group  - txn_commit() hands the txn to the WAL writer, lets go of
+//          the write txn & waits. txn_create() waits its turn, so
+//          the committers don't take turns themselves
+// async  - txn_commit_async(), the committer waits for the callback
+//          after it let go of the write txn, so others queue behind
+//          it
+typedef enum commit_mode {
+  commit_mode_direct,
+  commit_mode_group,
+  commit_mode_async,
+} commit_mode_t;
+
+static const char *commit_mode_names[] = {"direct", "group", "async"};
+
+typedef struct commit_thread {
+  db_t *db;
+  // write txns are one at a time, the direct & async committers
+  // take turns
+  pthread_mutex_t *writer;
+  pthread_mutex_t lock;
+  pthread_cond_t durable_cond;
+  uint64_t page_num;
+  size_t txs;
+  commit_mode_t mode;
+  bool durable;
+  bool failed;
+  uint8_t _padding[2];
+} commit_thread_t;
+
+typedef struct commit_writes {
+  db_t *db;
+  size_t txs;
+  size_t writes;
+  uint64_t last_write_pos;
+} commit_writes_t;
+
+// the records of a single write are reported one after the other,
+// before the next write moves the position
+static void commit_count_writes(
+    void *state, uint64_t tx_id, span_t *wal_record) {
+  (void)tx_id;
+  (void)wal_record;
+  commit_writes_t *w = state;
+  if (!w->db) return;  // the db initialization
+  wal_state_t *wal = &w->db->state->wal_state;
+  uint64_t pos =
+      wal->files[wal->current_append_file_index].last_write_pos;
+  w->txs++;
+  if (pos != w->last_write_pos) w->writes++;
+  w->last_write_pos = pos;
+}
+
+static void commit_durable(
+    void *state, uint64_t tx_id, bool durable) {
+  (void)tx_id;
+  commit_thread_t *t = state;
+  pthread_mutex_lock(&t->lock);
+  t->durable = true;
+  if (!durable) t->failed = true;
+  pthread_cond_signal(&t->durable_cond);
+  pthread_mutex_unlock(&t->lock);
+}
+
+static result_t commit_one(commit_thread_t *t) {
+  txn_t w;
+  ensure(txn_create(t->db, TX_WRITE, &w));
+  defer(txn_close, w);
+  page_t p = {.page_num = t->page_num};
+  ensure(txn_modify_page(&w, &p));
+  (*(uint64_t *)p.address)++;
+  if (t->mode != commit_mode_async) {
+    ensure(txn_commit(&w));
+    return success();
+  }
+  t->durable = false;
+  ensure(txn_commit_async(&w, commit_durable, t));
+  return success();
+}
+
+static void *commit_thread(void *state) {
+  commit_thread_t *t = state;
+  for (size_t i = 0; i < t->txs && !t->failed; i++) {
+    if (t->mode == commit_mode_group) {
+      t->failed = flopped(commit_one(t));
+      continue;
+    }
+    pthread_mutex_lock(t->writer);
+    t->failed = flopped(commit_one(t));
+    pthread_mutex_unlock(t->writer);
+    if (t->mode != commit_mode_async || t->failed) continue;
+    pthread_mutex_lock(&t->lock);
+    while (!t->durable) pthread_cond_wait(&t->durable_cond, &t->lock);
+    pthread_mutex_unlock(&t->lock);
+  }
+  if (t->failed) errors_print_all();
+  errors_clear();
+  return 0;
+}
+
+static result_t commit_allocate_pages(
+    db_t *db, commit_thread_t *threads, size_t count) {
+  txn_t w;
+  ensure(txn_create(db, TX_WRITE, &w));
+  defer(txn_close, w);
+  for (size_t i = 0; i < count; i++) {
+    page_t p = {.number_of_pages = 1};
+    ensure(txn_allocate_page(&w, &p, 0));
+    p.metadata->overflow.page_flags      = page_flags_overflow;
+    p.metadata->overflow.number_of_pages = 1;
+    threads[i].page_num                  = p.page_num;
+  }
+  ensure(txn_commit(&w));
+  return success();
+}
+
+static result_t commit_run(commit_mode_t mode, size_t count,
+    double *txs_per_sec, double *txs_per_write) {
+  ensure(bench_reset_dir());
+  db_t db;
+  commit_writes_t writes = {0};
+  db_options_t options   = {.minimum_size = 4 * 1024 * 1024,
+      .wal_write_callback                 = commit_count_writes,
+      .wal_write_callback_state           = &writes};
+  if (mode == commit_mode_group) {
+    options.flags = db_flags_wal_group_commit;
+  }
+  ensure(db_create(BENCH_DIR "/commit", &options, &db));
+  defer(db_close, db);
+
+  pthread_mutex_t writer = PTHREAD_MUTEX_INITIALIZER;
+  commit_thread_t threads[64];
+  pthread_t handles[64];
+  memset(threads, 0, sizeof(threads));
+  writes.db = &db;
+  ensure(commit_allocate_pages(&db, threads, count));
+  writes.txs = writes.writes = 0;
+  for (size_t i = 0; i < count; i++) {
+    threads[i].db     = &db;
+    threads[i].writer = &writer;
+    threads[i].mode   = mode;
+    threads[i].txs    = COMMIT_TXS / count;
+    pthread_mutex_init(&threads[i].lock, 0);
+    pthread_cond_init(&threads[i].durable_cond, 0);
+  }
+  uint64_t start = bench_now_ns();
+  for (size_t i = 0; i < count; i++) {
+    int rc =
+        pthread_create(&handles[i], 0, commit_thread, &threads[i]);
+    if (rc) {
+      failed(rc, msg("Unable to create committer thread"));
+    }
+  }
+  bool failures = false;
+  for (size_t i = 0; i < count; i++) {
+    pthread_join(handles[i], 0);
+    if (threads[i].failed) failures = true;
+    pthread_cond_destroy(&threads[i].durable_cond);
+    pthread_mutex_destroy(&threads[i].lock);
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+  ensure(!failures, msg("A committer thread failed"));
+  ensure(db_flush_wal(&db));
+  *txs_per_sec   = COMMIT_TXS * 1e9 / (double)elapsed;
+  *txs_per_write = (double)writes.txs / (double)MAX(writes.writes, 1);
+  return success();
+}
+
+result_t bench_commit_throughput(void) {
+  size_t counts[] = {1, 8, 64};
+  // txs/sec, with the average number of txs per WAL write
+  printf("%-10s %16s %16s %16s\n", "committers", "direct", "group",
+      "async");
+  for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+    printf("%-10zu", counts[c]);
+    for (commit_mode_t m = commit_mode_direct; m <= commit_mode_async;
+         m++) {
+      double txs_per_sec, txs_per_write;
+      ensure(commit_run(m, counts[c], &txs_per_sec, &txs_per_write),
+          with(commit_mode_names[m], "%s"));
+      printf(" %9.0f (%4.1f)", txs_per_sec, txs_per_write);
+    }
+    printf("\n");
+  }
+  return success();
+}
+// end::commit_throughput[]
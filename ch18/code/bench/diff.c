@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <gavran/internal.h>
+#include <sodium.h>
+
+#include "bench.h"
+
+#define DIFF_PAIRS 64
+#define DIFF_ROUNDS 256
+#define DIFF_RUNS 3
+#define DIFF_ENTRY 16
+
+// tag::wal_page_diff[]
+// wal_diff_page_kernel() over the kinds of changes a txn makes to a
+// page. Each workload has 1MB of (previous, modified) page pairs that
+// are diffed over and over, so the pages stay in the cache
+typedef struct diff_workload {
+  const char *name;
+  size_t pages;
+  void (*modify)(uint8_t *page, size_t size, uint64_t seed);
+} diff_workload_t;
+
+// a btree leaf at 3/4 full, an entry is inserted in the middle
+static void diff_btree_insert(
+    uint8_t *page, size_t size, uint64_t seed) {
+  size_t used = size / 4 * 3;
+  memset(page + used, 0, size - used);
+  size_t pos = (seed % (used / DIFF_ENTRY)) * DIFF_ENTRY;
+  memmove(page + pos + DIFF_ENTRY, page + pos, used - pos);
+  randombytes_buf(page + pos, DIFF_ENTRY);
+  page[0]++;  // the entries count
+}
+
+// a full hash page, a single bucket value is updated
+static void diff_hash_update(
+    uint8_t *page, size_t size, uint64_t seed) {
+  size_t pos = (seed % (size / DIFF_ENTRY)) * DIFF_ENTRY;
+  randombytes_buf(page + pos + 8, 8);
+  page[0]++;  // the page version
+}
+
+// a half full container page, an item is added from the end of the
+// free space and its offset is added to the index at the start
+static void diff_container_add(
+    uint8_t *page, size_t size, uint64_t seed) {
+  size_t used = size / 2;
+  memset(page + used / 2, 0, size - used);
+  size_t item = 32 + (seed % 8) * 16;
+  randombytes_buf(page + size - used / 2 - item, item);
+  size_t slot = (seed % (used / 8)) & ~(size_t)1;
+  page[used / 2 - 2 - slot] = (uint8_t)item;
+  page[0]++;  // the items count
+}
+
+// an 8 pages overflow value, a few bytes are patched
+static void diff_overflow_patch(
+    uint8_t *page, size_t size, uint64_t seed) {
+  randombytes_buf(page + (seed % (size - 64)), 64);
+}
+
+static diff_workload_t diff_workloads[] = {
+    {"btree", 1, diff_btree_insert},
+    {"hash", 1, diff_hash_update},
+    {"container", 1, diff_container_add},
+    {"overflow", 8, diff_overflow_patch},
+};
+
+// the best of a few runs, in ns per diffed page
+static double diff_run(diff_workload_t *w, uint8_t *pages,
+    uint8_t *output, bool scalar) {
+  size_t size  = w->pages * PAGE_SIZE;
+  size_t pairs = DIFF_PAIRS / w->pages;
+  double best  = 0;
+  for (size_t run = 0; run < DIFF_RUNS; run++) {
+    uint64_t start = bench_now_ns();
+    for (size_t r = 0; r < DIFF_ROUNDS; r++) {
+      for (size_t i = 0; i < pairs; i++) {
+        uint8_t *origin = pages + i * 2 * size;
+        wal_diff_page_kernel((uint64_t *)origin,
+            (uint64_t *)(origin + size), size / sizeof(uint64_t),
+            output, scalar);
+      }
+    }
+    double ns = (double)(bench_now_ns() - start) /
+                (double)(DIFF_ROUNDS * pairs);
+    if (!run || ns < best) best = ns;
+  }
+  return best;
+}
+
+result_t bench_wal_page_diff(void) {
+  uint8_t *pages, *output;
+  ensure(mem_calloc((void *)&pages, DIFF_PAIRS * 2 * PAGE_SIZE));
+  defer(free, pages);
+  ensure(mem_calloc((void *)&output, DIFF_PAIRS * PAGE_SIZE));
+  defer(free, output);
+  printf("%-10s %12s %12s %10s\n", "workload", "scalar", "vectorized",
+      "diff size");
+  for (size_t w = 0;
+       w < sizeof(diff_workloads) / sizeof(diff_workloads[0]); w++) {
+    size_t size   = diff_workloads[w].pages * PAGE_SIZE;
+    size_t pairs  = DIFF_PAIRS / diff_workloads[w].pages;
+    size_t bytes  = 0;
+    uint64_t seed = 1;
+    for (size_t i = 0; i < pairs; i++) {
+      uint8_t *origin = pages + i * 2 * size;
+      randombytes_buf(origin, size);
+      seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+      diff_workloads[w].modify(origin, size, seed >> 33);
+      memcpy(origin + size, origin, size);
+      seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+      diff_workloads[w].modify(origin + size, size, seed >> 33);
+      void *end = wal_diff_page_kernel((uint64_t *)origin,
+          (uint64_t *)(origin + size), size / sizeof(uint64_t),
+          output, false);
+      bytes += (size_t)((uint8_t *)end - output);
+    }
+    double scalar =
+        diff_run(&diff_workloads[w], pages, output, true);
+    double vectorized =
+        diff_run(&diff_workloads[w], pages, output, false);
+    printf("%-10s %9.0f ns %9.0f ns %8zu B\n",
+        diff_workloads[w].name, scalar, vectorized, bytes / pairs);
+  }
+  return success();
+}
+// end::wal_page_diff[]
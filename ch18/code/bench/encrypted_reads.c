@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <sodium.h>
+
+#include "bench.h"
+
+#define ENCRYPTED_PAGES 4096
+#define ENCRYPTED_HOT_PAGES 256
+#define ENCRYPTED_HOT_READS 16
+#define ENCRYPTED_RUNS 3
+
+// tag::encrypted_reads[]
+// scan - a read txn touches all the pages once
+// hot  - short read txns, each touches 16 of 256 hot pages
+// keys - derived per page, or once for the file with
+//        db_flags_encryption_file_key
+static result_t encrypted_write_pages(db_t *db, uint64_t *pages) {
+  txn_t w;
+  ensure(txn_create(db, TX_WRITE, &w));
+  defer(txn_close, w);
+  for (size_t i = 0; i < ENCRYPTED_PAGES; i++) {
+    page_t p = {.number_of_pages = 1};
+    ensure(txn_allocate_page(&w, &p, 0));
+    p.metadata->overflow.page_flags      = page_flags_overflow;
+    p.metadata->overflow.number_of_pages = 1;
+    randombytes_buf(p.address, PAGE_SIZE);
+    pages[i] = p.page_num;
+  }
+  ensure(txn_commit(&w));
+  return success();
+}
+
+static result_t encrypted_read(
+    db_t *db, uint64_t *pages, size_t count, uint64_t *sum) {
+  txn_t r;
+  ensure(txn_create(db, TX_READ, &r));
+  defer(txn_close, r);
+  for (size_t i = 0; i < count; i++) {
+    page_t p = {.page_num = pages[i]};
+    ensure(txn_get_page(&r, &p));
+    *sum += *(uint64_t *)p.address;
+  }
+  return success();
+}
+
+// the best of a few runs, in ns per page read
+static result_t encrypted_run(db_t *db, uint64_t *pages, bool hot,
+    double *ns_per_page, uint64_t *sum) {
+  uint64_t seed = 1;
+  uint64_t order[ENCRYPTED_HOT_READS];
+  *ns_per_page = 0;
+  for (size_t run = 0; run < ENCRYPTED_RUNS; run++) {
+    uint64_t start = bench_now_ns();
+    size_t reads   = 0;
+    if (hot) {
+      for (size_t t = 0; t < ENCRYPTED_PAGES; t++) {
+        for (size_t i = 0; i < ENCRYPTED_HOT_READS; i++) {
+          seed = seed * 6364136223846793005UL +
+                 1442695040888963407UL;
+          order[i] = pages[(seed >> 33) % ENCRYPTED_HOT_PAGES];
+        }
+        ensure(encrypted_read(db, order, ENCRYPTED_HOT_READS, sum));
+        reads += ENCRYPTED_HOT_READS;
+      }
+    } else {
+      for (size_t t = 0; t < 16; t++) {
+        ensure(encrypted_read(db, pages, ENCRYPTED_PAGES, sum));
+        reads += ENCRYPTED_PAGES;
+      }
+    }
+    double ns = (double)(bench_now_ns() - start) / (double)reads;
+    if (!run || ns < *ns_per_page) *ns_per_page = ns;
+  }
+  return success();
+}
+
+result_t bench_encrypted_reads(void) {
+  // shared decrypted pages, see pages.cache.c
+  size_t cache_sizes[] = {0, 512};
+  uint64_t *pages;
+  ensure(mem_calloc(
+      (void *)&pages, ENCRYPTED_PAGES * sizeof(uint64_t)));
+  defer(free, pages);
+  uint64_t sum = 0;
+  printf("%-10s %-6s %12s %12s\n", "cache", "keys", "scan", "hot");
+  for (size_t c = 0; c < sizeof(cache_sizes) / sizeof(cache_sizes[0]);
+       c++) {
+    for (size_t file_key = 0; file_key < 2; file_key++) {
+      ensure(bench_reset_dir());
+      db_t db;
+      db_options_t options = {.minimum_size = 64 * 1024 * 1024,
+          .pages_cache_size                 = cache_sizes[c]};
+      if (file_key) options.flags = db_flags_encryption_file_key;
+      randombytes_buf(options.encryption_key, 32);
+      ensure(db_create(BENCH_DIR "/encrypted", &options, &db));
+      defer(db_close, db);
+      ensure(encrypted_write_pages(&db, pages));
+      double scan, hot;
+      ensure(encrypted_run(&db, pages, false, &scan, &sum));
+      ensure(encrypted_run(&db, pages, true, &hot, &sum));
+      printf("%-10zu %-6s %9.0f ns %9.0f ns\n", cache_sizes[c],
+          file_key ? "file" : "page", scan, hot);
+    }
+  }
+  // keeps the page reads from being optimized away
+  if (sum == 42) printf("\n");
+  return success();
+}
+// end::encrypted_reads[]
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <sodium.h>
+
+#include "bench.h"
+
+#define FINALIZE_COMMITS 2
+
+// tag::commit_finalize[]
+// the latency of txn_commit() for a txn that modified every page,
+// with the pages hashed or encrypted by 0 (the committing thread
+// only), 2 or 4 commit threads
+static result_t finalize_allocate(
+    db_t *db, uint64_t *pages, size_t count) {
+  txn_t w;
+  ensure(txn_create(db, TX_WRITE, &w));
+  defer(txn_close, w);
+  for (size_t i = 0; i < count; i++) {
+    page_t p = {.number_of_pages = 1};
+    ensure(txn_allocate_page(&w, &p, 0));
+    p.metadata->overflow.page_flags      = page_flags_overflow;
+    p.metadata->overflow.number_of_pages = 1;
+    pages[i]                             = p.page_num;
+  }
+  ensure(txn_commit(&w));
+  return success();
+}
+
+static result_t finalize_commit(
+    db_t *db, uint64_t *pages, size_t count, uint64_t *elapsed) {
+  txn_t w;
+  ensure(txn_create(db, TX_WRITE, &w));
+  defer(txn_close, w);
+  for (size_t i = 0; i < count; i++) {
+    page_t p = {.page_num = pages[i]};
+    ensure(txn_modify_page(&w, &p));
+    randombytes_buf(p.address, 16);
+  }
+  uint64_t start = bench_now_ns();
+  ensure(txn_commit(&w));
+  *elapsed += bench_now_ns() - start;
+  return success();
+}
+
+static result_t finalize_run(size_t count, size_t threads,
+    bool encrypted, uint64_t *pages, double *ms) {
+  ensure(bench_reset_dir());
+  db_t db;
+  db_options_t options = {
+      .minimum_size   = (count + count / 64 + 1024) * PAGE_SIZE,
+      .commit_threads = threads};
+  if (encrypted) randombytes_buf(options.encryption_key, 32);
+  ensure(db_create(BENCH_DIR "/finalize", &options, &db));
+  defer(db_close, db);
+  ensure(finalize_allocate(&db, pages, count));
+  uint64_t elapsed = 0;
+  for (size_t i = 0; i < FINALIZE_COMMITS; i++) {
+    ensure(finalize_commit(&db, pages, count, &elapsed));
+  }
+  *ms = (double)elapsed / FINALIZE_COMMITS / 1e6;
+  return success();
+}
+
+result_t bench_commit_finalize(void) {
+  size_t counts[]  = {1000, 10000, 100000};
+  size_t threads[] = {0, 2, 4};
+  uint64_t *pages;
+  ensure(mem_calloc((void *)&pages, 100000 * sizeof(uint64_t)));
+  defer(free, pages);
+  printf("%-8s %-8s %12s %12s\n", "pages", "threads", "BLAKE2b",
+      "XChaCha20");
+  for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+    for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]);
+         t++) {
+      double hashed, encrypted;
+      ensure(finalize_run(
+                 counts[c], threads[t], false, pages, &hashed),
+          with(counts[c], "%zu"));
+      ensure(finalize_run(
+                 counts[c], threads[t], true, pages, &encrypted),
+          with(counts[c], "%zu"));
+      printf("%-8zu %-8zu %9.0f ms %9.0f ms\n", counts[c], threads[t],
+          hashed, encrypted);
+    }
+  }
+  return success();
+}
+// end::commit_finalize[]
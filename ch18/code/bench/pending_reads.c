@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "bench.h"
+
+#define PENDING_MAX_TXS 4096
+#define PENDING_READS 4096
+#define PENDING_RUNS 3
+
+// tag::pending_reads[]
+// txn_get_page() latency as committed txns pile up before they are
+// written to the data file, held back by an old read txn. Each txn
+// modifies a page of its own & a hot page that all of them modify:
+// oldest    - the page of the first pending txn
+// untouched - a page no pending txn modified, read from the file
+// hot       - the version of the hot page of the last txn
+static result_t pending_allocate(
+    db_t *db, uint64_t *pages, size_t count) {
+  txn_t w;
+  ensure(txn_create(db, TX_WRITE, &w));
+  defer(txn_close, w);
+  for (size_t i = 0; i < count; i++) {
+    page_t p = {.number_of_pages = 1};
+    ensure(txn_allocate_page(&w, &p, 0));
+    p.metadata->overflow.page_flags      = page_flags_overflow;
+    p.metadata->overflow.number_of_pages = 1;
+    pages[i]                             = p.page_num;
+  }
+  ensure(txn_commit(&w));
+  return success();
+}
+
+static result_t pending_commit(db_t *db, uint64_t page_num,
+    uint64_t hot_page_num) {
+  txn_t w;
+  ensure(txn_create(db, TX_WRITE, &w));
+  defer(txn_close, w);
+  page_t p = {.page_num = page_num};
+  ensure(txn_modify_page(&w, &p));
+  (*(uint64_t *)p.address)++;
+  page_t hot = {.page_num = hot_page_num};
+  ensure(txn_modify_page(&w, &hot));
+  (*(uint64_t *)hot.address)++;
+  ensure(txn_commit(&w));
+  return success();
+}
+
+// the best of a few runs, in ns per read
+static result_t pending_read(
+    db_t *db, uint64_t page_num, double *ns, uint64_t *sum) {
+  *ns = 0;
+  for (size_t run = 0; run < PENDING_RUNS; run++) {
+    txn_t r;
+    ensure(txn_create(db, TX_READ, &r));
+    defer(txn_close, r);
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < PENDING_READS; i++) {
+      page_t p = {.page_num = page_num};
+      ensure(txn_get_page(&r, &p));
+      *sum += *(uint64_t *)p.address;
+    }
+    double elapsed =
+        (double)(bench_now_ns() - start) / PENDING_READS;
+    if (!run || elapsed < *ns) *ns = elapsed;
+  }
+  return success();
+}
+
+result_t bench_pending_reads(void) {
+  size_t counts[] = {0, 16, 256, PENDING_MAX_TXS};
+  // the hot page & the untouched one come after the pages of the
+  // txns
+  uint64_t *pages;
+  ensure(mem_calloc(
+      (void *)&pages, (PENDING_MAX_TXS + 2) * sizeof(uint64_t)));
+  defer(free, pages);
+  uint64_t sum = 0;
+  printf("%-8s %12s %12s %12s\n", "pending", "oldest", "untouched",
+      "hot");
+  for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+    ensure(bench_reset_dir());
+    db_t db;
+    db_options_t options = {.minimum_size = 64 * 1024 * 1024};
+    ensure(db_create(BENCH_DIR "/pending", &options, &db));
+    defer(db_close, db);
+    ensure(pending_allocate(&db, pages, PENDING_MAX_TXS + 2));
+    uint64_t hot       = pages[PENDING_MAX_TXS];
+    uint64_t untouched = pages[PENDING_MAX_TXS + 1];
+    // keeps the txns below from being written to the data file
+    txn_t old;
+    ensure(txn_create(&db, TX_READ, &old));
+    defer(txn_close, old);
+    for (size_t i = 0; i < counts[c]; i++) {
+      ensure(pending_commit(&db, pages[i], hot));
+    }
+    double oldest_ns, untouched_ns, hot_ns;
+    ensure(pending_read(&db, pages[0], &oldest_ns, &sum));
+    ensure(pending_read(&db, untouched, &untouched_ns, &sum));
+    ensure(pending_read(&db, hot, &hot_ns, &sum));
+    printf("%-8zu %9.1f ns %9.1f ns %9.1f ns\n", counts[c],
+        oldest_ns, untouched_ns, hot_ns);
+  }
+  // keeps the page reads from being optimized away
+  if (sum == 42) printf("\n");
+  return success();
+}
+// end::pending_reads[]
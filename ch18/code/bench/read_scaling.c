@@ -0,0 +1,153 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bench.h"
+
+#define READ_TXS 65536
+#define READ_PAGES 256
+#define READ_PAGES_PER_TX 8
+
+// tag::read_scaling[]
+// read txns/sec over 1 to 64 reader threads, each read txn reads 8
+// of 256 pages. A writer thread commits meanwhile, so the readers
+// open & close txns while the committed state keeps moving and the
+// gc reclaims it
+typedef struct read_thread {
+  db_t *db;
+  uint64_t *pages;
+  size_t txs;
+  uint64_t seed;
+  uint64_t sum;
+  bool failed;
+  uint8_t _padding[7];
+} read_thread_t;
+
+typedef struct read_writer {
+  db_t *db;
+  uint64_t *pages;
+  size_t commits;
+  // set once the readers are done
+  bool done;
+  bool failed;
+  uint8_t _padding[6];
+} read_writer_t;
+
+static result_t read_one(read_thread_t *t) {
+  txn_t r;
+  ensure(txn_create(t->db, TX_READ, &r));
+  defer(txn_close, r);
+  for (size_t i = 0; i < READ_PAGES_PER_TX; i++) {
+    t->seed = t->seed * 6364136223846793005UL + 1442695040888963407UL;
+    page_t p = {.page_num = t->pages[(t->seed >> 33) % READ_PAGES]};
+    ensure(txn_get_page(&r, &p));
+    t->sum += *(uint64_t *)p.address;
+  }
+  return success();
+}
+
+static void *read_thread(void *state) {
+  read_thread_t *t = state;
+  for (size_t i = 0; i < t->txs && !t->failed; i++) {
+    t->failed = flopped(read_one(t));
+  }
+  if (t->failed) errors_print_all();
+  errors_clear();
+  return 0;
+}
+
+static result_t read_commit(read_writer_t *w) {
+  txn_t tx;
+  ensure(txn_create(w->db, TX_WRITE, &tx));
+  defer(txn_close, tx);
+  page_t p = {.page_num = w->pages[w->commits % READ_PAGES]};
+  ensure(txn_modify_page(&tx, &p));
+  (*(uint64_t *)p.address)++;
+  ensure(txn_commit(&tx));
+  return success();
+}
+
+static void *read_writer(void *state) {
+  read_writer_t *w = state;
+  while (!__atomic_load_n(&w->done, __ATOMIC_ACQUIRE) && !w->failed) {
+    w->failed = flopped(read_commit(w));
+    w->commits++;
+  }
+  if (w->failed) errors_print_all();
+  errors_clear();
+  return 0;
+}
+
+static result_t read_allocate_pages(db_t *db, uint64_t *pages) {
+  txn_t w;
+  ensure(txn_create(db, TX_WRITE, &w));
+  defer(txn_close, w);
+  for (size_t i = 0; i < READ_PAGES; i++) {
+    page_t p = {.number_of_pages = 1};
+    ensure(txn_allocate_page(&w, &p, 0));
+    p.metadata->overflow.page_flags      = page_flags_overflow;
+    p.metadata->overflow.number_of_pages = 1;
+    pages[i]                             = p.page_num;
+  }
+  ensure(txn_commit(&w));
+  return success();
+}
+
+static result_t read_run(size_t count, uint64_t *pages,
+    double *txs_per_sec, size_t *commits) {
+  ensure(bench_reset_dir());
+  db_t db;
+  db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+  ensure(db_create(BENCH_DIR "/read", &options, &db));
+  defer(db_close, db);
+  ensure(read_allocate_pages(&db, pages));
+
+  read_thread_t threads[64];
+  pthread_t handles[64];
+  memset(threads, 0, sizeof(threads));
+  read_writer_t writer = {.db = &db, .pages = pages};
+  pthread_t writer_handle;
+  if (pthread_create(&writer_handle, 0, read_writer, &writer)) {
+    failed(EINVAL, msg("Unable to create the writer thread"));
+  }
+  uint64_t start = bench_now_ns();
+  size_t started = 0;
+  for (; started < count; started++) {
+    threads[started].db    = &db;
+    threads[started].pages = pages;
+    threads[started].txs   = READ_TXS / count;
+    threads[started].seed  = started + 1;
+    if (pthread_create(&handles[started], 0, read_thread,
+            &threads[started])) {
+      break;
+    }
+  }
+  bool failures = started != count;
+  for (size_t i = 0; i < started; i++) {
+    pthread_join(handles[i], 0);
+    if (threads[i].failed) failures = true;
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+  __atomic_store_n(&writer.done, true, __ATOMIC_RELEASE);
+  pthread_join(writer_handle, 0);
+  ensure(!failures, msg("A reader thread failed"));
+  ensure(!writer.failed, msg("The writer thread failed"));
+  *txs_per_sec = READ_TXS * 1e9 / (double)elapsed;
+  *commits     = writer.commits;
+  return success();
+}
+
+result_t bench_read_scaling(void) {
+  size_t counts[] = {1, 2, 4, 8, 16, 32, 64};
+  uint64_t pages[READ_PAGES];
+  printf("%-8s %16s %10s\n", "readers", "read txs/sec", "commits");
+  for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+    double txs_per_sec;
+    size_t commits;
+    ensure(read_run(counts[c], pages, &txs_per_sec, &commits),
+        with(counts[c], "%zu"));
+    printf("%-8zu %16.0f %10zu\n", counts[c], txs_per_sec, commits);
+  }
+  return success();
+}
+// end::read_scaling[]
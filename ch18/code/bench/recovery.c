@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sodium.h>
+
+#include "bench.h"
+
+#define RECOVERY_PAGES 1024
+#define RECOVERY_TXS 4096
+#define RECOVERY_PAGES_PER_TX 16
+#define RECOVERY_RUNS 3
+
+// tag::wal_recovery_time[]
+// db_create() of a db whose WAL holds 4096 txns of 16 diffed pages
+// out of 1024 that never reached the data file. Recovery threads of 0
+// is the sequential recovery, 1 builds the final page images on the
+// calling thread only
+static result_t recovery_write_wal(bool encrypted) {
+  ensure(bench_reset_dir());
+  db_t db;
+  db_options_t options = {.minimum_size = 16 * 1024 * 1024,
+      .wal_size                         = 256 * 1024 * 1024};
+  if (encrypted) memset(options.encryption_key, 7, 32);
+  ensure(db_create(BENCH_DIR "/src/db", &options, &db));
+  defer(db_close, db);
+  uint64_t pages[RECOVERY_PAGES];
+  {
+    txn_t w;
+    ensure(txn_create(&db, TX_WRITE, &w));
+    defer(txn_close, w);
+    for (size_t i = 0; i < RECOVERY_PAGES; i++) {
+      page_t p = {.number_of_pages = 1};
+      ensure(txn_allocate_page(&w, &p, 0));
+      p.metadata->overflow.page_flags      = page_flags_overflow;
+      p.metadata->overflow.number_of_pages = 1;
+      pages[i]                             = p.page_num;
+    }
+    ensure(txn_commit(&w));
+  }
+  // <1>
+  // an open read txn keeps the pages out of the data file, as if the
+  // process crashed before the gc wrote them
+  txn_t leaked;
+  ensure(txn_create(&db, TX_READ, &leaked));
+  defer(free, leaked.working_set);
+  uint64_t seed = 1;
+  for (size_t tx = 0; tx < RECOVERY_TXS; tx++) {
+    txn_t w;
+    ensure(txn_create(&db, TX_WRITE, &w));
+    defer(txn_close, w);
+    for (size_t i = 0; i < RECOVERY_PAGES_PER_TX; i++) {
+      seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+      page_t p = {.page_num = pages[(seed >> 33) % RECOVERY_PAGES]};
+      ensure(txn_modify_page(&w, &p));
+      size_t offset = (seed >> 20) % (PAGE_SIZE - 64);
+      randombytes_buf(p.address + offset, 64);
+    }
+    ensure(txn_commit(&w));
+  }
+  return success();
+}
+
+static result_t recovery_open(
+    bool encrypted, size_t threads, double *ms) {
+  *ms = 0;
+  for (size_t run = 0; run < RECOVERY_RUNS; run++) {
+    if (system("rm -rf " BENCH_DIR "/run && cp -r " BENCH_DIR
+               "/src " BENCH_DIR "/run")) {
+      failed(EIO, msg("Unable to copy the recovery files"));
+    }
+    db_t db;
+    db_options_t options = {.minimum_size = 16 * 1024 * 1024,
+        .wal_size                         = 256 * 1024 * 1024,
+        .wal_recovery_threads             = threads};
+    if (encrypted) memset(options.encryption_key, 7, 32);
+    uint64_t start = bench_now_ns();
+    ensure(db_create(BENCH_DIR "/run/db", &options, &db));
+    double elapsed = (double)(bench_now_ns() - start) / 1e6;
+    ensure(db_close(&db));
+    if (!run || elapsed < *ms) *ms = elapsed;
+  }
+  return success();
+}
+
+result_t bench_wal_recovery_time(void) {
+  size_t threads[] = {0, 1, 2, 4};
+  printf("%-8s %12s %12s\n", "threads", "BLAKE2b", "XChaCha20");
+  double ms[2][4];
+  for (size_t e = 0; e < 2; e++) {
+    ensure(recovery_write_wal(e));
+    for (size_t t = 0; t < 4; t++) {
+      ensure(recovery_open(e, threads[t], &ms[e][t]));
+    }
+  }
+  for (size_t t = 0; t < 4; t++) {
+    printf("%-8zu %9.0f ms %9.0f ms\n", threads[t], ms[0][t],
+        ms[1][t]);
+  }
+  return success();
+}
+// end::wal_recovery_time[]
@@ -0,0 +1,93 @@
+#include <errno.h>
+#include <gavran/db.h>
+#include <gavran/internal.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include <pthread.h>
+#include <sodium.h>
+#include <string.h>
+
+// tag::checksum_crc32c_table[]
+// Castagnoli polynomial, reflected
+#define CRC32C_POLY 0x82F63B78
+
+static uint32_t crc32c_table[256];
+static pthread_once_t crc32c_table_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init_table(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (size_t j = 0; j < 8; j++) {
+      crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+    }
+    crc32c_table[i] = crc;
+  }
+}
+
+static uint32_t crc32c_sw(
+    uint32_t crc, const uint8_t *buf, size_t size) {
+  pthread_once(&crc32c_table_once, crc32c_init_table);
+  for (size_t i = 0; i < size; i++) {
+    crc = crc32c_table[(crc ^ buf[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return crc;
+}
+// end::checksum_crc32c_table[]
+
+#if defined(__x86_64__)
+// tag::checksum_crc32c_sse42[]
+// the crc32 instruction handles 8 bytes at a time, only called if
+// the CPU supports it
+__attribute__((target("sse4.2"))) static uint32_t crc32c_sse42(
+    uint32_t crc, const uint8_t *buf, size_t size) {
+  uint64_t crc64 = crc;
+  size_t i       = 0;
+  for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, buf + i, sizeof(uint64_t));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = (uint32_t)crc64;
+  for (; i < size; i++) {
+    crc = _mm_crc32_u8(crc, buf[i]);
+  }
+  return crc;
+}
+// end::checksum_crc32c_sse42[]
+#endif
+
+// tag::checksum_crc32c[]
+implementation_detail uint32_t checksum_crc32c(
+    const void *buf, size_t size) {
+  uint32_t crc = ~0U;
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2"))
+    return ~crc32c_sse42(crc, buf, size);
+#endif
+  return ~crc32c_sw(crc, buf, size);
+}
+// end::checksum_crc32c[]
+
+// tag::checksum_compute[]
+implementation_detail result_t checksum_compute(page_checksum_t kind,
+    const void *buf, size_t size, uint8_t hash[CHECKSUM_BYTES]) {
+  switch (kind) {
+    case page_checksum_blake2b:
+      ensure(
+          !crypto_generichash(hash, CHECKSUM_BYTES, buf, size, 0, 0),
+          msg("Unable to compute BLAKE2b hash"), with(size, "%zu"));
+      return success();
+    case page_checksum_crc32c: {
+      // the rest of the hash is zeroed, so callers can compare the
+      // whole value regardless of the kind
+      uint32_t crc = checksum_crc32c(buf, size);
+      memset(hash, 0, CHECKSUM_BYTES);
+      memcpy(hash, &crc, sizeof(uint32_t));
+      return success();
+    }
+    default:
+      failed(EINVAL, msg("Unknown page checksum"), with(kind, "%d"));
+  }
+}
+// end::checksum_compute[]
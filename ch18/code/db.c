@@ -14,10 +14,19 @@ static result_t db_init_file_header(db_t *db, txn_t *tx) {
   entry->file_header.last_tx_id = 0;
   entry->file_header.page_size_power_of_two =
       (uint8_t)(log2(PAGE_SIZE));
-  entry->file_header.version = GAVRAN_VERSION;
+  entry->file_header.version = (uint8_t)(
+      GAVRAN_VERSION | (db->state->options.page_checksum
+                           << FILE_HEADER_CHECKSUM_SHIFT));
+  if ((db->state->options.flags & db_flags_encrypted) &&
+      (db->state->options.flags & db_flags_encryption_file_key)) {
+    entry->file_header.version |= FILE_HEADER_FILE_KEY;
+  }
   memcpy(&entry->file_header.magic, FILE_HEADER_MAGIC, 5);
+  // <1>
+  // the root table ids are fixed, a larger file grows into the rest
+  // of the map once they are allocated
   entry->file_header.number_of_pages =
-      db->state->map.size / PAGE_SIZE;
+      MIN(db->state->map.size / PAGE_SIZE, BITS_IN_PAGE);
 
   return success();
 }
@@ -41,14 +50,12 @@ static result_t db_init_free_space_bitmap(txn_t *tx) {
   page_t p = {.page_num = 1, .number_of_pages = pages};
   ensure(txn_raw_modify_page(tx, &p));
   // mark header & free space pages as busy
-  for (size_t i = 0; i <= pages; i++) {
-    bitmap_set(p.address, i, true);
-  }
-  // mark as busy the pages beyond the end of the file
-  size_t end = entry->file_header.number_of_pages % BITS_IN_PAGE;
-  for (size_t i = end; i < BITS_IN_PAGE; i++) {
-    bitmap_set(p.address, i, true);
-  }
+  bitmap_set_range(p.address, 0, pages + 1, true);
+  // mark as busy the pages beyond the end of the file, up to the end
+  // of the last bitmap page
+  size_t end = (size_t)pages * BITS_IN_PAGE;
+  bitmap_set_range(p.address, entry->file_header.number_of_pages,
+      end - entry->file_header.number_of_pages, true);
   return success();
 }
 // end::db_init_free_space_bitmap[]
@@ -67,11 +74,30 @@ static result_t db_init_file_structure(db_t *db) {
   ensure(root.index_ids[0] == 2);  // ensure expected
   ensure(root.index_ids[1] == 4);  // indexes ids
 
+  uint64_t pages = db->state->map.size / PAGE_SIZE;
+  if (pages > BITS_IN_PAGE) {
+    ensure(db_finalize_new_file_size(&tx, pages));
+  }
+
   ensure(txn_commit(&tx));
   return success();
 }
 // end::db_init_file_structure[]
 
+// tag::db_use_file_key[]
+// WAL recovery validates the pages it recovered before db_init(), so
+// it sets the keys from the file header as well
+implementation_detail void db_use_file_key(
+    db_state_t *db, file_header_t *header) {
+  if (memcmp(FILE_HEADER_MAGIC, header->magic, 5)) return;  // new
+  if (header->version & FILE_HEADER_FILE_KEY) {
+    db->options.flags |= db_flags_encryption_file_key;
+  } else {
+    db->options.flags &= ~db_flags_encryption_file_key;
+  }
+}
+// end::db_use_file_key[]
+
 // tag::db_validate_file_on_startup[]
 static result_t db_validate_file_on_startup(db_t *db) {
   txn_t tx;
@@ -85,10 +111,21 @@ static result_t db_validate_file_on_startup(db_t *db) {
       msg("Unable to find valid file header magic value"),
       with(db->state->handle->filename, "%s"));
 
-  ensure(GAVRAN_VERSION == entry->file_header.version,
+  uint8_t version = entry->file_header.version;
+  ensure(GAVRAN_VERSION == (version & FILE_HEADER_VERSION_MASK),
       msg("Gavran version mismatch"), with(GAVRAN_VERSION, "%d"),
-      with(entry->file_header.version, "%d"),
-      with(db->state->handle->filename, "%s"));
+      with(version, "%d"), with(db->state->handle->filename, "%s"));
+
+  // <1>
+  // existing files keep the checksum they were created with
+  uint8_t checksum = (version & FILE_HEADER_CHECKSUM_MASK) >>
+                     FILE_HEADER_CHECKSUM_SHIFT;
+  ensure(checksum <= page_checksum_crc32c,
+      msg("Unknown page checksum in file header"),
+      with(checksum, "%d"), with(db->state->handle->filename, "%s"));
+  db->state->options.page_checksum = (page_checksum_t)checksum;
+  // and the keys of their pages
+  db_use_file_key(db->state, &entry->file_header);
 
   ensure(entry->file_header.number_of_pages * PAGE_SIZE <=
              db->state->map.size,
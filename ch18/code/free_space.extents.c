@@ -0,0 +1,237 @@
+#include <gavran/db.h>
+#include <gavran/internal.h>
+#include <stdlib.h>
+#include <string.h>
+
+// tag::free_space_extents_t[]
+// size classes of 1, 2-3, 4-7 ... 64-127 and 128+ pages
+#define FREE_SPACE_EXTENT_CLASSES 8
+// past that, freed ranges are only found through the bitmap
+#define FREE_SPACE_EXTENTS_PER_CLASS 256
+// ranges further than that from the hint are left to the bitmap
+// search, which looks near the hint first
+#define FREE_SPACE_EXTENTS_NEARBY PAGES_IN_METADATA
+// how far a freed range is merged with the free pages around it
+#define FREE_SPACE_EXTENTS_MAX_MERGE 1024
+
+typedef struct free_space_extent {
+  uint64_t page_num;
+  uint64_t count;
+} free_space_extent_t;
+
+struct free_space_extents {
+  // <1>
+  // the write txn that last changed them, like the free space index
+  uint64_t tx_id;
+  uint32_t counts[FREE_SPACE_EXTENT_CLASSES];
+  free_space_extent_t extents[FREE_SPACE_EXTENT_CLASSES]
+                             [FREE_SPACE_EXTENTS_PER_CLASS];
+  bool valid;
+  uint8_t _padding[7];
+};
+// end::free_space_extents_t[]
+
+// tag::free_space_extents_push[]
+static size_t free_space_extents_class(uint64_t count) {
+  size_t c = (size_t)(63 - __builtin_clzl(count));
+  return MIN(c, FREE_SPACE_EXTENT_CLASSES - 1);
+}
+
+static void free_space_extents_push(free_space_extents_t *extents,
+    uint64_t page_num, uint64_t count) {
+  if (!count) return;
+  size_t c = free_space_extents_class(count);
+  if (extents->counts[c] == FREE_SPACE_EXTENTS_PER_CLASS) return;
+  free_space_extent_t *e = &extents->extents[c][extents->counts[c]++];
+  e->page_num            = page_num;
+  e->count               = count;
+}
+
+static void free_space_extents_remove(
+    free_space_extents_t *extents, size_t c, size_t i) {
+  extents->counts[c]--;
+  memmove(&extents->extents[c][i], &extents->extents[c][i + 1],
+      (extents->counts[c] - i) * sizeof(free_space_extent_t));
+}
+// end::free_space_extents_push[]
+
+// tag::free_space_extents_build[]
+static void free_space_extents_build(txn_t *tx,
+    free_space_extents_t *extents, bitmap_search_state_t *s) {
+  memset(extents->counts, 0, sizeof(extents->counts));
+  uint64_t pages =
+      MIN(tx->state->number_of_pages, s->input.bitmap_size * 64);
+  uint64_t run = 0;
+  for (uint64_t i = 0; i < pages;) {
+    uint64_t word = s->input.bitmap[i / 64];
+    if (!(i % 64) && i + 64 <= pages &&
+        (word == 0 || word == UINT64_MAX)) {
+      if (word) {
+        free_space_extents_push(extents, i - run, run);
+        run = 0;
+      } else {
+        run += 64;
+      }
+      i += 64;
+      continue;
+    }
+    if (bitmap_is_set(s->input.bitmap, i)) {
+      free_space_extents_push(extents, i - run, run);
+      run = 0;
+    } else {
+      run++;
+    }
+    i++;
+  }
+  // <1>
+  // the free pages at the end of the file are left to bitmap_search,
+  // so new values are still placed near their hint
+  extents->tx_id = tx->state->tx_id;
+  extents->valid = true;
+}
+
+static result_t free_space_extents_get(txn_t *tx,
+    bitmap_search_state_t *s, free_space_extents_t **extents) {
+  db_state_t *db = tx->state->db;
+  if (!db->free_space_extents) {
+    ensure(mem_calloc((void *)&db->free_space_extents,
+        sizeof(free_space_extents_t)));
+  }
+  *extents = db->free_space_extents;
+  if (!(*extents)->valid) free_space_extents_build(tx, *extents, s);
+  return success();
+}
+// end::free_space_extents_build[]
+
+// tag::free_space_extents_take[]
+// the ranges are never removed when pages are allocated from the
+// bitmap, so they are checked before use
+static bool free_space_extents_is_free(txn_t *tx,
+    bitmap_search_state_t *s, free_space_extent_t *extent) {
+  uint64_t page_num = extent->page_num;
+  uint64_t end      = page_num + extent->count;
+  if (end > tx->state->number_of_pages ||
+      end > s->input.bitmap_size * 64)
+    return false;
+  while (page_num < end) {
+    uint64_t bit  = page_num % 64;
+    uint64_t bits = MIN(64 - bit, end - page_num);
+    uint64_t mask =
+        (bits == 64 ? UINT64_MAX : ((1UL << bits) - 1)) << bit;
+    if (s->input.bitmap[page_num / 64] & mask) return false;
+    page_num += bits;
+  }
+  return true;
+}
+
+implementation_detail result_t free_space_extents_take(
+    txn_t *tx, bitmap_search_state_t *search, bool *found) {
+  *found = false;
+  free_space_extents_t *extents;
+  ensure(free_space_extents_get(tx, search, &extents));
+  uint64_t required = search->input.space_required;
+  uint64_t near     = search->input.near_position;
+  // <1>
+  // the class of the request may have smaller ranges, the ones after
+  // it are always big enough
+  for (size_t c = free_space_extents_class(required);
+       c < FREE_SPACE_EXTENT_CLASSES; c++) {
+    bitmap_search_state_t best;
+    uint64_t best_distance = UINT64_MAX;
+    size_t best_index      = 0;
+    for (size_t i = extents->counts[c]; i-- > 0;) {
+      free_space_extent_t extent = extents->extents[c][i];
+      if (extent.count < required) continue;
+      if (!free_space_extents_is_free(tx, search, &extent)) {
+        free_space_extents_remove(extents, c, i);
+        if (best_distance != UINT64_MAX) best_index--;
+        continue;
+      }
+      // <2>
+      // same placement rules around metadata pages as the bitmap
+      bitmap_search_state_t s = {.input = search->input,
+          .output = {.found_position    = extent.page_num,
+              .space_available_at_position = extent.count}};
+      if (!bitmap_is_acceptable_match(&s)) continue;
+      uint64_t pos      = s.output.found_position;
+      uint64_t distance = pos > near ? pos - near : near - pos;
+      if (distance >= best_distance) continue;
+      best_distance = distance;
+      best_index    = i;
+      memcpy(&best, &s, sizeof(s));
+    }
+    // <3>
+    // the range closest to the hint, without a hint the lowest one
+    if (best_distance == UINT64_MAX ||
+        (near &&
+            best_distance > FREE_SPACE_EXTENTS_NEARBY + required))
+      continue;
+    free_space_extent_t extent = extents->extents[c][best_index];
+    free_space_extents_remove(extents, c, best_index);
+    uint64_t end = best.output.found_position + required;
+    free_space_extents_push(extents, extent.page_num,
+        best.output.found_position - extent.page_num);
+    free_space_extents_push(
+        extents, end, extent.page_num + extent.count - end);
+    memcpy(&search->output, &best.output, sizeof(best.output));
+    extents->tx_id = tx->state->tx_id;
+    *found         = true;
+    return success();
+  }
+  return success();
+}
+// end::free_space_extents_take[]
+
+// tag::free_space_extents_add[]
+implementation_detail void free_space_extents_add(txn_t *tx,
+    uint64_t *bitmap, uint64_t bitmap_size, uint64_t page_num,
+    uint64_t count) {
+  free_space_extents_t *extents = tx->state->db->free_space_extents;
+  if (!extents || !extents->valid) return;
+  // <1>
+  // the freed range is merged with the free pages around it, churn
+  // would otherwise leave the lists full of small ranges
+  uint64_t pages = MIN(tx->state->number_of_pages, bitmap_size * 64);
+  uint64_t start = page_num, end = page_num + count;
+  while (start && page_num - start < FREE_SPACE_EXTENTS_MAX_MERGE &&
+         !bitmap_is_set(bitmap, start - 1))
+    start--;
+  while (end < pages &&
+         end - (page_num + count) < FREE_SPACE_EXTENTS_MAX_MERGE &&
+         !bitmap_is_set(bitmap, end))
+    end++;
+  // <2>
+  // the ranges it swallowed are no longer listed on their own
+  if (start != page_num || end != page_num + count) {
+    for (size_t c = 0; c < FREE_SPACE_EXTENT_CLASSES; c++) {
+      for (size_t i = extents->counts[c]; i-- > 0;) {
+        free_space_extent_t *e = &extents->extents[c][i];
+        if (e->page_num >= start && e->page_num + e->count <= end)
+          free_space_extents_remove(extents, c, i);
+      }
+    }
+  }
+  free_space_extents_push(extents, start, end - start);
+  extents->tx_id = tx->state->tx_id;
+}
+
+implementation_detail void free_space_extents_discard(
+    txn_state_t *state) {
+  free_space_extents_t *extents = state->db->free_space_extents;
+  if (!extents) return;
+  bool rolled_back =
+      !(state->flags & TX_COMMITED) && extents->tx_id == state->tx_id;
+  // <1>
+  // ranges taken by a rolled back txn are free again, rebuilding
+  // is the only way to find them
+  if (rolled_back || (state->flags & txn_flags_apply_log)) {
+    extents->valid = false;
+  }
+}
+
+implementation_detail void free_space_extents_destroy(
+    db_state_t *db) {
+  free(db->free_space_extents);
+  db->free_space_extents = 0;
+}
+// end::free_space_extents_add[]
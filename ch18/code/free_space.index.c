@@ -0,0 +1,292 @@
+#include <gavran/db.h>
+#include <gavran/internal.h>
+#include <stdlib.h>
+#include <string.h>
+
+// tag::free_space_index_t[]
+// a block is 32MB of the file, a group is 2GB
+#define FREE_SPACE_BLOCK_WORDS 64
+#define FREE_SPACE_BLOCK_PAGES (FREE_SPACE_BLOCK_WORDS * 64)
+#define FREE_SPACE_GROUP_BLOCKS 64
+// the runs of a block are computed when the allocator needs them
+#define FREE_SPACE_RUNS_UNKNOWN UINT16_MAX
+
+typedef struct free_space_block {
+  uint16_t free;
+  uint16_t longest;
+  // the free pages at the start & end of the block
+  uint16_t leading;
+  uint16_t trailing;
+} free_space_block_t;
+
+struct free_space_index {
+  // <1>
+  // the write txn whose view of the bitmap it matches, there is only
+  // one at a time
+  uint64_t tx_id;
+  uint64_t number_of_pages;
+  size_t bitmap_words;
+  size_t number_of_blocks;
+  free_space_block_t *blocks;
+  // the free pages in each group of blocks
+  uint32_t *groups;
+  bool valid;
+  uint8_t _padding[7];
+};
+// end::free_space_index_t[]
+
+// tag::free_space_index_build[]
+static uint64_t free_space_index_word(
+    uint64_t *bitmap, size_t bitmap_words, size_t index) {
+  // past the end of the bitmap is never free
+  return index < bitmap_words ? bitmap[index] : UINT64_MAX;
+}
+
+static result_t free_space_index_build(
+    txn_t *tx, free_space_index_t *index, bitmap_search_state_t *s) {
+  size_t blocks =
+      ROUND_UP(s->input.bitmap_size, FREE_SPACE_BLOCK_WORDS);
+  size_t groups_size =
+      ROUND_UP(blocks, FREE_SPACE_GROUP_BLOCKS) * sizeof(uint32_t);
+  if (blocks != index->number_of_blocks) {
+    index->valid = false;
+    free(index->blocks);
+    free(index->groups);
+    index->groups           = 0;
+    index->number_of_blocks = 0;
+    ensure(mem_calloc(
+        (void *)&index->blocks, blocks * sizeof(free_space_block_t)));
+    ensure(mem_calloc((void *)&index->groups, groups_size));
+    index->number_of_blocks = blocks;
+  }
+  memset(index->groups, 0, groups_size);
+  for (size_t b = 0; b < blocks; b++) {
+    uint32_t busy = 0;
+    for (size_t i = 0; i < FREE_SPACE_BLOCK_WORDS; i++) {
+      busy += (uint32_t)__builtin_popcountl(free_space_index_word(
+          s->input.bitmap, s->input.bitmap_size,
+          b * FREE_SPACE_BLOCK_WORDS + i));
+    }
+    free_space_block_t *block = &index->blocks[b];
+    block->free    = (uint16_t)(FREE_SPACE_BLOCK_PAGES - busy);
+    block->longest = FREE_SPACE_RUNS_UNKNOWN;
+    index->groups[b / FREE_SPACE_GROUP_BLOCKS] += block->free;
+  }
+  index->bitmap_words    = s->input.bitmap_size;
+  index->number_of_pages = tx->state->number_of_pages;
+  index->tx_id           = tx->state->tx_id;
+  index->valid           = true;
+  return success();
+}
+
+static result_t free_space_index_get(
+    txn_t *tx, bitmap_search_state_t *s, free_space_index_t **index) {
+  db_state_t *db = tx->state->db;
+  if (!db->free_space) {
+    ensure(mem_calloc(
+        (void *)&db->free_space, sizeof(free_space_index_t)));
+  }
+  *index = db->free_space;
+  // <1>
+  // the file grew, the bitmap was moved or extended in place
+  if (!(*index)->valid ||
+      (*index)->number_of_pages != tx->state->number_of_pages ||
+      (*index)->bitmap_words != s->input.bitmap_size) {
+    ensure(free_space_index_build(tx, *index, s));
+  }
+  (*index)->tx_id = tx->state->tx_id;
+  return success();
+}
+// end::free_space_index_build[]
+
+// tag::free_space_index_update[]
+implementation_detail void free_space_index_update(txn_t *tx,
+    uint64_t page_num, uint64_t count, uint64_t changed, bool busy) {
+  free_space_index_t *index = tx->state->db->free_space;
+  if (!index || !index->valid || !count) return;
+  uint64_t end = page_num + count;
+  // <1>
+  // if some of the pages were already marked, we can't tell in which
+  // blocks they are
+  if (changed != count ||
+      index->number_of_pages != tx->state->number_of_pages ||
+      (end - 1) / FREE_SPACE_BLOCK_PAGES >= index->number_of_blocks) {
+    index->valid = false;
+    return;
+  }
+  while (page_num < end) {
+    size_t b = page_num / FREE_SPACE_BLOCK_PAGES;
+    uint16_t pages = (uint16_t)(
+        MIN(end, (b + 1) * FREE_SPACE_BLOCK_PAGES) - page_num);
+    if (busy) {
+      index->blocks[b].free -= pages;
+      index->groups[b / FREE_SPACE_GROUP_BLOCKS] -= pages;
+    } else {
+      index->blocks[b].free += pages;
+      index->groups[b / FREE_SPACE_GROUP_BLOCKS] += pages;
+    }
+    index->blocks[b].longest = FREE_SPACE_RUNS_UNKNOWN;
+    page_num += pages;
+  }
+  index->tx_id = tx->state->tx_id;
+}
+
+implementation_detail void free_space_index_discard(
+    txn_state_t *state) {
+  free_space_index_t *index = state->db->free_space;
+  if (!index) return;
+  bool rolled_back =
+      !(state->flags & TX_COMMITED) && index->tx_id == state->tx_id;
+  // <2>
+  // a shipped log changes the bitmap pages without going through it
+  if (rolled_back || (state->flags & txn_flags_apply_log)) {
+    index->valid = false;
+  }
+}
+
+implementation_detail void free_space_index_destroy(db_state_t *db) {
+  if (!db->free_space) return;
+  free(db->free_space->blocks);
+  free(db->free_space->groups);
+  free(db->free_space);
+  db->free_space = 0;
+}
+// end::free_space_index_update[]
+
+// tag::free_space_index_runs[]
+static uint16_t free_space_index_longest_in_word(uint64_t word) {
+  // the zeros between the lowest & highest set bits
+  int low  = __builtin_ctzl(word);
+  int high = 63 - __builtin_clzl(word);
+  if (high - low < 2) return 0;
+  uint64_t inner =
+      ~word & ((1UL << high) - 1) & ~((2UL << low) - 1);
+  uint16_t len = 0;
+  while (inner) {
+    inner &= inner >> 1;
+    len++;
+  }
+  return len;
+}
+
+static free_space_block_t *free_space_index_runs(
+    free_space_index_t *index, bitmap_search_state_t *s, size_t b) {
+  free_space_block_t *block = &index->blocks[b];
+  if (block->longest != FREE_SPACE_RUNS_UNKNOWN) return block;
+  if (block->free == 0 || block->free == FREE_SPACE_BLOCK_PAGES) {
+    block->longest = block->leading = block->trailing = block->free;
+    return block;
+  }
+  uint32_t run = 0, longest = 0;
+  bool has_leading = false;
+  for (size_t i = 0; i < FREE_SPACE_BLOCK_WORDS; i++) {
+    uint64_t word = free_space_index_word(s->input.bitmap,
+        s->input.bitmap_size, b * FREE_SPACE_BLOCK_WORDS + i);
+    if (word == 0) {
+      run += 64;
+      continue;
+    }
+    run += (uint32_t)__builtin_ctzl(word);
+    if (!has_leading) {
+      block->leading = (uint16_t)run;
+      has_leading    = true;
+    }
+    longest = MAX(longest, run);
+    longest = MAX(longest, free_space_index_longest_in_word(word));
+    run     = (uint32_t)__builtin_clzl(word);
+  }
+  block->trailing = (uint16_t)run;
+  block->longest  = (uint16_t)MAX(longest, run);
+  return block;
+}
+
+// <1>
+// a run of the required size may start in the block, or at its end
+// & continue in the blocks after it
+static bool free_space_index_may_fit(
+    free_space_index_t *index, bitmap_search_state_t *s, size_t b) {
+  uint64_t required = s->input.space_required;
+  // <2>
+  // any free page fits a single page, its runs aren't needed. Every
+  // allocation drops the runs of its block, so computing them would
+  // cost a scan of the block per single page allocation
+  if (required <= 1) return index->blocks[b].free > 0;
+  free_space_block_t *block = free_space_index_runs(index, s, b);
+  if (block->longest >= required) return true;
+  uint64_t run = block->trailing;
+  for (size_t next = b + 1; run && run < required &&
+                            next < index->number_of_blocks;
+       next++) {
+    block = free_space_index_runs(index, s, next);
+    run += block->leading;
+    if (block->free != FREE_SPACE_BLOCK_PAGES) break;
+  }
+  return run >= required;
+}
+// end::free_space_index_runs[]
+
+// tag::free_space_index_search[]
+static bool free_space_index_search_window(bitmap_search_state_t *s,
+    size_t start, size_t b, bitmap_search_state_t *window) {
+  // <1>
+  // room for a run from the end of the block, and to move it past a
+  // metadata page
+  uint64_t slack = s->input.space_required + 2 * PAGES_IN_METADATA;
+  size_t end = (b + 1) * FREE_SPACE_BLOCK_WORDS + slack / 64 + 1;
+  memset(window, 0, sizeof(bitmap_search_state_t));
+  window->input.bitmap = s->input.bitmap + start;
+  window->input.bitmap_size =
+      MIN(end, s->input.bitmap_size) - start;
+  window->input.space_required = s->input.space_required;
+  // <2>
+  // the smallest match in the window, it starts on a metadata range
+  // so the metadata pages are in the same place as in the bitmap
+  if (!bitmap_search(window)) return false;
+  window->output.found_position += start * 64;
+  return true;
+}
+
+static bool free_space_index_scan(free_space_index_t *index,
+    bitmap_search_state_t *s, size_t from, size_t to, size_t hint) {
+  bitmap_search_state_t window;
+  size_t b = from;
+  while (b < to) {
+    // <3>
+    // whole groups & blocks without a free page are skipped
+    if (!index->groups[b / FREE_SPACE_GROUP_BLOCKS]) {
+      b = (b / FREE_SPACE_GROUP_BLOCKS + 1) * FREE_SPACE_GROUP_BLOCKS;
+      continue;
+    }
+    if (index->blocks[b].free &&
+        free_space_index_may_fit(index, s, b)) {
+      size_t start = b * FREE_SPACE_BLOCK_WORDS;
+      if (b == hint / FREE_SPACE_BLOCK_PAGES) {
+        start = (hint / PAGES_IN_METADATA) * (PAGES_IN_METADATA / 64);
+      }
+      if (free_space_index_search_window(s, start, b, &window)) {
+        memcpy(&s->output, &window.output, sizeof(s->output));
+        return true;
+      }
+    }
+    b++;
+  }
+  return false;
+}
+
+implementation_detail result_t free_space_index_search(
+    txn_t *tx, bitmap_search_state_t *search, bool *found) {
+  free_space_index_t *index;
+  ensure(free_space_index_get(tx, search, &index));
+  size_t hint_block = MIN(
+      search->input.near_position / FREE_SPACE_BLOCK_PAGES,
+      index->number_of_blocks);
+  // <4>
+  // from the hint to the end of the file, then from its start
+  size_t blocks = index->number_of_blocks;
+  *found = free_space_index_scan(index, search, hint_block, blocks,
+               search->input.near_position) ||
+           free_space_index_scan(index, search, 0,
+               MIN(hint_block + 1, blocks), 0);
+  return success();
+}
+// end::free_space_index_search[]
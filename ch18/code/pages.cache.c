@@ -0,0 +1,272 @@
+#include <errno.h>
+#include <gavran/db.h>
+#include <gavran/internal.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PAGES_CACHE_NONE UINT32_MAX
+
+// tag::pages_cache_t[]
+typedef struct pages_cache_entry {
+  uint64_t page_num;
+  uint64_t version;
+  // txns that are borrowing the page
+  uint32_t refs;
+  // the next entry in the same bucket
+  uint32_t next;
+  // can be found by pages_cache_get()
+  bool hashed;
+  // <1>
+  // set on every hit, cleared as the clock hand passes by
+  bool referenced;
+  uint8_t _padding[6];
+} pages_cache_entry_t;
+
+struct pages_cache {
+  pthread_mutex_t lock;
+  // a power of two
+  size_t number_of_buckets;
+  size_t capacity;
+  size_t hand;
+  bool wipe;
+  uint8_t _padding[7];
+  pages_cache_stats_t stats;
+  uint32_t *buckets;
+  pages_cache_entry_t *entries;
+  // <2>
+  // the buffer of entries[i] is at buffers + i * PAGE_SIZE
+  void *buffers;
+};
+// end::pages_cache_t[]
+
+// tag::pages_cache_create[]
+implementation_detail result_t pages_cache_create(db_state_t *db) {
+  size_t capacity = db->options.pages_cache_size;
+  if (!capacity || !(db->options.flags & (db_flags_encrypted |
+                                           db_flags_avoid_mmap_io)))
+    return success();
+  // entries are indexed with 32 bits
+  capacity = MIN(capacity, PAGES_CACHE_NONE - 1);
+  size_t number_of_buckets = next_power_of_two(capacity);
+  pages_cache_t *cache;
+  ensure(mem_calloc((void *)&cache,
+      sizeof(pages_cache_t) + number_of_buckets * sizeof(uint32_t) +
+          capacity * sizeof(pages_cache_entry_t)));
+  size_t done = 0;
+  try_defer(free, cache, done);
+  cache->buckets = (uint32_t *)(cache + 1);
+  cache->entries =
+      (pages_cache_entry_t *)(cache->buckets + number_of_buckets);
+  int rc = posix_memalign(
+      &cache->buffers, PAGE_SIZE, capacity * PAGE_SIZE);
+  if (rc) {
+    failed(rc, msg("Unable to allocate the pages cache"),
+        with(capacity, "%zu"));
+  }
+  memset(cache->buckets, 0xff, number_of_buckets * sizeof(uint32_t));
+  cache->number_of_buckets = number_of_buckets;
+  cache->capacity          = capacity;
+  cache->wipe = db->options.flags & db_flags_encrypted;
+  pthread_mutex_init(&cache->lock, 0);
+  db->pages_cache = cache;
+  done            = 1;
+  return success();
+}
+
+implementation_detail void pages_cache_destroy(db_state_t *db) {
+  pages_cache_t *cache = db->pages_cache;
+  if (!cache) return;
+  if (cache->wipe) {
+    sodium_memzero(cache->buffers, cache->capacity * PAGE_SIZE);
+  }
+  free(cache->buffers);
+  pthread_mutex_destroy(&cache->lock);
+  free(cache);
+  db->pages_cache = 0;
+}
+// end::pages_cache_create[]
+
+// tag::pages_cache_get[]
+static uint32_t *pages_cache_bucket(
+    pages_cache_t *cache, uint64_t page_num, uint64_t version) {
+  uint64_t h = (page_num ^ (version * 0x9E3779B97F4A7C15UL));
+  return &cache->buckets[h & (cache->number_of_buckets - 1)];
+}
+
+static void *pages_cache_buffer(pages_cache_t *cache, uint32_t i) {
+  return cache->buffers + (size_t)i * PAGE_SIZE;
+}
+
+implementation_detail bool pages_cache_get(db_state_t *db,
+    uint64_t page_num, uint64_t version, void **buffer) {
+  pages_cache_t *cache = db->pages_cache;
+  pthread_mutex_lock(&cache->lock);
+  uint32_t i = *pages_cache_bucket(cache, page_num, version);
+  while (i != PAGES_CACHE_NONE) {
+    pages_cache_entry_t *e = &cache->entries[i];
+    if (e->page_num == page_num && e->version == version) break;
+    i = e->next;
+  }
+  if (i != PAGES_CACHE_NONE) {
+    cache->entries[i].refs++;
+    cache->entries[i].referenced = true;
+    cache->stats.hits++;
+    *buffer = pages_cache_buffer(cache, i);
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return i != PAGES_CACHE_NONE;
+}
+// end::pages_cache_get[]
+
+// tag::pages_cache_reserve[]
+static void pages_cache_unhash(pages_cache_t *cache, uint32_t i) {
+  pages_cache_entry_t *e = &cache->entries[i];
+  uint32_t *cur = pages_cache_bucket(cache, e->page_num, e->version);
+  while (*cur != i) cur = &cache->entries[*cur].next;
+  *cur      = e->next;
+  e->hashed = false;
+}
+
+implementation_detail bool pages_cache_reserve(
+    db_state_t *db, void **buffer) {
+  pages_cache_t *cache = db->pages_cache;
+  pthread_mutex_lock(&cache->lock);
+  // <1>
+  // CLOCK, the second time around all the bits were cleared, so only
+  // borrowed pages are left
+  uint32_t victim = PAGES_CACHE_NONE;
+  for (size_t n = 0; n < cache->capacity * 2; n++) {
+    uint32_t i             = (uint32_t)cache->hand;
+    pages_cache_entry_t *e = &cache->entries[i];
+    cache->hand            = (cache->hand + 1) % cache->capacity;
+    if (e->refs) continue;
+    if (e->referenced) {
+      e->referenced = false;
+      continue;
+    }
+    victim = i;
+    break;
+  }
+  bool evicted = false;
+  if (victim != PAGES_CACHE_NONE) {
+    pages_cache_entry_t *e = &cache->entries[victim];
+    if (e->hashed) {
+      pages_cache_unhash(cache, victim);
+      cache->stats.evictions++;
+      evicted = true;
+    }
+    // <2>
+    // not hashed, so no one else can get it while it is being filled
+    e->refs = 1;
+  }
+  pthread_mutex_unlock(&cache->lock);
+  if (victim == PAGES_CACHE_NONE) return false;
+  *buffer = pages_cache_buffer(cache, victim);
+  if (evicted && cache->wipe) {
+    sodium_memzero(*buffer, PAGE_SIZE);
+  }
+  return true;
+}
+// end::pages_cache_reserve[]
+
+// tag::pages_cache_insert[]
+static uint32_t pages_cache_index(
+    pages_cache_t *cache, void *buffer) {
+  return (uint32_t)((buffer - cache->buffers) / PAGE_SIZE);
+}
+
+static void pages_cache_release_locked(
+    pages_cache_t *cache, uint32_t i) {
+  pages_cache_entry_t *e = &cache->entries[i];
+  if (--e->refs || e->hashed) return;
+  // <1>
+  // an invalidated page, or a duplicate of a page already in the
+  // cache, it can be reused right away
+  e->referenced = false;
+  if (cache->wipe) {
+    sodium_memzero(pages_cache_buffer(cache, i), PAGE_SIZE);
+  }
+}
+
+implementation_detail void *pages_cache_insert(db_state_t *db,
+    uint64_t page_num, uint64_t version, void *buffer) {
+  pages_cache_t *cache = db->pages_cache;
+  uint32_t i           = pages_cache_index(cache, buffer);
+  pthread_mutex_lock(&cache->lock);
+  cache->stats.misses++;
+  uint32_t *bucket = pages_cache_bucket(cache, page_num, version);
+  uint32_t cur     = *bucket;
+  while (cur != PAGES_CACHE_NONE) {
+    pages_cache_entry_t *e = &cache->entries[cur];
+    if (e->page_num == page_num && e->version == version) break;
+    cur = e->next;
+  }
+  if (cur != PAGES_CACHE_NONE) {
+    // another thread filled the same page first
+    pages_cache_release_locked(cache, i);
+    cache->entries[cur].refs++;
+    buffer = pages_cache_buffer(cache, cur);
+  } else {
+    pages_cache_entry_t *e = &cache->entries[i];
+    e->page_num            = page_num;
+    e->version             = version;
+    e->referenced          = true;
+    e->hashed              = true;
+    e->next                = *bucket;
+    *bucket                = i;
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return buffer;
+}
+// end::pages_cache_insert[]
+
+// tag::pages_cache_release[]
+implementation_detail bool pages_cache_owns(
+    db_state_t *db, void *buffer) {
+  pages_cache_t *cache = db->pages_cache;
+  return cache && buffer >= cache->buffers &&
+         buffer < cache->buffers + cache->capacity * PAGE_SIZE;
+}
+
+implementation_detail void pages_cache_release(
+    db_state_t *db, void *buffer) {
+  pages_cache_t *cache = db->pages_cache;
+  pthread_mutex_lock(&cache->lock);
+  pages_cache_release_locked(
+      cache, pages_cache_index(cache, buffer));
+  pthread_mutex_unlock(&cache->lock);
+}
+
+implementation_detail void pages_cache_invalidate(
+    db_state_t *db, uint64_t page_num) {
+  pages_cache_t *cache = db->pages_cache;
+  if (!cache) return;
+  pthread_mutex_lock(&cache->lock);
+  uint32_t i = *pages_cache_bucket(cache, page_num, 0);
+  while (i != PAGES_CACHE_NONE) {
+    pages_cache_entry_t *e = &cache->entries[i];
+    if (e->page_num == page_num && e->version == 0) break;
+    i = e->next;
+  }
+  if (i != PAGES_CACHE_NONE) {
+    // <1>
+    // a txn still borrowing it keeps the page until it closes
+    pages_cache_unhash(cache, i);
+    cache->entries[i].refs++;
+    pages_cache_release_locked(cache, i);
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+// end::pages_cache_release[]
+
+// tag::db_pages_cache_stats[]
+void db_pages_cache_stats(db_t *db, pages_cache_stats_t *stats) {
+  pages_cache_t *cache = db->state->pages_cache;
+  memset(stats, 0, sizeof(pages_cache_stats_t));
+  if (!cache) return;
+  pthread_mutex_lock(&cache->lock);
+  *stats = cache->stats;
+  pthread_mutex_unlock(&cache->lock);
+}
+// end::db_pages_cache_stats[]
@@ -0,0 +1,278 @@
+#include <errno.h>
+#include <gavran/db.h>
+#include <gavran/internal.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#define PAGES_POOL_CACHE_SIZE 32
+#define PAGES_POOL_MIN_SLAB_PAGES 16
+
+// tag::pages_pool_t[]
+// single page buffers, carved from slabs that are only freed when
+// the db is closed. Free buffers are linked through their first word
+typedef struct pages_pool_buffer {
+  struct pages_pool_buffer *next;
+} pages_pool_buffer_t;
+
+struct pages_pool {
+  pthread_mutex_t lock;
+  uint64_t id;
+  struct pages_pool *next_pool;
+  pages_pool_buffer_t *free;
+  // <1>
+  // buffers are carved lazily, so the memory isn't touched until
+  // it is needed
+  void *slab_next;
+  void *slab_end;
+  void **slabs;
+  size_t number_of_slabs;
+  pages_pool_stats_t stats;
+};
+
+// <2>
+// a thread keeps a few buffers of the last pool it used, so most
+// txns never take the pool lock
+static _Thread_local struct {
+  uint64_t id;
+  size_t count;
+  uint64_t hits;
+  pages_pool_buffer_t *buffers[PAGES_POOL_CACHE_SIZE];
+} pages_pool_cache;
+
+// <3>
+// the live pools, a thread's cache may outlive the db it came from
+static pthread_mutex_t pages_pool_registry_lock =
+    PTHREAD_MUTEX_INITIALIZER;
+static pages_pool_t *pages_pool_registry;
+static uint64_t pages_pool_next_id;
+// end::pages_pool_t[]
+
+// tag::pages_pool_create[]
+implementation_detail result_t pages_pool_create(db_state_t *db) {
+  pages_pool_t *pool;
+  ensure(mem_calloc((void *)&pool, sizeof(pages_pool_t)));
+  int rc = pthread_mutex_init(&pool->lock, 0);
+  if (rc) {
+    free(pool);
+    failed(rc, msg("Unable to create the pages pool lock"));
+  }
+  pthread_mutex_lock(&pages_pool_registry_lock);
+  pool->id            = ++pages_pool_next_id;
+  pool->next_pool     = pages_pool_registry;
+  pages_pool_registry = pool;
+  pthread_mutex_unlock(&pages_pool_registry_lock);
+  db->pages_pool = pool;
+  return success();
+}
+
+implementation_detail void pages_pool_destroy(db_state_t *db) {
+  pages_pool_t *pool = db->pages_pool;
+  if (!pool) return;
+  pthread_mutex_lock(&pages_pool_registry_lock);
+  pages_pool_t **cur = &pages_pool_registry;
+  while (*cur != pool) cur = &(*cur)->next_pool;
+  *cur = pool->next_pool;
+  pthread_mutex_unlock(&pages_pool_registry_lock);
+  // other threads will drop their cached buffers on their next use
+  if (pages_pool_cache.id == pool->id) pages_pool_cache.count = 0;
+  for (size_t i = 0; i < pool->number_of_slabs; i++) {
+    free(pool->slabs[i]);
+  }
+  free(pool->slabs);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+  db->pages_pool = 0;
+}
+// end::pages_pool_create[]
+
+// tag::pages_pool_cache[]
+static void pages_pool_push_locked(pages_pool_t *pool,
+    pages_pool_buffer_t *first, pages_pool_buffer_t *last) {
+  last->next = pool->free;
+  pool->free = first;
+}
+
+static void pages_pool_flush_cache(void) {
+  if (!pages_pool_cache.count) return;
+  // <1>
+  // the buffers of a closed db were freed with its slabs, they are
+  // only touched while the registry lock keeps the pool alive
+  pthread_mutex_lock(&pages_pool_registry_lock);
+  pages_pool_t *pool = pages_pool_registry;
+  while (pool && pool->id != pages_pool_cache.id) {
+    pool = pool->next_pool;
+  }
+  if (pool) {
+    pages_pool_buffer_t **b = pages_pool_cache.buffers;
+    for (size_t i = 1; i < pages_pool_cache.count; i++) {
+      b[i - 1]->next = b[i];
+    }
+    pthread_mutex_lock(&pool->lock);
+    pages_pool_push_locked(
+        pool, b[0], b[pages_pool_cache.count - 1]);
+    pool->stats.hits += pages_pool_cache.hits;
+    pthread_mutex_unlock(&pool->lock);
+  }
+  pthread_mutex_unlock(&pages_pool_registry_lock);
+  pages_pool_cache.count = 0;
+}
+
+static pthread_key_t pages_pool_key;
+static pthread_once_t pages_pool_key_once = PTHREAD_ONCE_INIT;
+
+static void pages_pool_thread_exit(void *unused) {
+  (void)unused;
+  pages_pool_flush_cache();
+}
+
+static void pages_pool_key_create(void) {
+  pthread_key_create(&pages_pool_key, pages_pool_thread_exit);
+}
+
+static void pages_pool_claim_cache(pages_pool_t *pool) {
+  if (pages_pool_cache.id == pool->id) return;
+  // <2>
+  // switching between dbs on a thread is rare, the cache moves over
+  // to the new one. The buffers go back when the thread exits
+  pages_pool_flush_cache();
+  pthread_once(&pages_pool_key_once, pages_pool_key_create);
+  pthread_setspecific(pages_pool_key, pool);
+  pages_pool_cache.id   = pool->id;
+  pages_pool_cache.hits = 0;
+}
+// end::pages_pool_cache[]
+
+// tag::pages_pool_alloc[]
+static result_t pages_pool_carve_locked(
+    pages_pool_t *pool, void **buffer) {
+  if (pool->slab_next == pool->slab_end) {
+    // <1>
+    // slabs grow as the db does, up to 8MB each
+    size_t pages = PAGES_POOL_MIN_SLAB_PAGES
+                   << MIN(pool->number_of_slabs, 6);
+    ensure(mem_realloc((void *)&pool->slabs,
+        (pool->number_of_slabs + 1) * sizeof(void *)));
+    void *slab;
+    int rc = posix_memalign(&slab, PAGE_SIZE, pages * PAGE_SIZE);
+    if (rc) {
+      failed(rc, msg("Unable to allocate pages pool slab"),
+          with(pages, "%zu"));
+    }
+    pool->slabs[pool->number_of_slabs++] = slab;
+    pool->slab_next                      = slab;
+    pool->slab_end                       = slab + pages * PAGE_SIZE;
+  }
+  *buffer         = pool->slab_next;
+  pool->slab_next = pool->slab_next + PAGE_SIZE;
+  pool->stats.high_water_mark++;
+  return success();
+}
+
+implementation_detail result_t pages_pool_alloc(
+    db_state_t *db, uint32_t number_of_pages, void **buffer) {
+  pages_pool_t *pool = db->pages_pool;
+  // <2>
+  // overflow pages are rare & vary in size, they aren't pooled
+  if (number_of_pages > 1) {
+    void *tmp;
+    int rc =
+        posix_memalign(&tmp, PAGE_SIZE, number_of_pages * PAGE_SIZE);
+    if (rc) {
+      failed(rc, msg("Unable to allocate page aligned buffer"),
+          with(number_of_pages, "%u"));
+    }
+    *buffer = tmp;
+    return success();
+  }
+  pages_pool_claim_cache(pool);
+  if (pages_pool_cache.count) {
+    *buffer = pages_pool_cache.buffers[--pages_pool_cache.count];
+    pages_pool_cache.hits++;
+    return success();
+  }
+  // <3>
+  // refill half of the cache while we hold the lock
+  pthread_mutex_lock(&pool->lock);
+  pool->stats.hits += pages_pool_cache.hits;
+  pages_pool_cache.hits = 0;
+  while (pool->free &&
+         pages_pool_cache.count < PAGES_POOL_CACHE_SIZE / 2) {
+    pages_pool_cache.buffers[pages_pool_cache.count++] = pool->free;
+    pool->free = pool->free->next;
+  }
+  op_result_t *res;
+  if (!pages_pool_cache.count) {
+    pool->stats.misses++;
+    res = pages_pool_carve_locked(pool, buffer);
+  } else {
+    pool->stats.hits++;
+    *buffer = pages_pool_cache.buffers[--pages_pool_cache.count];
+    res     = success();
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return res;
+}
+// end::pages_pool_alloc[]
+
+// tag::pages_pool_free[]
+implementation_detail void pages_pool_free(
+    db_state_t *db, uint32_t number_of_pages, void *buffer) {
+  if (!buffer) return;
+  if (number_of_pages > 1) {
+    free(buffer);
+    return;
+  }
+  pages_pool_t *pool = db->pages_pool;
+  pages_pool_claim_cache(pool);
+  if (pages_pool_cache.count < PAGES_POOL_CACHE_SIZE) {
+    pages_pool_cache.buffers[pages_pool_cache.count++] = buffer;
+    return;
+  }
+  pages_pool_buffer_t *b = buffer;
+  pthread_mutex_lock(&pool->lock);
+  pages_pool_push_locked(pool, b, b);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+implementation_detail void pages_pool_free_map(
+    db_state_t *db, pages_map_t *pages) {
+  pages_pool_t *pool         = db->pages_pool;
+  pages_pool_buffer_t *first = 0, *last = 0;
+  size_t iter_state          = 0;
+  page_t *p;
+  pages_pool_claim_cache(pool);
+  while (pagesmap_get_next(pages, &iter_state, &p)) {
+    if (p->number_of_pages > 1) {
+      free(p->address);
+    } else if (pages_pool_cache.count < PAGES_POOL_CACHE_SIZE) {
+      pages_pool_cache.buffers[pages_pool_cache.count++] = p->address;
+    } else {
+      pages_pool_buffer_t *b = p->address;
+      b->next                = first;
+      first                  = b;
+      if (!last) last = b;
+    }
+  }
+  // <1>
+  // the whole txn goes back to the pool with a single lock
+  if (!first) return;
+  pthread_mutex_lock(&pool->lock);
+  pages_pool_push_locked(pool, first, last);
+  pthread_mutex_unlock(&pool->lock);
+}
+// end::pages_pool_free[]
+
+// tag::db_pages_pool_stats[]
+void db_pages_pool_stats(db_t *db, pages_pool_stats_t *stats) {
+  pages_pool_t *pool = db->state->pages_pool;
+  pthread_mutex_lock(&pool->lock);
+  // hits on this thread's cache, other threads add theirs when they
+  // go to the pool
+  if (pages_pool_cache.id == pool->id) {
+    pool->stats.hits += pages_pool_cache.hits;
+    pages_pool_cache.hits = 0;
+  }
+  *stats = pool->stats;
+  pthread_mutex_unlock(&pool->lock);
+}
+// end::db_pages_pool_stats[]
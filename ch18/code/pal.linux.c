@@ -0,0 +1,793 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <gavran/infrastructure.h>
+#include <gavran/pal.h>
+
+#ifdef GAVRAN_IO_URING
+#include <liburing.h>
+#endif
+
+enable_defer_imp(close, -1, *(int *), "%d");
+
+// tag::pal_io_request[]
+// the buffers are passed as is to the vectored I/O calls
+_Static_assert(sizeof(span_t) == sizeof(struct iovec) &&
+                   offsetof(span_t, address) ==
+                       offsetof(struct iovec, iov_base) &&
+                   offsetof(span_t, size) ==
+                       offsetof(struct iovec, iov_len),
+               "span_t must match the layout of struct iovec");
+
+// skip the part of the request that was already done
+static void pal_io_request_advance(pal_io_request_t *req,
+                                   size_t done) {
+  req->offset += done;
+  while (req->number_of_buffers) {
+    span_t *first = req->buffers;
+    if (done < first->size) {
+      first->address = (char *)first->address + done;
+      first->size -= done;
+      return;
+    }
+    done -= first->size;
+    req->buffers++;
+    req->number_of_buffers--;
+  }
+}
+
+static result_t pal_write_file_vectored(file_handle_t *handle,
+                                        pal_io_request_t *req) {
+  while (req->number_of_buffers) {
+    int count = (int)MIN(req->number_of_buffers, IOV_MAX);
+    ssize_t result = pwritev(handle->fd, (struct iovec *)req->buffers,
+                             count, (off_t)req->offset);
+    if (result == -1) {
+      if (errno == EINTR) continue;  // repeat on signal
+
+      failed(errno, msg("Unable to write bytes to file"),
+             with(req->offset, "%lu"),
+             with(handle->filename, "%s"));
+    }
+    pal_io_request_advance(req, (size_t)result);
+  }
+  return success();
+}
+// end::pal_io_request[]
+
+#ifdef GAVRAN_IO_URING
+// tag::pal_io_ring[]
+#define PAL_IO_RING_DEPTH 64
+
+typedef struct pal_io_ring {
+  struct io_uring ring;
+  // the WAL file is used by the WAL writer thread & checkpoints
+  pthread_mutex_t lock;
+  // I/O may still be in flight that we couldn't wait for, the
+  // buffers of the caller are no longer safe to reuse
+  bool broken;
+  bool exited;
+  uint8_t _padding[6];
+} pal_io_ring_t;
+
+static void pal_io_ring_create(file_handle_t *handle) {
+  pal_io_ring_t *r = calloc(1, sizeof(pal_io_ring_t));
+  if (!r) return;
+  if (io_uring_queue_init(PAL_IO_RING_DEPTH, &r->ring, 0) < 0) {
+    // io_uring may be disabled on this kernel, use blocking I/O
+    free(r);
+    return;
+  }
+  pthread_mutex_init(&r->lock, 0);
+  handle->io_ring = r;
+}
+
+static void pal_io_ring_close(file_handle_t *handle) {
+  pal_io_ring_t *r = handle->io_ring;
+  if (!r) return;
+  if (!r->exited) io_uring_queue_exit(&r->ring);
+  pthread_mutex_destroy(&r->lock);
+  free(r);
+  handle->io_ring = 0;
+}
+
+// <1>
+// waits for all the I/O in flight, the kernel must be done with the
+// buffers of the caller before we return to it
+static bool pal_io_ring_drain(pal_io_ring_t *r, size_t pending) {
+  while (pending) {
+    struct io_uring_cqe *cqe;
+    int rc = io_uring_wait_cqe(&r->ring, &cqe);
+    if (rc == -EINTR) continue;  // repeat on signal
+    if (rc < 0) return false;
+    io_uring_cqe_seen(&r->ring, cqe);
+    pending--;
+  }
+  return true;
+}
+
+// after a failure the queue may hold entries the kernel didn't take,
+// they point to buffers of the caller. A new ring drops them
+static void pal_io_ring_reset(pal_io_ring_t *r, size_t pending) {
+  if (!pal_io_ring_drain(r, pending)) {
+    r->broken = true;
+    return;
+  }
+  io_uring_queue_exit(&r->ring);
+  if (io_uring_queue_init(PAL_IO_RING_DEPTH, &r->ring, 0) < 0) {
+    r->broken = r->exited = true;
+  }
+}
+
+// the kernel may take only some of the entries, so we submit the rest
+static int pal_io_ring_submit(
+    pal_io_ring_t *r, size_t count, size_t *submitted) {
+  *submitted = 0;
+  while (*submitted < count) {
+    int rc = io_uring_submit(&r->ring);
+    if (rc == -EINTR) continue;  // repeat on signal
+    if (rc <= 0) return rc < 0 ? -rc : EIO;
+    *submitted += (size_t)rc;
+  }
+  return 0;
+}
+
+static inline void defer_pthread_mutex_unlock(cancel_defer_t *cd) {
+  pthread_mutex_unlock(cd->target);
+}
+
+static size_t pal_io_request_size(pal_io_request_t *req) {
+  size_t size = 0;
+  for (size_t i = 0; i < req->number_of_buffers; i++) {
+    size += req->buffers[i].size;
+  }
+  return size;
+}
+
+static void pal_io_ring_prep(pal_io_ring_t *r, file_handle_t *handle,
+                             pal_io_request_t *req, bool write) {
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&r->ring);
+  // the rest of the buffers will be submitted as a short I/O
+  unsigned count = (unsigned)MIN(req->number_of_buffers, IOV_MAX);
+  struct iovec *vecs = (struct iovec *)req->buffers;
+  if (write) {
+    io_uring_prep_writev(sqe, handle->fd, vecs, count, req->offset);
+  } else {
+    io_uring_prep_readv(sqe, handle->fd, vecs, count, req->offset);
+  }
+  io_uring_sqe_set_data(sqe, req);
+}
+
+static result_t pal_io_ring_complete(file_handle_t *handle,
+                                     size_t pending, bool write,
+                                     bool *needs_sync) {
+  pal_io_ring_t *r = handle->io_ring;
+  int err = 0;
+  bool needs_reset = false;
+  // <2>
+  while (pending) {
+    struct io_uring_cqe *cqe;
+    int rc = io_uring_wait_cqe(&r->ring, &cqe);
+    if (rc == -EINTR) continue;  // repeat on signal
+    if (rc < 0) {
+      pal_io_ring_reset(r, pending);
+      failed(-rc, msg("Unable to get I/O completion"),
+             with(handle->filename, "%s"));
+    }
+    pending--;
+    pal_io_request_t *req = io_uring_cqe_get_data(cqe);
+    int res = cqe->res;
+    io_uring_cqe_seen(&r->ring, cqe);
+    if (res < 0) {
+      if (!err) err = -res;
+      continue;
+    }
+    if (!req) continue;  // fsync
+    if ((size_t)res == pal_io_request_size(req)) continue;
+    if (res == 0) {
+      if (!err) err = EINVAL;  // EOF before we read entire buffer
+      continue;
+    }
+    // <3>
+    // short read / write, submit the rest of it
+    pal_io_request_advance(req, (size_t)res);
+    pal_io_ring_prep(r, handle, req, write);
+    size_t submitted;
+    rc = pal_io_ring_submit(r, 1, &submitted);
+    if (rc) {
+      if (!err) err = rc;
+      needs_reset = true;
+      continue;
+    }
+    pending++;
+    // the fsync may have already run
+    if (write) *needs_sync = true;
+  }
+  // nothing is in flight, but the entry we failed to submit may be
+  if (needs_reset) pal_io_ring_reset(r, 0);
+  if (err) {
+    failed(err, msg("Failed to complete I/O on file"),
+           with(handle->filename, "%s"));
+  }
+  return success();
+}
+
+static result_t pal_io_ring_run(file_handle_t *handle,
+                                pal_io_request_t *requests,
+                                size_t count, bool write, bool sync) {
+  pal_io_ring_t *r = handle->io_ring;
+  pthread_mutex_lock(&r->lock);
+  defer(pthread_mutex_unlock, r->lock);
+  if (r->broken) {
+    failed(EIO, msg("I/O ring failed, earlier I/O may be in flight"),
+           with(handle->filename, "%s"));
+  }
+  bool needs_sync = false;
+  while (count) {
+    // <4>
+    size_t batch = MIN(count, PAL_IO_RING_DEPTH - 1);
+    for (size_t i = 0; i < batch; i++) {
+      pal_io_ring_prep(r, handle, &requests[i], write);
+    }
+    size_t queued = batch;
+    // <5>
+    if (sync && batch == count) {
+      // drain, so it runs only after all the writes completed
+      struct io_uring_sqe *sqe = io_uring_get_sqe(&r->ring);
+      io_uring_prep_fsync(sqe, handle->fd, IORING_FSYNC_DATASYNC);
+      io_uring_sqe_set_flags(sqe, IOSQE_IO_DRAIN);
+      io_uring_sqe_set_data(sqe, 0);
+      queued++;
+    }
+    size_t submitted;
+    int rc = pal_io_ring_submit(r, queued, &submitted);
+    if (rc) {
+      // <6>
+      // wait for what the kernel took before we return the buffers
+      pal_io_ring_reset(r, submitted);
+      failed(rc, msg("Unable to submit I/O"),
+             with(handle->filename, "%s"), with(submitted, "%lu"),
+             with(queued, "%lu"));
+    }
+    ensure(pal_io_ring_complete(handle, submitted, write,
+                                &needs_sync));
+    requests += batch;
+    count -= batch;
+  }
+  if (needs_sync) {
+    ensure(pal_fsync(handle));
+  }
+  return success();
+}
+// end::pal_io_ring[]
+#endif
+
+// tag::fsync_parent_directory[]
+static result_t fsync_parent_directory(char *file) {
+  char *last = strrchr(file, '/');
+  int fd;
+  if (!last) {
+    // <1>
+    fd = open(".", O_RDONLY);
+  } else {
+    // <2>
+    *last = 0;
+    fd = open(file, O_RDONLY);
+    *last = '/';
+  }
+  if (fd == -1) {
+    failed(errno, msg("Unable to open parent directory"),
+           with(file, "%s"));
+  }
+  defer(close, fd);
+  if (fsync(fd)) {
+    failed(errno, msg("Failed to fsync parent directory"),
+           with(file, "%s"));
+  }
+  return success();
+}
+// end::fsync_parent_directory[]
+
+// tag::pal_ensure_full_path[]
+static result_t pal_ensure_full_path(char *file) {
+  // already exists?
+  struct stat st;
+  if (!stat(file, &st)) {
+    if (S_ISDIR(st.st_mode)) {
+      failed(EISDIR, msg("The path is a directory, expected a file"),
+             with(file, "%s"));
+    }
+    return success();  // file exists, so we are good
+  }
+
+  char *cur = file;
+  if (*cur == '/')  // rooted path
+    cur++;
+
+  while (*cur) {
+    char *next_sep = strchr(cur, '/');
+    if (!next_sep) {
+      return success();  // no more directories in path
+    }
+    *next_sep = 0;  // add null sep to cut the string
+
+    if (!stat(file, &st)) {  // now we are checking the directory!
+      if (!S_ISDIR(st.st_mode)) {
+        failed(ENOTDIR,
+               msg("The path is a file, but expected a directory"),
+               with(file, "%s"));
+      }
+    } else {  // probably does not exists
+      if (mkdir(file, S_IRWXU) == -1 && errno != EEXIST) {
+        failed(errno, msg("Unable to create directory"),
+               with(file, "%s"));
+      }
+      ensure(fsync_parent_directory(file));
+    }
+    *next_sep = '/';
+    cur = next_sep + 1;
+  }
+  failed(
+      EINVAL,
+      msg("The last char in the path is '/', which is not allowed"),
+      with(file, "%s"));
+}
+// end::pal_ensure_full_path[]
+
+// tag::pal_ensure_path[]
+static result_t pal_ensure_path(char *filename, uint64_t *size) {
+  struct stat st;
+  if (stat(filename, &st) == -1) {
+    if (errno != ENOENT) {
+      failed(errno, msg("Unable to stat "), with(filename, "%s"));
+    }
+    *size = 0;
+    ensure(pal_ensure_full_path(filename));
+    int fd = open(filename, O_CLOEXEC | O_CREAT | O_RDWR,
+                  S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+      failed(errno, msg("Unable to create file "),
+             with(filename, "%s"));
+    }
+    if (close(fd) == -1) {
+      failed(errno, msg("Unable to close file after creating it "),
+             with(filename, "%s"));
+    }
+  } else {
+    *size = (uint64_t)st.st_size;
+    if (S_ISDIR(st.st_mode)) {
+      failed(EISDIR, msg("The path is a directory, expected a file "),
+             with(filename, "%s"));
+    }
+  }
+  return success();
+}
+// end::pal_ensure_path[]
+
+// tag::pal_file_exists[]
+result_t pal_file_exists(const char *path, bool *exists) {
+  struct stat st;
+  if (stat(path, &st) == -1) {
+    if (errno != ENOENT) {
+      failed(errno, msg("Unable to stat "), with(path, "%s"));
+    }
+    *exists = false;
+    return success();
+  }
+  *exists = true;
+  return success();
+}
+// end::pal_file_exists[]
+
+// tag::pal_create_file[]
+result_t pal_create_file(const char *path, file_handle_t **handle_out,
+                         enum pal_file_creation_flags flags) {
+  errors_assert_empty();
+  size_t cancel_defer = 0;
+
+  // <1>
+  file_handle_t *handle;
+  ensure(mem_calloc((void *)&handle, sizeof(file_handle_t)));
+  try_defer(free, handle, cancel_defer);
+
+  // <2>
+  char *mutable;
+  ensure(mem_duplicate_string(&mutable, path));
+  defer(free, mutable);
+  ensure(pal_ensure_path(mutable, &handle->size));
+
+  // <3>
+  handle->filename = realpath(path, 0);
+  if (!handle->filename) {
+    failed(errno, msg("Failed to resolve realpath() of file"),
+           with(path, "%s"));
+  }
+  try_defer(free, handle->filename, cancel_defer);
+
+  // <4>
+  int open_flags = O_CLOEXEC | O_CREAT | O_RDWR;
+  if (flags & pal_file_creation_flags_durable) {
+    open_flags |= O_DIRECT | O_DSYNC;
+  }
+  handle->fd = open(handle->filename, open_flags, S_IRUSR | S_IWUSR);
+  if (handle->fd == -1) {
+    failed(errno, msg("Unable to open file "),
+           with(handle->filename, "%s"));
+  }
+#ifdef GAVRAN_IO_URING
+  pal_io_ring_create(handle);
+#endif
+  // <5>
+  if (handle->size == 0) {  // new db
+    if (!fsync_parent_directory(handle->filename)) {
+      failed(EIO,
+             msg("Failed to fsync parent dir on new file creation"),
+             with(handle->filename, "%s"));
+    }
+  }
+
+  *handle_out = handle;
+  cancel_defer = 1;
+  return success();
+}
+// end::pal_create_file[]
+
+// tag::pal_mmap_room[]
+// the address space after a map that is held for it to grow into, see
+// pal_mmap_with_room()
+typedef struct pal_mmap_room {
+  void *address;
+  uint64_t room;
+  struct pal_mmap_room *next;
+} pal_mmap_room_t;
+
+static pthread_mutex_t pal_mmap_rooms_lock =
+    PTHREAD_MUTEX_INITIALIZER;
+static pal_mmap_room_t *pal_mmap_rooms;
+
+static uint64_t pal_mmap_room_of(void *address, bool release) {
+  uint64_t room = 0;
+  pthread_mutex_lock(&pal_mmap_rooms_lock);
+  pal_mmap_room_t **cur = &pal_mmap_rooms;
+  while (*cur && (*cur)->address != address) cur = &(*cur)->next;
+  if (*cur) {
+    pal_mmap_room_t *found = *cur;
+    room                   = found->room;
+    if (release) {
+      *cur = found->next;
+      free(found);
+    }
+  }
+  pthread_mutex_unlock(&pal_mmap_rooms_lock);
+  return room;
+}
+// end::pal_mmap_room[]
+
+// tag::pal_mmap[]
+result_t pal_mmap(file_handle_t *handle, uint64_t offset, span_t *m) {
+  errors_assert_empty();
+  m->address = mmap(0, m->size, PROT_READ, MAP_SHARED, handle->fd,
+                    (off_t)offset);
+  if (m->address == MAP_FAILED) {
+    m->address = 0;
+    failed(errno, msg("Unable to map file"),
+           with(handle->filename, "%s"), with(m->size, "%lu"));
+  }
+  return success();
+}
+
+result_t pal_unmap(span_t *m) {
+  if (!m->address) return success();
+  // the room held after the map goes with it
+  uint64_t room = pal_mmap_room_of(m->address, true);
+  uint64_t size = MAX(m->size, room);
+  if (munmap(m->address, size) == -1) {
+    failed(EINVAL, msg("Unable to unmap"), with(m->address, "%p"));
+  }
+  m->address = 0;
+  return success();
+}
+// end::pal_mmap[]
+
+// tag::pal_mmap_grow[]
+// the room is held as PROT_NONE address space until the map is
+// unmapped, so nothing else is mapped there meanwhile
+#define PAL_MMAP_MAX_ROOM (64UL * 1024 * 1024 * 1024)
+
+result_t pal_mmap_with_room(file_handle_t *handle, uint64_t room,
+                            span_t *m) {
+  errors_assert_empty();
+  room = MIN(room, PAL_MMAP_MAX_ROOM);
+  if (room <= m->size) return pal_mmap(handle, 0, m);
+  pal_mmap_room_t *entry = calloc(1, sizeof(pal_mmap_room_t));
+  if (!entry) {
+    failed(ENOMEM, msg("Unable to allocate the room of the map"),
+           with(handle->filename, "%s"));
+  }
+  void *reserved = mmap(0, room, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                        -1, 0);
+  // <1>
+  // not having room isn't an error, the map will move as it grows
+  if (reserved == MAP_FAILED) {
+    free(entry);
+    return pal_mmap(handle, 0, m);
+  }
+  m->address = mmap(reserved, m->size, PROT_READ,
+                    MAP_SHARED | MAP_FIXED, handle->fd, 0);
+  if (m->address == MAP_FAILED) {
+    m->address = 0;
+    free(entry);
+    (void)munmap(reserved, room);
+    failed(errno, msg("Unable to map file"),
+           with(handle->filename, "%s"), with(m->size, "%lu"));
+  }
+  entry->address = m->address;
+  entry->room    = room;
+  pthread_mutex_lock(&pal_mmap_rooms_lock);
+  entry->next = pal_mmap_rooms;
+  pal_mmap_rooms = entry;
+  pthread_mutex_unlock(&pal_mmap_rooms_lock);
+  return success();
+}
+
+result_t pal_mmap_grow(file_handle_t *handle, span_t *m,
+                       uint64_t new_size, bool *grown) {
+  errors_assert_empty();
+  *grown = false;
+  if (new_size > pal_mmap_room_of(m->address, false)) {
+    return success();  // the map will move
+  }
+  // <2>
+  // the file replaces the start of the room, the old address stays
+  // valid for anyone who is still using the smaller map
+  void *address = mmap(m->address + m->size, new_size - m->size,
+                       PROT_READ, MAP_SHARED | MAP_FIXED, handle->fd,
+                       (off_t)m->size);
+  if (address == MAP_FAILED) {
+    failed(errno, msg("Unable to grow the map of the file"),
+           with(handle->filename, "%s"), with(m->size, "%lu"),
+           with(new_size, "%lu"));
+  }
+  m->size = new_size;
+  *grown  = true;
+  return success();
+}
+
+result_t pal_mmap_shrink(span_t *m, uint64_t new_size) {
+  // the end of the map goes back to the room
+  void *address = mmap(m->address + new_size, m->size - new_size,
+                       PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+                           MAP_FIXED,
+                       -1, 0);
+  if (address == MAP_FAILED) {
+    failed(errno, msg("Unable to shrink the map of the file"),
+           with(m->address, "%p"), with(new_size, "%lu"));
+  }
+  m->size = new_size;
+  return success();
+}
+// end::pal_mmap_grow[]
+
+// tag::pal_close_file[]
+result_t pal_close_file(file_handle_t *handle) {
+  if (!handle) return success();
+  defer(free, handle);
+  defer(free, handle->filename);
+#ifdef GAVRAN_IO_URING
+  pal_io_ring_close(handle);
+#endif
+  if (close(handle->fd) == -1) {
+    failed(errno, msg("Failed to close file"),
+           with(handle->filename, "%s"), with(handle->fd, "%i"));
+  }
+  return success();
+}
+// end::pal_close_file[]
+
+// tag::pal_enable_writes[]
+result_t pal_enable_writes(span_t *s) {
+  if (mprotect(s->address, s->size, PROT_READ | PROT_WRITE) == -1) {
+    failed(errno,
+           msg("Unable to modify the memory protection flags"));
+  }
+  return success();
+}
+
+void defer_pal_disable_writes(cancel_defer_t *cd) {
+  if (cd->cancelled && *cd->cancelled) return;
+  span_t *s = cd->target;
+  if (mprotect(s->address, s->size, PROT_READ) == -1) {
+    errors_push(errno,
+                msg("Unable to modify the memory protection flags"));
+  }
+}
+// end::pal_enable_writes[]
+
+// tag::pal_fsync[]
+result_t pal_fsync(file_handle_t *handle) {
+  if (fdatasync(handle->fd) == -1) {
+    failed(errno, msg("Failed to sync file"),
+           with(handle->filename, "%s"), with(handle->fd, "%i"));
+  }
+  return success();
+}
+// end::pal_fsync[]
+
+// tag::pal_map_defer[]
+void defer_pal_close_file(cancel_defer_t *cd) {
+  if (cd->cancelled && *cd->cancelled) return;
+  if (flopped(pal_close_file(*(void **)cd->target))) {
+    errors_push(EINVAL, msg("Failure to close file during defer"));
+  }
+}
+
+void defer_pal_unmap(cancel_defer_t *cd) {
+  if (cd->cancelled && *cd->cancelled) return;
+  span_t *ctx = cd->target;
+  if (flopped(pal_unmap(ctx))) {
+    errors_push(EINVAL, msg("Failure to close file during defer"),
+                with(ctx->address, "%p"));
+  }
+}
+// end::pal_map_defer[]
+
+// tag::pal_set_file_size[]
+result_t pal_set_file_size(file_handle_t *handle,
+                           uint64_t minimum_size,
+                           uint64_t maximum_size) {
+  errors_assert_empty();
+
+  struct stat st;
+  if (fstat(handle->fd, &st)) {
+    failed(errno, msg("Unable to stat file"),
+           with(handle->filename, "%s"), with(minimum_size, "%lu"));
+  }
+  uint64_t new_size = 0;
+
+  if (minimum_size > (uint64_t)st.st_size) {
+    new_size = minimum_size;
+  } else if (maximum_size < (uint64_t)st.st_size) {
+    new_size = maximum_size;
+  }
+
+  if (!new_size) return success();
+
+  if (ftruncate(handle->fd, (off_t)new_size) == -1) {
+    failed(errno, msg("Unable to change file to size"),
+           with(handle->filename, "%s"), with(new_size, "%lu"));
+  }
+  handle->size = new_size;
+
+  char *mutable;
+  ensure(mem_duplicate_string(&mutable, handle->filename));
+  defer(free, mutable);
+
+  ensure(fsync_parent_directory(mutable));
+
+  return success();
+}
+// end::pal_set_file_size[]
+
+// tag::pal_write_file[]
+result_t pal_write_file(file_handle_t *handle, uint64_t offset,
+                        const char *buffer, size_t size) {
+  errors_assert_empty();
+#ifdef GAVRAN_IO_URING
+  if (handle->io_ring) {
+    span_t span = {.address = (void *)buffer, .size = size};
+    pal_io_request_t req = {
+        .offset = offset, .buffers = &span, .number_of_buffers = 1};
+    return pal_io_ring_run(handle, &req, 1, true, false);
+  }
+#endif
+  while (size) {
+    ssize_t result = pwrite(handle->fd, buffer, size, (off_t)offset);
+    if (result == -1) {
+      if (errno == EINTR) continue;  // repeat on signal
+
+      failed(errno, msg("Unable to write bytes to file"),
+             with(size, "%lu"), with(handle->filename, "%s"));
+    }
+    size -= (size_t)result;
+    buffer += result;
+    offset += (size_t)result;
+  }
+  return success();
+}
+result_t pal_read_file(file_handle_t *handle, uint64_t offset,
+                       void *buffer, size_t size) {
+  errors_assert_empty();
+#ifdef GAVRAN_IO_URING
+  if (handle->io_ring) {
+    span_t span = {.address = buffer, .size = size};
+    pal_io_request_t req = {
+        .offset = offset, .buffers = &span, .number_of_buffers = 1};
+    return pal_io_ring_run(handle, &req, 1, false, false);
+  }
+#endif
+  while (size) {
+    ssize_t result = pread(handle->fd, buffer, size, (off_t)offset);
+    if (result == 0) {
+      failed(EINVAL, msg("File EOF before we read entire buffer"),
+             with(size, "%lu"), with(handle->filename, "%s"));
+    }
+    if (result == -1) {
+      if (errno == EINTR) continue;  // repeat on signal
+
+      failed(errno, msg("Unable to read bytes from file"),
+             with(size, "%lu"), with(handle->filename, "%s"));
+    }
+    size -= (size_t)result;
+    buffer += result;
+    offset += (size_t)result;
+  }
+  return success();
+}
+// end::pal_write_file[]
+
+// tag::pal_write_file_batch[]
+result_t pal_write_file_batch(file_handle_t *handle,
+                              pal_io_request_t *requests,
+                              size_t count, bool sync) {
+  errors_assert_empty();
+#ifdef GAVRAN_IO_URING
+  if (handle->io_ring) {
+    // a single submission for all the writes & the fsync
+    return pal_io_ring_run(handle, requests, count, true, sync);
+  }
+#endif
+  for (size_t i = 0; i < count; i++) {
+    ensure(pal_write_file_vectored(handle, &requests[i]));
+  }
+  if (sync) {
+    ensure(pal_fsync(handle));
+  }
+  return success();
+}
+
+result_t pal_read_file_vectored(file_handle_t *handle,
+                                pal_io_request_t *request) {
+  errors_assert_empty();
+#ifdef GAVRAN_IO_URING
+  if (handle->io_ring) {
+    return pal_io_ring_run(handle, request, 1, false, false);
+  }
+#endif
+  while (request->number_of_buffers) {
+    int count = (int)MIN(request->number_of_buffers, IOV_MAX);
+    ssize_t result =
+        preadv(handle->fd, (struct iovec *)request->buffers, count,
+               (off_t)request->offset);
+    if (result == 0) {
+      failed(EINVAL, msg("File EOF before we read entire buffer"),
+             with(request->offset, "%lu"),
+             with(handle->filename, "%s"));
+    }
+    if (result == -1) {
+      if (errno == EINTR) continue;  // repeat on signal
+
+      failed(errno, msg("Unable to read bytes from file"),
+             with(request->offset, "%lu"),
+             with(handle->filename, "%s"));
+    }
+    pal_io_request_advance(request, (size_t)result);
+  }
+  return success();
+}
+// end::pal_write_file_batch[]
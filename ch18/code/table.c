@@ -187,6 +187,7 @@ result_t table_set(txn_t *tx, table_item_t *item) {
       .container_id = item->schema->index_ids[0],
       .data         = item->entries[0]};
   ensure(container_item_put(tx, &c_item));
+  item->item_id = c_item.item_id;
 
   for (size_t i = 1; i < item->number_of_entries; i++) {
     switch (item->schema->types[i]) {
@@ -2,9 +2,11 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -43,3 +45,2972 @@ describe(tables) {
   }
 }
 // end::tests18[]
+
+// tag::wal_segments[]
+static result_t write_random_pages(
+    db_t* db, uint64_t* pages, size_t count, size_t tx) {
+  txn_t w;
+  ensure(txn_create(db, TX_WRITE, &w));
+  defer(txn_close, w);
+  for (size_t i = 0; i < count; i++) {
+    page_t p = {.page_num = pages[i]};
+    ensure(txn_modify_page(&w, &p));
+    // random data prevents compression
+    randombytes_buf(p.address, PAGE_SIZE);
+    sprintf(p.address, "Page %zu in tx %zu", i, tx);
+  }
+  ensure(txn_commit(&w));
+  return success();
+}
+
+static result_t allocate_pages(
+    db_t* db, uint64_t* pages, size_t count) {
+  txn_t w;
+  ensure(txn_create(db, TX_WRITE, &w));
+  defer(txn_close, w);
+  for (size_t i = 0; i < count; i++) {
+    page_t p = {.number_of_pages = 1};
+    ensure(txn_allocate_page(&w, &p, 0));
+    p.metadata->overflow.page_flags      = page_flags_overflow;
+    p.metadata->overflow.number_of_pages = 1;
+    pages[i]                             = p.page_num;
+  }
+  ensure(txn_commit(&w));
+  return success();
+}
+
+describe(wal_segments) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("moves to the next segment instead of growing the WAL") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .wal_size = 128 * 1024, .wal_segments = 4};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    uint64_t pages[6];
+    assert(allocate_pages(&db, pages, 6));
+
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    for (size_t tx = 0; tx < 8; tx++) {
+      assert(write_random_pages(&db, pages, 6, tx));
+    }
+    wal_state_t* wal = &db.state->wal_state;
+    for (size_t i = 0; i < 4; i++) {
+      assert(wal->files[i].last_write_pos);
+      assert(wal->files[i].span.size == options.wal_size);
+    }
+    // the reader is gone, all but the current segment are recycled
+    assert(txn_close(&r));
+    assert(write_random_pages(&db, pages, 6, 8));
+    for (size_t i = 0; i < 4; i++) {
+      if (i == wal->current_append_file_index) continue;
+      assert(wal->files[i].last_write_pos == 0);
+      assert(wal->files[i].span.size == options.wal_size);
+    }
+  }
+
+  it("recovers records after the segments wrapped around") {
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .wal_size = 128 * 1024, .wal_segments = 4};
+    uint64_t pages[7];
+    {
+      db_t db;
+      assert(db_create("/tmp/db/try", &options, &db));
+      defer(db_close, db);
+      assert(allocate_pages(&db, pages, 7));
+      {
+        txn_t r;
+        assert(txn_create(&db, TX_READ, &r));
+        defer(txn_close, r);
+        for (size_t tx = 0; tx < 6; tx++) {
+          assert(write_random_pages(&db, pages, 6, tx));
+        }
+      }
+      // prevent the pages from being written to the data file
+      txn_t leaked;
+      assert(txn_create(&db, TX_READ, &leaked));
+      defer(free, leaked.working_set);
+      // the last page is only in the oldest segment
+      assert(write_random_pages(&db, pages, 7, 6));
+      for (size_t tx = 7; tx < 12; tx++) {
+        assert(write_random_pages(&db, pages, 6, tx));
+      }
+      // the newest records are in a segment before the oldest ones
+      wal_state_t* wal = &db.state->wal_state;
+      assert(wal->current_append_file_index < 3);
+      assert(wal->files[3].last_write_pos);
+    }
+    db_t db;
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    for (size_t i = 0; i < 7; i++) {
+      char expected[64];
+      sprintf(expected, "Page %zu in tx %d", i, i < 6 ? 11 : 6);
+      page_t p = {.page_num = pages[i]};
+      assert(txn_get_page(&r, &p));
+      assert(strcmp(expected, p.address) == 0);
+    }
+  }
+
+  it("keeps the segments of an existing database") {
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .wal_size = 128 * 1024, .wal_segments = 4};
+    uint64_t pages[6];
+    {
+      db_t db;
+      assert(db_create("/tmp/db/try", &options, &db));
+      defer(db_close, db);
+      assert(allocate_pages(&db, pages, 6));
+      // prevent the pages from being written to the data file
+      txn_t leaked;
+      assert(txn_create(&db, TX_READ, &leaked));
+      defer(free, leaked.working_set);
+      for (size_t tx = 0; tx < 8; tx++) {
+        assert(write_random_pages(&db, pages, 6, tx));
+      }
+      assert(db.state->wal_state.files[3].last_write_pos);
+    }
+    // <1>
+    // the records in the last segments are still recovered
+    options.wal_segments = 2;
+    db_t db;
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    assert(db.state->wal_state.number_of_segments == 4);
+    assert(db.state->options.wal_segments == 4);
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    for (size_t i = 0; i < 6; i++) {
+      char expected[64];
+      sprintf(expected, "Page %zu in tx 7", i);
+      page_t p = {.page_num = pages[i]};
+      assert(txn_get_page(&r, &p));
+      assert(strcmp(expected, p.address) == 0);
+    }
+  }
+}
+// end::wal_segments[]
+
+// tag::page_checksum[]
+static result_t write_string_page(
+    db_t* db, const char* str, uint64_t* page_num) {
+  txn_t w;
+  ensure(txn_create(db, TX_WRITE, &w));
+  defer(txn_close, w);
+  page_t p = {.number_of_pages = 1};
+  ensure(txn_allocate_page(&w, &p, 0));
+  p.metadata->overflow.page_flags      = page_flags_overflow;
+  p.metadata->overflow.number_of_pages = 1;
+  strcpy(p.address, str);
+  ensure(txn_commit(&w));
+  *page_num = p.page_num;
+  return success();
+}
+
+describe(page_checksum) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("computes the standard CRC32C") {
+    assert(checksum_crc32c("123456789", 9) == 0xE3069283);
+    assert(checksum_crc32c("", 0) == 0);
+  }
+
+  it("recovers pages and WAL records using CRC32C") {
+    uint64_t page_num;
+    {
+      db_t db;
+      db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+          .page_checksum = page_checksum_crc32c};
+      assert(db_create("/tmp/db/try", &options, &db));
+      defer(db_close, db);
+      // prevent the page from being written to the data file
+      txn_t leaked;
+      assert(txn_create(&db, TX_READ, &leaked));
+      defer(free, leaked.working_set);
+      assert(write_string_page(&db, "Hello CRC32C", &page_num));
+    }
+    // the file header decides, not the options
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .flags = db_flags_page_validation_always};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    assert(db.state->options.page_checksum == page_checksum_crc32c);
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    page_t p = {.page_num = page_num};
+    assert(txn_get_page(&r, &p));
+    assert(strcmp("Hello CRC32C", p.address) == 0);
+  }
+
+  it("can detect disk corruption using CRC32C") {
+    uint64_t page_num;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .page_checksum = page_checksum_crc32c};
+    {
+      db_t db;
+      assert(db_create("/tmp/db/try", &options, &db));
+      defer(db_close, db);
+      assert(write_string_page(&db, "Hello CRC32C", &page_num));
+      // forcing a flush to disk, only allowed manually from tests
+      assert(wal_checkpoint(db.state, UINT64_MAX));
+    }
+    FILE* f = fopen("/tmp/db/try", "r+");
+    assert(f);
+    fseek(f, (long)(page_num * PAGE_SIZE + 100), SEEK_SET);
+    fputc(1, f);
+    fclose(f);
+
+    db_t db;
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    page_t p = {.page_num = page_num};
+    assert(!txn_get_page(&r, &p));
+    size_t err_count;
+    int err_code = errors_get_codes(&err_count)[0];
+    errors_clear();
+    assert(err_code == ENODATA);
+  }
+
+  it("existing files keep using BLAKE2b") {
+    uint64_t page_num;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    {
+      db_t db;
+      assert(db_create("/tmp/db/try", &options, &db));
+      defer(db_close, db);
+      assert(write_string_page(&db, "Hello BLAKE2b", &page_num));
+    }
+    options.page_checksum = page_checksum_crc32c;
+    options.flags         = db_flags_page_validation_always;
+    db_t db;
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    assert(db.state->options.page_checksum == page_checksum_blake2b);
+    assert(write_string_page(&db, "Still BLAKE2b", &page_num));
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    page_t p = {.page_num = page_num};
+    assert(txn_get_page(&r, &p));
+    assert(strcmp("Still BLAKE2b", p.address) == 0);
+  }
+}
+// end::page_checksum[]
+
+// tag::group_commit[]
+typedef struct wal_writes {
+  db_t* db;
+  size_t txs;
+  size_t batches;
+  uint64_t last_write_pos;
+} wal_writes_t;
+
+// the records of a single write are reported one after the other,
+// before the next write moves the position
+static void count_wal_batches(
+    void* state, uint64_t tx_id, span_t* wal_record) {
+  (void)tx_id;
+  (void)wal_record;
+  wal_writes_t* w = state;
+  if (!w->db) return;  // the db initialization
+  wal_state_t* wal = &w->db->state->wal_state;
+  uint64_t pos =
+      wal->files[wal->current_append_file_index].last_write_pos;
+  w->txs++;
+  if (pos != w->last_write_pos) w->batches++;
+  w->last_write_pos = pos;
+}
+
+static result_t write_overflow_page(
+    db_t* db, const char* value, uint64_t* page_num) {
+  txn_t w;
+  ensure(txn_create(db, TX_WRITE, &w));
+  defer(txn_close, w);
+  page_t p = {.number_of_pages = 1};
+  ensure(txn_allocate_page(&w, &p, 0));
+  p.metadata->overflow.page_flags      = page_flags_overflow;
+  p.metadata->overflow.number_of_pages = 1;
+  strcpy(p.address, value);
+  *page_num = p.page_num;
+  ensure(txn_commit(&w));
+  return success();
+}
+
+static void count_durable_commits(
+    void* state, uint64_t tx_id, bool durable) {
+  (void)tx_id;
+  if (durable) (*(size_t*)state)++;
+}
+
+static result_t write_overflow_page_async(db_t* db, const char* value,
+    uint64_t* page_num, size_t* durable_commits) {
+  txn_t w;
+  ensure(txn_create(db, TX_WRITE, &w));
+  defer(txn_close, w);
+  page_t p = {.number_of_pages = 1};
+  ensure(txn_allocate_page(&w, &p, 0));
+  p.metadata->overflow.page_flags      = page_flags_overflow;
+  p.metadata->overflow.number_of_pages = 1;
+  strcpy(p.address, value);
+  *page_num = p.page_num;
+  ensure(
+      txn_commit_async(&w, count_durable_commits, durable_commits));
+  return success();
+}
+
+describe(group_commit) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("coalesce several transactions into a single WAL write") {
+    wal_writes_t writes = {0};
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .flags                      = db_flags_wal_group_commit,
+        .wal_write_callback         = count_wal_batches,
+        .wal_write_callback_state   = &writes};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    writes.db = &db;
+    uint64_t page_num;
+    assert(write_overflow_page(&db, "Hello Gavran", &page_num));
+    // <1>
+    // a reader keeps the gc from checkpointing the WAL meanwhile
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    writes.txs = writes.batches = 0;
+    size_t durable_commits = 0;
+    // <2>
+    // the writer is busy, so the txs queue up behind it
+    wal_writer_lock(db.state);
+    for (size_t i = 0; i < 8; i++) {
+      assert(write_overflow_page_async(
+          &db, "Hello Gavran", &page_num, &durable_commits));
+    }
+    wal_writer_unlock(db.state);
+    assert(db_flush_wal(&db));
+    assert(durable_commits == 8);
+    assert(writes.txs == 8);
+    assert(writes.batches <= 2);
+  }
+
+  it("a commit returns once its transaction is durable") {
+    uint64_t page_num;
+    {
+      db_t db;
+      db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+          .flags = db_flags_wal_group_commit};
+      assert(db_create("/tmp/db/try", &options, &db));
+      defer(db_close, db);
+      assert(write_overflow_page(&db, "Hello Gavran", &page_num));
+      wal_state_t* wal = &db.state->wal_state;
+      assert(wal->durable_tx_id == db.state->last_tx_id);
+      assert(wal->pending_txs == 0);
+    }
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    page_t p = {.page_num = page_num};
+    assert(txn_get_page(&r, &p));
+    assert(strcmp("Hello Gavran", p.address) == 0);
+  }
+}
+// end::group_commit[]
+
+// tag::async_commit[]
+// writes to the WAL fail until the files are restored
+static result_t wal_fail_writes(db_t* db, int* saved) {
+  wal_state_t* wal = &db->state->wal_state;
+  for (size_t i = 0; i < wal->number_of_segments; i++) {
+    saved[i] = dup(wal->files[i].handle->fd);
+    int fd   = open(wal->files[i].handle->filename, O_RDONLY);
+    ensure(saved[i] != -1 && fd != -1);
+    ensure(dup2(fd, wal->files[i].handle->fd) != -1);
+    close(fd);
+  }
+  return success();
+}
+
+static result_t wal_restore_writes(db_t* db, int* saved) {
+  wal_state_t* wal = &db->state->wal_state;
+  for (size_t i = 0; i < wal->number_of_segments; i++) {
+    ensure(dup2(saved[i], wal->files[i].handle->fd) != -1);
+    close(saved[i]);
+  }
+  return success();
+}
+
+describe(group_commit_failure) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("drops the pending transactions if the write fails") {
+    uint64_t page_num;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .flags = db_flags_wal_group_commit};
+    {
+      db_t db;
+      assert(db_create("/tmp/db/try", &options, &db));
+      assert(write_overflow_page(&db, "Hello Gavran", &page_num));
+      assert(db_flush_wal(&db));
+      int saved[WAL_MAX_SEGMENTS];
+      assert(wal_fail_writes(&db, saved));
+      txn_t w;
+      assert(txn_create(&db, TX_WRITE, &w));
+      page_t p = {.page_num = page_num};
+      assert(txn_modify_page(&w, &p));
+      strcpy(p.address, "Never durable");
+      assert(!txn_commit(&w));
+      errors_clear();
+      assert(txn_close(&w));
+      assert(!db_flush_wal(&db));
+      errors_clear();
+      // <1>
+      // a failure is final, even once the WAL can be written to again
+      assert(wal_restore_writes(&db, saved));
+      uint64_t other;
+      assert(!write_overflow_page(&db, "Rejected", &other));
+      errors_clear();
+      assert(!db_close(&db));
+      errors_clear();
+    }
+    db_t db;
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    page_t p = {.page_num = page_num};
+    assert(txn_get_page(&r, &p));
+    assert(strcmp("Hello Gavran", p.address) == 0);
+  }
+}
+
+describe(async_commit) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("invokes the callback once the transaction is durable") {
+    size_t durable_commits = 0;
+    uint64_t page_num;
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    for (size_t i = 0; i < 8; i++) {
+      assert(write_overflow_page_async(
+          &db, "Hello Gavran", &page_num, &durable_commits));
+    }
+    // visible to the next transaction before it is durable
+    {
+      txn_t r;
+      assert(txn_create(&db, TX_READ, &r));
+      defer(txn_close, r);
+      page_t p = {.page_num = page_num};
+      assert(txn_get_page(&r, &p));
+      assert(strcmp("Hello Gavran", p.address) == 0);
+    }
+    assert(db_flush_wal(&db));
+    assert(durable_commits == 8);
+    assert(db.state->wal_state.durable_tx_id == db.state->last_tx_id);
+  }
+
+  it("async transactions survive a restart") {
+    size_t durable_commits = 0;
+    uint64_t page_num;
+    {
+      db_t db;
+      db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+      assert(db_create("/tmp/db/try", &options, &db));
+      defer(db_close, db);
+      assert(write_overflow_page_async(
+          &db, "Hello Gavran", &page_num, &durable_commits));
+      // sync commits are ordered after the async ones
+      uint64_t other;
+      assert(write_overflow_page(&db, "Hello Async", &other));
+    }
+    assert(durable_commits == 1);
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    page_t p = {.page_num = page_num};
+    assert(txn_get_page(&r, &p));
+    assert(strcmp("Hello Gavran", p.address) == 0);
+  }
+
+  it("drops the transactions that failed to be written") {
+    size_t durable_commits = 0;
+    uint64_t page_num;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    {
+      db_t db;
+      assert(db_create("/tmp/db/try", &options, &db));
+      assert(write_overflow_page(&db, "Hello Gavran", &page_num));
+      int saved[WAL_MAX_SEGMENTS];
+      assert(wal_fail_writes(&db, saved));
+      txn_t w;
+      assert(txn_create(&db, TX_WRITE, &w));
+      page_t p = {.page_num = page_num};
+      assert(txn_modify_page(&w, &p));
+      strcpy(p.address, "Never durable");
+      assert(txn_commit_async(&w, count_durable_commits,
+          &durable_commits));
+      assert(txn_close(&w));
+      // <2>
+      // the db is poisoned, nothing after the failure is accepted
+      assert(!db_flush_wal(&db));
+      errors_clear();
+      assert(durable_commits == 0);
+      uint64_t other;
+      assert(!write_overflow_page(&db, "Rejected", &other));
+      errors_clear();
+      assert(wal_restore_writes(&db, saved));
+      // the failed txs are gone, even if the WAL could take them now
+      assert(!db_close(&db));
+      errors_clear();
+    }
+    db_t db;
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    page_t p = {.page_num = page_num};
+    assert(txn_get_page(&r, &p));
+    assert(strcmp("Hello Gavran", p.address) == 0);
+  }
+}
+// end::async_commit[]
+
+// tag::pal_batch[]
+describe(pal_batch) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/files");
+    system("rm -f /tmp/files/*");
+  }
+
+  it("can write several ranges in a single batch") {
+    file_handle_t* h;
+    assert(pal_create_file(
+        "/tmp/files/try", &h, pal_file_creation_flags_none));
+    defer(pal_close_file, h);
+    assert(pal_set_file_size(h, 1024 * 128, 1024 * 128));
+
+    char a[] = "Hello from Gavran";
+    char b[] = "Batched writes";
+    char c[] = "Vectored";
+    span_t buffers[] = {{.address = b, .size = sizeof(b)},
+        {.address = a, .size = sizeof(a)},
+        {.address = c, .size = sizeof(c)}};
+    pal_io_request_t writes[] = {
+        {.offset = 8192, .buffers = buffers, .number_of_buffers = 1},
+        {.offset = 0, .buffers = buffers + 1, .number_of_buffers = 2},
+    };
+    assert(pal_write_file_batch(h, writes, 2, true));
+
+    char buffer[32];
+    assert(pal_read_file(h, 0, buffer, sizeof(a)));
+    assert(strcmp(a, buffer) == 0);
+    assert(pal_read_file(h, sizeof(a), buffer, sizeof(c)));
+    assert(strcmp(c, buffer) == 0);
+    assert(pal_read_file(h, 8192, buffer, sizeof(b)));
+    assert(strcmp(b, buffer) == 0);
+  }
+
+  it("can write more buffers than a single I/O takes") {
+    file_handle_t* h;
+    assert(pal_create_file(
+        "/tmp/files/try", &h, pal_file_creation_flags_none));
+    defer(pal_close_file, h);
+    assert(pal_set_file_size(h, 1024 * 128, 1024 * 128));
+
+    // past IOV_MAX, the rest is written as a short write
+    uint64_t values[1100];
+    span_t buffers[1100];
+    for (size_t i = 0; i < 1100; i++) {
+      values[i]  = i;
+      buffers[i] = (span_t){.address = &values[i], .size = 8};
+    }
+    pal_io_request_t write = {
+        .offset = 0, .buffers = buffers, .number_of_buffers = 1100};
+    assert(pal_write_file_batch(h, &write, 1, true));
+
+    uint64_t read[1100];
+    assert(pal_read_file(h, 0, read, sizeof(read)));
+    assert(memcmp(values, read, sizeof(read)) == 0);
+  }
+
+  it("can write more requests than a single submission takes") {
+    file_handle_t* h;
+    assert(pal_create_file(
+        "/tmp/files/try", &h, pal_file_creation_flags_none));
+    defer(pal_close_file, h);
+    assert(pal_set_file_size(h, 1024 * 512, 1024 * 512));
+
+    uint64_t values[100];
+    span_t buffers[100];
+    pal_io_request_t writes[100];
+    for (size_t i = 0; i < 100; i++) {
+      values[i]  = i + 1;
+      buffers[i] = (span_t){.address = &values[i], .size = 8};
+      writes[i]  = (pal_io_request_t){.offset = i * 4096,
+          .buffers                            = &buffers[i],
+          .number_of_buffers                  = 1};
+    }
+    assert(pal_write_file_batch(h, writes, 100, true));
+
+    for (size_t i = 0; i < 100; i++) {
+      uint64_t value;
+      assert(pal_read_file(h, i * 4096, &value, sizeof(value)));
+      assert(value == i + 1);
+    }
+  }
+
+  it("fails to read past the end of the file") {
+    file_handle_t* h;
+    assert(pal_create_file(
+        "/tmp/files/try", &h, pal_file_creation_flags_none));
+    defer(pal_close_file, h);
+    assert(pal_set_file_size(h, 1024 * 128, 1024 * 128));
+
+    // a short read up to the end, then nothing
+    char buffer[8192];
+    assert(!pal_read_file(h, 1024 * 124, buffer, sizeof(buffer)));
+    size_t count;
+    int* codes = errors_get_codes(&count);
+    assert(count > 0 && codes[0] == EINVAL);
+    errors_clear();
+
+    // the file can still be used after the failure
+    assert(pal_read_file(h, 1024 * 120, buffer, sizeof(buffer)));
+  }
+}
+// end::pal_batch[]
+
+// tag::write_back[]
+describe(write_back) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("merges adjacent pages when writing to the data file") {
+    uint64_t pages[16];
+    {
+      db_t db;
+      db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+          .write_back_max_io_size        = 3 * PAGE_SIZE};
+      assert(db_create("/tmp/db/try", &options, &db));
+      defer(db_close, db);
+      txn_t w;
+      assert(txn_create(&db, TX_WRITE, &w));
+      defer(txn_close, w);
+      for (size_t i = 0; i < 16; i++) {
+        page_t p = {.number_of_pages = 1 + (i % 3 == 0)};
+        assert(txn_allocate_page(&w, &p, 0));
+        p.metadata->overflow.page_flags      = page_flags_overflow;
+        p.metadata->overflow.number_of_pages = p.number_of_pages;
+        sprintf(p.address, "Page %zu", i);
+        pages[i] = p.page_num;
+      }
+      assert(txn_commit(&w));
+    }
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .flags                      = db_flags_avoid_mmap_io};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    for (size_t i = 0; i < 16; i++) {
+      char expected[32];
+      sprintf(expected, "Page %zu", i);
+      page_t p = {.page_num = pages[i]};
+      assert(txn_get_page(&r, &p));
+      assert(strcmp(expected, p.address) == 0);
+    }
+  }
+}
+// end::write_back[]
+
+// tag::parallel_recovery[]
+describe(parallel_recovery) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("recovers the final page images using multiple threads") {
+    uint64_t pages[8];
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    randombytes_buf(options.encryption_key, 32);
+    {
+      db_t db;
+      assert(db_create("/tmp/db/try", &options, &db));
+      defer(db_close, db);
+      txn_t w;
+      assert(txn_create(&db, TX_WRITE, &w));
+      for (size_t i = 0; i < 8; i++) {
+        page_t p = {.number_of_pages = 1};
+        assert(txn_allocate_page(&w, &p, 0));
+        p.metadata->overflow.page_flags      = page_flags_overflow;
+        p.metadata->overflow.number_of_pages = 1;
+        pages[i]                             = p.page_num;
+      }
+      assert(txn_commit(&w));
+      assert(txn_close(&w));
+
+      // prevent the pages from being written to the data file
+      txn_t leaked;
+      assert(txn_create(&db, TX_READ, &leaked));
+      defer(free, leaked.working_set);
+
+      for (size_t tx = 0; tx < 64; tx++) {
+        assert(txn_create(&db, TX_WRITE, &w));
+        defer(txn_close, w);
+        for (size_t i = tx % 2; i < 8; i += 2) {
+          page_t p = {.page_num = pages[i]};
+          assert(txn_modify_page(&w, &p));
+          sprintf(p.address + i * 64, "Page %zu in tx %zu", i, tx);
+        }
+        assert(txn_commit(&w));
+      }
+    }
+    db_t db;
+    options.wal_recovery_threads = 4;
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    for (size_t i = 0; i < 8; i++) {
+      char expected[64];
+      sprintf(expected, "Page %zu in tx %zu", i, 62 + i % 2);
+      page_t p = {.page_num = pages[i]};
+      assert(txn_get_page(&r, &p));
+      assert(strcmp(expected, p.address + i * 64) == 0);
+    }
+  }
+}
+// end::parallel_recovery[]
+
+// tag::wal_diff[]
+describe(wal_diff) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("recovers changes at the end of the page") {
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    {
+      db_t db;
+      assert(db_create("/tmp/db/try", &options, &db));
+      defer(db_close, db);
+      {
+        txn_t w;
+        assert(txn_create(&db, TX_WRITE, &w));
+        defer(txn_close, w);
+        page_t p = {.page_num = 3};
+        assert(txn_raw_modify_page(&w, &p));
+        memset(p.address, 'a', PAGE_SIZE);
+        assert(txn_commit(&w));
+      }
+      // prevent the pages from being written to the data file
+      txn_t leaked;
+      assert(txn_create(&db, TX_READ, &leaked));
+      defer(free, leaked.working_set);
+      {
+        txn_t w;
+        assert(txn_create(&db, TX_WRITE, &w));
+        defer(txn_close, w);
+        page_t p = {.page_num = 3};
+        assert(txn_raw_modify_page(&w, &p));
+        memset(p.address + PAGE_SIZE - 24, 'b', 24);
+        assert(txn_commit(&w));
+      }
+    }
+    db_t db;
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    page_t p = {.page_num = 3};
+    assert(txn_raw_get_page(&r, &p));
+    for (size_t i = 0; i < PAGE_SIZE; i++) {
+      char expected = i < PAGE_SIZE - 24 ? 'a' : 'b';
+      assert(((char *)p.address)[i] == expected);
+    }
+  }
+}
+// end::wal_diff[]
+
+// tag::wal_compression[]
+describe(wal_compression) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("skips compression below the minimum size") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .wal_compression_min_size      = 1024 * 1024,
+        .wal_compression_level         = 1};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+
+    txn_t wtx;
+    assert(txn_create(&db, TX_WRITE, &wtx));
+    defer(txn_close, wtx);
+    uint64_t initial = db.state->wal_state.files[0].last_write_pos;
+    for (size_t i = 3; i < 10; i++) {
+      page_t p = {.page_num = i};
+      assert(txn_raw_modify_page(&wtx, &p));
+      memset(p.address, 'a' + (char)i, PAGE_SIZE);
+    }
+    assert(txn_commit(&wtx));
+
+    uint64_t final = db.state->wal_state.files[0].last_write_pos;
+    assert((final - initial) == 8 * PAGE_SIZE);
+  }
+}
+// end::wal_compression[]
+
+// tag::wal_dictionary[]
+static void write_json_page(txn_t *w, size_t tx, uint64_t *page_num) {
+  page_t p = {.number_of_pages = 1};
+  assert(txn_allocate_page(w, &p, 0));
+  p.metadata->overflow.page_flags      = page_flags_overflow;
+  p.metadata->overflow.number_of_pages = 1;
+  char *cur                            = p.address;
+  for (size_t i = 0; i < 64; i++) {
+    size_t id = tx * 64 + i;
+    cur += sprintf(cur,
+        "{\"id\":%zu,\"name\":\"user-%zu\",\"email\":\"user%zu@"
+        "example.com\",\"active\":%s}\n",
+        id, id * 7, id % 13, id % 3 ? "true" : "false");
+  }
+  *page_num = p.page_num;
+}
+
+describe(wal_dictionary) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("recovers records compressed with a trained dictionary") {
+    uint64_t pages[256];
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .wal_size                      = 4 * 1024 * 1024,
+        .wal_compression_min_size      = 1,
+        .wal_dictionary_size           = 8 * 1024};
+    {
+      db_t db;
+      assert(db_create("/tmp/db/try", &options, &db));
+      defer(db_close, db);
+      for (size_t tx = 0; tx < 256; tx++) {
+        txn_t w;
+        assert(txn_create(&db, TX_WRITE, &w));
+        write_json_page(&w, tx, &pages[tx]);
+        assert(txn_commit(&w));
+        assert(txn_close(&w));
+        if (tx == 127) {
+          assert(db_train_wal_dictionary(&db));
+          assert(db.state->wal_state.compression_dictionary_page);
+        }
+        if (tx == 100) {
+          // prevent the pages from being written to the data file
+          txn_t leaked;
+          assert(txn_create(&db, TX_READ, &leaked));
+          free(leaked.working_set);
+        }
+      }
+    }
+    // recover the same files both sequentially and in parallel
+    system("cp /tmp/db/try /tmp/db/copy");
+    system("cp /tmp/db/try-a.wal /tmp/db/copy-a.wal");
+    system("cp /tmp/db/try-b.wal /tmp/db/copy-b.wal");
+    for (uint64_t threads = 0; threads < 4; threads += 3) {
+      db_t db;
+      options.wal_recovery_threads = threads;
+      assert(db_create(
+          threads ? "/tmp/db/copy" : "/tmp/db/try", &options, &db));
+      defer(db_close, db);
+      assert(db.state->wal_state.compression_dictionary_page);
+      txn_t r;
+      assert(txn_create(&db, TX_READ, &r));
+      defer(txn_close, r);
+      for (size_t tx = 0; tx < 256; tx++) {
+        char expected[128];
+        sprintf(expected, "{\"id\":%zu,", tx * 64);
+        page_t p = {.page_num = pages[tx]};
+        assert(txn_get_page(&r, &p));
+        assert(strncmp(expected, p.address, strlen(expected)) == 0);
+      }
+    }
+  }
+}
+// end::wal_dictionary[]
+
+// tag::concurrent_readers[]
+typedef struct concurrent_reader {
+  db_t* db;
+  uint64_t* pages;
+  uint64_t tree_id;
+  size_t reads;
+  bool* stop;
+  bool failed;
+  uint8_t padding[7];
+} concurrent_reader_t;
+
+static result_t write_counters(
+    db_t* db, uint64_t* pages, uint64_t counter) {
+  txn_t w;
+  ensure(txn_create(db, TX_WRITE, &w));
+  defer(txn_close, w);
+  for (size_t i = 0; i < 2; i++) {
+    page_t p = {.page_num = pages[i]};
+    ensure(txn_modify_page(&w, &p));
+    memcpy(p.address, &counter, sizeof(uint64_t));
+  }
+  ensure(txn_commit(&w));
+  return success();
+}
+
+static result_t read_counters(
+    db_t* db, uint64_t* pages, uint64_t* counter) {
+  txn_t r;
+  ensure(txn_create(db, TX_READ, &r));
+  defer(txn_close, r);
+  uint64_t values[2];
+  for (size_t i = 0; i < 2; i++) {
+    page_t p = {.page_num = pages[i]};
+    ensure(txn_get_page(&r, &p));
+    memcpy(&values[i], p.address, sizeof(uint64_t));
+  }
+  // both pages are always written in the same txn
+  ensure(values[0] == values[1] && values[0] >= *counter,
+      msg("Read txn saw a torn snapshot"), with(values[0], "%lu"),
+      with(values[1], "%lu"), with(*counter, "%lu"));
+  *counter = values[0];
+  return success();
+}
+
+static void* read_counters_thread(void* arg) {
+  concurrent_reader_t* r = arg;
+  uint64_t counter       = 0;
+  while (!__atomic_load_n(r->stop, __ATOMIC_ACQUIRE)) {
+    if (flopped(read_counters(r->db, r->pages, &counter))) {
+      errors_clear();
+      r->failed = true;
+      break;
+    }
+    r->reads++;
+  }
+  return 0;
+}
+
+static result_t read_keys(db_t* db, uint64_t tree_id) {
+  txn_t r;
+  ensure(txn_create(db, TX_READ, &r));
+  defer(txn_close, r);
+  for (size_t i = 0; i < 512; i += 7) {
+    char key[32];
+    btree_val_t get = {.tree_id = tree_id,
+        .key = {.address = key, .size = (size_t)sprintf(key,
+                                    "key-%05zu", i)}};
+    ensure(btree_get(&r, &get));
+    ensure(get.has_val && get.val == i, msg("Wrong btree value"),
+        with(i, "%zu"), with(get.val, "%lu"));
+  }
+  return success();
+}
+
+static void* read_keys_thread(void* arg) {
+  concurrent_reader_t* r = arg;
+  while (!__atomic_load_n(r->stop, __ATOMIC_ACQUIRE)) {
+    if (flopped(read_keys(r->db, r->tree_id))) {
+      errors_clear();
+      r->failed = true;
+      break;
+    }
+    r->reads++;
+  }
+  return 0;
+}
+
+static result_t write_keys(
+    db_t* db, uint64_t tree_id, size_t start, size_t count) {
+  txn_t w;
+  ensure(txn_create(db, TX_WRITE, &w));
+  defer(txn_close, w);
+  for (size_t i = start; i < start + count; i++) {
+    char key[32];
+    btree_val_t set = {.tree_id = tree_id,
+        .key = {.address = key, .size = (size_t)sprintf(key,
+                                    "key-%05zu", i)},
+        .val = i};
+    ensure(btree_set(&w, &set, 0));
+  }
+  ensure(txn_commit(&w));
+  return success();
+}
+
+describe(concurrent_readers) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("read txns on many threads see consistent snapshots") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    uint64_t pages[2];
+    assert(allocate_pages(&db, pages, 2));
+    assert(write_counters(&db, pages, 0));
+
+    bool stop = false;
+    concurrent_reader_t readers[8];
+    pthread_t threads[8];
+    for (size_t i = 0; i < 8; i++) {
+      readers[i] = (concurrent_reader_t){
+          .db = &db, .pages = pages, .stop = &stop};
+      assert(!pthread_create(
+          &threads[i], 0, read_counters_thread, &readers[i]));
+    }
+    // the gc runs on the write txn, or a read txn that held it back
+    bool written = true;
+    for (uint64_t i = 1; i <= 128 && written; i++) {
+      written = write_counters(&db, pages, i);
+    }
+    __atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+    for (size_t i = 0; i < 8; i++) {
+      pthread_join(threads[i], 0);
+      assert(!readers[i].failed);
+    }
+    assert(written);
+
+    uint64_t counter = 0;
+    assert(read_counters(&db, pages, &counter));
+    assert(counter == 128);
+  }
+
+  it("btree reads on many threads while the tree grows") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    uint64_t tree_id;
+    {
+      txn_t w;
+      assert(txn_create(&db, TX_WRITE, &w));
+      defer(txn_close, w);
+      assert(btree_create(&w, &tree_id));
+      assert(txn_commit(&w));
+    }
+    assert(write_keys(&db, tree_id, 0, 512));
+
+    bool stop = false;
+    concurrent_reader_t readers[8];
+    pthread_t threads[8];
+    for (size_t i = 0; i < 8; i++) {
+      readers[i] = (concurrent_reader_t){
+          .db = &db, .tree_id = tree_id, .stop = &stop};
+      assert(!pthread_create(
+          &threads[i], 0, read_keys_thread, &readers[i]));
+    }
+    // page splits modify the pages the readers are searching
+    bool written = true;
+    for (size_t i = 0; i < 64 && written; i++) {
+      written = write_keys(&db, tree_id, 512 + i * 64, 64);
+    }
+    __atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+    for (size_t i = 0; i < 8; i++) {
+      pthread_join(threads[i], 0);
+      assert(!readers[i].failed);
+    }
+    assert(written);
+    assert(read_keys(&db, tree_id));
+  }
+}
+// end::concurrent_readers[]
+
+// tag::epoch_reclamation[]
+describe(epoch_reclamation) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("an old read txn keeps its snapshot") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    uint64_t pages[2];
+    assert(allocate_pages(&db, pages, 2));
+    assert(write_counters(&db, pages, 1));
+
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    for (uint64_t i = 2; i <= 16; i++) {
+      assert(write_counters(&db, pages, i));
+    }
+    uint64_t counter = 0;
+    assert(read_counters(&db, pages, &counter));
+    assert(counter == 16);
+    page_t p = {.page_num = pages[0]};
+    assert(txn_get_page(&r, &p));
+    assert(*(uint64_t*)p.address == 1);
+    // <1>
+    // closing the read txn releases all the states it held back
+    assert(txn_close(&r));
+    assert(db.state->last_write_tx == db.state->default_read_tx);
+    assert(read_counters(&db, pages, &counter));
+    assert(counter == 16);
+  }
+
+  it("many read txns open at the same time") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    uint64_t pages[2];
+    assert(allocate_pages(&db, pages, 2));
+
+    // more readers than fit in a single block
+    txn_t readers[200];
+    for (uint64_t i = 0; i < 200; i++) {
+      assert(write_counters(&db, pages, i));
+      assert(txn_create(&db, TX_READ, &readers[i]));
+    }
+    for (uint64_t i = 0; i < 200; i++) {
+      page_t p = {.page_num = pages[1]};
+      assert(txn_get_page(&readers[i], &p));
+      assert(*(uint64_t*)p.address == i);
+    }
+    // the newest read txns go first, nothing can be written yet
+    for (size_t i = 199; i > 0; i--) {
+      assert(txn_close(&readers[i]));
+    }
+    assert(db.state->last_write_tx != db.state->default_read_tx);
+    assert(txn_close(&readers[0]));
+    assert(db.state->last_write_tx == db.state->default_read_tx);
+  }
+}
+// end::epoch_reclamation[]
+
+// tag::page_versions[]
+describe(page_versions) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("each read txn finds the version of its snapshot") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    uint64_t pages[2];
+    assert(allocate_pages(&db, pages, 2));
+
+    // the versions outgrow the table a few times while the oldest
+    // read txn keeps all of them in memory
+    txn_t readers[256];
+    for (uint64_t i = 0; i < 256; i++) {
+      assert(write_counters(&db, pages, i));
+      assert(txn_create(&db, TX_READ, &readers[i]));
+    }
+    for (uint64_t i = 0; i < 256; i++) {
+      uint64_t values[2];
+      for (size_t j = 0; j < 2; j++) {
+        page_t p = {.page_num = pages[j]};
+        assert(txn_get_page(&readers[i], &p));
+        memcpy(&values[j], p.address, sizeof(uint64_t));
+      }
+      assert(values[0] == i && values[1] == i);
+    }
+    // <1>
+    // oldest first, each close writes one more version to the file
+    for (uint64_t i = 0; i < 255; i++) {
+      assert(txn_close(&readers[i]));
+      page_t p = {.page_num = pages[0]};
+      assert(txn_get_page(&readers[255], &p));
+      assert(*(uint64_t*)p.address == 255);
+    }
+    assert(txn_close(&readers[255]));
+    uint64_t counter = 0;
+    assert(read_counters(&db, pages, &counter));
+    assert(counter == 255);
+  }
+}
+// end::page_versions[]
+
+// tag::pages_pool[]
+static result_t write_pages(db_t* db, uint64_t* pages, size_t count) {
+  txn_t w;
+  ensure(txn_create(db, TX_WRITE, &w));
+  defer(txn_close, w);
+  for (size_t i = 0; i < count; i++) {
+    page_t p = {.page_num = pages[i]};
+    ensure(txn_modify_page(&w, &p));
+    memset(p.address, (int)i, 64);
+  }
+  ensure(txn_commit(&w));
+  return success();
+}
+
+typedef struct pages_pool_thread {
+  db_t* first;
+  db_t* second;
+  uint64_t* pages;
+  pthread_barrier_t* barrier;
+  bool failed;
+  uint8_t _padding[7];
+} pages_pool_thread_t;
+
+static void* pages_pool_switch_thread(void* arg) {
+  pages_pool_thread_t* t = arg;
+  t->failed              = !write_pages(t->first, t->pages, 8);
+  // <1>
+  // the first db is closed while this thread caches its buffers
+  pthread_barrier_wait(t->barrier);
+  pthread_barrier_wait(t->barrier);
+  t->failed |= !write_pages(t->second, t->pages, 8);
+  return 0;
+}
+
+describe(pages_pool) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("reuses the page buffers of released txns") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    uint64_t pages[128];
+    assert(allocate_pages(&db, pages, 128));
+    assert(write_pages(&db, pages, 128));
+    pages_pool_stats_t before;
+    db_pages_pool_stats(&db, &before);
+
+    for (size_t i = 0; i < 16; i++) {
+      assert(write_pages(&db, pages, 128));
+    }
+    // <1>
+    // each txn is written back on close, the next one gets the same
+    // buffers from the pool
+    pages_pool_stats_t after;
+    db_pages_pool_stats(&db, &after);
+    assert(after.high_water_mark == before.high_water_mark);
+    assert(after.misses == before.misses);
+    assert(after.hits - before.hits >= 16 * 128);
+  }
+
+  it("buffers of a closed db aren't reused") {
+    uint64_t pages[8];
+    for (size_t i = 0; i < 2; i++) {
+      db_t db;
+      db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+      assert(db_create("/tmp/db/try", &options, &db));
+      defer(db_close, db);
+      assert(allocate_pages(&db, pages, 8));
+      assert(write_pages(&db, pages, 8));
+      pages_pool_stats_t stats;
+      db_pages_pool_stats(&db, &stats);
+      assert(stats.misses > 0);
+    }
+  }
+
+  it("drops the cache of a db closed by another thread") {
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    db_t first, second;
+    assert(db_create("/tmp/db/one", &options, &first));
+    assert(db_create("/tmp/db/two", &options, &second));
+    defer(db_close, second);
+    uint64_t pages[8];
+    assert(allocate_pages(&first, pages, 8));
+    assert(allocate_pages(&second, pages, 8));
+
+    pthread_barrier_t barrier;
+    assert(!pthread_barrier_init(&barrier, 0, 2));
+    pages_pool_thread_t t = {.first = &first,
+        .second                     = &second,
+        .pages                      = pages,
+        .barrier                    = &barrier};
+    pthread_t thread;
+    assert(!pthread_create(&thread, 0, pages_pool_switch_thread, &t));
+    pthread_barrier_wait(&barrier);
+    assert(db_close(&first));
+    pthread_barrier_wait(&barrier);
+    // <1>
+    // moving to the second db & exiting give the cache back, the
+    // buffers of the first one must not be touched
+    pthread_join(thread, 0);
+    pthread_barrier_destroy(&barrier);
+    assert(!t.failed);
+    assert(write_pages(&second, pages, 8));
+  }
+}
+// end::pages_pool[]
+
+// tag::parallel_commit[]
+describe(parallel_commit) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("finalizes the pages of a txn using multiple threads") {
+    for (size_t encrypted = 0; encrypted < 2; encrypted++) {
+      system("rm -f /tmp/db/*");
+      uint64_t pages[256];
+      db_options_t options = {.minimum_size = 8 * 1024 * 1024};
+      if (encrypted) randombytes_buf(options.encryption_key, 32);
+      {
+        db_t db;
+        options.commit_threads = 4;
+        assert(db_create("/tmp/db/try", &options, &db));
+        defer(db_close, db);
+        assert(allocate_pages(&db, pages, 256));
+        assert(write_pages(&db, pages, 256));
+      }
+      // <1>
+      // pages are validated when they are read, against the hashes &
+      // nonces the workers put in the metadata pages
+      db_t db;
+      options.commit_threads = 0;
+      assert(db_create("/tmp/db/try", &options, &db));
+      defer(db_close, db);
+      txn_t r;
+      assert(txn_create(&db, TX_READ, &r));
+      defer(txn_close, r);
+      for (size_t i = 0; i < 256; i++) {
+        page_t p = {.page_num = pages[i]};
+        assert(txn_get_page(&r, &p));
+        for (size_t j = 0; j < 64; j++) {
+          assert(((uint8_t*)p.address)[j] == (uint8_t)i);
+        }
+      }
+    }
+  }
+}
+// end::parallel_commit[]
+
+// tag::encryption_file_key[]
+describe(encryption_file_key) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("recovers pages of a file created with a file key") {
+    uint64_t page_num;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .flags = db_flags_encryption_file_key};
+    randombytes_buf(options.encryption_key, 32);
+    {
+      db_t db;
+      assert(db_create("/tmp/db/try", &options, &db));
+      defer(db_close, db);
+      // prevent the page from being written to the data file
+      txn_t leaked;
+      assert(txn_create(&db, TX_READ, &leaked));
+      defer(free, leaked.working_set);
+      assert(write_string_page(&db, "Hello file key", &page_num));
+    }
+    // the file header decides, not the options
+    options.flags = db_flags_page_validation_always;
+    db_t db;
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    assert(db.state->options.flags & db_flags_encryption_file_key);
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    page_t p = {.page_num = page_num};
+    assert(txn_get_page(&r, &p));
+    assert(strcmp("Hello file key", p.address) == 0);
+  }
+
+  it("keeps per page keys for existing files") {
+    uint64_t page_num;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    randombytes_buf(options.encryption_key, 32);
+    {
+      db_t db;
+      assert(db_create("/tmp/db/try", &options, &db));
+      defer(db_close, db);
+      assert(write_string_page(&db, "Per page", &page_num));
+    }
+    options.flags = db_flags_encryption_file_key |
+                    db_flags_page_validation_always;
+    db_t db;
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    assert(!(db.state->options.flags & db_flags_encryption_file_key));
+    assert(write_string_page(&db, "Still per page", &page_num));
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    page_t p = {.page_num = page_num};
+    assert(txn_get_page(&r, &p));
+    assert(strcmp("Still per page", p.address) == 0);
+  }
+}
+// end::encryption_file_key[]
+
+// tag::pages_cache[]
+static result_t read_pages(db_t* db, uint64_t* pages, size_t count) {
+  txn_t r;
+  ensure(txn_create(db, TX_READ, &r));
+  defer(txn_close, r);
+  for (size_t i = 0; i < count; i++) {
+    page_t p = {.page_num = pages[i]};
+    ensure(txn_get_page(&r, &p));
+    for (size_t j = 0; j < 64; j++) {
+      ensure(((uint8_t*)p.address)[j] == (uint8_t)i);
+    }
+  }
+  return success();
+}
+
+static result_t write_value(
+    db_t* db, uint64_t* pages, size_t count, uint8_t value) {
+  txn_t w;
+  ensure(txn_create(db, TX_WRITE, &w));
+  defer(txn_close, w);
+  for (size_t i = 0; i < count; i++) {
+    page_t p = {.page_num = pages[i]};
+    ensure(txn_modify_page(&w, &p));
+    memset(p.address, value, 64);
+  }
+  ensure(txn_commit(&w));
+  return success();
+}
+
+static result_t read_value(
+    txn_t* r, uint64_t* pages, size_t count, uint8_t value) {
+  for (size_t i = 0; i < count; i++) {
+    page_t p = {.page_num = pages[i]};
+    ensure(txn_get_page(r, &p));
+    for (size_t j = 0; j < 64; j++) {
+      ensure(((uint8_t*)p.address)[j] == value);
+    }
+  }
+  return success();
+}
+
+describe(pages_cache) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("read txns share the pages they decrypt") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .pages_cache_size = 64};
+    randombytes_buf(options.encryption_key, 32);
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    uint64_t pages[8];
+    assert(allocate_pages(&db, pages, 8));
+    assert(write_pages(&db, pages, 8));
+    pages_cache_stats_t before;
+    db_pages_cache_stats(&db, &before);
+    for (size_t i = 0; i < 10; i++) {
+      assert(read_pages(&db, pages, 8));
+    }
+    pages_cache_stats_t after;
+    db_pages_cache_stats(&db, &after);
+    // the pages & their metadata page are decrypted once
+    assert(after.misses - before.misses <= 9);
+    assert(after.hits - before.hits >= 9 * 8);
+  }
+
+  it("read txns see the version of their snapshot") {
+    for (size_t encrypted = 0; encrypted < 2; encrypted++) {
+      system("rm -f /tmp/db/*");
+      db_t db;
+      db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+          .pages_cache_size = 64};
+      if (encrypted) {
+        randombytes_buf(options.encryption_key, 32);
+      } else {
+        options.flags = db_flags_avoid_mmap_io;
+      }
+      assert(db_create("/tmp/db/try", &options, &db));
+      defer(db_close, db);
+      uint64_t pages[8];
+      assert(allocate_pages(&db, pages, 8));
+      assert(write_value(&db, pages, 8, 1));
+      txn_t old;
+      assert(txn_create(&db, TX_READ, &old));
+      assert(read_value(&old, pages, 8, 1));
+      // <1>
+      // the old txn keeps the new version out of the file
+      assert(write_value(&db, pages, 8, 2));
+      {
+        txn_t r;
+        assert(txn_create(&db, TX_READ, &r));
+        defer(txn_close, r);
+        assert(read_value(&r, pages, 8, 2));
+        assert(read_value(&old, pages, 8, 1));
+      }
+      // <2>
+      // the cached pages of the file are replaced once it is written
+      assert(txn_close(&old));
+      txn_t r;
+      assert(txn_create(&db, TX_READ, &r));
+      defer(txn_close, r);
+      assert(read_value(&r, pages, 8, 2));
+    }
+  }
+
+  it("evicts pages that aren't borrowed") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .pages_cache_size = 4};
+    randombytes_buf(options.encryption_key, 32);
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    uint64_t pages[64];
+    assert(allocate_pages(&db, pages, 64));
+    assert(write_pages(&db, pages, 64));
+    // <1>
+    // a single txn borrows all of the cache, the rest of the pages
+    // are its own copies
+    assert(read_pages(&db, pages, 64));
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    page_t p = {.page_num = pages[63]};
+    assert(txn_get_page(&r, &p));
+    assert(((uint8_t*)p.address)[0] == 63);
+    pages_cache_stats_t stats;
+    db_pages_cache_stats(&db, &stats);
+    assert(stats.evictions > 0);
+  }
+
+  it("reads ahead when scanning pages in order") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .flags = db_flags_avoid_mmap_io, .pages_cache_size = 128};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    uint64_t pages[64];
+    assert(allocate_pages(&db, pages, 64));
+    assert(write_pages(&db, pages, 64));
+    for (size_t i = 1; i < 64; i++) {
+      assert(pages[i] == pages[i - 1] + 1);
+    }
+    pages_cache_stats_t before;
+    db_pages_cache_stats(&db, &before);
+    assert(read_pages(&db, pages, 64));
+    // <1>
+    // most of the pages were already read with the one before them
+    pages_cache_stats_t after;
+    db_pages_cache_stats(&db, &after);
+    assert(after.hits - before.hits >= 48);
+  }
+
+  it("detects corruption of pages decrypted in place") {
+    uint64_t page_num;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .flags = db_flags_avoid_mmap_io, .pages_cache_size = 64};
+    randombytes_buf(options.encryption_key, 32);
+    {
+      db_t db;
+      assert(db_create("/tmp/db/try", &options, &db));
+      defer(db_close, db);
+      assert(write_string_page(&db, "Hello Cache", &page_num));
+      // forcing a flush to disk, only allowed manually from tests
+      assert(wal_checkpoint(db.state, UINT64_MAX));
+    }
+    FILE* f = fopen("/tmp/db/try", "r+");
+    assert(f);
+    fseek(f, (long)(page_num * PAGE_SIZE + 100), SEEK_SET);
+    fputc(1, f);
+    fclose(f);
+
+    db_t db;
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    page_t p = {.page_num = page_num};
+    assert(!txn_get_page(&r, &p));
+    size_t err_count;
+    int err_code = errors_get_codes(&err_count)[0];
+    errors_clear();
+    assert(err_code == EINVAL);
+  }
+}
+// end::pages_cache[]
+
+// tag::savepoints[]
+static result_t allocate_string_page(
+    txn_t* w, const char* str, page_t* p) {
+  p->number_of_pages = 1;
+  ensure(txn_allocate_page(w, p, 0));
+  p->metadata->overflow.page_flags      = page_flags_overflow;
+  p->metadata->overflow.number_of_pages = 1;
+  strcpy(p->address, str);
+  return success();
+}
+
+static result_t modify_string_page(
+    txn_t* w, uint64_t page_num, const char* str) {
+  page_t p = {.page_num = page_num};
+  ensure(txn_modify_page(w, &p));
+  strcpy(p.address, str);
+  return success();
+}
+
+static result_t expect_string_page(
+    txn_t* tx, uint64_t page_num, const char* str) {
+  page_t p = {.page_num = page_num};
+  ensure(txn_get_page(tx, &p));
+  ensure(strcmp(str, p.address) == 0, msg("Wrong page value"),
+      with(page_num, "%lu"));
+  return success();
+}
+
+describe(savepoints) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("rolls back the changes made after a savepoint") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    page_t p = {0}, n = {0};
+    {
+      txn_t w;
+      assert(txn_create(&db, TX_WRITE, &w));
+      defer(txn_close, w);
+      assert(allocate_string_page(&w, "one", &p));
+      txn_savepoint_t* sp;
+      assert(txn_savepoint(&w, &sp));
+      assert(modify_string_page(&w, p.page_num, "two"));
+      assert(allocate_string_page(&w, "new", &n));
+      assert(txn_rollback_to(&w, sp));
+      // <1>
+      // the page is as it was & the new one is free again
+      assert(expect_string_page(&w, p.page_num, "one"));
+      bool busy;
+      assert(txn_is_page_busy(&w, n.page_num, &busy));
+      assert(!busy);
+      assert(txn_commit(&w));
+    }
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    assert(expect_string_page(&r, p.page_num, "one"));
+    bool busy;
+    assert(txn_is_page_busy(&r, n.page_num, &busy));
+    assert(!busy);
+  }
+
+  it("released savepoints merge into the outer one") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    randombytes_buf(options.encryption_key, 32);
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    txn_t w;
+    assert(txn_create(&db, TX_WRITE, &w));
+    defer(txn_close, w);
+    page_t p = {0};
+    assert(allocate_string_page(&w, "one", &p));
+    txn_savepoint_t *outer, *inner;
+    assert(txn_savepoint(&w, &outer));
+    assert(modify_string_page(&w, p.page_num, "two"));
+    assert(txn_savepoint(&w, &inner));
+    assert(modify_string_page(&w, p.page_num, "three"));
+    assert(txn_release_savepoint(&w, inner));
+    assert(expect_string_page(&w, p.page_num, "three"));
+    // <1>
+    // the changes of the released savepoint belong to the outer one
+    assert(txn_rollback_to(&w, outer));
+    assert(expect_string_page(&w, p.page_num, "one"));
+    assert(!txn_rollback_to(&w, inner));
+    size_t err_count;
+    int err_code = errors_get_codes(&err_count)[0];
+    errors_clear();
+    assert(err_code == EINVAL);
+    // the outer savepoint is still active
+    assert(modify_string_page(&w, p.page_num, "four"));
+    assert(txn_rollback_to(&w, outer));
+    assert(expect_string_page(&w, p.page_num, "one"));
+  }
+
+  it("isolates the failed items of a batch") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    uint64_t tree_id;
+    {
+      txn_t w;
+      assert(txn_create(&db, TX_WRITE, &w));
+      defer(txn_close, w);
+      assert(btree_create(&w, &tree_id));
+      for (size_t i = 0; i < 1024; i++) {
+        txn_savepoint_t* sp;
+        assert(txn_savepoint(&w, &sp));
+        char key[32];
+        btree_val_t set = {.tree_id = tree_id,
+            .key = {.address = key, .size = (size_t)sprintf(key,
+                                        "key-%05zu", i)},
+            .val = i};
+        assert(btree_set(&w, &set, 0));
+        // <1>
+        // every fifth item is bad, even if it split the tree pages
+        if (i % 5 == 0) {
+          assert(txn_rollback_to(&w, sp));
+        }
+        assert(txn_release_savepoint(&w, sp));
+      }
+      assert(txn_commit(&w));
+    }
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    for (size_t i = 0; i < 1024; i++) {
+      char key[32];
+      btree_val_t get = {.tree_id = tree_id,
+          .key = {.address = key, .size = (size_t)sprintf(key,
+                                      "key-%05zu", i)}};
+      assert(btree_get(&r, &get));
+      assert(get.has_val == (i % 5 != 0));
+      if (get.has_val) assert(get.val == i);
+    }
+  }
+}
+// end::savepoints[]
+
+// tag::write_batch[]
+static span_t batch_key(char* buffer, size_t i) {
+  span_t key = {.address = buffer,
+      .size = (size_t)sprintf(buffer, "item-%05zu", i)};
+  return key;
+}
+
+describe(write_batch) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("applies btree & hash operations in a single txn") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    uint64_t trees[2], hash_id;
+    {
+      txn_t w;
+      assert(txn_create(&db, TX_WRITE, &w));
+      defer(txn_close, w);
+      assert(btree_create(&w, &trees[0]));
+      assert(btree_create(&w, &trees[1]));
+      assert(hash_create(&w, &hash_id));
+      assert(txn_commit(&w));
+    }
+    write_batch_t batch;
+    assert(write_batch_create(&batch));
+    defer(write_batch_close, batch);
+    char buffer[32];
+    // <1>
+    // out of order & spread over both trees, enough to split pages
+    for (size_t i = 0; i < 4096; i++) {
+      size_t n = (i * 2654435761) % 4096;
+      assert(write_batch_btree_set(
+          &batch, trees[n % 2], batch_key(buffer, n), n));
+      assert(write_batch_hash_set(&batch, hash_id, n, n * 2));
+    }
+    // <2>
+    // later operations on the same key win
+    for (size_t i = 0; i < 4096; i += 7) {
+      assert(write_batch_btree_del(
+          &batch, trees[i % 2], batch_key(buffer, i)));
+      assert(write_batch_hash_del(&batch, hash_id, i));
+    }
+    assert(write_batch_btree_set(
+        &batch, trees[0], batch_key(buffer, 14), 1234));
+    assert(write_batch_commit(&db, &batch));
+
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    for (size_t i = 0; i < 4096; i++) {
+      btree_val_t get = {
+          .tree_id = trees[i % 2], .key = batch_key(buffer, i)};
+      assert(btree_get(&r, &get));
+      hash_val_t hash_get_val = {.hash_id = hash_id, .key = i};
+      assert(hash_get(&r, &hash_get_val));
+      assert(hash_get_val.has_val == (i % 7 != 0));
+      if (i == 14) {
+        assert(get.has_val && get.val == 1234);
+        continue;
+      }
+      assert(get.has_val == (i % 7 != 0));
+      if (!get.has_val) continue;
+      assert(get.val == i);
+      assert(hash_get_val.val == i * 2);
+      get.tree_id = trees[(i + 1) % 2];
+      assert(btree_get(&r, &get));
+      assert(!get.has_val);
+    }
+  }
+
+  it("returns the ids of new items once applied") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    uint64_t container_id, index_ids[2];
+    index_type_t types[2] = {index_type_container, index_type_btree};
+    table_schema_t schema = {
+        .count = 2, .index_ids = index_ids, .types = types};
+    {
+      txn_t w;
+      assert(txn_create(&db, TX_WRITE, &w));
+      defer(txn_close, w);
+      assert(container_create(&w, &container_id));
+      assert(table_create_anonymous(&w, &schema));
+      assert(txn_commit(&w));
+    }
+    write_batch_t batch;
+    assert(write_batch_create(&batch));
+    defer(write_batch_close, batch);
+    uint64_t ids[64];
+    char buffer[32];
+    for (size_t i = 0; i < 32; i++) {
+      span_t key = batch_key(buffer, i);
+      assert(write_batch_container_put(
+          &batch, container_id, key, &ids[i * 2]));
+      span_t entries[2] = {
+          {.address = "value", .size = 6}, batch_key(buffer, i)};
+      assert(write_batch_table_set(
+          &batch, &schema, entries, 2, &ids[i * 2 + 1]));
+    }
+    txn_t w;
+    assert(txn_create(&db, TX_WRITE, &w));
+    defer(txn_close, w);
+    assert(write_batch_apply(&w, &batch));
+    for (size_t i = 0; i < 32; i++) {
+      span_t key              = batch_key(buffer, i);
+      container_item_t item = {
+          .container_id = container_id, .item_id = ids[i * 2]};
+      assert(container_item_get(&w, &item));
+      assert(item.data.size == key.size);
+      assert(memcmp(item.data.address, key.address, key.size) == 0);
+      // the lookup key is the first entry
+      span_t lookup[2] = {key, key};
+      table_item_t get = {.schema = &schema,
+          .entries             = lookup,
+          .number_of_entries   = 2,
+          .index_to_use        = 1};
+      assert(table_get(&w, &get));
+      assert(get.item_id == ids[i * 2 + 1]);
+      assert(strcmp("value", get.result.address) == 0);
+    }
+  }
+}
+// end::write_batch[]
+
+// tag::bitmap_metadata_shift[]
+describe(bitmap_metadata_shift) {
+  before_each() { errors_clear(); }
+
+  it("moves a match off a metadata page if there is room") {
+    uint64_t bitmap[4];
+    memset(bitmap, 0xff, sizeof(bitmap));
+    // pages 128 - 137 are free, 128 is the place of a metadata page
+    bitmap[2] = ~0x3ffUL;
+    bitmap_search_state_t search = {.input = {.bitmap = bitmap,
+                                        .bitmap_size    = 4,
+                                        .space_required = 2}};
+    assert(bitmap_search(&search));
+    assert(search.output.found_position == 129);
+    // <1>
+    // there isn't room for all of them after the metadata page
+    memset(&search, 0, sizeof(search));
+    search.input.bitmap         = bitmap;
+    search.input.bitmap_size    = 4;
+    search.input.space_required = 10;
+    assert(!bitmap_search(&search));
+  }
+}
+// end::bitmap_metadata_shift[]
+
+// tag::db_init_large_file[]
+describe(db_init_large_file) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("leaves the pages of a file a bitmap page covers free") {
+    db_t db;
+    // <1>
+    // all the 65,536 pages a single bitmap page covers
+    db_options_t options = {.minimum_size = 512 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    uint64_t pages = r.state->number_of_pages;
+    assert(pages == BITS_IN_PAGE);
+    bool busy;
+    assert(txn_is_page_busy(&r, pages / 2, &busy) && !busy);
+    assert(txn_is_page_busy(&r, pages - 1, &busy) && !busy);
+  }
+
+  it("creates a file larger than a bitmap page covers") {
+    db_t db;
+    db_options_t options = {.minimum_size = 1024 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    uint64_t pages = r.state->number_of_pages;
+    assert(pages == 2 * BITS_IN_PAGE);
+    table_schema_t schema;
+    assert(table_get_schema(&r, "root", &schema));
+    assert(schema.count == 2 && schema.index_ids[1] == 4);
+    bool busy;
+    assert(txn_is_page_busy(&r, BITS_IN_PAGE + 1, &busy) && !busy);
+    assert(txn_is_page_busy(&r, pages - 1, &busy) && !busy);
+  }
+}
+// end::db_init_large_file[]
+
+// tag::free_space_bitmap_move[]
+describe(free_space_bitmap_move) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("points the file header at the moved bitmap") {
+    uint64_t start;
+    {
+      db_t db;
+      db_options_t options = {.minimum_size = 512 * 1024 * 1024};
+      assert(db_create("/tmp/db/try", &options, &db));
+      defer(db_close, db);
+      txn_t w;
+      assert(txn_create(&db, TX_WRITE, &w));
+      defer(txn_close, w);
+      // <1>
+      // a single bitmap page can't cover the file anymore
+      assert(db_try_increase_file_size(&w, 1));
+      page_metadata_t* header;
+      assert(txn_get_metadata(&w, 0, &header));
+      start = header->file_header.free_space_bitmap_start;
+      assert(start != 1);
+      page_metadata_t* bitmap;
+      assert(txn_get_metadata(&w, start, &bitmap));
+      assert(bitmap->free_space.page_flags ==
+             page_flags_free_space_bitmap);
+      assert(bitmap->free_space.number_of_pages * BITS_IN_PAGE >=
+             w.state->number_of_pages);
+      assert(txn_commit(&w));
+    }
+    db_t db;
+    db_options_t options = {.minimum_size = 512 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    page_metadata_t* header;
+    assert(txn_get_metadata(&r, 0, &header));
+    assert(header->file_header.free_space_bitmap_start == start);
+    bool busy;
+    assert(txn_is_page_busy(&r, start, &busy) && busy);
+    assert(txn_is_page_busy(&r, 1, &busy) && !busy);
+  }
+}
+// end::free_space_bitmap_move[]
+
+// tag::wal_large_new_value[]
+describe(wal_large_new_value) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("writes a new multi page value to the WAL in full") {
+    uint64_t page_num;
+    {
+      db_t db;
+      db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+      assert(db_create("/tmp/db/try", &options, &db));
+      defer(db_close, db);
+      txn_t w;
+      assert(txn_create(&db, TX_WRITE, &w));
+      defer(txn_close, w);
+      // <1>
+      // a single modified entry, many pages of data
+      page_t p = {.number_of_pages = 300};
+      assert(txn_allocate_page(&w, &p, 0));
+      p.metadata->overflow.page_flags      = page_flags_overflow;
+      p.metadata->overflow.number_of_pages = 300;
+      p.metadata->overflow.size_of_value   = 300 * PAGE_SIZE;
+      memset(p.address, 0xab, 300 * PAGE_SIZE);
+      page_num = p.page_num;
+      assert(txn_commit(&w));
+    }
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    page_t p = {.page_num = page_num};
+    assert(txn_get_page(&r, &p));
+    assert(p.number_of_pages == 300);
+    uint8_t* data = p.address;
+    for (size_t i = 0; i < 300 * PAGE_SIZE; i++) {
+      assert(data[i] == 0xab);
+    }
+  }
+}
+// end::wal_large_new_value[]
+
+// tag::free_space_mark_large_file[]
+static result_t allocate_overflow(
+    txn_t* w, uint32_t pages, uint64_t hint, uint64_t* page_num) {
+  page_t p = {.number_of_pages = pages};
+  ensure(txn_allocate_page(w, &p, hint));
+  p.metadata->overflow.page_flags      = page_flags_overflow;
+  p.metadata->overflow.number_of_pages = pages;
+  *page_num                            = p.page_num;
+  return success();
+}
+
+describe(free_space_mark_large_file) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("marks pages past the first bitmap page") {
+    db_t db;
+    db_options_t options = {.minimum_size = 512 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    txn_t w;
+    assert(txn_create(&db, TX_WRITE, &w));
+    defer(txn_close, w);
+    assert(db_try_increase_file_size(&w, 1));
+    // <1>
+    // the bitmap is now more than a page, these are in its second one
+    uint64_t page_num;
+    assert(allocate_overflow(&w, 3, BITS_IN_PAGE + 1024, &page_num));
+    assert(page_num > BITS_IN_PAGE);
+    bool busy;
+    for (uint64_t i = 0; i < 3; i++) {
+      assert(txn_is_page_busy(&w, page_num + i, &busy) && busy);
+    }
+    page_t p = {.page_num = page_num};
+    assert(txn_free_page(&w, &p));
+    for (uint64_t i = 0; i < 3; i++) {
+      assert(txn_is_page_busy(&w, page_num + i, &busy) && !busy);
+    }
+    assert(txn_commit(&w));
+  }
+}
+// end::free_space_mark_large_file[]
+
+// tag::txn_resize_modified_page[]
+describe(txn_resize_modified_page) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("reallocates a freed page with another size in the same txn") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    uint64_t page_num;
+    {
+      txn_t w;
+      assert(txn_create(&db, TX_WRITE, &w));
+      defer(txn_close, w);
+      page_t p = {0};
+      assert(txn_allocate_page(&w, &p, 0));
+      p.metadata->common.page_flags = page_flags_overflow;
+      page_num                      = p.page_num;
+      assert(txn_commit(&w));
+    }
+    {
+      txn_t w;
+      assert(txn_create(&db, TX_WRITE, &w));
+      defer(txn_close, w);
+      page_t p = {.page_num = page_num};
+      assert(txn_free_page(&w, &p));
+      // <1>
+      // the same page, but now it is 5 pages long
+      page_t big = {.number_of_pages = 5};
+      assert(txn_allocate_page(&w, &big, page_num));
+      assert(big.page_num == page_num);
+      assert(big.number_of_pages == 5);
+      big.metadata->overflow.page_flags      = page_flags_overflow;
+      big.metadata->overflow.number_of_pages = 5;
+      big.metadata->overflow.size_of_value   = 5 * PAGE_SIZE;
+      memset(big.address, 0xcd, 5 * PAGE_SIZE);
+      assert(txn_commit(&w));
+    }
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    page_t p = {.page_num = page_num};
+    assert(txn_get_page(&r, &p));
+    assert(p.number_of_pages == 5);
+    uint8_t* data = p.address;
+    for (size_t i = 0; i < 5 * PAGE_SIZE; i++) {
+      assert(data[i] == 0xcd);
+    }
+  }
+
+  it("restores the size of the page on rollback to a savepoint") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    page_t p = {0};
+    {
+      txn_t w;
+      assert(txn_create(&db, TX_WRITE, &w));
+      defer(txn_close, w);
+      assert(allocate_string_page(&w, "one", &p));
+      assert(txn_commit(&w));
+    }
+    txn_t w;
+    assert(txn_create(&db, TX_WRITE, &w));
+    defer(txn_close, w);
+    assert(modify_string_page(&w, p.page_num, "two"));
+    txn_savepoint_t* sp;
+    assert(txn_savepoint(&w, &sp));
+    page_t freed = {.page_num = p.page_num};
+    assert(txn_free_page(&w, &freed));
+    page_t big = {.number_of_pages = 5};
+    assert(txn_allocate_page(&w, &big, p.page_num));
+    assert(big.page_num == p.page_num);
+    assert(big.number_of_pages == 5);
+    assert(txn_rollback_to(&w, sp));
+    // <1>
+    // back to a single page, with the value it had at the savepoint
+    page_t modified = {.page_num = p.page_num};
+    assert(txn_raw_modify_page(&w, &modified));
+    assert(modified.number_of_pages == 1);
+    assert(expect_string_page(&w, p.page_num, "two"));
+    assert(txn_commit(&w));
+  }
+}
+// end::txn_resize_modified_page[]
+
+// tag::txn_modify_multi_page[]
+describe(txn_modify_multi_page) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("keeps the value of a multi page value modified after restart") {
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    uint64_t page_num;
+    {
+      db_t db;
+      assert(db_create("/tmp/db/try", &options, &db));
+      defer(db_close, db);
+      txn_t w;
+      assert(txn_create(&db, TX_WRITE, &w));
+      defer(txn_close, w);
+      page_t p = {.number_of_pages = 3};
+      assert(txn_allocate_page(&w, &p, 0));
+      p.metadata->overflow.page_flags      = page_flags_overflow;
+      p.metadata->overflow.number_of_pages = 3;
+      p.metadata->overflow.size_of_value   = 3 * PAGE_SIZE;
+      memset(p.address, 0xab, 3 * PAGE_SIZE);
+      page_num = p.page_num;
+      assert(txn_commit(&w));
+    }
+    db_t db;
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    {
+      txn_t w;
+      assert(txn_create(&db, TX_WRITE, &w));
+      defer(txn_close, w);
+      page_t p = {.page_num = page_num};
+      // <1>
+      // the file holds the value now, the txn copies all its pages
+      assert(txn_modify_page(&w, &p));
+      assert(p.number_of_pages == 3);
+      ((uint8_t*)p.address)[0] = 0xcd;
+      assert(txn_commit(&w));
+    }
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    page_t p = {.page_num = page_num};
+    assert(txn_get_page(&r, &p));
+    uint8_t* data = p.address;
+    assert(data[0] == 0xcd);
+    for (size_t i = 1; i < 3 * PAGE_SIZE; i++) {
+      assert(data[i] == 0xab);
+    }
+  }
+
+  it("allocates in a reopened file with a multi page bitmap") {
+    db_options_t options = {.minimum_size = 1024 * 1024 * 1024};
+    {
+      db_t db;
+      assert(db_create("/tmp/db/try", &options, &db));
+      defer(db_close, db);
+    }
+    db_t db;
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    txn_t w;
+    assert(txn_create(&db, TX_WRITE, &w));
+    defer(txn_close, w);
+    page_t p = {.number_of_pages = 1};
+    assert(txn_allocate_page(&w, &p, 0));
+    p.metadata->overflow.page_flags      = page_flags_overflow;
+    p.metadata->overflow.number_of_pages = 1;
+    bool busy;
+    assert(txn_is_page_busy(&w, 0, &busy) && busy);
+    assert(txn_commit(&w));
+  }
+}
+// end::txn_modify_multi_page[]
+
+// tag::free_space_index[]
+describe(free_space_index) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("never hands out busy pages") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    txn_t w;
+    assert(txn_create(&db, TX_WRITE, &w));
+    defer(txn_close, w);
+    // <1>
+    // enough to grow the file & span several regions of the bitmap
+    uint32_t sizes[] = {1, 3, 64, 130, 1, 300, 7, 1};
+    uint64_t starts[512];
+    uint32_t counts[512];
+    for (size_t i = 0; i < 512; i++) {
+      counts[i] = sizes[i % 8];
+      assert(allocate_overflow(&w, counts[i], 0, &starts[i]));
+      // freeing some of them leaves holes of different sizes
+      if (i % 3 == 0) {
+        page_t p = {.page_num = starts[i]};
+        assert(txn_free_page(&w, &p));
+        counts[i] = 0;
+      }
+    }
+    for (size_t i = 0; i < 512; i++) {
+      for (size_t j = 0; j < counts[i]; j++) {
+        bool busy;
+        assert(txn_is_page_busy(&w, starts[i] + j, &busy));
+        assert(busy);
+      }
+      for (size_t k = i + 1; k < 512; k++) {
+        if (!counts[i] || !counts[k]) continue;
+        assert(starts[i] + counts[i] <= starts[k] ||
+               starts[k] + counts[k] <= starts[i]);
+      }
+    }
+    assert(txn_commit(&w));
+  }
+
+  it("forgets the allocations that were rolled back") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    uint64_t first, again;
+    {
+      txn_t w;
+      assert(txn_create(&db, TX_WRITE, &w));
+      defer(txn_close, w);
+      assert(allocate_overflow(&w, 1, 0, &first));
+    }
+    txn_t w;
+    assert(txn_create(&db, TX_WRITE, &w));
+    defer(txn_close, w);
+    assert(allocate_overflow(&w, 1, 0, &again));
+    assert(first == again);
+    // <1>
+    // the same goes for a savepoint
+    txn_savepoint_t* sp;
+    assert(txn_savepoint(&w, &sp));
+    assert(allocate_overflow(&w, 1, 0, &first));
+    assert(txn_rollback_to(&w, sp));
+    assert(allocate_overflow(&w, 1, 0, &again));
+    assert(first == again);
+    assert(txn_commit(&w));
+  }
+
+  it("can use a file as large as a bitmap page covers") {
+    db_t db;
+    db_options_t options = {.minimum_size = 512 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    txn_t w;
+    assert(txn_create(&db, TX_WRITE, &w));
+    defer(txn_close, w);
+    uint64_t page_num;
+    assert(allocate_overflow(&w, 300, 0, &page_num));
+    bool busy;
+    assert(txn_is_page_busy(&w, page_num + 299, &busy) && busy);
+    assert(page_num + 300 <= w.state->number_of_pages);
+    assert(txn_commit(&w));
+  }
+
+  it("grows files larger than 2GB") {
+    uint64_t gb = 1024 * 1024 * 1024;
+    assert(next_power_of_two(3 * gb) == 4 * gb);
+    assert(db_find_next_db_size(2 * gb, 16 * PAGE_SIZE) > 2 * gb);
+    assert(db_find_next_db_size(3 * gb, 16 * PAGE_SIZE) > 3 * gb);
+  }
+}
+// end::free_space_index[]
+
+// tag::bitmap_ranges[]
+describe(bitmap_ranges) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("matches setting the bits one at a time") {
+    uint64_t ranges[4] = {0}, bits[4] = {0};
+    srand(42);
+    for (size_t i = 0; i < 1000; i++) {
+      uint64_t pos   = (uint64_t)rand() % 200;
+      uint64_t count = (uint64_t)rand() % (256 - pos);
+      bool val       = rand() % 2;
+      uint64_t expected = 0;
+      for (uint64_t j = pos; j < pos + count; j++) {
+        if (bitmap_is_set(bits, j) != val) {
+          expected++;
+          bitmap_set(bits, j, val);
+        }
+      }
+      assert(bitmap_set_range(ranges, pos, count, val) == expected);
+      assert(!memcmp(ranges, bits, sizeof(bits)));
+    }
+  }
+
+  it("marks a large value busy & free as a whole") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    txn_t w;
+    assert(txn_create(&db, TX_WRITE, &w));
+    defer(txn_close, w);
+    uint64_t page_num, again;
+    assert(allocate_overflow(&w, 300, 0, &page_num));
+    bool busy;
+    for (uint64_t i = 0; i < 300; i++) {
+      assert(txn_is_page_busy(&w, page_num + i, &busy) && busy);
+    }
+    page_t p = {.page_num = page_num};
+    assert(txn_free_page(&w, &p));
+    for (uint64_t i = 0; i < 300; i++) {
+      assert(txn_is_page_busy(&w, page_num + i, &busy) && !busy);
+    }
+    assert(allocate_overflow(&w, 300, 0, &again));
+    assert(page_num == again);
+    assert(txn_commit(&w));
+  }
+}
+// end::bitmap_ranges[]
+
+// tag::bitmap_search_words[]
+static bool search_bitmap(uint64_t* bitmap, size_t size,
+    uint64_t required, uint64_t near, uint64_t* found) {
+  bitmap_search_state_t search = {.input = {.bitmap = bitmap,
+                                      .bitmap_size       = size,
+                                      .space_required    = required,
+                                      .near_position     = near}};
+  if (!bitmap_search(&search)) return false;
+  *found = search.output.found_position;
+  for (uint64_t i = 0; i < required; i++) {
+    if (bitmap_is_set(bitmap, *found + i)) return false;
+  }
+  return true;
+}
+
+describe(bitmap_search_words) {
+  before_each() { errors_clear(); }
+
+  it("skips over busy & free words") {
+    uint64_t bitmap[64];
+    memset(bitmap, 0xff, sizeof(bitmap));
+    bitmap[10] &= ~(1UL << 17);
+    bitmap[39] = ~(ULONG_MAX >> 4);
+    bitmap[40] = bitmap[41] = bitmap[42] = 0;
+    bitmap[43] = ~1UL;
+    uint64_t found;
+    assert(search_bitmap(bitmap, 64, 1, 0, &found));
+    assert(found == 10 * 64 + 17);
+    assert(search_bitmap(bitmap, 64, 3, 0, &found));
+    assert(found == 39 * 64);
+    assert(search_bitmap(bitmap, 64, 1, 11 * 64, &found));
+    assert(found == 39 * 64);
+    assert(search_bitmap(bitmap, 64, 64, 0, &found));
+    assert(found > 39 * 64 && found + 64 <= 43 * 64 + 1);
+    assert(!search_bitmap(bitmap, 64, 250, 0, &found));
+  }
+
+  it("finds a gap in a partially used word") {
+    uint64_t bitmap[8];
+    memset(bitmap, 0xff, sizeof(bitmap));
+    bitmap[5] = ~(0xfUL << 30);
+    uint64_t found;
+    assert(search_bitmap(bitmap, 8, 4, 0, &found));
+    assert(found == 5 * 64 + 30);
+    assert(!search_bitmap(bitmap, 8, 5, 0, &found));
+  }
+}
+// end::bitmap_search_words[]
+
+// tag::bitmap_search_scalar[]
+// the search before the word level fast paths, one set bit & one word
+// at a time, kept as the reference for the random bitmaps below
+static bool scalar_finalize_match(bitmap_search_state_t* search) {
+  if (search->internal.current_set_bit >
+      search->internal.previous_set_bit +
+          search->input.space_required) {
+    // intentionally overflowing here
+    search->output.found_position =
+        search->internal.previous_set_bit + 1;
+    search->output.space_available_at_position =
+        (search->internal.current_set_bit -
+            search->output.found_position);
+    return true;
+  }
+  return false;
+}
+
+static bool scalar_search_word(bitmap_search_state_t* search) {
+  uint64_t bitset = search->internal.current_word;
+
+  if (bitset == ULONG_MAX) {
+    // all bits are set, can skip whole thing
+    scalar_finalize_match(search);
+    search->internal.previous_set_bit =
+        (search->internal.index + 1) * 64 - 1;
+    return false;
+  }
+
+  if (bitset == 0) {
+    search->internal.current_set_bit =
+        (search->internal.index + 1) * 64;
+    return scalar_finalize_match(search);
+  }
+
+  while (bitset != 0) {
+    int r = __builtin_ctzl(bitset);
+    search->internal.current_set_bit =
+        (search->internal.index) * 64 + (uint64_t)r;
+    if (search->internal.current_set_bit >
+        search->internal.previous_set_bit +
+            search->input.space_required) {
+      // intentionally overflowing here
+      search->output.found_position =
+          search->internal.previous_set_bit + 1;
+      search->output.space_available_at_position =
+          (search->internal.current_set_bit -
+              search->output.found_position);
+      search->internal.previous_set_bit =
+          search->internal.current_set_bit;
+      return true;
+    }
+    search->internal.previous_set_bit =
+        search->internal.current_set_bit;
+    bitset ^= (bitset & -bitset);
+  }
+
+  search->internal.current_set_bit =
+      (search->internal.index + 1) * 64;
+  return scalar_finalize_match(search);
+}
+
+static bool scalar_search_once(bitmap_search_state_t* search) {
+  uint64_t original_pos = search->output.found_position;
+  do {
+    if (scalar_search_word(search)) {
+      if (search->internal.current_set_bit % 64) {
+        // mask the already found item
+        uint64_t mask =
+            ~(ULONG_MAX << (search->internal.current_set_bit % 64));
+        search->internal.current_word |= mask;
+      } else {
+        // run out current word, but maybe we have more in the next?
+        uint64_t next = search->internal.index + 1;
+        if (next < search->input.bitmap_size &&
+            (search->input.bitmap[next] & 1) == 0) {
+          search->internal.index++;
+          search->internal.current_word =
+              search->input.bitmap[search->internal.index];
+          continue;
+        } else {
+          search->internal.current_word = ULONG_MAX;
+        }
+      }
+      if (!bitmap_is_acceptable_match(search)) continue;
+      return true;
+    }
+    if (original_pos != search->output.found_position &&
+        bitmap_is_acceptable_match(search))
+      return true;
+    search->internal.index++;
+    if (search->internal.index >= search->input.bitmap_size)
+      return false;
+    search->internal.current_word =
+        search->input.bitmap[search->internal.index];
+  } while (true);
+}
+
+static bool scalar_search_smallest_nearby(
+    bitmap_search_state_t* search) {
+  uint64_t current_pos  = 0;
+  uint64_t current_size = ULONG_MAX;
+
+  // the bigger the request range, the less we care about locality
+  size_t boundary =
+      (search->input.near_position + 64 +
+          search->input.space_required);
+  while (scalar_search_once(search)) {
+    if (search->input.space_required ==
+        search->output.space_available_at_position)
+      return true;  // perfect match!
+    if (current_size > search->output.space_available_at_position) {
+      current_size = search->output.space_available_at_position;
+      current_pos  = search->output.found_position;
+    }
+    if (search->input.near_position &&
+        search->output.found_position > boundary) {
+      // We have gone too far? Stop being choosy
+      if (current_size < search->output.space_available_at_position) {
+        search->output.space_available_at_position = current_size;
+        search->output.found_position              = current_pos;
+      }
+      return true;
+    }
+  }
+
+  search->output.space_available_at_position = current_size;
+  search->output.found_position              = current_pos;
+
+  return current_size != ULONG_MAX;
+}
+
+static bool scalar_search(bitmap_search_state_t* search) {
+  if (!search->input.space_required ||
+      search->input.near_position / 64 >= search->input.bitmap_size)
+    return false;
+
+  search->internal.current_word     = search->input.bitmap[0];
+  search->internal.previous_set_bit = ULONG_MAX;
+
+  search->internal.search_offset = search->input.near_position / 64;
+
+  void *old_bitmap  = search->input.bitmap;
+  uint64_t old_size = search->input.bitmap_size;
+
+  search->input.bitmap += search->internal.search_offset;
+  search->input.bitmap_size -= search->internal.search_offset;
+  search->internal.search_offset *= 64;  //  pages instead of words
+
+  if (scalar_search_smallest_nearby(search)) {
+    search->output.found_position += search->internal.search_offset;
+    return true;
+  }
+  if (!search->internal.search_offset) {
+    return false;  // already scanned it all
+  }
+
+  search->input.bitmap        = old_bitmap;
+  search->input.bitmap_size   = old_size;
+  search->input.near_position = 0;  // search all
+  return scalar_search(search);
+}
+
+// fixed seed, a failure can be replayed
+static uint64_t random_next(uint64_t* state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15UL);
+  z          = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9UL;
+  z          = (z ^ (z >> 27)) * 0x94d049bb133111ebUL;
+  return z ^ (z >> 31);
+}
+
+// busy & free words, runs that end or start mid word & noise
+static uint64_t random_word(uint64_t* state) {
+  uint64_t r     = random_next(state);
+  uint64_t shift = random_next(state) % 64;
+  switch (r % 7) {
+    case 0:
+      return 0;
+    case 1:
+      return ULONG_MAX;
+    case 2:
+      return ULONG_MAX << shift;
+    case 3:
+      return ULONG_MAX >> shift;
+    case 4:
+      return random_next(state) | random_next(state);
+    case 5:
+      return ~(1UL << shift);
+    default:
+      return random_next(state);
+  }
+}
+
+static uint64_t random_required(
+    uint64_t* state, size_t bitmap_size) {
+  uint64_t sizes[] = {1, 2, 3, 63, 64, 65, 127, 129, 191};
+  uint64_t count   = sizeof(sizes) / sizeof(sizes[0]);
+  uint64_t r       = random_next(state);
+  if (r % 2) return sizes[(r / 2) % count];
+  return 1 + (r / 2) % (bitmap_size * 64);
+}
+
+describe(bitmap_search_scalar) {
+  before_each() { errors_clear(); }
+
+  it("matches the scalar search on random bitmaps") {
+    uint64_t state = 0x6761767261;
+    uint64_t bitmap[48];
+    for (size_t round = 0; round < 20000; round++) {
+      size_t size = 1 + random_next(&state) % 48;
+      for (size_t i = 0; i < size; i++) {
+        bitmap[i] = random_word(&state);
+      }
+      uint64_t required = random_required(&state, size);
+      uint64_t near     = 0;
+      if (random_next(&state) % 4) {
+        near = random_next(&state) % (size * 64);
+      }
+
+      bitmap_search_state_t expected = {
+          .input = {.bitmap       = bitmap,
+              .bitmap_size        = size,
+              .space_required     = required,
+              .near_position      = near}};
+      bitmap_search_state_t actual = expected;
+      bool expected_found          = scalar_search(&expected);
+      bool actual_found            = bitmap_search(&actual);
+      bool same                    = expected_found == actual_found;
+      if (same && expected_found) {
+        same = expected.output.found_position ==
+                   actual.output.found_position &&
+               expected.output.space_available_at_position ==
+                   actual.output.space_available_at_position;
+      }
+      if (!same) {
+        printf("round %zu: size %zu, %lu pages near %lu, expected "
+               "%d at %lu (%lu), got %d at %lu (%lu)\n",
+            round, size, required, near, expected_found,
+            expected.output.found_position,
+            expected.output.space_available_at_position, actual_found,
+            actual.output.found_position,
+            actual.output.space_available_at_position);
+        assert(false);
+      }
+    }
+  }
+}
+// end::bitmap_search_scalar[]
+
+// tag::free_space_extents[]
+describe(free_space_extents) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("takes the freed range closest to the hint") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    txn_t w;
+    assert(txn_create(&db, TX_WRITE, &w));
+    defer(txn_close, w);
+    uint64_t ranges[6], again;
+    for (size_t i = 0; i < 6; i++) {
+      uint64_t hint = i ? ranges[i - 1] : 0;
+      assert(allocate_overflow(&w, 3, hint, &ranges[i]));
+    }
+    page_t p = {.page_num = ranges[4]};
+    assert(txn_free_page(&w, &p));
+    p = (page_t){.page_num = ranges[1]};
+    assert(txn_free_page(&w, &p));
+    assert(allocate_overflow(&w, 3, ranges[4], &again));
+    assert(again == ranges[4]);
+    assert(allocate_overflow(&w, 3, ranges[0], &again));
+    assert(again == ranges[1]);
+    assert(txn_commit(&w));
+  }
+
+  it("leaves a freed range far from the hint to the bitmap") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    txn_t w;
+    assert(txn_create(&db, TX_WRITE, &w));
+    defer(txn_close, w);
+    uint64_t first, second, third, again;
+    assert(allocate_overflow(&w, 3, 0, &first));
+    assert(allocate_overflow(&w, 3, first, &second));
+    assert(allocate_overflow(&w, 3, second, &third));
+    page_t p = {.page_num = second};
+    assert(txn_free_page(&w, &p));
+    assert(allocate_overflow(&w, 2, third + 256, &again));
+    // <1>
+    // in the same metadata range as the hint
+    assert(again / PAGES_IN_METADATA ==
+           (third + 256) / PAGES_IN_METADATA);
+    assert(txn_commit(&w));
+  }
+
+  it("merges adjacent freed ranges") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    txn_t w;
+    assert(txn_create(&db, TX_WRITE, &w));
+    defer(txn_close, w);
+    uint64_t a, b, filler, again;
+    assert(allocate_overflow(&w, 3, 0, &a));
+    assert(allocate_overflow(&w, 3, a, &b));
+    assert(allocate_overflow(&w, 64, b, &filler));
+    page_t p = {.page_num = a};
+    assert(txn_free_page(&w, &p));
+    p = (page_t){.page_num = b};
+    assert(txn_free_page(&w, &p));
+    // <2>
+    // neither range fits on its own, and the bitmap search starts
+    // past them, at the metadata range of the hint
+    uint64_t hint = PAGES_IN_METADATA + 2;
+    assert(filler + 64 < PAGES_IN_METADATA);
+    assert(allocate_overflow(&w, 6, hint, &again));
+    assert(again == a);
+    assert(txn_commit(&w));
+  }
+
+  it("splits a larger freed range") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    txn_t w;
+    assert(txn_create(&db, TX_WRITE, &w));
+    defer(txn_close, w);
+    uint64_t big, after, a, b;
+    assert(allocate_overflow(&w, 20, 0, &big));
+    assert(allocate_overflow(&w, 1, big, &after));
+    page_t p = {.page_num = big};
+    assert(txn_free_page(&w, &p));
+    assert(allocate_overflow(&w, 17, 0, &a));
+    // <3>
+    // the rest of the range goes back to its size class
+    assert(allocate_overflow(&w, 3, 0, &b));
+    assert(a == big && b == big + 17);
+    assert(txn_commit(&w));
+  }
+}
+// end::free_space_extents[]
+
+// tag::mmap_growth[]
+describe(mmap_growth) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("grows the map in place, older txns can still read") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    void* address = db.state->map.address;
+    size_t size   = db.state->map.size;
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    {
+      txn_t w;
+      assert(txn_create(&db, TX_WRITE, &w));
+      defer(txn_close, w);
+      uint64_t page_num;
+      assert(allocate_overflow(&w, 1000, 0, &page_num));
+      assert(txn_commit(&w));
+    }
+    assert(db.state->map.size > size);
+    assert(db.state->map.address == address);
+    page_t p = {.page_num = 0};
+    assert(txn_get_page(&r, &p));
+  }
+
+  it("shrinks the map back on rollback") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    size_t size = db.state->map.size;
+    {
+      txn_t w;
+      assert(txn_create(&db, TX_WRITE, &w));
+      defer(txn_close, w);
+      uint64_t page_num;
+      assert(allocate_overflow(&w, 1000, 0, &page_num));
+      assert(w.state->map.size > size);
+    }
+    assert(db.state->map.size == size);
+    txn_t w;
+    assert(txn_create(&db, TX_WRITE, &w));
+    defer(txn_close, w);
+    uint64_t page_num;
+    assert(allocate_overflow(&w, 1000, 0, &page_num));
+    assert(w.state->map.address == db.state->map.address);
+    assert(txn_commit(&w));
+  }
+
+  it("holds the room after the map until the db is closed") {
+    void* address;
+    size_t size;
+    {
+      db_t db;
+      db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+      assert(db_create("/tmp/db/try", &options, &db));
+      defer(db_close, db);
+      address = db.state->map.address;
+      size    = db.state->map.size;
+      // <1>
+      // nothing else can be mapped where the file will grow
+      void* other = mmap(address + size, 1024 * 1024, PROT_READ,
+          MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+      assert(other == MAP_FAILED);
+      txn_t w;
+      assert(txn_create(&db, TX_WRITE, &w));
+      defer(txn_close, w);
+      uint64_t page_num;
+      assert(allocate_overflow(&w, 1000, 0, &page_num));
+      assert(txn_commit(&w));
+      assert(w.state->map.address == address);
+      assert(w.state->map.size > size);
+    }
+    // <2>
+    // and the room is released with the map
+    void* other = mmap(address + size, 1024 * 1024, PROT_READ,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    assert(other == address + size);
+    munmap(other, 1024 * 1024);
+  }
+}
+// end::mmap_growth[]
@@ -0,0 +1,1172 @@
+#include <gavran/db.h>
+#include <gavran/internal.h>
+#include <string.h>
+
+// tag::txn_create_read[]
+static result_t txn_create_read(db_state_t *db, txn_t *tx) {
+  // <1>
+  // each read txn gets its own view, so temporary buffers aren't
+  // shared between threads
+  txn_state_t *view = &tx->read_view;
+  memset(view, 0, sizeof(txn_state_t));
+  // <2>
+  // only writes to the reader's own cache line, see txn.epoch.c
+  ensure(txn_epoch_enter(db, &tx->reader));
+  txn_state_t *state    = txn_epoch_pin(db, tx->reader);
+  view->db              = db;
+  view->tx_id           = state->tx_id;
+  view->map             = state->map;
+  view->number_of_pages = state->number_of_pages;
+  view->flags           = (state->flags & ~TX_WRITE) | TX_READ;
+  tx->state             = view;
+  return success();
+}
+// end::txn_create_read[]
+
+// tag::txn_create[]
+// tag::txn_create_working_set[]
+result_t txn_create(db_t *db, db_flags_t flags, txn_t *tx) {
+  errors_assert_empty();
+  if (db->state->options.flags & db_flags_page_need_txn_working_set) {
+    ensure(pagesmap_new(8, &tx->working_set));
+  } else {
+    tx->working_set = 0;
+  }
+  tx->next_page_read = 0;
+  // end::txn_create_working_set[]
+  // <1>
+  if (flags == TX_READ) {
+    ensure(txn_create_read(db->state, tx));
+    return success();
+  }
+  if ((db->state->options.flags & db_flags_log_shipping_target)) {
+    ensure(flags & txn_flags_apply_log,
+        msg("txn_create(flags) must have txn_flags_apply_log when "
+            "running in log shipping mode"),
+        with(flags, "%d"));
+  }
+
+  ensure(flags & TX_WRITE,
+      msg("txn_create(flags) must be flagged with either TX_WRITE "
+          "or TX_READ"),
+      with(flags, "%d"));
+  // <2>
+  // with group commit, write txns on other threads wait their turn.
+  // The db opening txns start the writer, before other threads can
+  bool group =
+      (db->state->options.flags & db_flags_wal_group_commit) &&
+      !(flags & txn_flags_apply_log);
+  if (group) {
+    ensure(wal_writer_start(db->state));
+  } else {
+    ensure(!db->state->active_write_tx,
+        msg("Opening a second write transaction is forbidden"));
+  }
+
+  size_t cancel_defer = 0;
+  txn_state_t *state;
+  ensure(mem_calloc((void *)&state, sizeof(txn_state_t)));
+  try_defer(free, state, cancel_defer);
+
+  ensure(pagesmap_new(8, &state->modified_pages));
+
+  if (group) wal_writer_acquire_write_tx(db->state);
+  state->flags           = flags | db->state->options.flags;
+  state->db              = db->state;
+  state->map             = db->state->map;
+  state->number_of_pages = db->state->number_of_pages;
+  // <3>
+  state->prev_tx =
+      __atomic_load_n(&db->state->last_write_tx, __ATOMIC_ACQUIRE);
+  state->tx_id = db->state->last_tx_id + 1;
+  // a gc on a read txn's thread may release older states meanwhile
+  if (flopped(txn_epoch_enter(db->state, &tx->reader))) {
+    if (group) wal_writer_release_write_tx(db->state, state->tx_id);
+    return failure_code();
+  }
+  if (!group) db->state->active_write_tx = state->tx_id;
+
+  tx->state    = state;
+  cancel_defer = 1;
+  return success();
+}
+// end::txn_create[]
+
+static result_t txn_hash_page(
+    txn_t *tx, page_t *page, uint8_t hash[CHECKSUM_BYTES]);
+
+// tag::txn_validate_page[]
+static result_t txn_validate_page_hash(txn_t *tx, page_t *page,
+    uint8_t expected_hash[CHECKSUM_BYTES]) {
+  // <1>
+  uint8_t hash[CHECKSUM_BYTES];
+  ensure(txn_hash_page(tx, page, hash));
+  // <2>
+  if (!memcmp(hash, expected_hash, CHECKSUM_BYTES))
+    return success();
+  // <3>
+  if (sodium_is_zero(expected_hash, CHECKSUM_BYTES) &&
+      sodium_is_zero(
+          page->address, page->number_of_pages * PAGE_SIZE))
+    return success();
+  // <4>
+  failed(ENODATA,
+      msg("Unable to validate hash for page, data corruption?"),
+      with(page->page_num, "%lu"));
+}
+static result_t txn_validate_page(txn_t *tx, page_t *page) {
+  page_metadata_t *metadata;
+  if ((page->page_num & PAGES_IN_METADATA_MASK) != page->page_num) {
+    ensure(txn_get_metadata(tx, page->page_num, &metadata));
+  } else {
+    metadata = page->address;
+  }
+  ensure(txn_validate_page_hash(
+      tx, page, metadata->cyrpto.hash_blake2b));
+  return success();
+}
+// end::txn_validate_page[]
+
+// tag::txn_ensure_page_is_valid[]
+static result_t txn_ensure_page_is_valid(txn_t *tx, page_t *page) {
+  if ((tx->state->flags & db_flags_page_validation_none) ==
+      db_flags_page_validation_none)
+    return success();
+  if (tx->state->flags & db_flags_page_validation_always) {
+    ensure(txn_validate_page(tx, page));
+    return success();
+  }
+  if ((tx->state->flags & db_flags_page_validation_once) == 0)
+    return success();
+
+  db_state_t *db   = tx->state->db;
+  uint64_t *bitmap = db->first_read_bitmap;
+  // before the db init is completed or extended during this run
+  if (!bitmap || page->page_num >= db->original_number_of_pages)
+    return success();
+  uint64_t *word = &bitmap[page->page_num / 64];
+  uint64_t bit   = 1UL << page->page_num % 64;
+  // already checked
+  if (__atomic_load_n(word, __ATOMIC_RELAXED) & bit) return success();
+  ensure(txn_validate_page(tx, page));
+  // we only do it one, can skip it next time, other threads may be
+  // marking other pages in the same word
+  __atomic_fetch_or(word, bit, __ATOMIC_RELAXED);
+  return success();
+}
+// end::txn_ensure_page_is_valid[]
+
+// tag::txn_generate_nonce[]
+static void txn_generate_nonce(page_metadata_t *metadata) {
+  if (sodium_is_zero(metadata->cyrpto.aead.nonce,
+          PAGE_METADATA_CRYPTO_NONCE_SIZE)) {
+    randombytes_buf(
+        metadata->cyrpto.aead.nonce, PAGE_METADATA_CRYPTO_NONCE_SIZE);
+  } else {
+    sodium_increment(
+        metadata->cyrpto.aead.nonce, PAGE_METADATA_CRYPTO_NONCE_SIZE);
+  }
+}
+static void txn_set_nonce(page_metadata_t *metadata,
+    uint8_t nonce[crypto_aead_xchacha20poly1305_IETF_NPUBBYTES]) {
+  memcpy(nonce, metadata->cyrpto.aead.nonce,
+      PAGE_METADATA_CRYPTO_NONCE_SIZE);
+  memset(nonce + PAGE_METADATA_CRYPTO_NONCE_SIZE, 0,
+      crypto_aead_xchacha20poly1305_IETF_NPUBBYTES -
+          PAGE_METADATA_CRYPTO_NONCE_SIZE);
+}
+// end::txn_generate_nonce[]
+
+// tag::txn_page_key[]
+static const char TxnKeyCtx[8]     = "TxnPages";
+static const char TxnFileKeyCtx[8] = "TxnFiles";
+
+// derived up front, the file header says if the pages use it
+implementation_detail result_t txn_file_key_create(db_state_t *db) {
+  if (!(db->options.flags & db_flags_encrypted)) return success();
+  uint8_t *key;
+  ensure(mem_calloc(
+      (void *)&key, crypto_aead_xchacha20poly1305_IETF_KEYBYTES));
+  if (sodium_mlock(
+          key, crypto_aead_xchacha20poly1305_IETF_KEYBYTES)) {
+    free(key);
+    failed(ENOMEM, msg("Unable to lock the file key in memory"));
+  }
+  db->encryption_file_key = key;
+  if (crypto_kdf_derive_from_key(key,
+          crypto_aead_xchacha20poly1305_IETF_KEYBYTES, 0,
+          TxnFileKeyCtx, db->options.encryption_key)) {
+    failed(EINVAL, msg("Unable to derive the file key"));
+  }
+  return success();
+}
+
+implementation_detail void txn_file_key_destroy(db_state_t *db) {
+  if (!db->encryption_file_key) return;
+  // wipes the key as well
+  sodium_munlock(db->encryption_file_key,
+      crypto_aead_xchacha20poly1305_IETF_KEYBYTES);
+  free(db->encryption_file_key);
+  db->encryption_file_key = 0;
+}
+
+_Static_assert(crypto_aead_xchacha20poly1305_IETF_NPUBBYTES -
+                       PAGE_METADATA_CRYPTO_NONCE_SIZE ==
+                   sizeof(uint64_t),
+    "The page number must fit in the rest of the nonce");
+
+// <1>
+// pages sharing the file key have their page number in the rest of
+// the nonce instead. The file header page always has its own key,
+// since it tells if the file has one
+static result_t txn_page_key(db_state_t *db, uint64_t page_num,
+    page_metadata_t *metadata,
+    uint8_t subkey[crypto_aead_xchacha20poly1305_IETF_KEYBYTES],
+    uint8_t nonce[crypto_aead_xchacha20poly1305_IETF_NPUBBYTES],
+    const uint8_t **key) {
+  txn_set_nonce(metadata, nonce);
+  if (page_num &&
+      (db->options.flags & db_flags_encryption_file_key)) {
+    memcpy(nonce + PAGE_METADATA_CRYPTO_NONCE_SIZE, &page_num,
+        sizeof(uint64_t));
+    *key = db->encryption_file_key;
+    return success();
+  }
+  if (crypto_kdf_derive_from_key(subkey,
+          crypto_aead_xchacha20poly1305_IETF_KEYBYTES, page_num,
+          TxnKeyCtx, db->options.encryption_key)) {
+    failed(EINVAL, msg("Unable to derive key for page decryption"),
+        with(page_num, "%ld"));
+  }
+  *key = subkey;
+  return success();
+}
+// end::txn_page_key[]
+
+// tag::txn_encrypt_page[]
+static result_t txn_encrypt_page(txn_t *tx, uint64_t page_num,
+    void *start, size_t size, page_metadata_t *metadata) {
+  // <1>
+  uint8_t subkey[crypto_aead_xchacha20poly1305_IETF_KEYBYTES];
+  uint8_t nonce[crypto_aead_xchacha20poly1305_IETF_NPUBBYTES];
+  const uint8_t *key;
+  // <2>
+  txn_generate_nonce(metadata);
+  ensure(txn_page_key(
+      tx->state->db, page_num, metadata, subkey, nonce, &key));
+  // <3>
+  int result = crypto_aead_xchacha20poly1305_ietf_encrypt_detached(
+      start, metadata->cyrpto.aead.mac, 0, start, size, 0, 0, 0,
+      nonce, key);
+  sodium_memzero(subkey, crypto_aead_xchacha20poly1305_IETF_KEYBYTES);
+  if (result) {
+    failed(
+        EINVAL, msg("Unable to encrypt page"), with(page_num, "%ld"));
+  }
+  return success();
+}
+// end::txn_encrypt_page[]
+
+// tag::txn_decrypt[]
+static result_t txn_decrypt(db_state_t *db, void *start,
+    size_t size, void *dest, page_metadata_t *metadata,
+    uint64_t page_num) {
+  uint8_t subkey[crypto_aead_xchacha20poly1305_ietf_KEYBYTES];
+  uint8_t nonce[crypto_aead_xchacha20poly1305_ietf_NPUBBYTES];
+  const uint8_t *key;
+  ensure(txn_page_key(db, page_num, metadata, subkey, nonce, &key));
+  // <1>
+  // a failed decryption zeroes the destination, when decrypting in
+  // place we need to know if the page was empty beforehand
+  bool in_place = start == dest;
+  bool empty    = in_place && sodium_is_zero(start, size);
+  int result = crypto_aead_xchacha20poly1305_ietf_decrypt_detached(
+      dest, 0, start, size, metadata->cyrpto.aead.mac, 0, 0, nonce,
+      key);
+  sodium_memzero(subkey, crypto_aead_xchacha20poly1305_ietf_KEYBYTES);
+  if (result) {
+    if (!in_place) empty = sodium_is_zero(start, size);
+    if (!empty &&
+        !sodium_is_zero(metadata->cyrpto.aead.mac,
+            crypto_aead_xchacha20poly1305_ietf_ABYTES)) {
+      failed(EINVAL, msg("Unable to decrypt page"),
+          with(page_num, "%ld"));
+    }
+    memset(dest, 0, size);
+  }
+  return success();
+}
+// end::txn_decrypt[]
+
+// tag::txn_decrypt_page[]
+// the buffer may be the page itself, decrypting in place
+static result_t txn_decrypt_page_to(
+    txn_t *tx, page_t *page, void *buffer) {
+  if ((page->page_num & PAGES_IN_METADATA_MASK) == page->page_num) {
+    size_t shift = PAGE_METADATA_CRYPTO_HEADER_SIZE;
+    ensure(txn_decrypt(tx->state->db, page->address + shift,
+        PAGE_SIZE - shift, buffer + shift, page->address,
+        page->page_num));
+    memmove(buffer, page->address, shift);
+  } else {
+    page_metadata_t *metadata;
+    ensure(txn_get_metadata(tx, page->page_num, &metadata));
+    ensure(txn_decrypt(tx->state->db, page->address,
+        page->number_of_pages * PAGE_SIZE, buffer, metadata,
+        page->page_num));
+  }
+  return success();
+}
+
+static result_t txn_decrypt_page(txn_t *tx, page_t *page) {
+  size_t cancel_defer  = 0;
+  page_buffer_t pooled = {.db = tx->state->db,
+      .number_of_pages     = page->number_of_pages};
+  ensure(pages_pool_alloc(
+      pooled.db, page->number_of_pages, &pooled.address));
+  try_defer(pages_pool_free_buffer, pooled, cancel_defer);
+  void *buffer = pooled.address;
+  ensure(txn_decrypt_page_to(tx, page, buffer));
+  // <1>
+  page_t existing = {.page_num = page->page_num};
+  if (pagesmap_lookup(tx->working_set, &existing)) {
+    // this can happen if we are using encryption AND 32 bits mode
+    // let's replace the encrypted content with the plain text one
+    memcpy(
+        existing.address, buffer, page->number_of_pages * PAGE_SIZE);
+    sodium_memzero(buffer, page->number_of_pages * PAGE_SIZE);
+    pages_pool_free(pooled.db, page->number_of_pages, buffer);
+    memcpy(page, &existing, sizeof(page_t));
+  } else {
+    page->address = buffer;
+    ensure(pagesmap_put_new(&tx->working_set, page));
+  }
+  cancel_defer = 1;
+  return success();
+}
+// end::txn_decrypt_page[]
+
+// tag::txn_can_borrow_page[]
+static bool txn_can_borrow_page(txn_t *tx, page_t *page) {
+  // <1>
+  // write txns copy the pages they modify, so they can share the
+  // pages they only read. Plain text versions that aren't in the
+  // file yet don't need to be read or decrypted at all
+  return tx->state->db->pages_cache && page->number_of_pages == 1 &&
+         !(tx->state->flags & txn_flags_apply_log) &&
+         (!page->address || (tx->state->flags & db_flags_encrypted));
+}
+
+static result_t txn_ensure_cached_page_is_valid(
+    txn_t *tx, page_t *page, void *buffer) {
+  if (tx->state->flags & db_flags_encrypted) {
+    ensure(txn_decrypt_page_to(tx, page, buffer));
+  } else {
+    ensure(txn_ensure_page_is_valid(tx, page));
+  }
+  return success();
+}
+// end::txn_can_borrow_page[]
+
+// tag::txn_read_ahead[]
+#define TXN_READ_AHEAD_PAGES 8
+
+// the pages after the one the txn asked for, in reserved buffers
+typedef struct txn_read_ahead {
+  db_state_t *db;
+  uint64_t page_num;
+  size_t count;
+  void *buffers[TXN_READ_AHEAD_PAGES - 1];
+} txn_read_ahead_t;
+
+static void defer_txn_read_ahead_release(cancel_defer_t *cd) {
+  if (cd->cancelled && *cd->cancelled) return;
+  txn_read_ahead_t *ahead = cd->target;
+  for (size_t i = 0; i < ahead->count; i++) {
+    pages_cache_release(ahead->db, ahead->buffers[i]);
+  }
+  ahead->count = 0;
+}
+
+static void txn_read_ahead_reserve(
+    txn_t *tx, page_t *page, txn_read_ahead_t *ahead) {
+  db_state_t *db  = tx->state->db;
+  ahead->db       = db;
+  ahead->page_num = page->page_num + 1;
+  ahead->count    = 0;
+  // <1>
+  // only sequential reads from the file read ahead. Pages with
+  // versions the txn can see may be written to the file meanwhile
+  if (page->page_num != tx->next_page_read) return;
+  uint64_t max = MIN(TXN_READ_AHEAD_PAGES - 1,
+      tx->state->map.size / PAGE_SIZE - ahead->page_num);
+  while (ahead->count < max) {
+    page_t next      = {.page_num = ahead->page_num + ahead->count};
+    uint64_t version = 0;
+    void *buffer     = 0;
+    if (txn_versions_lookup(db, tx->state->tx_id, &next, &version) ||
+        pages_cache_get(db, next.page_num, 0, &buffer) ||
+        !pages_cache_reserve(db, &buffer)) {
+      if (buffer) pages_cache_release(db, buffer);
+      break;
+    }
+    ahead->buffers[ahead->count++] = buffer;
+  }
+}
+
+static result_t txn_read_ahead(txn_t *tx, page_t *page,
+    void *buffer, txn_read_ahead_t *ahead) {
+  txn_read_ahead_reserve(tx, page, ahead);
+  tx->next_page_read = ahead->page_num + ahead->count;
+  // <2>
+  // a single read for the page & the ones after it
+  span_t buffers[TXN_READ_AHEAD_PAGES] = {
+      {.address = buffer, .size = PAGE_SIZE}};
+  for (size_t i = 0; i < ahead->count; i++) {
+    buffers[i + 1] =
+        (span_t){.address = ahead->buffers[i], .size = PAGE_SIZE};
+  }
+  pal_io_request_t req = {.offset = page->page_num * PAGE_SIZE,
+      .buffers = buffers, .number_of_buffers = ahead->count + 1};
+  ensure(pal_read_file_vectored(tx->state->db->handle, &req));
+  page->address = buffer;
+  return success();
+}
+
+static void txn_cache_read_ahead(txn_t *tx, txn_read_ahead_t *ahead) {
+  // <3>
+  // validating a page may need its metadata page, so this is done
+  // after the txn got the page it asked for
+  for (size_t i = 0; i < ahead->count; i++) {
+    page_t page = {.page_num = ahead->page_num + i,
+        .number_of_pages     = 1,
+        .address             = ahead->buffers[i]};
+    if (!txn_ensure_cached_page_is_valid(tx, &page, page.address)) {
+      // may be a part of an overflow page, or not in use at all,
+      // the txn never asked for it
+      errors_clear();
+      pages_cache_release(ahead->db, page.address);
+      continue;
+    }
+    void *cached = pages_cache_insert(
+        ahead->db, page.page_num, 0, page.address);
+    pages_cache_release(ahead->db, cached);
+  }
+  ahead->count = 0;
+}
+// end::txn_read_ahead[]
+
+// tag::txn_borrow_page[]
+static result_t txn_fill_cached_page(txn_t *tx, page_t *page,
+    void *buffer, txn_read_ahead_t *ahead) {
+  if (!page->address) {
+    if (tx->state->flags & db_flags_avoid_mmap_io) {
+      ensure(pages_check_bounds(tx, page));
+      ensure(txn_read_ahead(tx, page, buffer, ahead));
+    } else {
+      ensure(pages_get(tx, page));
+    }
+  }
+  ensure(txn_ensure_cached_page_is_valid(tx, page, buffer));
+  return success();
+}
+
+static result_t txn_borrow_page(
+    txn_t *tx, page_t *page, uint64_t version, bool *borrowed) {
+  db_state_t *db         = tx->state->db;
+  page_buffer_t buffer   = {.db = db, .number_of_pages = 1};
+  txn_read_ahead_t ahead = {.db = db};
+  size_t done            = 0;
+  *borrowed              = false;
+  defer(txn_read_ahead_release, ahead);
+  if (!pages_cache_get(
+          db, page->page_num, version, &buffer.address)) {
+    // <2>
+    // all the cached pages are borrowed, the txn uses its own copy
+    if (!pages_cache_reserve(db, &buffer.address)) return success();
+    try_defer(pages_cache_release, buffer, done);
+    ensure(txn_fill_cached_page(tx, page, buffer.address, &ahead));
+    buffer.address = pages_cache_insert(
+        db, page->page_num, version, buffer.address);
+    done = 1;
+  }
+  // <3>
+  // released when the working set is cleared
+  size_t cancel_defer = 0;
+  try_defer(pages_cache_release, buffer, cancel_defer);
+  page->address = buffer.address;
+  ensure(pagesmap_put_new(&tx->working_set, page));
+  cancel_defer = 1;
+  *borrowed    = true;
+  txn_cache_read_ahead(tx, &ahead);
+  return success();
+}
+// end::txn_borrow_page[]
+
+// tag::txn_raw_get_page[]
+result_t txn_raw_get_page(txn_t *tx, page_t *page) {
+  errors_assert_empty();
+  page->address = 0;
+  if (!(tx->state->flags & TX_COMMITED) &&
+      pagesmap_lookup(tx->state->modified_pages, page))
+    return success();
+  if (pagesmap_lookup(tx->working_set, page)) return success();
+  // committed pages that the gc didn't write to the file yet
+  uint64_t version = 0;
+  txn_versions_lookup(
+      tx->state->db, tx->state->tx_id, page, &version);
+  if (!page->number_of_pages) page->number_of_pages = 1;
+  // <1>
+  if (txn_can_borrow_page(tx, page)) {
+    bool borrowed;
+    ensure(txn_borrow_page(tx, page, version, &borrowed));
+    if (borrowed) return success();
+  }
+
+  if (!page->address) {
+    ensure(pages_get(tx, page));
+  }
+
+  // <2>
+  if (!(tx->state->flags & txn_flags_apply_log)) {
+    if (tx->state->flags & db_flags_encrypted) {
+      ensure(txn_decrypt_page(tx, page));
+    } else {
+      ensure(txn_ensure_page_is_valid(tx, page));
+    }
+  }
+
+  return success();
+}
+// end::txn_raw_get_page[]
+
+// tag::txn_resize_modified_page[]
+implementation_detail result_t txn_resize_modified_page(
+    txn_state_t *state, page_t *page, uint32_t number_of_pages) {
+  void *address;
+  ensure(pages_pool_alloc(state->db, number_of_pages, &address));
+  memcpy(address, page->address,
+      MIN(number_of_pages, page->number_of_pages) * PAGE_SIZE);
+  if (number_of_pages > page->number_of_pages) {
+    memset(address + page->number_of_pages * PAGE_SIZE, 0,
+        (number_of_pages - page->number_of_pages) * PAGE_SIZE);
+  }
+  if (state->flags & db_flags_encrypted) {
+    sodium_memzero(page->address, page->number_of_pages * PAGE_SIZE);
+  }
+  pages_pool_free(state->db, page->number_of_pages, page->address);
+  page->address         = address;
+  page->number_of_pages = number_of_pages;
+  // the version in the file doesn't match it anymore
+  page->previous = 0;
+  pagesmap_update(state->modified_pages, page);
+  return success();
+}
+// end::txn_resize_modified_page[]
+
+// tag::txn_raw_modify_page[]
+result_t txn_raw_modify_page(txn_t *tx, page_t *page) {
+  errors_assert_empty();
+
+  ensure(tx->state->flags & TX_WRITE,
+      msg("Read transactions cannot modify the pages"),
+      with(tx->state->flags, "%d"));
+
+  uint32_t number_of_pages = page->number_of_pages;
+  if (pagesmap_lookup(tx->state->modified_pages, page)) {
+    if (tx->state->savepoints) {
+      ensure(txn_savepoint_record(tx, page, false));
+    }
+    // <1>
+    // the page was freed & allocated again with another size
+    if (number_of_pages &&
+        number_of_pages != page->number_of_pages) {
+      ensure(txn_resize_modified_page(
+          tx->state, page, number_of_pages));
+    }
+    return success();
+  }
+  // end::txn_raw_modify_page[]
+
+  size_t done = 0;
+  if (!page->number_of_pages) page->number_of_pages = 1;
+  page_buffer_t pooled = {.db = tx->state->db,
+      .number_of_pages     = page->number_of_pages};
+  ensure(pages_pool_alloc(
+      pooled.db, page->number_of_pages, &pooled.address));
+  try_defer(pages_pool_free_buffer, pooled, done);
+  page->address = pooled.address;
+  // <2>
+  // the size is kept if the txn or the page versions know the page, a
+  // value that is only in the file is read with the size we expect
+  page_t original = {.page_num = page->page_num,
+      .number_of_pages         = page->number_of_pages};
+  ensure(txn_raw_get_page(tx, &original));
+  if (original.number_of_pages == page->number_of_pages) {
+    memcpy(page->address, original.address,
+        (PAGE_SIZE * page->number_of_pages));
+    page->previous = original.address;
+  } else {  // mismatch in size means that we consider to be new only
+    memset(page->address, 0, (PAGE_SIZE * page->number_of_pages));
+    page->previous = 0;
+  }
+  if (tx->state->savepoints) {
+    ensure(txn_savepoint_record(tx, page, true));
+  }
+  ensure(pagesmap_put_new(&tx->state->modified_pages, page),
+      msg("Failed to allocate entry"));
+  done = 1;
+  return success();
+}
+
+// tag::txn_hash_page[]
+static result_t txn_hash_page(
+    txn_t *tx, page_t *page, uint8_t hash[CHECKSUM_BYTES]) {
+  bool is_metadata_page =
+      (page->page_num & PAGES_IN_METADATA_MASK) == page->page_num;
+
+  void *start = is_metadata_page ? page->address + CHECKSUM_BYTES
+                                 : page->address;
+  size_t size = is_metadata_page ? PAGE_SIZE - sizeof(page_metadata_t)
+                                 : page->number_of_pages * PAGE_SIZE;
+
+  // <1>
+  // the file header decides the checksum, see db_init(), and the
+  // header page is read before we know it, so it describes itself
+  page_checksum_t kind = tx->state->db->options.page_checksum;
+  if (page->page_num == 0) {
+    page_metadata_t *header = page->address;
+    kind                    = (page_checksum_t)(
+        header->file_header.version >> FILE_HEADER_CHECKSUM_SHIFT);
+  }
+  if (!checksum_compute(kind, start, size, hash)) {
+    failed(ENODATA,
+        msg("Unable to compute page hash for page, shouldn't happen"),
+        with(page->page_num, "%lu"));
+  }
+  return success();
+}
+// end::txn_hash_page[]
+
+// tag::tx_finalize_page[]
+static result_t tx_finalize_page(
+    txn_t *tx, page_t *page, page_metadata_t *metadata) {
+  if (tx->state->flags & db_flags_encrypted) {
+    if ((page->page_num & PAGES_IN_METADATA_MASK) == page->page_num) {
+      size_t shift = PAGE_METADATA_CRYPTO_HEADER_SIZE;
+      return txn_encrypt_page(tx, page->page_num,
+          page->address + shift, PAGE_SIZE - shift, metadata);
+    }
+    return txn_encrypt_page(tx, page->page_num, page->address,
+        page->number_of_pages * PAGE_SIZE, metadata);
+  } else {
+    return txn_hash_page(tx, page, metadata->cyrpto.hash_blake2b);
+  }
+}
+// end::tx_finalize_page[]
+
+// tag::txn_finalize_modified_pages[]
+// pages given to a worker at a time, so they don't contend on every
+// page of the txn
+#define TXN_FINALIZE_BATCH_SIZE 16
+
+typedef struct txn_finalize_operation {
+  txn_t *tx;
+  page_t *pages;
+  // null for metadata pages, they are finalized last
+  page_metadata_t **metadata;
+  size_t count;
+  // errors are per thread, only the first failed page is reported
+  uint64_t failed_page_num;
+  bool failed;
+  uint8_t padding[7];
+} txn_finalize_operation_t;
+
+static void txn_finalize_pages_batch(void *arg, size_t index) {
+  txn_finalize_operation_t *op = arg;
+  size_t end = MIN(op->count, (index + 1) * TXN_FINALIZE_BATCH_SIZE);
+  for (size_t i = index * TXN_FINALIZE_BATCH_SIZE; i < end; i++) {
+    if (!op->metadata[i]) continue;
+    if (tx_finalize_page(op->tx, &op->pages[i], op->metadata[i]))
+      continue;
+    errors_clear();
+    if (!__atomic_exchange_n(&op->failed, true, __ATOMIC_ACQ_REL)) {
+      op->failed_page_num = op->pages[i].page_num;
+    }
+  }
+}
+
+static result_t txn_finalize_data_pages(
+    txn_t *tx, txn_finalize_operation_t *op) {
+  workers_t *workers = tx->state->db->commit_workers;
+  // <1>
+  // small txns aren't worth waking up the workers
+  if (!workers || op->count <= TXN_FINALIZE_BATCH_SIZE) {
+    for (size_t i = 0; i < op->count; i++) {
+      if (!op->metadata[i]) continue;
+      ensure(tx_finalize_page(tx, &op->pages[i], op->metadata[i]));
+    }
+    return success();
+  }
+  workers_run(workers, txn_finalize_pages_batch, op,
+      (op->count + TXN_FINALIZE_BATCH_SIZE - 1) /
+          TXN_FINALIZE_BATCH_SIZE);
+  if (op->failed) {
+    failed(EINVAL, msg("Unable to finalize page"),
+        with(op->failed_page_num, "%lu"));
+  }
+  return success();
+}
+
+static result_t txn_finalize_modified_pages(txn_t *tx) {
+  txn_state_t *state = tx->state;
+  // <2>
+  txn_finalize_operation_t op = {.tx = tx};
+  ensure(mem_calloc((void *)&op.pages,
+      state->modified_pages->count * sizeof(page_t)));
+  defer(free, op.pages);
+  ensure(mem_calloc((void *)&op.metadata,
+      state->modified_pages->count * sizeof(page_metadata_t *)));
+  defer(free, op.metadata);
+  size_t iter_state = 0;
+  page_t *current;
+  while (pagesmap_get_next(
+      tx->state->modified_pages, &iter_state, &current)) {
+    // <3>
+    // can't modify in place, the hash may change, need a copy
+    memcpy(&op.pages[op.count++], current, sizeof(page_t));
+  }
+  // <4>
+  // may add metadata pages to the txn, so it happens before any of
+  // the workers are looking at the pages
+  for (size_t i = 0; i < op.count; i++) {
+    page_metadata_t *metadata;
+    ensure(txn_modify_metadata(tx, op.pages[i].page_num, &metadata));
+    if ((op.pages[i].page_num & PAGES_IN_METADATA_MASK) ==
+        op.pages[i].page_num)
+      // we handle metadata page separately, note that metadata pages
+      // *must* be modified, that is why we call modify metadat first
+      continue;
+    op.metadata[i] = metadata;
+  }
+  ensure(txn_finalize_data_pages(tx, &op));
+  // <5>
+  // the metadata pages hold the hashes & nonces of the data pages,
+  // so they are finalized once all of those are done
+  iter_state = 0;
+  while (pagesmap_get_next(
+      tx->state->modified_pages, &iter_state, &current)) {
+    if ((current->page_num & PAGES_IN_METADATA_MASK) !=
+        current->page_num)
+      continue;  // not a metadata page
+    page_metadata_t *entries = current->address;
+
+    ensure(tx_finalize_page(tx, current, entries));
+  }
+  return success();
+}
+// end::txn_finalize_modified_pages[]
+
+// tag::txn_commit[]
+static result_t txn_prepare_commit(txn_t *tx) {
+  // the changes are kept, there is nothing to roll back to
+  txn_savepoint_free_all(tx->state);
+  // <1>
+  if (!(tx->state->flags & txn_flags_apply_log)) {
+    page_metadata_t *header;
+    ensure(txn_modify_metadata(tx, 0, &header));
+    header->file_header.last_tx_id = tx->state->tx_id;
+    ensure(txn_finalize_modified_pages(tx));
+  }
+  // <2>
+  // publishing the pages must not fail once the txn is in the WAL
+  db_state_t *db = tx->state->db;
+  txn_epoch_lock(db);
+  defer(txn_epoch_unlock, db);
+  ensure(txn_versions_reserve(db, tx->state->modified_pages->count));
+  return success();
+}
+
+static void txn_publish_commit(txn_t *tx) {
+  db_state_t *db = tx->state->db;
+  tx->state->flags |= TX_COMMITED;
+
+  // <1>
+  // Update global references to the current span on commit, the gc
+  // may be running on a read txn's thread
+  txn_epoch_lock(db);
+  // the state we started from may have been released meanwhile
+  tx->state->prev_tx = db->last_write_tx;
+  if (!db->transactions_to_free) db->transactions_to_free = tx->state;
+  txn_versions_publish(db, tx->state);
+  __atomic_store_n(
+      &db->last_write_tx->next_tx, tx->state, __ATOMIC_RELEASE);
+  __atomic_store_n(&db->last_write_tx, tx->state, __ATOMIC_SEQ_CST);
+  db->last_tx_id      = tx->state->tx_id;
+  db->map             = tx->state->map;
+  db->number_of_pages = tx->state->number_of_pages;
+  txn_epoch_unlock(db);
+
+  // <2>
+  while (tx->state->on_rollback) {
+    cleanup_callback_t *cur = tx->state->on_rollback;
+    tx->state->on_rollback  = cur->next;
+    free(cur);
+  }
+}
+
+result_t txn_commit(txn_t *tx) {
+  errors_assert_empty();
+  if (!tx->state->modified_pages->count) return success();
+
+  ensure(txn_prepare_commit(tx));
+  db_state_t *db = tx->state->db;
+  bool apply_log = tx->state->flags & txn_flags_apply_log;
+  // <1>
+  // a group commit waits for its own tx to be durable, the writer
+  // writes all the txs queued meanwhile in a single write & barrier
+  if (!apply_log && (tx->state->flags & db_flags_wal_group_commit)) {
+    ensure(wal_writer_submit(tx->state, 0, 0));
+    // <2>
+    // the next write txn runs while this one becomes durable, so
+    // its record can join the same write
+    txn_publish_commit(tx);
+    wal_writer_release_write_tx(db, tx->state->tx_id);
+    ensure(wal_writer_wait(db, tx->state->tx_id));
+    return success();
+  }
+  if (db->wal_writer && !apply_log) {
+    // go through the writer to keep the order of txs in the WAL
+    ensure(wal_writer_submit(tx->state, 0, 0));
+    ensure(wal_writer_wait(db, tx->state->tx_id));
+  } else {
+    // the writer must be idle before we touch the WAL directly
+    ensure(wal_writer_wait(db, db->last_tx_id));
+    // and so must a checkpoint running on a read txn's thread
+    txn_epoch_lock(db);
+    defer(txn_epoch_unlock, db);
+    ensure(wal_append(tx->state));
+  }
+  // end::txn_commit[]
+
+  txn_publish_commit(tx);
+  return success();
+}
+
+// tag::txn_commit_async[]
+result_t txn_commit_async(
+    txn_t *tx, txn_commit_callback_t callback, void *state) {
+  errors_assert_empty();
+  ensure(!(tx->state->flags & txn_flags_apply_log),
+      msg("Cannot use async commit when applying a shipped log"),
+      with(tx->state->tx_id, "%lu"));
+  if (!tx->state->modified_pages->count) {
+    if (callback) callback(state, tx->state->tx_id, true);
+    return success();
+  }
+  ensure(txn_prepare_commit(tx));
+  ensure(wal_writer_start(tx->state->db));
+  // <1>
+  ensure(wal_writer_submit(tx->state, callback, state));
+  // <2>
+  txn_publish_commit(tx);
+  return success();
+}
+// end::txn_commit_async[]
+
+// tag::txn_free_single_tx_state[]
+implementation_detail void txn_free_single_tx_state(
+    txn_state_t *state) {
+  // <1>
+  // a single trip to the pool for all the pages of the txn
+  pages_pool_free_map(state->db, state->modified_pages);
+  // <2>
+  while (state->on_forget) {
+    cleanup_callback_t *cur = state->on_forget;
+    cur->func(cur->state);
+    state->on_forget = cur->next;
+    free(cur);
+  }
+  free(state->modified_pages);
+  free(state);
+}
+// end::txn_free_single_tx_state[]
+
+// tag::txn_free_registered_transactions[]
+static void txn_free_registered_transactions(db_state_t *state) {
+  while (state->transactions_to_free) {
+    txn_state_t *cur = state->transactions_to_free;
+
+    if (cur->tx_id >= state->oldest_active_tx) break;
+
+    // <1>
+    // the pages are in the file, the next merge stops here
+    if (cur->next_tx) cur->next_tx->prev_tx = 0;
+
+    state->transactions_to_free = cur->next_tx;
+    __atomic_store_n(&state->default_read_tx->next_tx, cur->next_tx,
+        __ATOMIC_RELEASE);
+    state->default_read_tx->map             = cur->map;
+    state->default_read_tx->number_of_pages = cur->number_of_pages;
+    if (state->last_write_tx == cur) {
+      __atomic_store_n(&state->last_write_tx, state->default_read_tx,
+          __ATOMIC_SEQ_CST);
+    }
+    // <2>
+    // read txns that got here before we unlinked it may still use
+    // it, it is freed in a batch once they are done
+    txn_versions_release(state, cur);
+    txn_epoch_retire(state, cur);
+  }
+}
+// end::txn_free_registered_transactions[]
+
+// tag::txn_write_state_to_disk[]
+static int txn_compare_pages(const void *a, const void *b) {
+  uint64_t x = ((const page_t *)a)->page_num;
+  uint64_t y = ((const page_t *)b)->page_num;
+  return x < y ? -1 : x > y;
+}
+
+implementation_detail result_t txn_write_pages_to_disk(
+    db_state_t *db, pages_map_t *modified_pages, bool sync) {
+  size_t count = modified_pages->count;
+  page_t *pages;
+  ensure(mem_alloc((void *)&pages, count * sizeof(page_t)));
+  defer(free, pages);
+  span_t *buffers;
+  ensure(mem_alloc((void *)&buffers, count * sizeof(span_t)));
+  defer(free, buffers);
+  pal_io_request_t *writes;
+  ensure(
+      mem_alloc((void *)&writes, count * sizeof(pal_io_request_t)));
+  defer(free, writes);
+
+  size_t iter_state = 0;
+  page_t *current;
+  for (size_t i = 0;
+       pagesmap_get_next(modified_pages, &iter_state, &current);) {
+    pages[i++] = *current;
+  }
+  // <1>
+  // sequential order, adjacent pages are merged to a single write
+  qsort(pages, count, sizeof(page_t), txn_compare_pages);
+  uint64_t max_io_size    = db->options.write_back_max_io_size;
+  size_t number_of_writes = 0;
+  uint64_t next_offset    = UINT64_MAX;
+  uint64_t io_size        = 0;
+  for (size_t i = 0; i < count; i++) {
+    uint64_t offset = pages[i].page_num * PAGE_SIZE;
+    buffers[i]      = (span_t){.address = pages[i].address,
+        .size = pages[i].number_of_pages * PAGE_SIZE};
+    if (offset == next_offset &&
+        io_size + buffers[i].size <= max_io_size) {
+      writes[number_of_writes - 1].number_of_buffers++;
+      io_size += buffers[i].size;
+    } else {
+      writes[number_of_writes++] = (pal_io_request_t){
+          .offset            = offset,
+          .buffers           = &buffers[i],
+          .number_of_buffers = 1};
+      io_size = buffers[i].size;
+    }
+    next_offset = offset + buffers[i].size;
+  }
+  // the writes & the fsync are submitted together
+  ensure(pal_write_file_batch(
+             db->handle, writes, number_of_writes, sync),
+      msg("Unable to write pages"), with(count, "%zu"));
+  // <2>
+  // read txns will find the new version in the file from now on
+  for (size_t i = 0; db->pages_cache && i < count; i++) {
+    for (uint32_t j = 0; j < pages[i].number_of_pages; j++) {
+      pages_cache_invalidate(db, pages[i].page_num + j);
+    }
+  }
+  return success();
+}
+
+static result_t txn_write_state_to_disk(
+    txn_state_t *s, pages_map_t *pages) {
+  // <3>
+  bool checkpoint = wal_will_checkpoint(s->db, s->tx_id);
+  ensure(txn_write_pages_to_disk(s->db, pages, checkpoint),
+      msg("Unable to write transaction pages"),
+      with(s->tx_id, "%lu"));
+  if (checkpoint) {
+    ensure(wal_checkpoint(s->db, s->tx_id));
+  }
+  return success();
+}
+// end::txn_write_state_to_disk[]
+
+// tag::txn_merge_unique_pages[]
+static result_t txn_merge_unique_pages(
+    txn_state_t *state, pages_map_t **merged) {
+  // merged will have distinct set of the latest pages that we want
+  // to write. The states still own them, read txns on other threads
+  // may be looking at them
+  ensure(pagesmap_new(8, merged));
+  txn_state_t *prev = state;
+  while (prev) {
+    size_t iter_state = 0;
+    page_t *entry;
+    while (pagesmap_get_next(
+        prev->modified_pages, &iter_state, &entry)) {
+      page_t check = {.page_num = entry->page_num};
+      if (pagesmap_lookup(*merged, &check)) continue;
+
+      ensure(pagesmap_put_new(merged, entry));
+    }
+    prev = prev->prev_tx;
+  }
+  return success();
+}
+// end::txn_merge_unique_pages[]
+
+// tag::txn_gc[]
+// called with the txn chain lock held
+static result_t txn_gc(db_state_t *db) {
+  // <1>
+  // states released by earlier runs, once no txn can see them
+  txn_epoch_reclaim(db);
+  // <2>
+  // states read txns are using stay in memory, read txns on the
+  // default state announce 0 and keep everything in memory
+  uint64_t oldest_reader = txn_epoch_oldest_reader(db);
+  // <3>
+  // transactions that aren't durable yet (async commit) must not be
+  // written to the data file, they'll be handled on a later gc
+  uint64_t durable_tx_id =
+      __atomic_load_n(&db->wal_state.durable_tx_id, __ATOMIC_ACQUIRE);
+  txn_state_t *latest_unused = db->default_read_tx;
+  while (latest_unused->next_tx &&
+         latest_unused->next_tx->tx_id < oldest_reader &&
+         latest_unused->next_tx->tx_id <= durable_tx_id) {
+    latest_unused = latest_unused->next_tx;
+  }
+  if (latest_unused == db->default_read_tx) {
+    return success();  // no work to be done
+  }
+  // <4>
+  db->oldest_active_tx = latest_unused->tx_id + 1;
+  // <5>
+  pages_map_t *merged = 0;
+  defer(free, merged);
+  ensure(txn_merge_unique_pages(latest_unused, &merged));
+  ensure(txn_write_state_to_disk(latest_unused, merged));
+  txn_free_registered_transactions(db);
+  txn_epoch_reclaim(db);
+  return success();
+}
+// end::txn_gc[]
+
+// tag::txn_close[]
+// tag::working_set_txn_close[]
+implementation_detail void txn_clear_working_set(txn_t *tx) {
+  if (tx->working_set) {
+    size_t iter_state = 0;
+    page_t *p;
+    while (pagesmap_get_next(tx->working_set, &iter_state, &p)) {
+      if (pages_cache_owns(tx->state->db, p->address)) {
+        pages_cache_release(tx->state->db, p->address);
+        continue;
+      }
+      if (tx->state->flags & db_flags_encrypted) {
+        sodium_memzero(p->address, p->number_of_pages * PAGE_SIZE);
+      }
+      pages_pool_free(tx->state->db, p->number_of_pages, p->address);
+    }
+    free(tx->working_set);
+  }
+}
+result_t txn_close(txn_t *tx) {
+  if (!tx || !tx->state) return success();
+  db_state_t *db = tx->state->db;
+  bool reader    = tx->state == &tx->read_view;
+  txn_clear_working_set(tx);
+  free(tx->state->tmp.buffer.address);
+  op_result_t *res = btree_stack_free(&tx->state->tmp.stack);
+  // end::working_set_txn_close[]
+  // <1>
+  // a read txn only writes to its own reader, unless it was holding
+  // back the oldest state that wasn't written to the file yet
+  if (reader) {
+    txn_state_t *oldest = __atomic_load_n(
+        &db->default_read_tx->next_tx, __ATOMIC_ACQUIRE);
+    bool held_back = oldest && tx->state->tx_id <= oldest->tx_id;
+    tx->state      = 0;
+    txn_epoch_exit(db, tx->reader);
+    // if the lock is busy, the gc will run when the write txn closes
+    if (held_back && txn_epoch_trylock(db)) {
+      defer(txn_epoch_unlock, db);
+      ensure(txn_gc(db));
+    }
+    return res;
+  }
+  uint64_t tx_id = tx->state->tx_id;
+  txn_epoch_exit(db, tx->reader);
+  txn_savepoint_free_all(tx->state);
+  free_space_index_discard(tx->state);
+  free_space_extents_discard(tx->state);
+  if (!(tx->state->flags & TX_COMMITED)) {  // rollback
+    // <2>
+    while (tx->state->on_rollback) {
+      cleanup_callback_t *cur = tx->state->on_rollback;
+      cur->func(cur->state);
+      tx->state->on_rollback = cur->next;
+      free(cur);
+    }
+    // <3>
+    while (tx->state->on_forget) {
+      // we didn't commit, can just discard this
+      cleanup_callback_t *cur = tx->state->on_forget;
+      tx->state->on_forget    = cur->next;
+      free(cur);
+    }
+    txn_free_single_tx_state(tx->state);
+  } else {
+    // <4>
+    // write back & free older states in a batch, before another
+    // write txn can be opened
+    txn_epoch_lock(db);
+    if (!txn_gc(db)) res = failure_code();
+    txn_epoch_unlock(db);
+  }
+  tx->state = 0;
+  if (db->wal_writer) {
+    wal_writer_release_write_tx(db, tx_id);
+  } else if (tx_id == db->active_write_tx) {
+    db->active_write_tx = 0;
+  }
+  return res;
+}
+// end::txn_close[]
+
+// tag::txn_register_cleanup_action[]
+result_t txn_register_cleanup_action(cleanup_callback_t **head,
+    void (*action)(void *), void *state_to_copy,
+    size_t size_of_state) {
+  cleanup_callback_t *cur;
+  ensure(mem_calloc(
+      (void *)&cur, sizeof(cleanup_callback_t) + size_of_state));
+  memcpy(cur->state, state_to_copy, size_of_state);
+  cur->func = action;
+  cur->next = *head;
+  *head     = cur;
+  return success();
+}
+// end::txn_register_cleanup_action[]
+
+// tag::txn_alloc_temp[]
+implementation_detail result_t txn_alloc_temp(
+    txn_t *tx, size_t min_size, void **buffer) {
+  if (tx->state->tmp.buffer.size < min_size) {
+    tx->state->tmp.buffer.size = next_power_of_two(min_size);
+    ensure(mem_realloc(
+        &tx->state->tmp.buffer.address, tx->state->tmp.buffer.size));
+  }
+  *buffer = tx->state->tmp.buffer.address;
+  return success();
+}
+// end::txn_alloc_temp[]
\ No newline at end of file
@@ -0,0 +1,274 @@
+#include <errno.h>
+#include <gavran/db.h>
+#include <gavran/internal.h>
+#include <pthread.h>
+#include <string.h>
+
+// an idle reader doesn't hold back write back or reclamation
+#define TXN_READER_IDLE UINT64_MAX
+#define TXN_READERS_PER_BLOCK (PAGE_ALIGNMENT / 64 - 1)
+
+// tag::txn_reader_t[]
+// each reader has a cache line of its own, written only by the
+// thread running the read txn and read by the gc
+struct txn_reader {
+  // the epoch the txn entered at, guards freeing memory
+  uint64_t epoch;
+  // the snapshot the txn reads, guards writing pages to the file
+  uint64_t tx_id;
+  uint32_t owned;
+  uint8_t padding[44];
+};
+_Static_assert(sizeof(txn_reader_t) == 64,
+    "A reader must take exactly one cache line");
+
+typedef struct txn_readers_block {
+  struct txn_readers_block *next;
+  uint8_t padding[56];
+  txn_reader_t readers[TXN_READERS_PER_BLOCK];
+} txn_readers_block_t;
+_Static_assert(sizeof(txn_readers_block_t) == PAGE_ALIGNMENT,
+    "A readers block must take exactly one page");
+// end::txn_reader_t[]
+
+// tag::txn_epoch_t[]
+struct txn_epoch {
+  // guards the txn chain, write back & reclamation. The write txn
+  // takes it, read txns only try to if they held back the gc
+  pthread_mutex_t lock;
+  // bumped by the gc, txns only load it
+  uint64_t epoch;
+  // the db address may be reused after it is closed, the id isn't
+  uint64_t id;
+  // blocks are only added, never removed while the db is open
+  txn_readers_block_t *blocks;
+  // unlinked states, newest first, waiting for the txns that may
+  // still be looking at them
+  txn_state_t *retired;
+  // same, for other structures read txns search without a lock
+  txn_retired_t *retired_memory;
+};
+
+// <1>
+// a thread usually runs one read txn at a time on a db, so it keeps
+// its reader around instead of searching the blocks for a free one
+static _Thread_local struct {
+  uint64_t id;
+  txn_reader_t *reader;
+} txn_reader_cache;
+static uint64_t txn_epoch_next_id;
+// end::txn_epoch_t[]
+
+// tag::txn_epoch_create[]
+implementation_detail result_t txn_epoch_create(db_state_t *db) {
+  txn_epoch_t *e;
+  ensure(mem_calloc((void *)&e, sizeof(txn_epoch_t)));
+  int rc = pthread_mutex_init(&e->lock, 0);
+  if (rc) {
+    free(e);
+    failed(rc, msg("Unable to create the txn chain lock"));
+  }
+  e->id = __atomic_add_fetch(&txn_epoch_next_id, 1, __ATOMIC_RELAXED);
+  db->epoch = e;
+  return success();
+}
+
+implementation_detail void txn_epoch_destroy(db_state_t *db) {
+  txn_epoch_t *e = db->epoch;
+  if (!e) return;
+  // no txns are running at this point
+  while (e->retired) {
+    txn_state_t *cur = e->retired;
+    e->retired       = cur->next_tx;
+    txn_free_single_tx_state(cur);
+  }
+  while (e->retired_memory) {
+    txn_retired_t *cur = e->retired_memory;
+    e->retired_memory  = cur->next;
+    free(cur);
+  }
+  while (e->blocks) {
+    txn_readers_block_t *cur = e->blocks;
+    e->blocks                = cur->next;
+    free(cur);
+  }
+  if (txn_reader_cache.id == e->id) txn_reader_cache.reader = 0;
+  pthread_mutex_destroy(&e->lock);
+  free(e);
+  db->epoch = 0;
+}
+// end::txn_epoch_create[]
+
+implementation_detail void txn_epoch_lock(db_state_t *db) {
+  pthread_mutex_lock(&db->epoch->lock);
+}
+
+implementation_detail bool txn_epoch_trylock(db_state_t *db) {
+  return !pthread_mutex_trylock(&db->epoch->lock);
+}
+
+implementation_detail void txn_epoch_unlock(db_state_t *db) {
+  pthread_mutex_unlock(&db->epoch->lock);
+}
+
+// tag::txn_epoch_claim_reader[]
+static result_t txn_epoch_claim_reader(
+    txn_epoch_t *e, txn_reader_t **reader) {
+  txn_readers_block_t *block =
+      __atomic_load_n(&e->blocks, __ATOMIC_ACQUIRE);
+  for (; block; block = block->next) {
+    for (size_t i = 0; i < TXN_READERS_PER_BLOCK; i++) {
+      txn_reader_t *r = &block->readers[i];
+      uint32_t unowned = 0;
+      if (!__atomic_load_n(&r->owned, __ATOMIC_RELAXED) &&
+          __atomic_compare_exchange_n(&r->owned, &unowned, 1, false,
+              __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        *reader = r;
+        return success();
+      }
+    }
+  }
+  // <1>
+  // all taken, the new block is published with its first reader
+  // already claimed by us
+  ensure(mem_alloc_page_aligned(
+      (void *)&block, sizeof(txn_readers_block_t)));
+  memset(block, 0, sizeof(txn_readers_block_t));
+  for (size_t i = 0; i < TXN_READERS_PER_BLOCK; i++) {
+    block->readers[i].epoch = TXN_READER_IDLE;
+    block->readers[i].tx_id = TXN_READER_IDLE;
+  }
+  block->readers[0].owned = 1;
+  block->next = __atomic_load_n(&e->blocks, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&e->blocks, &block->next,
+      block, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+  }
+  *reader = &block->readers[0];
+  return success();
+}
+// end::txn_epoch_claim_reader[]
+
+// tag::txn_epoch_enter[]
+implementation_detail result_t txn_epoch_enter(
+    db_state_t *db, txn_reader_t **reader) {
+  txn_epoch_t *e = db->epoch;
+  if (txn_reader_cache.reader && txn_reader_cache.id == e->id) {
+    *reader                 = txn_reader_cache.reader;
+    txn_reader_cache.reader = 0;
+  } else {
+    ensure(txn_epoch_claim_reader(e, reader));
+  }
+  // <1>
+  // nothing retired from now on will be freed until we exit
+  __atomic_store_n(&(*reader)->epoch,
+      __atomic_load_n(&e->epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+  return success();
+}
+
+implementation_detail txn_state_t *txn_epoch_pin(
+    db_state_t *db, txn_reader_t *reader) {
+  while (true) {
+    txn_state_t *state =
+        __atomic_load_n(&db->last_write_tx, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&reader->tx_id, state->tx_id, __ATOMIC_SEQ_CST);
+    // <2>
+    // if the gc moved past this state before it saw our snapshot, it
+    // may be writing newer pages to the file, try again
+    txn_state_t *latest =
+        __atomic_load_n(&db->last_write_tx, __ATOMIC_SEQ_CST);
+    if (state == latest) return state;
+  }
+}
+
+implementation_detail void txn_epoch_exit(
+    db_state_t *db, txn_reader_t *reader) {
+  __atomic_store_n(&reader->tx_id, TXN_READER_IDLE, __ATOMIC_RELEASE);
+  __atomic_store_n(&reader->epoch, TXN_READER_IDLE, __ATOMIC_RELEASE);
+  // <3>
+  // the cache holds a single reader, keeping one of another db
+  if (!txn_reader_cache.reader) {
+    txn_reader_cache.id     = db->epoch->id;
+    txn_reader_cache.reader = reader;
+    return;
+  }
+  __atomic_store_n(&reader->owned, 0, __ATOMIC_RELEASE);
+}
+// end::txn_epoch_enter[]
+
+// tag::txn_epoch_oldest[]
+static uint64_t txn_epoch_oldest(txn_epoch_t *e, bool tx_id) {
+  uint64_t oldest = TXN_READER_IDLE;
+  for (txn_readers_block_t *block =
+           __atomic_load_n(&e->blocks, __ATOMIC_ACQUIRE);
+       block; block = block->next) {
+    for (size_t i = 0; i < TXN_READERS_PER_BLOCK; i++) {
+      txn_reader_t *r = &block->readers[i];
+      uint64_t value  = __atomic_load_n(
+          tx_id ? &r->tx_id : &r->epoch, __ATOMIC_SEQ_CST);
+      oldest = MIN(oldest, value);
+    }
+  }
+  return oldest;
+}
+
+implementation_detail uint64_t txn_epoch_oldest_reader(
+    db_state_t *db) {
+  return txn_epoch_oldest(db->epoch, true);
+}
+// end::txn_epoch_oldest[]
+
+// tag::txn_epoch_retire[]
+implementation_detail void txn_epoch_retire(
+    db_state_t *db, txn_state_t *state) {
+  txn_epoch_t *e = db->epoch;
+  // <1>
+  // the state is already unlinked, so only txns that entered by now
+  // may have a reference to it
+  state->epoch   = e->epoch;
+  state->next_tx = e->retired;
+  e->retired     = state;
+}
+
+implementation_detail void txn_epoch_retire_memory(
+    db_state_t *db, txn_retired_t *memory) {
+  txn_epoch_t *e    = db->epoch;
+  memory->epoch     = e->epoch;
+  memory->next      = e->retired_memory;
+  e->retired_memory = memory;
+}
+
+implementation_detail void txn_epoch_reclaim(db_state_t *db) {
+  txn_epoch_t *e = db->epoch;
+  if (!e->retired && !e->retired_memory) return;
+  // <2>
+  // txns entering from now on can't reach the retired states, a
+  // single bump covers the whole batch
+  if ((e->retired && e->retired->epoch == e->epoch) ||
+      (e->retired_memory && e->retired_memory->epoch == e->epoch)) {
+    __atomic_store_n(&e->epoch, e->epoch + 1, __ATOMIC_SEQ_CST);
+  }
+  uint64_t oldest = txn_epoch_oldest(e, false);
+  txn_retired_t **mem = &e->retired_memory;
+  while (*mem && (*mem)->epoch >= oldest) {
+    mem = &(*mem)->next;
+  }
+  while (*mem) {
+    txn_retired_t *next = (*mem)->next;
+    free(*mem);
+    *mem = next;
+  }
+  // <3>
+  // the retired lists are sorted by epoch, newest first
+  txn_state_t **prev = &e->retired;
+  while (*prev && (*prev)->epoch >= oldest) {
+    prev = &(*prev)->next_tx;
+  }
+  txn_state_t *cur = *prev;
+  *prev            = 0;
+  while (cur) {
+    txn_state_t *next = cur->next_tx;
+    txn_free_single_tx_state(cur);
+    cur = next;
+  }
+}
+// end::txn_epoch_retire[]
@@ -0,0 +1,250 @@
+#include <errno.h>
+#include <gavran/db.h>
+#include <gavran/internal.h>
+#include <string.h>
+
+// tag::txn_savepoint_t[]
+struct txn_savepoint {
+  txn_savepoint_t *prev;
+  // <1>
+  // the pages modified since the savepoint, previous is a copy of
+  // the page as it was at the savepoint, or null if it wasn't
+  // modified by the txn yet
+  pages_map_t *pages;
+  uint64_t number_of_pages;
+};
+// end::txn_savepoint_t[]
+
+// tag::txn_savepoint_free[]
+static void txn_savepoint_free_buffer(
+    txn_state_t *state, page_t *page, void *buffer) {
+  if (state->flags & db_flags_encrypted) {
+    sodium_memzero(buffer, page->number_of_pages * PAGE_SIZE);
+  }
+  pages_pool_free(state->db, page->number_of_pages, buffer);
+}
+
+static void txn_savepoint_clear(
+    txn_state_t *state, txn_savepoint_t *sp) {
+  size_t iter_state = 0;
+  page_t *p;
+  while (pagesmap_get_next(sp->pages, &iter_state, &p)) {
+    if (p->previous) txn_savepoint_free_buffer(state, p, p->previous);
+  }
+  memset(sp->pages->entries, 0,
+      sp->pages->number_of_buckets * sizeof(page_t));
+  sp->pages->count           = 0;
+  sp->pages->resize_required = 0;
+}
+
+static void txn_savepoint_pop(txn_state_t *state) {
+  txn_savepoint_t *sp = state->savepoints;
+  txn_savepoint_clear(state, sp);
+  state->savepoints = sp->prev;
+  free(sp->pages);
+  free(sp);
+}
+
+implementation_detail void txn_savepoint_free_all(
+    txn_state_t *state) {
+  while (state->savepoints) txn_savepoint_pop(state);
+}
+// end::txn_savepoint_free[]
+
+// tag::txn_savepoint[]
+result_t txn_savepoint(txn_t *tx, txn_savepoint_t **savepoint) {
+  errors_assert_empty();
+  ensure((tx->state->flags & TX_WRITE) &&
+             !(tx->state->flags & TX_COMMITED),
+      msg("Savepoints can only be used by uncommitted write "
+          "transactions"),
+      with(tx->state->flags, "%d"));
+  txn_savepoint_t *sp;
+  ensure(mem_calloc((void *)&sp, sizeof(txn_savepoint_t)));
+  size_t done = 0;
+  try_defer(free, sp, done);
+  ensure(pagesmap_new(8, &sp->pages));
+  sp->number_of_pages   = tx->state->number_of_pages;
+  sp->prev              = tx->state->savepoints;
+  tx->state->savepoints = sp;
+  *savepoint            = sp;
+  done                  = 1;
+  return success();
+}
+
+implementation_detail result_t txn_savepoint_record(
+    txn_t *tx, page_t *page, bool new_page) {
+  txn_savepoint_t *sp = tx->state->savepoints;
+  page_t saved        = {.page_num = page->page_num};
+  // <1>
+  // only the first change after the savepoint is recorded
+  if (pagesmap_lookup(sp->pages, &saved)) return success();
+  saved.address         = page->address;
+  saved.number_of_pages = page->number_of_pages;
+  size_t done           = 0;
+  page_buffer_t copy    = {
+      .db = tx->state->db, .number_of_pages = page->number_of_pages};
+  try_defer(pages_pool_free_buffer, copy, done);
+  if (!new_page) {
+    ensure(pages_pool_alloc(
+        copy.db, copy.number_of_pages, &copy.address));
+    memcpy(copy.address, page->address,
+        page->number_of_pages * PAGE_SIZE);
+    saved.previous = copy.address;
+  }
+  ensure(pagesmap_put_new(&sp->pages, &saved));
+  done = 1;
+  return success();
+}
+// end::txn_savepoint[]
+
+// tag::txn_rollback_to[]
+static result_t txn_savepoint_find(
+    txn_state_t *state, txn_savepoint_t *savepoint) {
+  ensure(!(state->flags & TX_COMMITED),
+      msg("Cannot use a savepoint of a committed transaction"),
+      with(state->tx_id, "%lu"));
+  for (txn_savepoint_t *sp = state->savepoints; sp; sp = sp->prev) {
+    if (sp == savepoint) return success();
+  }
+  failed(EINVAL, msg("The savepoint isn't active in the transaction"),
+      with(state->tx_id, "%lu"));
+}
+
+static bool txn_savepoint_is_new(
+    txn_savepoint_t *sp, page_t *page) {
+  page_t saved = {.page_num = page->page_num};
+  return pagesmap_lookup(sp->pages, &saved) && !saved.previous;
+}
+
+static result_t txn_savepoint_undo(
+    txn_state_t *state, txn_savepoint_t *sp) {
+  size_t iter_state  = 0;
+  bool has_new_pages = false;
+  page_t *p;
+  while (!has_new_pages &&
+         pagesmap_get_next(sp->pages, &iter_state, &p)) {
+    has_new_pages = !p->previous;
+  }
+  if (has_new_pages) {
+    // <1>
+    // the pages map has no delete, the pages that are kept are moved
+    // to a new map of the same size, so it never needs to grow
+    pages_map_t *kept;
+    ensure(pagesmap_new(
+        state->modified_pages->number_of_buckets, &kept));
+    size_t done = 0;
+    try_defer(free, kept, done);
+    iter_state = 0;
+    while (
+        pagesmap_get_next(state->modified_pages, &iter_state, &p)) {
+      if (!txn_savepoint_is_new(sp, p)) {
+        ensure(pagesmap_put_new(&kept, p));
+      }
+    }
+    iter_state = 0;
+    while (
+        pagesmap_get_next(state->modified_pages, &iter_state, &p)) {
+      if (txn_savepoint_is_new(sp, p)) {
+        txn_savepoint_free_buffer(state, p, p->address);
+      }
+    }
+    free(state->modified_pages);
+    state->modified_pages = kept;
+    done                  = 1;
+  }
+  // <2>
+  // restoring in place, the modified pages keep their addresses
+  iter_state = 0;
+  while (pagesmap_get_next(sp->pages, &iter_state, &p)) {
+    if (!p->previous) continue;
+    page_t modified = {.page_num = p->page_num};
+    if (pagesmap_lookup(state->modified_pages, &modified)) {
+      if (modified.number_of_pages != p->number_of_pages) {
+        ensure(txn_resize_modified_page(
+            state, &modified, p->number_of_pages));
+      }
+      memcpy(modified.address, p->previous,
+          p->number_of_pages * PAGE_SIZE);
+    }
+  }
+  txn_savepoint_clear(state, sp);
+  state->number_of_pages = sp->number_of_pages;
+  free_space_index_discard(state);
+  free_space_extents_discard(state);
+  return success();
+}
+
+result_t txn_rollback_to(txn_t *tx, txn_savepoint_t *savepoint) {
+  errors_assert_empty();
+  ensure(txn_savepoint_find(tx->state, savepoint));
+  // <3>
+  // from the innermost savepoint out, so a page that changed after
+  // several of them ends up as it was at the oldest one
+  while (tx->state->savepoints != savepoint) {
+    ensure(txn_savepoint_undo(tx->state, tx->state->savepoints));
+    txn_savepoint_pop(tx->state);
+  }
+  ensure(txn_savepoint_undo(tx->state, savepoint));
+  return success();
+}
+// end::txn_rollback_to[]
+
+// tag::txn_release_savepoint[]
+static result_t txn_savepoint_ensure_capacity(
+    pages_map_t **pages, size_t additional) {
+  size_t required = (*pages)->count + additional;
+  if (required <= (*pages)->number_of_buckets * 3 / 4) {
+    return success();
+  }
+  pages_map_t *bigger;
+  ensure(pagesmap_new(next_power_of_two(required * 2), &bigger));
+  size_t done = 0;
+  try_defer(free, bigger, done);
+  size_t iter_state = 0;
+  page_t *p;
+  while (pagesmap_get_next(*pages, &iter_state, &p)) {
+    ensure(pagesmap_put_new(&bigger, p));
+  }
+  free(*pages);
+  *pages = bigger;
+  done   = 1;
+  return success();
+}
+
+static result_t txn_savepoint_merge(txn_state_t *state) {
+  txn_savepoint_t *sp     = state->savepoints;
+  txn_savepoint_t *parent = sp->prev;
+  if (parent) {
+    // <1>
+    // once there is room for all of them, moving the pages can't
+    // fail midway
+    ensure(txn_savepoint_ensure_capacity(
+        &parent->pages, sp->pages->count));
+    size_t iter_state = 0;
+    page_t *p;
+    while (pagesmap_get_next(sp->pages, &iter_state, &p)) {
+      page_t existing = {.page_num = p->page_num};
+      // <2>
+      // the parent has an older copy, or knows the page is new
+      if (pagesmap_lookup(parent->pages, &existing)) continue;
+      ensure(pagesmap_put_new(&parent->pages, p));
+      p->previous = 0;
+    }
+  }
+  txn_savepoint_pop(state);
+  return success();
+}
+
+result_t txn_release_savepoint(
+    txn_t *tx, txn_savepoint_t *savepoint) {
+  errors_assert_empty();
+  ensure(txn_savepoint_find(tx->state, savepoint));
+  bool done = false;
+  while (!done) {
+    done = tx->state->savepoints == savepoint;
+    ensure(txn_savepoint_merge(tx->state));
+  }
+  return success();
+}
+// end::txn_release_savepoint[]
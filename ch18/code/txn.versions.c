@@ -0,0 +1,132 @@
+#include <errno.h>
+#include <gavran/db.h>
+#include <gavran/internal.h>
+#include <string.h>
+
+// tag::txn_versions_t[]
+typedef struct txn_version {
+  page_t page;
+  uint64_t tx_id;
+  struct txn_version *next;
+} txn_version_t;
+
+struct txn_versions {
+  // the table is replaced when it is full, read txns may still be
+  // searching the old one
+  txn_retired_t retired;
+  // a power of two, for both the buckets & the versions
+  size_t capacity;
+  // <1>
+  // versions are handed out in commit order, so those already in
+  // the file are always the ones in [0, first_live)
+  size_t first_live;
+  size_t used;
+  txn_version_t **buckets;
+  txn_version_t *versions;
+};
+// end::txn_versions_t[]
+
+// tag::txn_versions_lookup[]
+implementation_detail bool txn_versions_lookup(db_state_t *db,
+    uint64_t tx_id, page_t *page, uint64_t *version) {
+  txn_versions_t *t =
+      __atomic_load_n(&db->versions, __ATOMIC_ACQUIRE);
+  if (!t) return false;
+  txn_version_t *v = __atomic_load_n(
+      &t->buckets[page->page_num & (t->capacity - 1)],
+      __ATOMIC_ACQUIRE);
+  // <1>
+  // each bucket is sorted by tx id, newest first, the first match
+  // is the version the txn should see
+  for (; v; v = __atomic_load_n(&v->next, __ATOMIC_ACQUIRE)) {
+    if (v->page.page_num == page->page_num && v->tx_id <= tx_id) {
+      memcpy(page, &v->page, sizeof(page_t));
+      *version = v->tx_id;
+      return true;
+    }
+  }
+  return false;
+}
+// end::txn_versions_lookup[]
+
+// tag::txn_versions_publish[]
+static void txn_versions_add(
+    txn_versions_t *t, page_t *page, uint64_t tx_id) {
+  txn_version_t *v = &t->versions[t->used++];
+  memcpy(&v->page, page, sizeof(page_t));
+  v->tx_id = tx_id;
+  txn_version_t **bucket =
+      &t->buckets[page->page_num & (t->capacity - 1)];
+  v->next = *bucket;
+  __atomic_store_n(bucket, v, __ATOMIC_RELEASE);
+}
+
+implementation_detail void txn_versions_publish(
+    db_state_t *db, txn_state_t *state) {
+  // <1>
+  // the space was reserved before the txn was written to the WAL
+  txn_versions_t *t = db->versions;
+  size_t iter_state = 0;
+  page_t *p;
+  while (pagesmap_get_next(state->modified_pages, &iter_state, &p)) {
+    txn_versions_add(t, p, state->tx_id);
+  }
+}
+// end::txn_versions_publish[]
+
+// tag::txn_versions_reserve[]
+implementation_detail result_t txn_versions_reserve(
+    db_state_t *db, size_t count) {
+  txn_versions_t *old = db->versions;
+  if (old && old->used + count <= old->capacity) return success();
+  size_t live     = old ? old->used - old->first_live : 0;
+  size_t capacity = next_power_of_two(MAX(64, (live + count) * 2));
+  // <1>
+  // a single allocation, so it can be retired as a unit
+  txn_versions_t *t;
+  ensure(mem_calloc((void *)&t,
+      sizeof(txn_versions_t) + capacity * sizeof(txn_version_t *) +
+          capacity * sizeof(txn_version_t)));
+  t->capacity = capacity;
+  t->buckets  = (txn_version_t **)(t + 1);
+  t->versions = (txn_version_t *)(t->buckets + capacity);
+  // <2>
+  // copied in commit order, keeping the buckets sorted
+  for (size_t i = old ? old->first_live : 0; old && i < old->used;
+       i++) {
+    txn_version_t *v = &old->versions[i];
+    txn_versions_add(t, &v->page, v->tx_id);
+  }
+  __atomic_store_n(&db->versions, t, __ATOMIC_RELEASE);
+  if (old) txn_epoch_retire_memory(db, &old->retired);
+  return success();
+}
+// end::txn_versions_reserve[]
+
+// tag::txn_versions_release[]
+implementation_detail void txn_versions_release(
+    db_state_t *db, txn_state_t *state) {
+  // <1>
+  // states are released oldest first, once their pages are in the
+  // file, so their versions are at the end of their buckets
+  txn_versions_t *t = db->versions;
+  size_t iter_state = 0;
+  page_t *p;
+  while (pagesmap_get_next(state->modified_pages, &iter_state, &p)) {
+    txn_version_t **v =
+        &t->buckets[p->page_num & (t->capacity - 1)];
+    while (*v && (*v)->tx_id > state->tx_id) {
+      v = &(*v)->next;
+    }
+    // read txns may still be going over the rest, they'll find the
+    // pages in the file from now on
+    __atomic_store_n(v, 0, __ATOMIC_RELEASE);
+  }
+  t->first_live += state->modified_pages->count;
+}
+
+implementation_detail void txn_versions_destroy(db_state_t *db) {
+  free(db->versions);
+  db->versions = 0;
+}
+// end::txn_versions_release[]
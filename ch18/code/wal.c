@@ -0,0 +1,1478 @@
+#include <gavran/db.h>
+#include <gavran/internal.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include <sodium.h>
+#include <string.h>
+#include <zstd.h>
+
+// tag::wal_txn_t[]
+enum wal_txn_page_flags {
+  wal_txn_page_flags_none = 0,
+  wal_txn_page_flags_diff = 1,
+};
+
+typedef struct wal_txn_page {
+  uint64_t page_num;
+  uint64_t offset;
+  uint32_t number_of_pages;
+  uint32_t flags;
+} wal_txn_page_t;
+
+enum wal_txn_flags {
+  wal_txn_flags_none       = 0,
+  wal_txn_flags_compressed = 1,
+  // hash_blake2b holds a CRC32C, see page_checksum_t
+  wal_txn_flags_crc32c = 2,
+};
+
+typedef struct wal_txn {
+  uint8_t hash_blake2b[32];
+  uint64_t tx_id;
+  uint64_t page_aligned_tx_size;
+  uint64_t tx_size;
+  uint64_t number_of_modified_pages;
+  uint64_t total_number_of_pages_in_database;
+  enum wal_txn_flags flags;
+  // 0 if compressed without a dictionary
+  uint32_t dictionary_page;
+  wal_txn_page_t pages[];
+} wal_txn_t;
+// end::wal_txn_t[]
+
+// tag::wal_page_diff[]
+typedef struct wal_page_diff {
+  uint32_t offset;
+  int32_t length;  // negative means zero filled
+} wal_page_diff_t;
+// end::wal_page_diff[]
+
+// tag::wal_apply_diff[]
+static void *wal_apply_diff(
+    void *input, void *input_end, page_t *page) {
+  wal_page_diff_t diff;
+  while (input < input_end) {
+    memcpy(&diff, input, sizeof(wal_page_diff_t));
+    input += sizeof(wal_page_diff_t);
+    if (diff.length < 0) {
+      memset(page->address + diff.offset, 0, (size_t)(-diff.length));
+    } else {
+      memcpy(page->address + diff.offset, input, (size_t)diff.length);
+      input += diff.length;
+    }
+  }
+  return input;
+}
+// end::wal_apply_diff[]
+
+// tag::wal_diff_scan[]
+// each scan returns the first index in [i, end) matching its
+// condition, or end if there is none
+typedef struct wal_diff_kernel {
+  size_t (*find_mismatch)(const uint64_t *restrict origin,
+      const uint64_t *restrict modified, size_t i, size_t end);
+  size_t (*find_match)(const uint64_t *restrict origin,
+      const uint64_t *restrict modified, size_t i, size_t end);
+  size_t (*find_nonzero)(
+      const uint64_t *restrict modified, size_t i, size_t end);
+} wal_diff_kernel_t;
+
+static size_t wal_diff_find_mismatch_scalar(
+    const uint64_t *restrict origin,
+    const uint64_t *restrict modified, size_t i, size_t end) {
+  while (i < end && origin[i] == modified[i]) i++;
+  return i;
+}
+
+static size_t wal_diff_find_match_scalar(
+    const uint64_t *restrict origin,
+    const uint64_t *restrict modified, size_t i, size_t end) {
+  while (i < end && origin[i] != modified[i]) i++;
+  return i;
+}
+
+static size_t wal_diff_find_nonzero_scalar(
+    const uint64_t *restrict modified, size_t i, size_t end) {
+  while (i < end && modified[i] == 0) i++;
+  return i;
+}
+
+static const wal_diff_kernel_t wal_diff_kernel_scalar = {
+    .find_mismatch = wal_diff_find_mismatch_scalar,
+    .find_match    = wal_diff_find_match_scalar,
+    .find_nonzero  = wal_diff_find_nonzero_scalar,
+};
+// end::wal_diff_scan[]
+
+#if defined(__x86_64__)
+// tag::wal_diff_scan_sse2[]
+// SSE2 is always available on x86_64, 16 bytes per compare
+static size_t wal_diff_find_mismatch_sse2(
+    const uint64_t *restrict origin,
+    const uint64_t *restrict modified, size_t i, size_t end) {
+  for (; i + 4 <= end; i += 4) {
+    __m128i a = _mm_cmpeq_epi32(
+        _mm_loadu_si128((const void *)(origin + i)),
+        _mm_loadu_si128((const void *)(modified + i)));
+    __m128i b = _mm_cmpeq_epi32(
+        _mm_loadu_si128((const void *)(origin + i + 2)),
+        _mm_loadu_si128((const void *)(modified + i + 2)));
+    if (_mm_movemask_epi8(_mm_and_si128(a, b)) != 0xFFFF) break;
+  }
+  return wal_diff_find_mismatch_scalar(origin, modified, i, end);
+}
+
+static size_t wal_diff_find_nonzero_sse2(
+    const uint64_t *restrict modified, size_t i, size_t end) {
+  __m128i zero = _mm_setzero_si128();
+  for (; i + 4 <= end; i += 4) {
+    __m128i v = _mm_or_si128(
+        _mm_loadu_si128((const void *)(modified + i)),
+        _mm_loadu_si128((const void *)(modified + i + 2)));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(v, zero)) != 0xFFFF)
+      break;
+  }
+  return wal_diff_find_nonzero_scalar(modified, i, end);
+}
+
+static const wal_diff_kernel_t wal_diff_kernel_sse2 = {
+    .find_mismatch = wal_diff_find_mismatch_sse2,
+    // changed runs are usually short, not worth vectorizing
+    .find_match   = wal_diff_find_match_scalar,
+    .find_nonzero = wal_diff_find_nonzero_sse2,
+};
+// end::wal_diff_scan_sse2[]
+
+// tag::wal_diff_scan_avx2[]
+// 64 bytes per iteration, only called if the CPU supports it
+__attribute__((target("avx2"))) static size_t
+wal_diff_find_mismatch_avx2(const uint64_t *restrict origin,
+    const uint64_t *restrict modified, size_t i, size_t end) {
+  for (; i + 8 <= end; i += 8) {
+    __m256i a = _mm256_cmpeq_epi64(
+        _mm256_loadu_si256((const void *)(origin + i)),
+        _mm256_loadu_si256((const void *)(modified + i)));
+    __m256i b = _mm256_cmpeq_epi64(
+        _mm256_loadu_si256((const void *)(origin + i + 4)),
+        _mm256_loadu_si256((const void *)(modified + i + 4)));
+    if (_mm256_movemask_epi8(_mm256_and_si256(a, b)) != -1) break;
+  }
+  return wal_diff_find_mismatch_scalar(origin, modified, i, end);
+}
+
+__attribute__((target("avx2"))) static size_t
+wal_diff_find_match_avx2(const uint64_t *restrict origin,
+    const uint64_t *restrict modified, size_t i, size_t end) {
+  for (; i + 4 <= end; i += 4) {
+    __m256i eq = _mm256_cmpeq_epi64(
+        _mm256_loadu_si256((const void *)(origin + i)),
+        _mm256_loadu_si256((const void *)(modified + i)));
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(eq);
+    if (mask) return i + (size_t)__builtin_ctz(mask) / 8;
+  }
+  return wal_diff_find_match_scalar(origin, modified, i, end);
+}
+
+__attribute__((target("avx2"))) static size_t
+wal_diff_find_nonzero_avx2(
+    const uint64_t *restrict modified, size_t i, size_t end) {
+  for (; i + 8 <= end; i += 8) {
+    __m256i v = _mm256_or_si256(
+        _mm256_loadu_si256((const void *)(modified + i)),
+        _mm256_loadu_si256((const void *)(modified + i + 4)));
+    if (!_mm256_testz_si256(v, v)) break;
+  }
+  return wal_diff_find_nonzero_scalar(modified, i, end);
+}
+
+static const wal_diff_kernel_t wal_diff_kernel_avx2 = {
+    .find_mismatch = wal_diff_find_mismatch_avx2,
+    .find_match    = wal_diff_find_match_avx2,
+    .find_nonzero  = wal_diff_find_nonzero_avx2,
+};
+// end::wal_diff_scan_avx2[]
+
+static const wal_diff_kernel_t *wal_diff_select_kernel(void) {
+  if (__builtin_cpu_supports("avx2")) return &wal_diff_kernel_avx2;
+  return &wal_diff_kernel_sse2;
+}
+#else
+static const wal_diff_kernel_t *wal_diff_select_kernel(void) {
+  return &wal_diff_kernel_scalar;
+}
+#endif
+
+// tag::wal_diff_page[]
+static void *wal_diff_page_using(const wal_diff_kernel_t *k,
+    uint64_t *restrict origin, uint64_t *restrict modified,
+    size_t size, void *output) {
+  if (!origin) {  // no previous definition
+    memcpy(output, modified, size * sizeof(uint64_t));
+    return output + (size * sizeof(uint64_t));
+  }
+  void *current = output;
+  void *end     = output + size * sizeof(uint64_t);
+  size_t i = k->find_mismatch(origin, modified, 0, size);
+  while (i < size) {
+    size_t diff_start = i;
+    // single diff size limited to 8MB
+    size_t limit = MIN(size, diff_start + 1024 * 1024);
+    // <1>
+    // zero filled ranges are extended over unchanged words as well
+    i           = k->find_nonzero(modified, i, limit);
+    bool zeroes = i == limit;
+    if (!zeroes && origin[i] != modified[i]) {
+      i = k->find_match(origin, modified, i, limit);
+    }
+    void *required_write = current + sizeof(wal_page_diff_t);
+    wal_page_diff_t diff = {
+        .offset = (uint32_t)(diff_start * sizeof(uint64_t)),
+        .length = (int32_t)((i - diff_start) * sizeof(uint64_t))};
+    if (zeroes) {
+      diff.length = -diff.length;  // indicates zero fill
+    } else {
+      required_write += diff.length;
+    }
+    if (required_write >= end) {
+      memcpy(output, modified, size * sizeof(uint64_t));
+      return end;
+    }
+    memcpy(current, &diff, sizeof(wal_page_diff_t));
+    current += sizeof(wal_page_diff_t);
+    if (diff.length > 0) {
+      memcpy(current, modified + diff_start, (size_t)diff.length);
+      current += diff.length;
+    }
+    // <2>
+    i = k->find_mismatch(origin, modified, i, size);
+  }
+
+  return current;
+}
+
+static void *wal_diff_page(uint64_t *restrict origin,
+    uint64_t *restrict modified, size_t size, void *output) {
+  return wal_diff_page_using(
+      wal_diff_select_kernel(), origin, modified, size, output);
+}
+// end::wal_diff_page[]
+
+// tag::wal_diff_page_kernel[]
+// for gavran-bench, scalar forces the word at a time scan
+implementation_detail void *wal_diff_page_kernel(
+    uint64_t *restrict origin, uint64_t *restrict modified,
+    size_t size, void *output, bool scalar) {
+  const wal_diff_kernel_t *k =
+      scalar ? &wal_diff_kernel_scalar : wal_diff_select_kernel();
+  return wal_diff_page_using(k, origin, modified, size, output);
+}
+// end::wal_diff_page_kernel[]
+
+// tag::wal_setup_transaction_data[]
+static void *wal_setup_transaction_data(
+    txn_state_t *tx, wal_txn_t *wt, void *output) {
+  size_t iter_state = 0;
+  page_t *entry;
+  size_t index = 0;
+
+  while (pagesmap_get_next(tx->modified_pages, &iter_state, &entry)) {
+    wt->pages[index].number_of_pages = entry->number_of_pages;
+    wt->pages[index].page_num        = entry->page_num;
+    size_t size = wt->pages[index].number_of_pages * PAGE_SIZE;
+    void *end;
+    if (tx->db->options.flags & db_flags_encrypted) {
+      memcpy(output, entry->address, size);
+      end = output + size;
+    } else {
+      end = wal_diff_page(entry->previous, entry->address,
+          size / sizeof(uint64_t), output);
+    }
+    wt->pages[index].flags = (size == (size_t)(end - output))
+                                 ? wal_txn_page_flags_none
+                                 : wal_txn_page_flags_diff;
+    wt->pages[index].offset = (uint64_t)(output - (void *)wt);
+    output                  = end;
+    index++;
+  }
+  return output;
+}
+// end::wal_setup_transaction_data[]
+
+// tag::wal_compress_transaction[]
+// only a single thread seals records at any given time, so the
+// compression context & buffer can be shared
+static void *wal_compress_transaction(
+    db_state_t *db, wal_txn_t *wt, void *start, void *end) {
+  // <1>
+  if (wt->tx_size < db->options.wal_compression_min_size) return end;
+  size_t input_size    = (size_t)(end - start);
+  size_t required_size = ZSTD_compressBound(input_size);
+  reusable_buffer_t *buffer = &db->wal_state.compression_buffer;
+  if (required_size > buffer->size) {
+    if (flopped(mem_realloc(&buffer->address, required_size))) {
+      // no memory, we'll skip compression
+      errors_clear();  // recoverable, so can clear it
+      return end;
+    }
+    buffer->size = required_size;
+  }
+  // <2>
+  wal_state_t *wal = &db->wal_state;
+  size_t res;
+  if (wal->compression_dictionary) {
+    res = ZSTD_compress_usingCDict(wal->compression_ctx,
+        buffer->address, required_size, start, input_size,
+        wal->compression_dictionary);
+  } else {
+    res = ZSTD_compressCCtx(wal->compression_ctx, buffer->address,
+        required_size, start, input_size,
+        db->options.wal_compression_level);
+  }
+  if (ZSTD_isError(res) || res >= input_size) {
+    // * we got an error, let's just return uncompressed
+    // * compressed bigger than input? skip it
+    return end;
+  }
+  wt->flags |= wal_txn_flags_compressed;
+  if (wal->compression_dictionary) {
+    wt->dictionary_page = (uint32_t)wal->compression_dictionary_page;
+  }
+  memcpy(start, buffer->address, res);
+  return start + res;
+}
+// end::wal_compress_transaction[]
+
+// tag::wal_prepare_txn_buffer[]
+static result_t wal_prepare_txn_buffer(
+    txn_state_t *tx, wal_txn_t **txn_buffer) {
+  uint64_t pages = tx->modified_pages->count;
+  // <1>
+  size_t tx_header_size =
+      sizeof(wal_txn_t) + pages * sizeof(wal_txn_page_t);
+  // <2>
+  // an entry may span many pages, a new one is written in full
+  uint64_t data_pages = 0;
+  size_t iter_state   = 0;
+  page_t *entry;
+  while (pagesmap_get_next(tx->modified_pages, &iter_state, &entry)) {
+    data_pages += entry->number_of_pages;
+  }
+  uint64_t total_size =
+      (TO_PAGES(tx_header_size) + data_pages) * PAGE_SIZE;
+  size_t cancel_defer = 0;
+  wal_txn_t *wt;
+  ensure(mem_alloc_page_aligned((void *)&wt, total_size));
+  try_defer(free, wt, cancel_defer);
+  memset(wt, 0, total_size);
+  wt->total_number_of_pages_in_database = tx->number_of_pages;
+  wt->number_of_modified_pages          = pages;
+  wt->tx_id                             = tx->tx_id;
+  void *end                             = wal_setup_transaction_data(
+      tx, wt, ((char *)wt) + tx_header_size);
+  wt->tx_size = (uint64_t)((char *)end - (char *)wt);
+
+  *txn_buffer  = wt;
+  cancel_defer = 1;
+  return success();
+}
+// end::wal_prepare_txn_buffer[]
+
+// tag::wal_seal_txn_buffer[]
+static result_t wal_seal_txn_buffer(
+    db_state_t *db, wal_txn_t *wt) {
+  void *end = (char *)wt + wt->tx_size;
+  if (!(db->options.flags & db_flags_encrypted)) {
+    wal_dictionary_add_sample(db, (char *)wt + sizeof(wal_txn_t),
+        wt->tx_size - sizeof(wal_txn_t));
+    end = wal_compress_transaction(
+        db, wt, (char *)wt + sizeof(wal_txn_t), end);
+  }
+  wt->tx_size              = (uint64_t)((char *)end - (char *)wt);
+  wt->page_aligned_tx_size = TO_PAGES(wt->tx_size) * PAGE_SIZE;
+  memset(((void *)wt) + wt->tx_size, 0,
+      wt->page_aligned_tx_size - wt->tx_size);
+
+  // <1>
+  // the flag is covered by the hash, recovery can trust it
+  if (db->options.page_checksum == page_checksum_crc32c)
+    wt->flags |= wal_txn_flags_crc32c;
+  const size_t size = CHECKSUM_BYTES;
+  ensure(checksum_compute(db->options.page_checksum,
+             (uint8_t *)wt + size, wt->page_aligned_tx_size - size,
+             wt->hash_blake2b),
+      msg("Unable to compute hash for transaction"),
+      with(wt->tx_id, "%lu"));
+  return success();
+}
+// end::wal_seal_txn_buffer[]
+
+// tag::wal_record_api[]
+implementation_detail result_t wal_prepare_record(
+    txn_state_t *tx, span_t *record) {
+  wal_txn_t *wt;
+  ensure(wal_prepare_txn_buffer(tx, &wt));
+  record->address = wt;
+  record->size    = wt->tx_size;
+  return success();
+}
+
+implementation_detail result_t wal_seal_record(
+    db_state_t *db, span_t *record) {
+  wal_txn_t *wt = record->address;
+  ensure(wal_seal_txn_buffer(db, wt));
+  record->size = wt->page_aligned_tx_size;
+  return success();
+}
+// end::wal_record_api[]
+
+static result_t wal_increase_file_size_if_needed(
+    wal_file_state_t *cur_file, uint64_t size_to_write) {
+  if (cur_file->last_write_pos + size_to_write >
+      cur_file->span.size) {
+    // we need to increase the WAL size
+    uint64_t wal_size =
+        cur_file->span.size +
+        MAX(next_power_of_two(cur_file->span.size / 10),
+            size_to_write * 2);
+    ensure(pal_set_file_size(cur_file->handle, wal_size, UINT64_MAX));
+    cur_file->span.size = wal_size;
+  }
+  return success();
+}
+
+// tag::wal_segment_for_write[]
+static wal_file_state_t *wal_segment_for_write(
+    wal_state_t *wal, uint64_t size_to_write) {
+  size_t cur_index       = wal->current_append_file_index;
+  size_t next_index      = (cur_index + 1) % wal->number_of_segments;
+  wal_file_state_t *cur  = &wal->files[cur_index];
+  wal_file_state_t *next = &wal->files[next_index];
+  if (!cur->last_write_pos ||
+      cur->last_write_pos + size_to_write <= cur->span.size)
+    return cur;
+  // <1>
+  // segments are used in order, so the next one is the oldest, if a
+  // reader still needs it, we have to grow the current one
+  if (next_index == cur_index || next->last_write_pos) return cur;
+  wal->current_append_file_index = next_index;
+  return next;
+}
+// end::wal_segment_for_write[]
+
+// tag::wal_write_records[]
+static result_t wal_write_records(
+    db_state_t *db, void *records, size_t size, uint64_t last_tx_id) {
+  wal_state_t *wal = &db->wal_state;
+  {
+    wal_writer_lock(db);
+    defer(wal_writer_unlock, db);
+    wal_file_state_t *cur_file = wal_segment_for_write(wal, size);
+    ensure(wal_increase_file_size_if_needed(cur_file, size));
+    // <1>
+    ensure(pal_write_file(
+        cur_file->handle, cur_file->last_write_pos, records, size));
+    cur_file->last_write_pos += size;
+    cur_file->last_tx_id = last_tx_id;
+    __atomic_store_n(
+        &wal->durable_tx_id, last_tx_id, __ATOMIC_RELEASE);
+  }
+  // <2>
+  if (db->options.wal_write_callback) {
+    void *end = records + size;
+    while (records < end) {
+      wal_txn_t *txn_buffer = records;
+      span_t wal_record     = {.address = txn_buffer,
+          .size = txn_buffer->page_aligned_tx_size};
+      db->options.wal_write_callback(
+          db->options.wal_write_callback_state, txn_buffer->tx_id,
+          &wal_record);
+      records += txn_buffer->page_aligned_tx_size;
+    }
+  }
+  return success();
+}
+// end::wal_write_records[]
+
+// tag::wal_group_commit[]
+implementation_detail result_t wal_add_pending(
+    db_state_t *db, span_t *record) {
+  wal_state_t *wal           = &db->wal_state;
+  reusable_buffer_t *pending = &wal->pending;
+  size_t required            = pending->used + record->size;
+  if (required > pending->size) {
+    // must remain page aligned, since the WAL is using O_DIRECT
+    size_t new_size = MAX(required, pending->size * 2);
+    void *buffer;
+    ensure(mem_alloc_page_aligned(&buffer, new_size));
+    memcpy(buffer, pending->address, pending->used);
+    free(pending->address);
+    pending->address = buffer;
+    pending->size    = new_size;
+  }
+  memcpy(pending->address + pending->used, record->address,
+      record->size);
+  pending->used = required;
+  wal->pending_txs++;
+  if (pending->used >= db->options.wal_group_commit_max_size ||
+      wal->pending_txs >= db->options.wal_group_commit_max_txs) {
+    ensure(wal_flush(db));
+  }
+  return success();
+}
+
+implementation_detail void wal_fail_pending(db_state_t *db) {
+  wal_state_t *wal  = &db->wal_state;
+  wal->pending.used = 0;
+  wal->pending_txs  = 0;
+  wal->failed       = true;
+}
+
+result_t wal_flush(db_state_t *db) {
+  wal_state_t *wal = &db->wal_state;
+  if (wal->failed) {
+    failed(EIO, msg("The WAL failed to write earlier transactions"));
+  }
+  if (!wal->pending_txs) return success();
+  wal_txn_t *last = wal->pending.address;
+  for (uint64_t i = 1; i < wal->pending_txs; i++) {
+    last = (void *)last + last->page_aligned_tx_size;
+  }
+  // a single write & durability barrier for all the pending txs
+  if (flopped(wal_write_records(db, wal->pending.address,
+          wal->pending.used, last->tx_id))) {
+    // <1>
+    // their callers are told that they failed, writing them later
+    // would make them durable anyway
+    wal_fail_pending(db);
+    failed(EIO,
+        msg("Unable to write pending transactions to the WAL"),
+        with(last->tx_id, "%lu"));
+  }
+  wal->pending.used = 0;
+  wal->pending_txs  = 0;
+  return success();
+}
+// end::wal_group_commit[]
+
+// tag::wal_append[]
+result_t wal_append(txn_state_t *tx) {
+  if (tx->db->wal_state.failed) {
+    failed(EIO, msg("The WAL failed, cannot commit transaction"),
+        with(tx->tx_id, "%lu"));
+  }
+  span_t record           = {0};
+  size_t skip_free_buffer = 0;
+  try_defer(free, record.address, skip_free_buffer);
+
+  // <1>
+  if (tx->flags & txn_flags_apply_log) {
+    skip_free_buffer      = 1;
+    wal_txn_t *txn_buffer = tx->shipped_wal_record;
+    record.address        = txn_buffer;
+    record.size           = txn_buffer->page_aligned_tx_size;
+  } else {
+    ensure(wal_prepare_record(tx, &record));
+    ensure(wal_seal_record(tx->db, &record));
+  }
+  // <2>
+  // group commits are written by the WAL writer, see txn_commit()
+  return wal_write_records(
+      tx->db, record.address, record.size, tx->tx_id);
+}
+// end::wal_append[]
+
+// tag::wal_recovery_operation[]
+typedef struct wal_recovery_record {
+  void *start;
+  wal_txn_t *tx;
+  ZSTD_DCtx *ctx;
+  reusable_buffer_t buffer;
+  bool failed;
+  uint8_t padding[7];
+} wal_recovery_record_t;
+
+typedef struct wal_recovery_operation {
+  db_t *db;
+  wal_state_t *wal;
+  // the segments with records, ordered by their first tx
+  wal_file_state_t *files[WAL_MAX_SEGMENTS];
+  size_t number_of_files;
+  size_t current_recovery_file_index;
+  void *start;
+  void *end;
+  uint64_t last_recovered_tx_id;
+  reusable_buffer_t tmp_buffer;
+  // only used for parallel recovery, records validated ahead
+  workers_t *workers;
+  wal_recovery_record_t *records;
+  // final page images, not yet written to the data file
+  pages_map_t **images;
+  size_t number_of_records;
+  size_t records_capacity;
+  size_t next_record;
+} wal_recovery_operation_t;
+// end::wal_recovery_operation[]
+
+static result_t wal_validate_transaction(db_t *db, ZSTD_DCtx *ctx,
+    reusable_buffer_t *buffer, void *start, void *end,
+    wal_txn_t **txn_p);
+
+// tag::wal_init_recover_state[]
+static void wal_init_recover_state(
+    db_t *db, wal_state_t *wal, wal_recovery_operation_t *state) {
+  memset(state, 0, sizeof(wal_recovery_operation_t));
+  state->db                   = db;
+  state->wal                  = wal;
+  state->last_recovered_tx_id = 0;
+
+  // <1>
+  // find the appropriate order to scan through the WAL segments
+  uint64_t tx_ids[WAL_MAX_SEGMENTS];
+  for (size_t i = 0; i < wal->number_of_segments; i++) {
+    void *start = wal->files[i].span.address;
+    void *end   = start + wal->files[i].span.size;
+    wal_txn_t *tx;
+    if (flopped(wal_validate_transaction(db, wal->decompression_ctx,
+            &state->tmp_buffer, start, end, &tx)) ||
+        !tx)
+      continue;
+    size_t pos = state->number_of_files++;
+    while (pos && tx_ids[pos - 1] > tx->tx_id) {
+      tx_ids[pos]       = tx_ids[pos - 1];
+      state->files[pos] = state->files[pos - 1];
+      pos--;
+    }
+    tx_ids[pos]       = tx->tx_id;
+    state->files[pos] = &wal->files[i];
+  }
+  errors_clear();  // errors expected, txs did not pass validation?
+  if (!state->number_of_files) {
+    return;  // nothing to do here, no need to recover
+  }
+  // <2>
+  // new records are appended after the most recent segment
+  wal->current_append_file_index =
+      (size_t)(state->files[state->number_of_files - 1] - wal->files);
+  state->start = state->files[0]->span.address;
+  state->end   = state->start + state->files[0]->span.size;
+}
+// end::wal_init_recover_state[]
+
+// tag::wal_validate_recovered_pages[]
+static result_t wal_validate_recovered_pages(
+    db_t *db, pages_map_t *modified_pages) {
+  size_t iter_state = 0;
+  page_t *page_to_validate;
+  while (pagesmap_get_next(
+      modified_pages, &iter_state, &page_to_validate)) {
+    txn_t rtx;
+    ensure(txn_create(db, TX_READ, &rtx));
+    defer(txn_close, rtx);
+    page_t p = {.page_num = page_to_validate->page_num};
+    ensure(txn_get_page(&rtx, &p));
+  }
+  return success();
+}
+// end::wal_validate_recovered_pages[]
+
+// tag::wal_range[]
+static result_t wal_get_next_range(
+    wal_recovery_operation_t *state, void **current, void **end) {
+  *end = state->end;
+  if (state->start >= state->end) {
+    *current = 0;
+    return success();
+  }
+  *current = state->start;
+  return success();
+}
+
+static void wal_increment_next_range_start(
+    wal_recovery_operation_t *state, size_t amount) {
+  state->start += amount;
+}
+// end::wal_range[]
+
+// tag::wal_validate_after_end_of_transactions[]
+static result_t wal_ensure_last_tx_id_is_set(
+    wal_recovery_operation_t *s) {
+  if (s->last_recovered_tx_id) return success();
+  txn_t rtx;  // nothing from WAL, load the db's last_tx_id
+  ensure(txn_create(s->db, TX_READ, &rtx));
+  defer(txn_close, rtx);
+  page_t page = {.page_num = 0};  // maybe new db, have to use raw API
+  ensure(txn_raw_get_page(&rtx, &page));
+  page_metadata_t *metadata = page.address;
+  s->last_recovered_tx_id   = metadata->file_header.last_tx_id;
+  return success();
+}
+static result_t wal_validate_after_end_of_transactions(
+    wal_recovery_operation_t *s) {
+  ensure(wal_ensure_last_tx_id_is_set(s));
+  while (true) {
+    void *cur, *end;
+    ensure(wal_get_next_range(s, &cur, &end));
+    if (!cur) break;
+    wal_txn_t *tx;
+    if (flopped(wal_validate_transaction(s->db,
+            s->wal->decompression_ctx, &s->tmp_buffer, cur, end,
+            &tx)) ||
+        !tx) {
+      errors_clear();  // errors are expected here
+      wal_increment_next_range_start(s, PAGE_SIZE);
+      continue;
+    }
+    if (s->last_recovered_tx_id > tx->tx_id) {
+      break;  // valid old tx, we had a WAL reset and can stop
+    }
+    wal_file_state_t *file =
+        s->files[s->current_recovery_file_index];
+    ssize_t corrupted_pos   = cur - file->span.address;
+    wal_txn_t *corrupted_tx = cur;
+    failed(ENODATA, msg("Valid TX after invalid TX"),
+        with(corrupted_pos, "%zd"), with(tx->tx_id, "%lu"),
+        with(corrupted_tx->tx_id, "%lu"),
+        with(s->db->state->last_tx_id, "%lu"));
+  }
+  return success();
+}
+// end::wal_validate_after_end_of_transactions[]
+
+// tag::wal_decompress_transaction[]
+static result_t wal_decompress_transaction(db_t *db, ZSTD_DCtx *ctx,
+    reusable_buffer_t *buffer, wal_txn_t *in, wal_txn_t **txp) {
+  // <1>
+  if (!(in->flags & wal_txn_flags_compressed)) {
+    *txp = in;
+    return success();
+  }
+  // <2>
+  size_t required_size =
+      ZSTD_getDecompressedSize((void *)in + sizeof(wal_txn_t),
+          in->tx_size - sizeof(wal_txn_t)) +
+      sizeof(wal_txn_t);
+  if (required_size > buffer->size) {
+    ensure(mem_realloc(&buffer->address, required_size));
+    buffer->size = required_size;
+  }
+  // <3>
+  ZSTD_DDict *ddict = 0;
+  if (in->dictionary_page) {
+    ensure(wal_dictionary_get(db, in->dictionary_page, &ddict));
+  }
+  size_t res = ZSTD_decompress_usingDDict(ctx,
+      buffer->address + sizeof(wal_txn_t),
+      required_size - sizeof(wal_txn_t),
+      (void *)in + sizeof(wal_txn_t), in->tx_size - sizeof(wal_txn_t),
+      ddict);
+  if (ZSTD_isError(res)) {
+    const char *zstd_error = ZSTD_getErrorName(res);
+    failed(ENODATA, msg("Failed to decompress transaction"),
+        with(in->tx_id, "%lu"), with(zstd_error, "%s"));
+  }
+  // <4>
+  memcpy(buffer->address, in, sizeof(wal_txn_t));
+  *txp            = buffer->address;
+  (*txp)->tx_size = buffer->used = res + sizeof(wal_txn_t);
+  return success();
+}
+// end::wal_decompress_transaction[]
+
+// tag::wal_validate_transaction[]
+static result_t wal_validate_transaction(db_t *db, ZSTD_DCtx *ctx,
+    reusable_buffer_t *buffer, void *start, void *end,
+    wal_txn_t **txn_p) {
+  *txn_p        = 0;
+  wal_txn_t *tx = start;
+  if (!tx->tx_id || tx->page_aligned_tx_size + start > end) {
+    *txn_p = 0;
+    return success();
+  }
+  uint8_t hash[CHECKSUM_BYTES];
+  const size_t size = CHECKSUM_BYTES;
+  page_checksum_t kind = tx->flags & wal_txn_flags_crc32c
+                             ? page_checksum_crc32c
+                             : page_checksum_blake2b;
+  ensure(checksum_compute(kind, (uint8_t *)tx + size,
+             tx->page_aligned_tx_size - size, hash),
+      msg("Unable to compute hash for transaction on recover"),
+      with(tx->tx_id, "%lu"));
+
+  if (memcmp(hash, tx->hash_blake2b, size) != 0) {
+    *txn_p = 0;  // not a match on the hash, failed
+    return success();
+  }
+  // we got a valid hash, can go forward with this
+  ensure(wal_decompress_transaction(db, ctx, buffer, tx, txn_p));
+  return success();
+}
+// end::wal_validate_transaction[]
+
+// tag::wal_recovery_validate[]
+// dictionaries are loaded from the data file, so only on the caller's
+// thread, after the page images were written
+static bool wal_recovery_needs_dictionary(
+    wal_recovery_operation_t *state, void *start) {
+  wal_txn_t *tx = start;
+  return (tx->flags & wal_txn_flags_compressed) &&
+         tx->dictionary_page &&
+         !wal_dictionary_find(state->wal, tx->dictionary_page);
+}
+
+static void wal_recovery_validate_record(void *arg, size_t index) {
+  wal_recovery_operation_t *state = arg;
+  wal_recovery_record_t *rec      = &state->records[index];
+  if (wal_recovery_needs_dictionary(state, rec->start)) {
+    rec->failed = true;
+    return;
+  }
+  rec->failed = !wal_validate_transaction(state->db, rec->ctx,
+      &rec->buffer, rec->start, state->end, &rec->tx);
+  if (rec->failed) {
+    // errors are per thread, we'll re-validate on the caller's
+    // thread to report them
+    errors_clear();
+  }
+}
+
+static void wal_recovery_fill_records(
+    wal_recovery_operation_t *state) {
+  // <1>
+  // headers aren't validated yet, only used to find the next records
+  void *cur           = state->start;
+  uint64_t last_tx_id = state->last_recovered_tx_id;
+  size_t count        = 0;
+  while (count < state->records_capacity && cur < state->end) {
+    wal_txn_t *tx = cur;
+    if (tx->tx_id <= last_tx_id || !tx->page_aligned_tx_size ||
+        tx->page_aligned_tx_size % PAGE_SIZE ||
+        tx->page_aligned_tx_size > (uint64_t)(state->end - cur))
+      break;
+    state->records[count++].start = cur;
+    last_tx_id                    = tx->tx_id;
+    cur += tx->page_aligned_tx_size;
+  }
+  // <2>
+  state->number_of_records = count;
+  state->next_record       = 0;
+  workers_run(
+      state->workers, wal_recovery_validate_record, state, count);
+}
+
+static result_t wal_recovery_validate(
+    wal_recovery_operation_t *state, wal_txn_t **txp) {
+  if (!state->workers) {
+    return wal_validate_transaction(state->db,
+        state->wal->decompression_ctx, &state->tmp_buffer,
+        state->start, state->end, txp);
+  }
+  if (state->next_record >= state->number_of_records ||
+      state->records[state->next_record].start != state->start) {
+    wal_recovery_fill_records(state);
+  }
+  if (state->next_record >= state->number_of_records ||
+      state->records[state->next_record].failed) {
+    state->number_of_records = 0;
+    if (wal_recovery_needs_dictionary(state, state->start)) {
+      ensure(txn_write_pages_to_disk(
+          state->db->state, *state->images, false));
+    }
+    return wal_validate_transaction(state->db,
+        state->wal->decompression_ctx, &state->tmp_buffer,
+        state->start, state->end, txp);
+  }
+  *txp = state->records[state->next_record++].tx;
+  return success();
+}
+
+static result_t wal_recovery_free_records(
+    wal_recovery_operation_t *state) {
+  for (size_t i = 0; i < state->records_capacity; i++) {
+    ZSTD_freeDCtx(state->records[i].ctx);
+    free(state->records[i].buffer.address);
+  }
+  free(state->records);
+  return success();
+}
+enable_defer(wal_recovery_free_records);
+// end::wal_recovery_validate[]
+
+// tag::wal_next_valid_transaction[]
+static result_t wal_next_valid_transaction(
+    struct wal_recovery_operation *state, wal_txn_t **txp) {
+  if (state->start >= state->end ||
+      !wal_recovery_validate(state, txp) ||
+      !*txp || state->last_recovered_tx_id >= (*txp)->tx_id) {
+    *txp = 0;
+    // <1>
+    void *end_of_valid_tx = state->start;
+    ensure(wal_validate_after_end_of_transactions(state));
+    if (state->current_recovery_file_index >= state->number_of_files)
+      return success();  // no more segments
+    // <2>
+    wal_file_state_t *file =
+        state->files[state->current_recovery_file_index];
+    file->last_write_pos =
+        (uint64_t)(end_of_valid_tx - file->span.address);
+    // <3>
+    if (++state->current_recovery_file_index ==
+        state->number_of_files) {
+      state->start = state->end;
+      return success();
+    }
+    file         = state->files[state->current_recovery_file_index];
+    state->start = file->span.address;
+    state->end   = state->start + file->span.size;
+    // <4>
+    return wal_next_valid_transaction(state, txp);
+  } else {
+    state->last_recovered_tx_id = (*txp)->tx_id;
+    state->start = state->start + (*txp)->page_aligned_tx_size;
+  }
+  return success();
+}
+// end::wal_next_valid_transaction[]
+
+// tag::wal_recover_page[]
+static result_t wal_recover_page(db_t *db, pages_map_t **pages,
+    wal_txn_page_t *page, void *end, const void *src, void **input) {
+  size_t size  = page->number_of_pages * PAGE_SIZE;
+  page_t final = {.page_num = page->page_num,
+      .number_of_pages      = page->number_of_pages};
+  ensure(mem_alloc_page_aligned((void *)&final.address, size));
+  size_t done = 0;
+  try_defer(free, final.address, done);
+  if (page->flags == wal_txn_page_flags_diff) {
+    txn_t tx;
+    ensure(txn_create(db, TX_READ, &tx));
+    defer(txn_close, tx);
+    page_t before = {.page_num = page->page_num,
+        .number_of_pages       = page->number_of_pages};
+    ensure(pages_get(&tx, &before));
+    memcpy(final.address, before.address,
+        page->number_of_pages * PAGE_SIZE);
+    *input = wal_apply_diff(*input, end, &final);
+  } else {
+    memcpy(final.address, src + page->offset, size);
+    *input += size;
+  }
+
+  ensure(pagesmap_put_new(pages, &final));
+  done = 1;
+
+  return success();
+}
+// end::wal_recover_page[]
+
+// tag::wal_recover_tx[]
+static result_t free_hash_table_and_contents(pages_map_t **pages) {
+  size_t iter_state = 0;
+  page_t *p;
+  while (pagesmap_get_next(*pages, &iter_state, &p)) {
+    free(p->address);
+  }
+  free(*pages);
+  return success();
+}
+enable_defer(free_hash_table_and_contents);
+
+// tag::wal_ensure_data_file_size[]
+static result_t wal_ensure_data_file_size(
+    db_t *db, uint64_t min_pages) {
+  if (db->state->handle->size > min_pages * PAGE_SIZE) {
+    return success();
+  }
+  ensure(pal_set_file_size(
+      db->state->handle, min_pages * PAGE_SIZE, UINT64_MAX));
+  ensure(pal_unmap(&db->state->map));
+  db->state->map.size = db->state->handle->size;
+  if (!(db->state->options.flags & db_flags_avoid_mmap_io)) {
+    ensure(pal_mmap_with_room(db->state->handle,
+        db->state->options.maximum_size, &db->state->map));
+    db->state->default_read_tx->map = db->state->map;
+  }
+  return success();
+}
+// end::wal_ensure_data_file_size[]
+
+static result_t wal_recover_tx(
+    db_t *db, wal_txn_t *tx, pages_map_t **recovered_pages) {
+  void *input = (void *)tx + sizeof(wal_txn_t) +
+                sizeof(wal_txn_page_t) * tx->number_of_modified_pages;
+  pages_map_t *pages;
+  ensure(pagesmap_new(
+      next_power_of_two(tx->number_of_modified_pages +
+                        tx->number_of_modified_pages / 2),
+      &pages));
+  defer(free_hash_table_and_contents, pages);
+  for (size_t i = 0; i < tx->number_of_modified_pages; i++) {
+    ensure(wal_ensure_data_file_size(
+        db, tx->pages[i].page_num + tx->pages[i].number_of_pages));
+
+    size_t end_offset = i + 1 < tx->number_of_modified_pages
+                            ? tx->pages[i + 1].offset
+                            : tx->tx_size;
+    ensure(wal_recover_page(db, &pages, tx->pages + i,
+        ((void *)tx) + end_offset, tx, &input));
+  }
+  size_t iter_state = 0;
+  page_t *p;
+  while (pagesmap_get_next(pages, &iter_state, &p)) {
+    page_t existing = {.page_num = p->page_num};
+    if (!pagesmap_lookup(*recovered_pages, &existing)) {
+      ensure(pagesmap_put_new(recovered_pages, p));
+    }
+    ensure(pal_write_file(db->state->handle, p->page_num * PAGE_SIZE,
+        p->address, p->number_of_pages * PAGE_SIZE));
+  }
+  return success();
+}
+// end::wal_recover_tx[]
+
+// tag::wal_apply_log_write_pages[]
+static result_t wal_apply_log_write_pages(
+    wal_txn_t *wal_tx, txn_t *write_tx, void *input, void *src) {
+  for (size_t i = 0; i < wal_tx->number_of_modified_pages; i++) {
+    wal_txn_page_t *cur = &wal_tx->pages[i];
+    size_t end_offset   = i + 1 < wal_tx->number_of_modified_pages
+                            ? wal_tx->pages[i + 1].offset
+                            : wal_tx->tx_size;
+    page_t page = {.page_num = cur->page_num,
+        .number_of_pages     = cur->number_of_pages};
+    ensure(txn_raw_modify_page(write_tx, &page));
+    if (cur->flags == wal_txn_page_flags_diff) {
+      input =
+          wal_apply_diff(input, (void *)wal_tx + end_offset, &page);
+    } else {
+      memcpy(page.address, src + cur->offset,
+          cur->number_of_pages * PAGE_SIZE);
+      input += cur->number_of_pages * PAGE_SIZE;
+    }
+  }
+  return success();
+}
+// end::wal_apply_log_write_pages[]
+
+// tag::wal_apply_wal_record[]
+result_t wal_apply_wal_record(db_t *db, reusable_buffer_t *tmp_buffer,
+    uint64_t tx_id, span_t *wal_record) {
+  ensure(db->state->options.flags & db_flags_log_shipping_target,
+      msg("db wasn't set with db_flags_apply_log flag"));
+  ensure(((intptr_t)wal_record->address & 4095) == 0,
+      msg("wal_record must be aligned on 4KB boundary, but wasn't"),
+      with(wal_record->address, "%p"));
+  // <1>
+  txn_t write_tx;
+  ensure(txn_create(db, TX_WRITE | TX_APPLY_LOG, &write_tx));
+  defer(txn_close, write_tx);
+  write_tx.state->shipped_wal_record = wal_record->address;
+
+  // <2>
+  wal_txn_t *wal_tx;
+  ensure(wal_validate_transaction(db,
+      db->state->wal_state.decompression_ctx, tmp_buffer,
+      wal_record->address, wal_record->address + wal_record->size,
+      &wal_tx));
+  // <3>
+  ensure(wal_tx, msg("Unable to validate WAL transaction"));
+  ensure(wal_tx->tx_id == write_tx.state->tx_id &&
+             tx_id == wal_tx->tx_id,
+      msg("Cannot apply a transaction out of order"),
+      with(tx_id, "%lu"), with(wal_tx->tx_id, "%lu"),
+      with(write_tx.state->tx_id, "%lu"));
+
+  // <4>
+  if (wal_tx->total_number_of_pages_in_database >
+      write_tx.state->number_of_pages) {
+    ensure(db_increase_file_size(&write_tx,
+        wal_tx->total_number_of_pages_in_database * PAGE_SIZE));
+  }
+  // <5>
+  void *input =
+      (void *)wal_tx + sizeof(wal_txn_t) +
+      sizeof(wal_txn_page_t) * wal_tx->number_of_modified_pages;
+  ensure(wal_apply_log_write_pages(
+      wal_tx, &write_tx, input, wal_record->address));
+  ensure(txn_commit(&write_tx));
+  return success();
+}
+// end::wal_apply_wal_record[]
+
+// tag::wal_complete_recovery[]
+static result_t wal_complete_recovery(
+    wal_recovery_operation_t *state) {
+  txn_t recovery_tx;
+  ensure(txn_create(state->db, TX_READ, &recovery_tx));
+  defer(txn_close, recovery_tx);
+  page_t header_page = {.page_num = 0};
+  ensure(txn_raw_get_page(&recovery_tx, &header_page));
+  page_metadata_t *header = header_page.address;
+  db_use_file_key(state->db->state, &header->file_header);
+
+  state->db->state->number_of_pages =
+      header->file_header.number_of_pages;
+  state->db->state->last_tx_id = header->file_header.last_tx_id;
+  if (state->last_recovered_tx_id == 0) {  // empty db / no recovery
+    if (header->file_header.last_tx_id != 0) {  // no recovery needed
+      state->last_recovered_tx_id = header->file_header.last_tx_id;
+    }
+    state->db->state->number_of_pages =
+        state->db->state->map.size / PAGE_SIZE;
+  } else {
+    ensure(header->common.page_flags == page_flags_file_header,
+        msg("First page was not a metadata page?"));
+    // the recovered pages are validated before db_init() runs
+    state->db->state->options.page_checksum =
+        (page_checksum_t)(header->file_header.version >>
+                          FILE_HEADER_CHECKSUM_SHIFT);
+  }
+  ensure(
+      header->file_header.last_tx_id == state->last_recovered_tx_id,
+      msg("The last recovered tx id does not match the header tx id"),
+      with(header->file_header.last_tx_id, "%lu"),
+      with(state->last_recovered_tx_id, "%lu"));
+
+  ensure(wal_ensure_data_file_size(
+      state->db, state->db->state->number_of_pages));
+  state->db->state->default_read_tx->map = state->db->state->map;
+  state->db->state->default_read_tx->number_of_pages =
+      state->db->state->number_of_pages;
+  return success();
+}
+// end::wal_complete_recovery[]
+
+// tag::wal_recover_tx_images[]
+static result_t wal_recover_tx_page_image(
+    pages_map_t **images, uint64_t page_num, void *src) {
+  page_t image = {.page_num = page_num, .number_of_pages = 1};
+  if (pagesmap_lookup(*images, &image)) {
+    memcpy(image.address, src, PAGE_SIZE);
+    return success();
+  }
+  ensure(mem_alloc_page_aligned(&image.address, PAGE_SIZE));
+  size_t done = 0;
+  try_defer(free, image.address, done);
+  memcpy(image.address, src, PAGE_SIZE);
+  ensure(pagesmap_put_new(images, &image));
+  done = 1;
+  return success();
+}
+
+static result_t wal_recover_tx_images(db_t *db, wal_txn_t *tx,
+    pages_map_t **images, pages_map_t **recovered_pages) {
+  void *input = (void *)tx + sizeof(wal_txn_t) +
+                sizeof(wal_txn_page_t) * tx->number_of_modified_pages;
+  for (size_t i = 0; i < tx->number_of_modified_pages; i++) {
+    wal_txn_page_t *cur = &tx->pages[i];
+    ensure(wal_ensure_data_file_size(
+        db, cur->page_num + cur->number_of_pages));
+    size_t size  = cur->number_of_pages * PAGE_SIZE;
+    page_t final = {.page_num = cur->page_num,
+        .number_of_pages      = cur->number_of_pages};
+    ensure(mem_alloc_page_aligned(&final.address, size));
+    defer(free, final.address);
+    if (cur->flags == wal_txn_page_flags_diff) {
+      size_t end_offset = i + 1 < tx->number_of_modified_pages
+                              ? tx->pages[i + 1].offset
+                              : tx->tx_size;
+      // <1>
+      // the base is the latest image we have, or the data file
+      for (size_t j = 0; j < cur->number_of_pages; j++) {
+        page_t base = {.page_num = cur->page_num + j};
+        if (pagesmap_lookup(*images, &base)) {
+          memcpy(final.address + j * PAGE_SIZE, base.address,
+              PAGE_SIZE);
+          continue;
+        }
+        ensure(pal_read_file(db->state->handle,
+            base.page_num * PAGE_SIZE, final.address + j * PAGE_SIZE,
+            PAGE_SIZE));
+      }
+      input = wal_apply_diff(input, (void *)tx + end_offset, &final);
+    } else {
+      memcpy(final.address, (void *)tx + cur->offset, size);
+      input += size;
+    }
+    // <2>
+    // kept per page, a later tx may reuse part of an overflow range
+    for (size_t j = 0; j < cur->number_of_pages; j++) {
+      ensure(wal_recover_tx_page_image(images, cur->page_num + j,
+          final.address + j * PAGE_SIZE));
+    }
+    page_t existing = {.page_num = cur->page_num};
+    if (!pagesmap_lookup(*recovered_pages, &existing)) {
+      existing.number_of_pages = cur->number_of_pages;
+      existing.address         = (void *)tx;  // only needs to be set
+      ensure(pagesmap_put_new(recovered_pages, &existing));
+    }
+  }
+  return success();
+}
+// end::wal_recover_tx_images[]
+
+// tag::wal_validate_recovered_pages_batched[]
+static result_t wal_validate_recovered_pages_batched(
+    db_t *db, pages_map_t *modified_pages) {
+  size_t iter_state = 0;
+  page_t *page_to_validate;
+  bool has_more = true;
+  while (has_more) {
+    txn_t rtx;
+    ensure(txn_create(db, TX_READ, &rtx));
+    defer(txn_close, rtx);
+    for (size_t i = 0; i < 1024; i++) {
+      has_more = pagesmap_get_next(
+          modified_pages, &iter_state, &page_to_validate);
+      if (!has_more) break;
+      page_t p = {.page_num = page_to_validate->page_num};
+      ensure(txn_get_page(&rtx, &p));
+    }
+  }
+  return success();
+}
+// end::wal_validate_recovered_pages_batched[]
+
+// tag::wal_recover_parallel[]
+static result_t wal_recover_parallel(
+    db_t *db, wal_recovery_operation_t *state) {
+  size_t threads = db->state->options.wal_recovery_threads;
+  // <1>
+  // the calling thread is also validating records
+  ensure(workers_create(threads - 1, &state->workers));
+  defer(workers_destroy, state->workers);
+  state->records_capacity = threads * 8;
+  ensure(mem_calloc((void *)&state->records,
+      state->records_capacity * sizeof(wal_recovery_record_t)));
+  defer(wal_recovery_free_records, *state);
+  for (size_t i = 0; i < state->records_capacity; i++) {
+    state->records[i].ctx = ZSTD_createDCtx();
+    if (!state->records[i].ctx) {
+      failed(ENOMEM, msg("Unable to create decompression context"));
+    }
+  }
+
+  pages_map_t *images;
+  ensure(pagesmap_new(16, &images));
+  defer(free_hash_table_and_contents, images);
+  state->images = &images;
+  pages_map_t *recovered_pages;
+  ensure(pagesmap_new(16, &recovered_pages));
+  defer(free, recovered_pages);
+
+  // <2>
+  while (true) {
+    wal_txn_t *tx;
+    ensure(wal_next_valid_transaction(state, &tx));
+    if (!tx) break;
+    ensure(wal_recover_tx_images(db, tx, &images, &recovered_pages));
+  }
+  // <3>
+  ensure(txn_write_pages_to_disk(db->state, images, false));
+  ensure(wal_complete_recovery(state));
+  ensure(wal_validate_recovered_pages_batched(db, recovered_pages));
+  return success();
+}
+// end::wal_recover_parallel[]
+
+// tag::wal_recover[]
+static result_t wal_recover(db_t *db, wal_state_t *wal) {
+  wal_recovery_operation_t recovery_state;
+  wal_init_recover_state(db, wal, &recovery_state);
+  if (db->state->options.wal_recovery_threads) {
+    defer(free, recovery_state.tmp_buffer.address);
+    ensure(wal_recover_parallel(db, &recovery_state));
+    return success();
+  }
+  pages_map_t *recovered_pages;
+  ensure(pagesmap_new(16, &recovered_pages));
+  defer(free, recovered_pages);
+  defer(free, recovery_state.tmp_buffer.address);
+
+  while (true) {
+    wal_txn_t *tx;
+    ensure(wal_next_valid_transaction(&recovery_state, &tx));
+    if (!tx) break;
+    ensure(wal_recover_tx(db, tx, &recovered_pages));
+  }
+  ensure(wal_complete_recovery(&recovery_state));
+  ensure(wal_validate_recovered_pages(db, recovered_pages));
+  return success();
+}
+// end::wal_recover[]
+
+// tag::wal_open_single_file[]
+static result_t wal_get_wal_filename(
+    const char *db_file_name, char wal_code, char **wal_file_name) {
+  size_t db_name_len = strlen(db_file_name);  // \0 + -a.wal
+  ensure(mem_alloc((void *)wal_file_name, db_name_len + 1 + 6));
+  memcpy(*wal_file_name, db_file_name, db_name_len);
+  (*wal_file_name)[db_name_len++] = '-';
+  (*wal_file_name)[db_name_len++] = wal_code;
+  memcpy((*wal_file_name) + db_name_len, ".wal", 5);  // include \0
+  return success();
+}
+static result_t wal_open_file(struct wal_file_state *file_state,
+    db_t *db, char wal_code, enum pal_file_creation_flags flags) {
+  char *wal_file_name;
+  ensure(wal_get_wal_filename(
+      db->state->handle->filename, wal_code, &wal_file_name));
+  defer(free, wal_file_name);
+  ensure(pal_create_file(wal_file_name, &file_state->handle, flags));
+  return success();
+}
+static result_t wal_open_single_file(
+    struct wal_file_state *file_state, db_t *db, char wal_code) {
+  ensure(wal_open_file(
+      file_state, db, wal_code, pal_file_creation_flags_none));
+  ensure(pal_set_file_size(
+      file_state->handle, db->state->options.wal_size, UINT64_MAX));
+  file_state->span.size = file_state->handle->size;
+  ensure(pal_mmap(file_state->handle, 0, &file_state->span));
+  return success();
+}
+// end::wal_open_single_file[]
+
+// tag::wal_count_segments[]
+static result_t wal_count_segments(db_t *db, size_t *segments) {
+  *segments = db->state->options.wal_segments;
+  // <1>
+  // segments are never removed, the options may ask for fewer than an
+  // existing database has, their records must still be recovered
+  for (size_t i = *segments; i < WAL_MAX_SEGMENTS; i++) {
+    char *wal_file_name;
+    ensure(wal_get_wal_filename(
+        db->state->handle->filename, 'a' + (char)i, &wal_file_name));
+    defer(free, wal_file_name);
+    bool exists;
+    ensure(pal_file_exists(wal_file_name, &exists));
+    if (exists) *segments = i + 1;
+  }
+  db->state->options.wal_segments = *segments;
+  return success();
+}
+// end::wal_count_segments[]
+
+// tag::wal_close_segments[]
+static result_t wal_close_segments(wal_state_t *wal) {
+  // need to proceed even if there are failures
+  bool failure = false;
+  for (size_t i = 0; i < wal->number_of_segments; i++) {
+    failure |= !pal_unmap(&wal->files[i].span);
+    failure |= !pal_close_file(wal->files[i].handle);
+    wal->files[i].handle = 0;
+  }
+  if (failure) {
+    failed(EIO, msg("Unable to properly close the wal"));
+  }
+  return success();
+}
+enable_defer(wal_close_segments);
+// end::wal_close_segments[]
+
+// tag::wal_open_and_recover[]
+result_t wal_open_and_recover(db_t *db) {
+  memset(&db->state->wal_state, 0, sizeof(wal_state_t));
+  wal_state_t *wal = &db->state->wal_state;
+  // <1>
+  wal->compression_ctx   = ZSTD_createCCtx();
+  wal->decompression_ctx = ZSTD_createDCtx();
+  if (!wal->compression_ctx || !wal->decompression_ctx) {
+    failed(ENOMEM, msg("Unable to create zstd contexts"));
+  }
+  // <2>
+  ensure(wal_count_segments(db, &wal->number_of_segments));
+  {
+    defer(wal_close_segments, *wal);
+    for (size_t i = 0; i < wal->number_of_segments; i++) {
+      ensure(wal_open_single_file(&wal->files[i], db, 'a' + (char)i));
+    }
+    ensure(wal_recover(db, wal));
+  }
+  wal->durable_tx_id = db->state->last_tx_id;
+  for (size_t i = 0; i < wal->number_of_segments; i++) {
+    ensure(wal_open_file(&wal->files[i], db, 'a' + (char)i,
+        pal_file_creation_flags_durable));
+  }
+  return success();
+}
+// end::wal_open_and_recover[]
+
+result_t wal_close(db_state_t *db) {
+  if (!db) return success();
+  // need to proceed even if there are failures
+  bool failure = !wal_close_segments(&db->wal_state);
+
+  free(db->wal_state.pending.address);
+  free(db->wal_state.compression_buffer.address);
+  wal_dictionary_close(&db->wal_state);
+  ZSTD_freeCCtx(db->wal_state.compression_ctx);
+  ZSTD_freeDCtx(db->wal_state.decompression_ctx);
+  memset(&db->wal_state, 0, sizeof(wal_state_t));
+  if (failure) {
+    return failure_code();
+  }
+  return success();
+}
+
+// tag::wal_will_checkpoint[]
+bool wal_will_checkpoint(db_state_t *db, uint64_t tx_id) {
+  if (!db) return false;
+  wal_writer_lock(db);
+  defer(wal_writer_unlock, db);
+
+  wal_state_t *wal = &db->wal_state;
+  for (size_t i = 0; i < wal->number_of_segments; i++) {
+    wal_file_state_t *file = &wal->files[i];
+    // empty, or still needed by a reader
+    if (!file->last_write_pos || file->last_tx_id > tx_id) continue;
+    // <1>
+    // segments we moved away from are recycled right away, the
+    // current one only after it is half full
+    if (i != wal->current_append_file_index ||
+        file->last_write_pos > db->options.wal_size / 2)
+      return true;
+  }
+  return false;
+}
+// end::wal_will_checkpoint[]
+
+// tag::wal_reset_file[]
+static result_t wal_reset_file(
+    db_state_t *db, wal_file_state_t *file) {
+  (void)db;
+  void *zero;
+  ensure(mem_alloc_page_aligned(&zero, PAGE_SIZE));
+  defer(free, zero);
+  memset(zero, 0, PAGE_SIZE);
+  // reset the start of the log, preventing recovery from proceeding
+  ensure(pal_write_file(file->handle, 0, zero, PAGE_SIZE),
+      msg("Unable to reset WAL first page"));
+  // <1>
+  if (file->span.size > db->options.wal_size) {
+    ensure(pal_set_file_size(file->handle, 0, db->options.wal_size));
+    file->span.size = db->options.wal_size;
+  }
+  file->last_write_pos = 0;
+  return success();
+}
+// end::wal_reset_file[]
+
+// tag::wal_checkpoint[]
+result_t wal_checkpoint(db_state_t *db, uint64_t tx_id) {
+  // the WAL writer thread may be appending concurrently
+  wal_writer_lock(db);
+  defer(wal_writer_unlock, db);
+  wal_state_t *wal = &db->wal_state;
+  // <1>
+  // each segment is recycled once all its txs are in the data file,
+  // so a slow reader only pins the segments written after it
+  for (size_t i = 0; i < wal->number_of_segments; i++) {
+    wal_file_state_t *file = &wal->files[i];
+    // avoid resetting if nothing is written here
+    if (!file->last_write_pos || file->last_tx_id > tx_id) continue;
+    ensure(wal_reset_file(db, file));
+  }
+  return success();
+}
+// end::wal_checkpoint[]
@@ -0,0 +1,241 @@
+#include <errno.h>
+#include <gavran/db.h>
+#include <gavran/internal.h>
+#include <string.h>
+#include <zdict.h>
+#include <zstd.h>
+
+// the root btree maps this key to the page of the current dictionary
+#define WAL_DICTIONARY_KEY "$wal_dictionary"
+
+// tag::wal_dictionary_t[]
+// dictionaries are never freed, so the page number is enough to
+// identify a dictionary version from a WAL record
+typedef struct wal_dictionary {
+  struct wal_dictionary *next;
+  uint64_t page_num;
+  ZSTD_DDict *ddict;
+} wal_dictionary_t;
+// end::wal_dictionary_t[]
+
+// tag::wal_dictionary_add_sample[]
+implementation_detail void wal_dictionary_add_sample(
+    db_state_t *db, void *start, size_t size) {
+  if (!db->options.wal_dictionary_size) return;
+  wal_state_t *wal           = &db->wal_state;
+  reusable_buffer_t *samples = &wal->dictionary_samples;
+  reusable_buffer_t *sizes   = &wal->dictionary_sample_sizes;
+  // <1>
+  // zstd recommends ~100 times the dictionary size in samples
+  size_t max_size = db->options.wal_dictionary_size * 100;
+  size            = MIN(size, max_size / 2);
+  if (samples->size < max_size) {
+    if (flopped(mem_realloc(&samples->address, max_size))) {
+      errors_clear();  // sampling is best effort
+      return;
+    }
+    samples->size = max_size;
+  }
+  if (sizes->size < sizes->used + sizeof(size_t)) {
+    if (flopped(mem_realloc(&sizes->address, sizes->size * 2 + 64))) {
+      errors_clear();
+      return;
+    }
+    sizes->size = sizes->size * 2 + 64;
+  }
+  // <2>
+  // drop the oldest half, we want to train on recent records
+  if (samples->used + size > max_size) {
+    size_t *sample_sizes = sizes->address;
+    size_t count         = sizes->used / sizeof(size_t);
+    size_t dropped = 0, dropped_size = 0;
+    while (dropped < count &&
+           samples->used - dropped_size > max_size / 2) {
+      dropped_size += sample_sizes[dropped++];
+    }
+    memmove(samples->address, samples->address + dropped_size,
+        samples->used - dropped_size);
+    memmove(sample_sizes, sample_sizes + dropped,
+        (count - dropped) * sizeof(size_t));
+    samples->used -= dropped_size;
+    sizes->used -= dropped * sizeof(size_t);
+  }
+  memcpy(samples->address + samples->used, start, size);
+  memcpy(sizes->address + sizes->used, &size, sizeof(size_t));
+  samples->used += size;
+  sizes->used += sizeof(size_t);
+}
+// end::wal_dictionary_add_sample[]
+
+// tag::wal_dictionary_get[]
+implementation_detail ZSTD_DDict *wal_dictionary_find(
+    wal_state_t *wal, uint64_t page_num) {
+  for (wal_dictionary_t *cur = wal->dictionaries; cur;
+       cur                   = cur->next) {
+    if (cur->page_num == page_num) return cur->ddict;
+  }
+  return 0;
+}
+
+static result_t wal_dictionary_read(
+    txn_t *tx, uint64_t page_num, span_t *dict) {
+  page_t p = {.page_num = page_num};
+  ensure(txn_get_page(tx, &p));
+  ensure(p.metadata->overflow.page_flags == page_flags_overflow &&
+             p.metadata->overflow.size_of_value <=
+                 p.number_of_pages * PAGE_SIZE,
+      msg("WAL dictionary page is not a valid overflow page"),
+      with(page_num, "%lu"));
+  dict->address = p.address;
+  dict->size    = p.metadata->overflow.size_of_value;
+  return success();
+}
+
+implementation_detail result_t wal_dictionary_get(
+    db_t *db, uint64_t page_num, ZSTD_DDict **ddict) {
+  wal_state_t *wal = &db->state->wal_state;
+  *ddict           = wal_dictionary_find(wal, page_num);
+  if (*ddict) return success();
+  // <1>
+  // during recovery, the pages were already written to the data file
+  txn_t rtx;
+  ensure(txn_create(db, TX_READ, &rtx));
+  defer(txn_close, rtx);
+  span_t dict;
+  ensure(wal_dictionary_read(&rtx, page_num, &dict));
+
+  wal_dictionary_t *entry;
+  ensure(mem_calloc((void *)&entry, sizeof(wal_dictionary_t)));
+  size_t done = 0;
+  try_defer(free, entry, done);
+  entry->page_num = page_num;
+  entry->ddict    = ZSTD_createDDict(dict.address, dict.size);
+  if (!entry->ddict) {
+    failed(ENOMEM, msg("Unable to create WAL decompression dict"),
+        with(page_num, "%lu"));
+  }
+  entry->next       = wal->dictionaries;
+  wal->dictionaries = entry;
+  *ddict            = entry->ddict;
+  done              = 1;
+  return success();
+}
+// end::wal_dictionary_get[]
+
+// tag::wal_dictionary_use[]
+static result_t wal_dictionary_use(db_t *db, uint64_t page_num) {
+  wal_state_t *wal = &db->state->wal_state;
+  ZSTD_DDict *ddict;
+  ensure(wal_dictionary_get(db, page_num, &ddict));
+  txn_t rtx;
+  ensure(txn_create(db, TX_READ, &rtx));
+  defer(txn_close, rtx);
+  span_t dict;
+  ensure(wal_dictionary_read(&rtx, page_num, &dict));
+  ZSTD_CDict *cdict = ZSTD_createCDict(dict.address, dict.size,
+      db->state->options.wal_compression_level);
+  if (!cdict) {
+    failed(ENOMEM, msg("Unable to create WAL compression dictionary"),
+        with(page_num, "%lu"));
+  }
+  ZSTD_freeCDict(wal->compression_dictionary);
+  wal->compression_dictionary      = cdict;
+  wal->compression_dictionary_page = page_num;
+  return success();
+}
+
+implementation_detail result_t wal_dictionary_open(db_t *db) {
+  // encrypted records aren't compressed
+  if (!db->state->options.wal_dictionary_size ||
+      db->state->options.flags & db_flags_encrypted) {
+    return success();
+  }
+  txn_t rtx;
+  ensure(txn_create(db, TX_READ, &rtx));
+  defer(txn_close, rtx);
+  table_schema_t root = table_root_schema();
+  btree_val_t kvp     = {.tree_id = root.index_ids[1],
+      .key = {.address = WAL_DICTIONARY_KEY,
+          .size        = sizeof(WAL_DICTIONARY_KEY)}};
+  ensure(btree_get(&rtx, &kvp));
+  if (kvp.has_val) {
+    ensure(wal_dictionary_use(db, kvp.val));
+  }
+  return success();
+}
+
+implementation_detail void wal_dictionary_close(wal_state_t *wal) {
+  while (wal->dictionaries) {
+    wal_dictionary_t *cur = wal->dictionaries;
+    wal->dictionaries     = cur->next;
+    ZSTD_freeDDict(cur->ddict);
+    free(cur);
+  }
+  ZSTD_freeCDict(wal->compression_dictionary);
+  free(wal->dictionary_samples.address);
+  free(wal->dictionary_sample_sizes.address);
+}
+// end::wal_dictionary_use[]
+
+// tag::db_train_wal_dictionary[]
+static result_t wal_dictionary_store(
+    db_t *db, span_t *dict, uint64_t *page_num) {
+  txn_t w;
+  ensure(txn_create(db, TX_WRITE, &w));
+  defer(txn_close, w);
+  page_t p = {.number_of_pages = (uint32_t)TO_PAGES(dict->size)};
+  ensure(txn_allocate_page(&w, &p, 0));
+  // <1>
+  ensure(p.page_num <= UINT32_MAX,
+      msg("WAL dictionary must be placed in the first 2^32 pages"),
+      with(p.page_num, "%lu"));
+  p.metadata->overflow.page_flags      = page_flags_overflow;
+  p.metadata->overflow.number_of_pages = p.number_of_pages;
+  p.metadata->overflow.size_of_value   = dict->size;
+  memcpy(p.address, dict->address, dict->size);
+
+  table_schema_t root = table_root_schema();
+  btree_val_t set     = {.tree_id = root.index_ids[1],
+      .key = {.address = WAL_DICTIONARY_KEY,
+          .size        = sizeof(WAL_DICTIONARY_KEY)},
+      .val = p.page_num};
+  ensure(btree_set(&w, &set, 0));
+  ensure(txn_commit(&w));
+  *page_num = p.page_num;
+  return success();
+}
+
+result_t db_train_wal_dictionary(db_t *db) {
+  db_state_t *s = db->state;
+  ensure(!(s->options.flags & db_flags_encrypted),
+      msg("WAL records of encrypted databases aren't compressed"));
+  ensure(s->options.wal_dictionary_size,
+      msg("wal_dictionary_size must be set to train a dictionary"));
+  // <1>
+  // the WAL writer may still be sampling records
+  ensure(wal_writer_wait(s, s->last_tx_id));
+  wal_state_t *wal = &s->wal_state;
+  size_t count = wal->dictionary_sample_sizes.used / sizeof(size_t);
+
+  span_t dict = {.size = s->options.wal_dictionary_size};
+  ensure(mem_alloc(&dict.address, dict.size));
+  defer(free, dict.address);
+  // <2>
+  dict.size = ZDICT_trainFromBuffer(dict.address, dict.size,
+      wal->dictionary_samples.address,
+      wal->dictionary_sample_sizes.address, (unsigned)count);
+  if (ZDICT_isError(dict.size)) {
+    const char *zdict_error = ZDICT_getErrorName(dict.size);
+    failed(ENODATA, msg("Unable to train WAL dictionary"),
+        with(count, "%zu"), with(zdict_error, "%s"));
+  }
+  // <3>
+  uint64_t page_num;
+  ensure(wal_dictionary_store(db, &dict, &page_num));
+  ensure(wal_writer_wait(s, s->last_tx_id));
+  ensure(wal_dictionary_use(db, page_num));
+  wal->dictionary_samples.used      = 0;
+  wal->dictionary_sample_sizes.used = 0;
+  return success();
+}
+// end::db_train_wal_dictionary[]
@@ -0,0 +1,235 @@
+#include <errno.h>
+#include <gavran/db.h>
+#include <gavran/internal.h>
+#include <pthread.h>
+#include <string.h>
+
+// tag::wal_writer_t[]
+typedef struct wal_write_request {
+  struct wal_write_request *next;
+  span_t record;
+  uint64_t tx_id;
+  txn_commit_callback_t callback;
+  void *callback_state;
+} wal_write_request_t;
+
+struct wal_writer {
+  db_state_t *db;
+  pthread_t thread;
+  // guards the queue & flags below
+  pthread_mutex_t queue_lock;
+  pthread_cond_t has_work;
+  pthread_cond_t done_work;
+  // signaled when db->active_write_tx is released, see
+  // wal_writer_acquire_write_tx()
+  pthread_cond_t write_tx_released;
+  // guards the WAL files, shared with checkpoints on the txn thread
+  pthread_mutex_t wal_lock;
+  wal_write_request_t *head;
+  wal_write_request_t *tail;
+  // last tx whose completion callback was already invoked
+  uint64_t completed_tx_id;
+  bool stop;
+  bool failed;
+  uint8_t padding[6];
+};
+// end::wal_writer_t[]
+
+implementation_detail void wal_writer_lock(db_state_t *db) {
+  if (db->wal_writer) pthread_mutex_lock(&db->wal_writer->wal_lock);
+}
+
+implementation_detail void wal_writer_unlock(db_state_t *db) {
+  if (db->wal_writer)
+    pthread_mutex_unlock(&db->wal_writer->wal_lock);
+}
+
+// tag::wal_writer_process[]
+static bool wal_writer_process(
+    wal_writer_t *w, wal_write_request_t *batch) {
+  bool durable = !w->failed;
+  // <1>
+  for (wal_write_request_t *cur = batch; cur && durable;
+       cur                      = cur->next) {
+    durable = wal_seal_record(w->db, &cur->record) &&
+              wal_add_pending(w->db, &cur->record);
+  }
+  // <2>
+  durable = durable && wal_flush(w->db);
+  if (!durable) {
+    // the errors belong to this thread, the txn thread will get
+    // EIO from any future commit & from db_close. The records of the
+    // batch that made it to the pending buffer are dropped as well
+    errors_clear();
+    wal_fail_pending(w->db);
+  }
+  // <3>
+  while (batch) {
+    wal_write_request_t *cur = batch;
+    batch                    = cur->next;
+    if (cur->callback)
+      cur->callback(cur->callback_state, cur->tx_id, durable);
+    free(cur->record.address);
+    free(cur);
+  }
+  return durable;
+}
+// end::wal_writer_process[]
+
+// tag::wal_writer_thread[]
+static void *wal_writer_thread(void *arg) {
+  wal_writer_t *w = arg;
+  pthread_mutex_lock(&w->queue_lock);
+  while (true) {
+    while (!w->head && !w->stop) {
+      pthread_cond_wait(&w->has_work, &w->queue_lock);
+    }
+    if (!w->head) break;  // stopped & drained
+    // take all the queued txs, they'll share a single write
+    wal_write_request_t *batch = w->head;
+    uint64_t last_tx_id        = w->tail->tx_id;
+    w->head = w->tail = 0;
+    pthread_mutex_unlock(&w->queue_lock);
+
+    bool durable = wal_writer_process(w, batch);
+
+    pthread_mutex_lock(&w->queue_lock);
+    if (durable) {
+      w->completed_tx_id = last_tx_id;
+    } else {
+      __atomic_store_n(&w->failed, true, __ATOMIC_RELEASE);
+    }
+    pthread_cond_broadcast(&w->done_work);
+  }
+  pthread_mutex_unlock(&w->queue_lock);
+  return 0;
+}
+// end::wal_writer_thread[]
+
+// tag::wal_writer_start[]
+implementation_detail result_t wal_writer_start(db_state_t *db) {
+  if (db->wal_writer) return success();
+  wal_writer_t *w;
+  ensure(mem_calloc((void *)&w, sizeof(wal_writer_t)));
+  size_t done = 0;
+  try_defer(free, w, done);
+  w->db              = db;
+  w->completed_tx_id = db->last_tx_id;
+  pthread_mutex_init(&w->queue_lock, 0);
+  pthread_mutex_init(&w->wal_lock, 0);
+  pthread_cond_init(&w->has_work, 0);
+  pthread_cond_init(&w->done_work, 0);
+  pthread_cond_init(&w->write_tx_released, 0);
+  int rc = pthread_create(&w->thread, 0, wal_writer_thread, w);
+  ensure(rc == 0, msg("Unable to start WAL writer thread"),
+      with(rc, "%d"));
+  db->wal_writer = w;
+  done           = 1;
+  return success();
+}
+// end::wal_writer_start[]
+
+// tag::wal_writer_stop[]
+implementation_detail result_t wal_writer_stop(db_state_t *db) {
+  wal_writer_t *w = db->wal_writer;
+  if (!w) return success();
+  pthread_mutex_lock(&w->queue_lock);
+  w->stop = true;
+  pthread_cond_signal(&w->has_work);
+  pthread_mutex_unlock(&w->queue_lock);
+  pthread_join(w->thread, 0);
+
+  bool has_failed = w->failed;
+  db->wal_writer  = 0;
+  pthread_mutex_destroy(&w->queue_lock);
+  pthread_mutex_destroy(&w->wal_lock);
+  pthread_cond_destroy(&w->has_work);
+  pthread_cond_destroy(&w->done_work);
+  pthread_cond_destroy(&w->write_tx_released);
+  free(w);
+  if (has_failed) {
+    failed(EIO, msg("WAL writer failed to write transactions"));
+  }
+  return success();
+}
+// end::wal_writer_stop[]
+
+// tag::wal_writer_submit[]
+implementation_detail result_t wal_writer_submit(txn_state_t *tx,
+    txn_commit_callback_t callback, void *callback_state) {
+  wal_writer_t *w = tx->db->wal_writer;
+  if (__atomic_load_n(&w->failed, __ATOMIC_ACQUIRE)) {
+    failed(EIO, msg("WAL writer failed, cannot commit transaction"),
+        with(tx->tx_id, "%lu"));
+  }
+
+  wal_write_request_t *req;
+  ensure(mem_calloc((void *)&req, sizeof(wal_write_request_t)));
+  size_t done = 0;
+  try_defer(free, req, done);
+  // <1>
+  ensure(wal_prepare_record(tx, &req->record));
+  req->tx_id          = tx->tx_id;
+  req->callback       = callback;
+  req->callback_state = callback_state;
+
+  pthread_mutex_lock(&w->queue_lock);
+  if (w->tail)
+    w->tail->next = req;
+  else
+    w->head = req;
+  w->tail = req;
+  pthread_cond_signal(&w->has_work);
+  pthread_mutex_unlock(&w->queue_lock);
+  done = 1;
+  return success();
+}
+// end::wal_writer_submit[]
+
+// tag::wal_writer_wait[]
+implementation_detail result_t wal_writer_wait(
+    db_state_t *db, uint64_t tx_id) {
+  wal_writer_t *w = db->wal_writer;
+  if (!w) return success();
+  pthread_mutex_lock(&w->queue_lock);
+  while (!w->failed && w->completed_tx_id < tx_id) {
+    pthread_cond_wait(&w->done_work, &w->queue_lock);
+  }
+  bool has_failed = w->failed;
+  pthread_mutex_unlock(&w->queue_lock);
+  if (has_failed) {
+    failed(EIO, msg("WAL writer failed to write transaction"),
+        with(tx_id, "%lu"));
+  }
+  return success();
+}
+// end::wal_writer_wait[]
+
+// tag::wal_writer_write_tx[]
+// with group commit, a committer lets go of the write txn once its
+// record is queued & waits for it to be durable afterward. The next
+// write txn, on any thread, waits here meanwhile instead of failing
+implementation_detail void wal_writer_acquire_write_tx(
+    db_state_t *db) {
+  wal_writer_t *w = db->wal_writer;
+  pthread_mutex_lock(&w->queue_lock);
+  while (db->active_write_tx) {
+    pthread_cond_wait(&w->write_tx_released, &w->queue_lock);
+  }
+  // the previous write txn was published before it was released
+  db->active_write_tx = db->last_tx_id + 1;
+  pthread_mutex_unlock(&w->queue_lock);
+}
+
+implementation_detail void wal_writer_release_write_tx(
+    db_state_t *db, uint64_t tx_id) {
+  wal_writer_t *w = db->wal_writer;
+  pthread_mutex_lock(&w->queue_lock);
+  // a committed group txn was released already
+  if (db->active_write_tx == tx_id) {
+    db->active_write_tx = 0;
+    pthread_cond_signal(&w->write_tx_released);
+  }
+  pthread_mutex_unlock(&w->queue_lock);
+}
+// end::wal_writer_write_tx[]
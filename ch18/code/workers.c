@@ -0,0 +1,126 @@
+#include <errno.h>
+#include <gavran/db.h>
+#include <gavran/internal.h>
+#include <pthread.h>
+
+// tag::workers_t[]
+struct workers {
+  pthread_mutex_t lock;
+  pthread_cond_t has_work;
+  pthread_cond_t work_done;
+  // the current job, shared by all the threads
+  workers_func_t func;
+  void *state;
+  size_t count;
+  size_t next_index;
+  size_t completed;
+  // bumped on every job, so threads know they have new work
+  uint64_t generation;
+  // threads currently running the job
+  size_t active;
+  size_t number_of_threads;
+  bool stop;
+  uint8_t padding[7];
+  pthread_t threads[];
+};
+// end::workers_t[]
+
+// tag::workers_execute[]
+static void workers_execute(workers_t *w) {
+  while (true) {
+    size_t index =
+        __atomic_fetch_add(&w->next_index, 1, __ATOMIC_RELAXED);
+    if (index >= w->count) return;
+    w->func(w->state, index);
+    __atomic_add_fetch(&w->completed, 1, __ATOMIC_RELEASE);
+  }
+}
+
+static void *workers_thread(void *arg) {
+  workers_t *w        = arg;
+  uint64_t generation = 0;
+  pthread_mutex_lock(&w->lock);
+  while (true) {
+    while (!w->stop && w->generation == generation) {
+      pthread_cond_wait(&w->has_work, &w->lock);
+    }
+    if (w->stop) break;
+    generation = w->generation;
+    w->active++;
+    pthread_mutex_unlock(&w->lock);
+    workers_execute(w);
+    pthread_mutex_lock(&w->lock);
+    if (--w->active == 0) pthread_cond_broadcast(&w->work_done);
+  }
+  pthread_mutex_unlock(&w->lock);
+  return 0;
+}
+// end::workers_execute[]
+
+// tag::workers_create[]
+implementation_detail result_t workers_create(
+    size_t number_of_threads, workers_t **workers) {
+  workers_t *w;
+  ensure(mem_calloc((void *)&w,
+      sizeof(workers_t) + number_of_threads * sizeof(pthread_t)));
+  pthread_mutex_init(&w->lock, 0);
+  pthread_cond_init(&w->has_work, 0);
+  pthread_cond_init(&w->work_done, 0);
+  for (size_t i = 0; i < number_of_threads; i++) {
+    int rc = pthread_create(&w->threads[i], 0, workers_thread, w);
+    if (rc) {
+      workers_destroy(w);
+      failed(rc, msg("Unable to create worker thread"),
+          with(i, "%zu"));
+    }
+    w->number_of_threads++;
+  }
+  *workers = w;
+  return success();
+}
+
+implementation_detail void workers_destroy(workers_t *w) {
+  if (!w) return;
+  pthread_mutex_lock(&w->lock);
+  w->stop = true;
+  pthread_cond_broadcast(&w->has_work);
+  pthread_mutex_unlock(&w->lock);
+  for (size_t i = 0; i < w->number_of_threads; i++) {
+    pthread_join(w->threads[i], 0);
+  }
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->has_work);
+  pthread_cond_destroy(&w->work_done);
+  free(w);
+}
+// end::workers_create[]
+
+// tag::workers_run[]
+implementation_detail void workers_run(
+    workers_t *w, workers_func_t func, void *state, size_t count) {
+  if (!count) return;
+  pthread_mutex_lock(&w->lock);
+  // <1>
+  // a late thread may still be looking at the previous job
+  while (w->active) {
+    pthread_cond_wait(&w->work_done, &w->lock);
+  }
+  w->func       = func;
+  w->state      = state;
+  w->count      = count;
+  w->next_index = 0;
+  w->completed  = 0;
+  w->generation++;
+  pthread_cond_broadcast(&w->has_work);
+  pthread_mutex_unlock(&w->lock);
+  // <2>
+  // the calling thread is doing its share of the work as well
+  workers_execute(w);
+  pthread_mutex_lock(&w->lock);
+  while (w->active ||
+         __atomic_load_n(&w->completed, __ATOMIC_ACQUIRE) < count) {
+    pthread_cond_wait(&w->work_done, &w->lock);
+  }
+  pthread_mutex_unlock(&w->lock);
+}
+// end::workers_run[]
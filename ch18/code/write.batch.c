@@ -0,0 +1,295 @@
+#include <errno.h>
+#include <gavran/db.h>
+#include <gavran/internal.h>
+#include <stdlib.h>
+#include <string.h>
+
+// tag::write_batch_state_t[]
+typedef struct write_batch_btree_op {
+  btree_val_t kvp;
+  // <1>
+  // the key is in the data of the batch, which moves as it grows
+  size_t key_offset;
+  // the order it was added in, for operations on the same key
+  size_t seq;
+  bool del;
+  uint8_t _padding[7];
+} write_batch_btree_op_t;
+
+typedef struct write_batch_hash_op {
+  hash_val_t kvp;
+  bool del;
+  uint8_t _padding[7];
+} write_batch_hash_op_t;
+
+typedef struct write_batch_item_op {
+  // null for a container item
+  table_schema_t *schema;
+  uint64_t container_id;
+  // the data of a container item, or the entries of a table item
+  size_t offset;
+  size_t size;
+  uint64_t *item_id;
+} write_batch_item_op_t;
+
+struct write_batch_state {
+  reusable_buffer_t data;
+  reusable_buffer_t btree_ops;
+  reusable_buffer_t hash_ops;
+  reusable_buffer_t item_ops;
+  // used while applying the batch
+  reusable_buffer_t tmp;
+};
+// end::write_batch_state_t[]
+
+// tag::write_batch_create[]
+result_t write_batch_create(write_batch_t *batch) {
+  ensure(mem_calloc(
+      (void *)&batch->state, sizeof(write_batch_state_t)));
+  return success();
+}
+
+result_t write_batch_close(write_batch_t *batch) {
+  if (!batch || !batch->state) return success();
+  free(batch->state->data.address);
+  free(batch->state->btree_ops.address);
+  free(batch->state->hash_ops.address);
+  free(batch->state->item_ops.address);
+  free(batch->state->tmp.address);
+  free(batch->state);
+  batch->state = 0;
+  return success();
+}
+// end::write_batch_create[]
+
+// tag::write_batch_add[]
+static result_t write_batch_reserve(
+    reusable_buffer_t *buffer, size_t size) {
+  if (buffer->used + size > buffer->size) {
+    size_t new_size = next_power_of_two(buffer->used + size);
+    ensure(mem_realloc(&buffer->address, new_size));
+    buffer->size = new_size;
+  }
+  return success();
+}
+
+static result_t write_batch_append(reusable_buffer_t *buffer,
+    void *src, size_t size, size_t *offset) {
+  ensure(write_batch_reserve(buffer, size));
+  if (offset) *offset = buffer->used;
+  memcpy(buffer->address + buffer->used, src, size);
+  buffer->used += size;
+  return success();
+}
+
+static result_t write_batch_add_btree(write_batch_t *batch,
+    uint64_t tree_id, span_t *key, uint64_t val, bool del) {
+  write_batch_state_t *state = batch->state;
+  write_batch_btree_op_t op  = {.kvp = {.tree_id = tree_id,
+                                   .key = {.size = key->size},
+                                   .val = val},
+      .seq = state->btree_ops.used / sizeof(write_batch_btree_op_t),
+      .del = del};
+  ensure(key->size > 0 && key->size <= 512,
+      msg("Invalid btree key size"), with(key->size, "%zu"));
+  ensure(write_batch_reserve(
+      &state->btree_ops, sizeof(write_batch_btree_op_t)));
+  ensure(write_batch_append(
+      &state->data, key->address, key->size, &op.key_offset));
+  ensure(write_batch_append(
+      &state->btree_ops, &op, sizeof(write_batch_btree_op_t), 0));
+  return success();
+}
+
+result_t write_batch_btree_set(write_batch_t *batch,
+    uint64_t tree_id, span_t key, uint64_t val) {
+  return write_batch_add_btree(batch, tree_id, &key, val, false);
+}
+
+result_t write_batch_btree_del(
+    write_batch_t *batch, uint64_t tree_id, span_t key) {
+  return write_batch_add_btree(batch, tree_id, &key, 0, true);
+}
+
+result_t write_batch_hash_set(write_batch_t *batch, uint64_t hash_id,
+    uint64_t key, uint64_t val) {
+  write_batch_hash_op_t op = {
+      .kvp = {.hash_id = hash_id, .key = key, .val = val}};
+  ensure(write_batch_append(&batch->state->hash_ops, &op,
+      sizeof(write_batch_hash_op_t), 0));
+  return success();
+}
+
+result_t write_batch_hash_del(
+    write_batch_t *batch, uint64_t hash_id, uint64_t key) {
+  write_batch_hash_op_t op = {
+      .kvp = {.hash_id = hash_id, .key = key}, .del = true};
+  ensure(write_batch_append(&batch->state->hash_ops, &op,
+      sizeof(write_batch_hash_op_t), 0));
+  return success();
+}
+
+result_t write_batch_container_put(write_batch_t *batch,
+    uint64_t container_id, span_t data, uint64_t *item_id) {
+  write_batch_state_t *state = batch->state;
+  write_batch_item_op_t op   = {.container_id = container_id,
+      .size = data.size, .item_id = item_id};
+  ensure(write_batch_reserve(
+      &state->item_ops, sizeof(write_batch_item_op_t)));
+  ensure(write_batch_append(
+      &state->data, data.address, data.size, &op.offset));
+  ensure(write_batch_append(
+      &state->item_ops, &op, sizeof(write_batch_item_op_t), 0));
+  return success();
+}
+
+result_t write_batch_table_set(write_batch_t *batch,
+    table_schema_t *schema, span_t *entries,
+    uint16_t number_of_entries, uint64_t *item_id) {
+  write_batch_state_t *state = batch->state;
+  write_batch_item_op_t op   = {.schema = schema,
+      .size = number_of_entries, .item_id = item_id};
+  size_t size = number_of_entries * sizeof(span_t);
+  for (size_t i = 0; i < number_of_entries; i++) {
+    size += entries[i].size;
+  }
+  ensure(write_batch_reserve(
+      &state->item_ops, sizeof(write_batch_item_op_t)));
+  ensure(write_batch_reserve(&state->data, size));
+  // <1>
+  // the entries are followed by their data, with the offsets of the
+  // data instead of its address
+  op.offset         = state->data.used;
+  span_t *copies    = state->data.address + op.offset;
+  size_t data_start = op.offset + number_of_entries * sizeof(span_t);
+  for (size_t i = 0; i < number_of_entries; i++) {
+    copies[i].address = (void *)data_start;
+    copies[i].size    = entries[i].size;
+    memcpy(state->data.address + data_start, entries[i].address,
+        entries[i].size);
+    data_start += entries[i].size;
+  }
+  state->data.used = data_start;
+  ensure(write_batch_append(
+      &state->item_ops, &op, sizeof(write_batch_item_op_t), 0));
+  return success();
+}
+// end::write_batch_add[]
+
+// tag::write_batch_apply[]
+static result_t write_batch_apply_items(
+    txn_t *tx, write_batch_state_t *state) {
+  write_batch_item_op_t *ops = state->item_ops.address;
+  size_t count = state->item_ops.used / sizeof(write_batch_item_op_t);
+  for (size_t i = 0; i < count; i++) {
+    uint64_t item_id;
+    if (!ops[i].schema) {
+      container_item_t item = {.container_id = ops[i].container_id,
+          .data = {.address = state->data.address + ops[i].offset,
+              .size         = ops[i].size}};
+      ensure(container_item_put(tx, &item));
+      item_id = item.item_id;
+    } else {
+      span_t *copies = state->data.address + ops[i].offset;
+      state->tmp.used = 0;
+      ensure(write_batch_reserve(
+          &state->tmp, ops[i].size * sizeof(span_t)));
+      span_t *entries = state->tmp.address;
+      for (size_t j = 0; j < ops[i].size; j++) {
+        entries[j].address =
+            state->data.address + (size_t)copies[j].address;
+        entries[j].size = copies[j].size;
+      }
+      table_item_t item = {.schema = ops[i].schema,
+          .entries             = entries,
+          .number_of_entries   = (uint16_t)ops[i].size};
+      ensure(table_set(tx, &item));
+      item_id = item.item_id;
+    }
+    if (ops[i].item_id) *ops[i].item_id = item_id;
+  }
+  return success();
+}
+
+static int write_batch_compare_btree_ops(
+    const void *a, const void *b) {
+  const write_batch_btree_op_t *x = a;
+  const write_batch_btree_op_t *y = b;
+  if (x->kvp.tree_id != y->kvp.tree_id) {
+    return x->kvp.tree_id < y->kvp.tree_id ? -1 : 1;
+  }
+  int match = memcmp(x->kvp.key.address, y->kvp.key.address,
+      MIN(x->kvp.key.size, y->kvp.key.size));
+  if (match) return match;
+  if (x->kvp.key.size != y->kvp.key.size) {
+    return x->kvp.key.size < y->kvp.key.size ? -1 : 1;
+  }
+  return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static result_t write_batch_apply_btrees(
+    txn_t *tx, write_batch_state_t *state) {
+  write_batch_btree_op_t *ops = state->btree_ops.address;
+  size_t count =
+      state->btree_ops.used / sizeof(write_batch_btree_op_t);
+  for (size_t i = 0; i < count; i++) {
+    ops[i].kvp.key.address = state->data.address + ops[i].key_offset;
+  }
+  qsort(ops, count, sizeof(write_batch_btree_op_t),
+      write_batch_compare_btree_ops);
+  state->tmp.used = 0;
+  ensure(
+      write_batch_reserve(&state->tmp, count * sizeof(btree_val_t)));
+  btree_val_t *sets = state->tmp.address;
+  size_t i          = 0;
+  while (i < count) {
+    if (ops[i].del) {
+      ensure(btree_del(tx, &ops[i].kvp));
+      i++;
+      continue;
+    }
+    // <1>
+    // runs of sets are applied together, sharing the path to a leaf
+    size_t run = 0;
+    for (; i < count && !ops[i].del; i++) {
+      memcpy(&sets[run++], &ops[i].kvp, sizeof(btree_val_t));
+    }
+    ensure(btree_set_many(tx, sets, run));
+  }
+  return success();
+}
+
+static result_t write_batch_apply_hashes(
+    txn_t *tx, write_batch_state_t *state) {
+  write_batch_hash_op_t *ops = state->hash_ops.address;
+  size_t count = state->hash_ops.used / sizeof(write_batch_hash_op_t);
+  // <2>
+  // hashing spreads neighboring keys anyway, these are kept in order
+  for (size_t i = 0; i < count; i++) {
+    hash_val_t kvp = ops[i].kvp;
+    if (ops[i].del) {
+      ensure(hash_del(tx, &kvp));
+    } else {
+      ensure(hash_set(tx, &kvp, 0));
+    }
+  }
+  return success();
+}
+
+result_t write_batch_apply(txn_t *tx, write_batch_t *batch) {
+  errors_assert_empty();
+  ensure(write_batch_apply_items(tx, batch->state));
+  ensure(write_batch_apply_btrees(tx, batch->state));
+  ensure(write_batch_apply_hashes(tx, batch->state));
+  return success();
+}
+
+result_t write_batch_commit(db_t *db, write_batch_t *batch) {
+  txn_t w;
+  ensure(txn_create(db, TX_WRITE, &w));
+  defer(txn_close, w);
+  ensure(write_batch_apply(&w, batch));
+  ensure(txn_commit(&w));
+  return success();
+}
+// end::write_batch_apply[]
@@ -53,6 +53,17 @@ result_t pages_get(txn_t *tx, page_t *p);
 result_t pages_write(db_state_t *db, page_t *p);
 // end::paging_api[]
 
+// tag::page_checksum_t[]
+// how unencrypted pages & WAL records are checksummed, BLAKE2b
+// is the default, CRC32C is much cheaper on hardware supporting it
+typedef enum __attribute__((__packed__)) page_checksum {
+  page_checksum_blake2b = 0,
+  page_checksum_crc32c  = 1,
+} page_checksum_t;
+
+#define CHECKSUM_BYTES crypto_generichash_BYTES
+// end::page_checksum_t[]
+
 // tag::page_crypto_metadata_t[]
 typedef struct page_crypto_metadata {
   union {
@@ -144,6 +155,14 @@ typedef struct free_space_bitmap_heart {
 // tag::file_header[]
 #define FILE_HEADER_MAGIC "GVRN!"
 
+// the high nibble of the version is the page_checksum_t, so files
+// created before it was introduced are using BLAKE2b
+#define FILE_HEADER_VERSION_MASK 0x0F
+#define FILE_HEADER_CHECKSUM_MASK 0x70
+#define FILE_HEADER_CHECKSUM_SHIFT 4
+// set on files created with db_flags_encryption_file_key
+#define FILE_HEADER_FILE_KEY 0x80
+
 typedef struct file_header {
   page_flags_t page_flags;
   uint8_t version;
@@ -203,6 +222,11 @@ typedef enum db_flags {
   db_flags_page_validation_once   = 1 << 7,
   db_flags_page_validation_always = 1 << 8,
   db_flags_log_shipping_target    = 1 << 9,
+  db_flags_wal_group_commit       = 1 << 10,
+  // only used when creating an encrypted file, pages share a key
+  // derived once for the file instead of deriving one per page. An
+  // existing file keeps the keys it was created with
+  db_flags_encryption_file_key    = 1 << 11,
   db_flags_page_validation_none =
       db_flags_page_validation_once | db_flags_page_validation_always,
   db_flags_page_validation_none_mask =
@@ -213,12 +237,6 @@ typedef enum db_flags {
 
 } db_flags_t;
 
-// tag::txn_t[]
-typedef struct txn {
-  txn_state_t *state;
-  pages_map_t *working_set;
-} txn_t;
-// end::txn_t[]
 // end::tx_structs[]
 
 // tag::wal_write_callback_t[]
@@ -236,10 +254,49 @@ typedef struct db_options {
   uint32_t _padding;
   wal_write_callback_t wal_write_callback;
   void *wal_write_callback_state;
+  // the most the WAL writer puts in a single write, only relevant
+  // with db_flags_wal_group_commit or txn_commit_async()
+  uint64_t wal_group_commit_max_size;
+  uint64_t wal_group_commit_max_txs;
+  // adjacent pages are merged into writes up to this size
+  uint64_t write_back_max_io_size;
+  // 0 means recovering the WAL on the calling thread only
+  uint64_t wal_recovery_threads;
+  // smaller WAL records are written without compression
+  uint64_t wal_compression_min_size;
+  // passed to zstd, 0 means zstd's default level
+  int32_t wal_compression_level;
+  uint32_t _padding2;
+  // max size of a trained WAL dictionary, 0 disables sampling and
+  // compressing new records with a dictionary
+  uint64_t wal_dictionary_size;
+  // number of WAL segments, each preallocated to wal_size. An
+  // existing database keeps using all the segments it has
+  uint64_t wal_segments;
+  // only used when creating the file, afterward the file header
+  // determines the checksum
+  page_checksum_t page_checksum;
+  uint8_t _padding3[7];
+  // 0 means finalizing the modified pages of a txn on the committing
+  // thread only
+  uint64_t commit_threads;
+  // pages that read txns of an encrypted or db_flags_avoid_mmap_io db
+  // share, instead of decrypting or reading them again, 0 disables
+  // the cache
+  uint64_t pages_cache_size;
 } db_options_t;
 // end::database_page_validation_options[]
 
+typedef struct reusable_buffer {
+  void *address;
+  size_t size;
+  size_t used;
+} reusable_buffer_t;
+
 // tag::wal_data_structs[]
+// segments are named 'a', 'b', etc after the data file
+#define WAL_MAX_SEGMENTS 16
+
 typedef struct wal_file_state {
   file_handle_t *handle;
   span_t span;
@@ -249,11 +306,41 @@ typedef struct wal_file_state {
 
 typedef struct wal_state {
   size_t current_append_file_index;
-  wal_file_state_t files[2];
+  // only the first number_of_segments are in use
+  wal_file_state_t files[WAL_MAX_SEGMENTS];
+  size_t number_of_segments;
+  uint64_t durable_tx_id;
+  // WAL records waiting for the next group commit
+  reusable_buffer_t pending;
+  uint64_t pending_txs;
+  // kept for the lifetime of the WAL, to avoid setup per commit
+  struct ZSTD_CCtx_s *compression_ctx;
+  struct ZSTD_DCtx_s *decompression_ctx;
+  reusable_buffer_t compression_buffer;
+  // trained dictionaries, see db_train_wal_dictionary()
+  struct wal_dictionary *dictionaries;
+  struct ZSTD_CDict_s *compression_dictionary;
+  uint64_t compression_dictionary_page;
+  reusable_buffer_t dictionary_samples;
+  reusable_buffer_t dictionary_sample_sizes;
+  // set when pending records failed to be written, they were dropped
+  // & the WAL rejects any further writes
+  bool failed;
+  uint8_t _padding[7];
 } wal_state_t;
 // end::wal_data_structs[]
 
 // tag::db_state_t[]
+typedef struct wal_writer wal_writer_t;
+typedef struct txn_epoch txn_epoch_t;
+typedef struct txn_reader txn_reader_t;
+typedef struct txn_versions txn_versions_t;
+typedef struct pages_pool pages_pool_t;
+typedef struct workers workers_t;
+typedef struct pages_cache pages_cache_t;
+typedef struct free_space_index free_space_index_t;
+typedef struct free_space_extents free_space_extents_t;
+
 typedef struct db_state {
   db_options_t options;
   span_t map;
@@ -268,6 +355,23 @@ typedef struct db_state {
   uint64_t *first_read_bitmap;
   uint64_t original_number_of_pages;
   uint64_t oldest_active_tx;
+  wal_writer_t *wal_writer;
+  // read txns may run on any thread, see txn.epoch.c
+  txn_epoch_t *epoch;
+  // pages of committed txns, by page number, see txn.versions.c
+  txn_versions_t *versions;
+  // buffers for the pages txns copy, see pages.pool.c
+  pages_pool_t *pages_pool;
+  // hash or encrypt the pages of large txns, see txn.c
+  workers_t *commit_workers;
+  // plain text pages borrowed by read txns, see pages.cache.c
+  pages_cache_t *pages_cache;
+  // free pages per region of the file, see free_space.index.c
+  free_space_index_t *free_space;
+  // recently freed ranges by size, see free_space.extents.c
+  free_space_extents_t *free_space_extents;
+  // mlock'ed, with db_flags_encryption_file_key, see txn.c
+  uint8_t *encryption_file_key;
 } db_state_t;
 // end::db_state_t[]
 
@@ -288,13 +392,8 @@ typedef struct btree_stack {
 } btree_stack_t;
 // end::btree_stack_t[]
 
-typedef struct reusable_buffer {
-  void *address;
-  size_t size;
-  size_t used;
-} reusable_buffer_t;
-
 // tag::txn_state_t[]
+typedef struct txn_savepoint txn_savepoint_t;
 typedef struct txn_state {
   uint64_t tx_id;
   db_state_t *db;
@@ -307,20 +406,65 @@ typedef struct txn_state {
   txn_state_t *next_tx;
   void *shipped_wal_record;
   uint64_t can_free_after_tx_id;
+  // the reclamation epoch the state was retired at
+  uint64_t epoch;
   struct {
     reusable_buffer_t buffer;
     btree_stack_t stack;
   } tmp;
+  // the innermost savepoint of a write txn
+  txn_savepoint_t *savepoints;
   uint32_t usages;
   db_flags_t flags;
 } txn_state_t;
 // end::txn_state_t[]
 
+// tag::txn_t[]
+typedef struct txn {
+  txn_state_t *state;
+  pages_map_t *working_set;
+  // read txns get their own view of the committed state, so they
+  // can run on any thread without allocating
+  txn_state_t read_view;
+  // where a read txn announces its epoch & snapshot to the gc
+  txn_reader_t *reader;
+  // the page after the last one read from the file, a read of this
+  // page reads the next ones ahead of time, see txn_read_ahead()
+  uint64_t next_page_read;
+} txn_t;
+// end::txn_t[]
+
 // tag::txn_api[]
 result_t db_create(
     const char *filename, db_options_t *options, db_t *db);
 result_t db_close(db_t *db);
 enable_defer(db_close);
+result_t db_flush_wal(db_t *db);
+result_t db_train_wal_dictionary(db_t *db);
+
+// tag::pages_pool_stats_t[]
+typedef struct pages_pool_stats {
+  // buffers handed out from the pool
+  uint64_t hits;
+  // buffers the pool had to carve from a slab
+  uint64_t misses;
+  // the most buffers the pool held at once
+  uint64_t high_water_mark;
+} pages_pool_stats_t;
+void db_pages_pool_stats(db_t *db, pages_pool_stats_t *stats);
+// end::pages_pool_stats_t[]
+
+// tag::pages_cache_stats_t[]
+typedef struct pages_cache_stats {
+  // pages a read txn borrowed from the cache
+  uint64_t hits;
+  // pages that were decrypted or read into the cache
+  uint64_t misses;
+  // cached pages that were replaced by other pages
+  uint64_t evictions;
+} pages_cache_stats_t;
+void db_pages_cache_stats(db_t *db, pages_cache_stats_t *stats);
+// end::pages_cache_stats_t[]
 
 result_t txn_create(db_t *db, db_flags_t flags, txn_t *tx);
 result_t txn_close(txn_t *tx);
@@ -329,6 +473,26 @@ enable_defer(txn_close);
 result_t txn_commit(txn_t *tx);
 result_t txn_raw_get_page(txn_t *tx, page_t *page);
 
+// tag::txn_commit_async[]
+typedef void (*txn_commit_callback_t)(
+    void *state, uint64_t tx_id, bool durable);
+result_t txn_commit_async(
+    txn_t *tx, txn_commit_callback_t callback, void *state);
+// end::txn_commit_async[]
+
+// tag::txn_savepoint[]
+// a write txn can undo the changes made after a savepoint & go on.
+// Pages are only rolled back if they were modified after it using
+// txn_modify_page(), addresses from before it may be stale after
+// a rollback
+result_t txn_savepoint(txn_t *tx, txn_savepoint_t **savepoint);
+// the savepoint stays active, later ones are discarded
+result_t txn_rollback_to(txn_t *tx, txn_savepoint_t *savepoint);
+// keeps the changes, discarding the savepoint & later ones
+result_t txn_release_savepoint(
+    txn_t *tx, txn_savepoint_t *savepoint);
+// end::txn_savepoint[]
+
 result_t txn_raw_modify_page(txn_t *tx, page_t *page);
 // end::txn_api[]
 
@@ -359,6 +523,28 @@ static inline void bitmap_set(
 static inline bool bitmap_is_set(uint64_t *buffer, uint64_t pos) {
   return (buffer[pos / 64] & (1UL << pos % 64)) != 0;
 }
+// a word at a time, returns how many of the bits changed
+static inline uint64_t bitmap_set_range(
+    uint64_t *buffer, uint64_t pos, uint64_t count, bool val) {
+  uint64_t changed = 0;
+  while (count) {
+    uint64_t bit  = pos % 64;
+    uint64_t bits = MIN(count, 64 - bit);
+    uint64_t mask = (bits == 64 ? UINT64_MAX : (1UL << bits) - 1)
+                    << bit;
+    uint64_t *word = &buffer[pos / 64];
+    if (val) {
+      changed += (uint64_t)__builtin_popcountl(~*word & mask);
+      *word |= mask;
+    } else {
+      changed += (uint64_t)__builtin_popcountl(*word & mask);
+      *word &= ~mask;
+    }
+    pos += bits;
+    count -= bits;
+  }
+  return changed;
+}
 // end::bit-manipulations[]
 
 result_t wal_apply_wal_record(db_t *db, reusable_buffer_t *tmp_buffer,
@@ -438,6 +624,9 @@ result_t btree_create(txn_t *tx, uint64_t *tree_id);
 result_t btree_drop(txn_t *tx, uint64_t tree_id);
 
 result_t btree_set(txn_t *tx, btree_val_t *set, btree_val_t *old);
+// sets the values in order, keys that are sorted share the path to
+// their leaf instead of searching from the root for each one
+result_t btree_set_many(txn_t *tx, btree_val_t *sets, size_t count);
 result_t btree_get(txn_t *tx, btree_val_t *kvp);
 result_t btree_del(txn_t *tx, btree_val_t *del);
 // end::btree_api[]
@@ -508,3 +697,39 @@ result_t table_set(txn_t *tx, table_item_t *item);
 result_t table_del(txn_t *tx, table_item_t *item);
 
 result_t table_get(txn_t *tx, table_item_t *item);
+
+// tag::write_batch_api[]
+// operations on several btrees, hashes, containers & tables that
+// are applied together. The keys & values are copied to the batch
+typedef struct write_batch_state write_batch_state_t;
+typedef struct write_batch {
+  write_batch_state_t *state;
+} write_batch_t;
+
+result_t write_batch_create(write_batch_t *batch);
+result_t write_batch_close(write_batch_t *batch);
+enable_defer(write_batch_close);
+
+result_t write_batch_btree_set(write_batch_t *batch,
+    uint64_t tree_id, span_t key, uint64_t val);
+result_t write_batch_btree_del(
+    write_batch_t *batch, uint64_t tree_id, span_t key);
+result_t write_batch_hash_set(write_batch_t *batch, uint64_t hash_id,
+    uint64_t key, uint64_t val);
+result_t write_batch_hash_del(
+    write_batch_t *batch, uint64_t hash_id, uint64_t key);
+// the id of the new item is set when the batch is applied, if the
+// item_id isn't null
+result_t write_batch_container_put(write_batch_t *batch,
+    uint64_t container_id, span_t data, uint64_t *item_id);
+// the schema must be valid until the batch is applied
+result_t write_batch_table_set(write_batch_t *batch,
+    table_schema_t *schema, span_t *entries,
+    uint16_t number_of_entries, uint64_t *item_id);
+
+// the containers & tables are written first, in order. Then btree
+// operations sorted by tree & key, then the hash operations
+result_t write_batch_apply(txn_t *tx, write_batch_t *batch);
+// applies the batch in a new write txn & commits it
+result_t write_batch_commit(db_t *db, write_batch_t *batch);
+// end::write_batch_api[]
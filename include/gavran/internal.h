@@ -12,6 +12,8 @@ typedef struct pages_hash_table {
 
 result_t pagesmap_put_new(pages_map_t **table_p, page_t *page);
 bool pagesmap_lookup(pages_map_t *table, page_t *page);
+// replaces the entry of the same page, false if there isn't one
+bool pagesmap_update(pages_map_t *table, page_t *page);
 bool pagesmap_get_next(
     pages_map_t *table, size_t *state, page_t **page);
 result_t pagesmap_new(
@@ -20,6 +22,13 @@ result_t pagesmap_new(
 
 implementation_detail void txn_free_single_tx_state(
     txn_state_t *state);
+// keeps the start of the page, the rest of it is zeroed
+implementation_detail result_t txn_resize_modified_page(
+    txn_state_t *state, page_t *page, uint32_t number_of_pages);
+
+// sorted by page number, adjacent pages are merged to a single write
+implementation_detail result_t txn_write_pages_to_disk(
+    db_state_t *db, pages_map_t *modified_pages, bool sync);
 
 implementation_detail void txn_clear_working_set(txn_t *tx);
 static inline void defer_txn_clear_working_set(cancel_defer_t *cd) {
@@ -29,6 +38,8 @@ static inline void defer_txn_clear_working_set(cancel_defer_t *cd) {
 
 implementation_detail result_t db_increase_file_size(
     txn_t *tx, uint64_t new_size);
+implementation_detail result_t db_finalize_new_file_size(
+    txn_t *tx, uint64_t pages);
 
 implementation_detail uint64_t db_find_next_db_size(
     uint64_t current, uint64_t requested_size);
@@ -38,6 +49,9 @@ implementation_detail result_t db_validate_options(
 implementation_detail result_t db_setup_page_validation(db_t *ptr);
 
 implementation_detail result_t db_init(db_t *db);
+// pages share the file key if the file header says so
+implementation_detail void db_use_file_key(
+    db_state_t *db, file_header_t *header);
 
 implementation_detail result_t db_initialize_default_read_tx(
     db_state_t *db_state);
@@ -50,7 +64,7 @@ implementation_detail void db_initialize_default_options(
 
 __attribute__((const)) static inline uint64_t next_power_of_two(
     uint64_t x) {
-  return 1 << (64 - __builtin_clzll(x - 1));
+  return 1UL << (64 - __builtin_clzll(x - 1));
 }
 
 // tag::bitmap_search[]
@@ -84,12 +98,227 @@ implementation_detail bool bitmap_is_acceptable_match(
 // tag::wal_api[]
 result_t wal_open_and_recover(db_t *db);
 result_t wal_append(txn_state_t *tx);
+result_t wal_flush(db_state_t *db);
 bool wal_will_checkpoint(db_state_t *db, uint64_t tx_id);
 result_t wal_checkpoint(db_state_t *db, uint64_t tx_id);
 result_t wal_close(db_state_t *db);
 enable_defer(wal_close);
 // end::wal_api[]
 
+// tag::wal_diff_page_api[]
+// wal_diff_page() with the scan kernel picked by the caller, scalar
+// forces the word at a time scan. Only ch18 has it
+implementation_detail void *wal_diff_page_kernel(
+    uint64_t *restrict origin, uint64_t *restrict modified,
+    size_t size, void *output, bool scalar);
+// end::wal_diff_page_api[]
+
+// tag::checksum_api[]
+implementation_detail uint32_t checksum_crc32c(
+    const void *buf, size_t size);
+implementation_detail result_t checksum_compute(page_checksum_t kind,
+    const void *buf, size_t size, uint8_t hash[CHECKSUM_BYTES]);
+// end::checksum_api[]
+
+// tag::workers_api[]
+typedef void (*workers_func_t)(void *state, size_t index);
+// runs func(state, i) for i in [0, count) on all the threads
+implementation_detail void workers_run(workers_t *workers,
+    workers_func_t func, void *state, size_t count);
+implementation_detail result_t workers_create(
+    size_t number_of_threads, workers_t **workers);
+implementation_detail void workers_destroy(workers_t *workers);
+static inline void defer_workers_destroy(cancel_defer_t *cd) {
+  if (cd->cancelled && *cd->cancelled) return;
+  workers_destroy(*(workers_t **)cd->target);
+}
+// end::workers_api[]
+
+// tag::wal_writer_api[]
+implementation_detail result_t wal_prepare_record(
+    txn_state_t *tx, span_t *record);
+implementation_detail result_t wal_seal_record(
+    db_state_t *db, span_t *record);
+implementation_detail result_t wal_add_pending(
+    db_state_t *db, span_t *record);
+// drops the pending records after a failed write, see wal_state_t
+implementation_detail void wal_fail_pending(db_state_t *db);
+
+implementation_detail result_t wal_writer_start(db_state_t *db);
+implementation_detail result_t wal_writer_stop(db_state_t *db);
+implementation_detail result_t wal_writer_submit(txn_state_t *tx,
+    txn_commit_callback_t callback, void *callback_state);
+implementation_detail result_t wal_writer_wait(
+    db_state_t *db, uint64_t tx_id);
+
+implementation_detail void wal_writer_acquire_write_tx(
+    db_state_t *db);
+implementation_detail void wal_writer_release_write_tx(
+    db_state_t *db, uint64_t tx_id);
+implementation_detail void wal_writer_lock(db_state_t *db);
+implementation_detail void wal_writer_unlock(db_state_t *db);
+static inline void defer_wal_writer_unlock(cancel_defer_t *cd) {
+  if (cd->cancelled && *cd->cancelled) return;
+  wal_writer_unlock(*(db_state_t **)cd->target);
+}
+// end::wal_writer_api[]
+
+// tag::txn_epoch_api[]
+implementation_detail result_t txn_epoch_create(db_state_t *db);
+implementation_detail void txn_epoch_destroy(db_state_t *db);
+implementation_detail result_t txn_epoch_enter(
+    db_state_t *db, txn_reader_t **reader);
+implementation_detail txn_state_t *txn_epoch_pin(
+    db_state_t *db, txn_reader_t *reader);
+implementation_detail void txn_epoch_exit(
+    db_state_t *db, txn_reader_t *reader);
+implementation_detail uint64_t txn_epoch_oldest_reader(
+    db_state_t *db);
+// the lock guards the txn chain, taken by writers & the gc
+implementation_detail void txn_epoch_lock(db_state_t *db);
+implementation_detail bool txn_epoch_trylock(db_state_t *db);
+implementation_detail void txn_epoch_unlock(db_state_t *db);
+static inline void defer_txn_epoch_unlock(cancel_defer_t *cd) {
+  if (cd->cancelled && *cd->cancelled) return;
+  txn_epoch_unlock(*(db_state_t **)cd->target);
+}
+implementation_detail void txn_epoch_retire(
+    db_state_t *db, txn_state_t *state);
+// memory that read txns may still be searching, starts with this
+typedef struct txn_retired {
+  struct txn_retired *next;
+  uint64_t epoch;
+} txn_retired_t;
+implementation_detail void txn_epoch_retire_memory(
+    db_state_t *db, txn_retired_t *memory);
+implementation_detail void txn_epoch_reclaim(db_state_t *db);
+// end::txn_epoch_api[]
+
+// tag::txn_file_key_api[]
+// the key pages share with db_flags_encryption_file_key
+implementation_detail result_t txn_file_key_create(db_state_t *db);
+implementation_detail void txn_file_key_destroy(db_state_t *db);
+// end::txn_file_key_api[]
+
+// tag::pages_pool_api[]
+// page sized buffers are pooled, larger ones use the heap
+implementation_detail result_t pages_pool_create(db_state_t *db);
+implementation_detail void pages_pool_destroy(db_state_t *db);
+implementation_detail result_t pages_pool_alloc(
+    db_state_t *db, uint32_t number_of_pages, void **buffer);
+implementation_detail void pages_pool_free(
+    db_state_t *db, uint32_t number_of_pages, void *buffer);
+// returns all the buffers in the map at once
+implementation_detail void pages_pool_free_map(
+    db_state_t *db, pages_map_t *pages);
+
+// returned to the pool by try_defer() if the caller fails
+typedef struct page_buffer {
+  db_state_t *db;
+  void *address;
+  uint32_t number_of_pages;
+  uint32_t _padding;
+} page_buffer_t;
+static inline void defer_pages_pool_free_buffer(cancel_defer_t *cd) {
+  if (cd->cancelled && *cd->cancelled) return;
+  page_buffer_t *b = cd->target;
+  pages_pool_free(b->db, b->number_of_pages, b->address);
+}
+// end::pages_pool_api[]
+
+// tag::pages_cache_api[]
+implementation_detail result_t pages_check_bounds(
+    txn_t *tx, page_t *p);
+// single pages, by page number & the tx id of the version, 0 for the
+// version in the data file. Callers hold a reference to the buffer
+// until they release it
+implementation_detail result_t pages_cache_create(db_state_t *db);
+implementation_detail void pages_cache_destroy(db_state_t *db);
+implementation_detail bool pages_cache_get(db_state_t *db,
+    uint64_t page_num, uint64_t version, void **buffer);
+// an unused buffer to fill, false if all of them are in use
+implementation_detail bool pages_cache_reserve(
+    db_state_t *db, void **buffer);
+// returns the buffer to use, another thread may have cached the page
+implementation_detail void *pages_cache_insert(db_state_t *db,
+    uint64_t page_num, uint64_t version, void *buffer);
+implementation_detail void pages_cache_release(
+    db_state_t *db, void *buffer);
+implementation_detail bool pages_cache_owns(
+    db_state_t *db, void *buffer);
+// the page was written to the data file
+implementation_detail void pages_cache_invalidate(
+    db_state_t *db, uint64_t page_num);
+static inline void defer_pages_cache_release(cancel_defer_t *cd) {
+  if (cd->cancelled && *cd->cancelled) return;
+  page_buffer_t *b = cd->target;
+  pages_cache_release(b->db, b->address);
+}
+// end::pages_cache_api[]
+
+// tag::txn_versions_api[]
+// the committed pages that weren't written to the file yet, by page
+// number, newest version first. Changed under the txn chain lock
+implementation_detail result_t txn_versions_reserve(
+    db_state_t *db, size_t count);
+implementation_detail void txn_versions_publish(
+    db_state_t *db, txn_state_t *state);
+implementation_detail void txn_versions_release(
+    db_state_t *db, txn_state_t *state);
+// the version is the tx id that wrote the page
+implementation_detail bool txn_versions_lookup(db_state_t *db,
+    uint64_t tx_id, page_t *page, uint64_t *version);
+implementation_detail void txn_versions_destroy(db_state_t *db);
+// end::txn_versions_api[]
+
+// tag::txn_savepoint_api[]
+// called for pages modified while a savepoint is active, before a
+// new page is added to the modified pages
+implementation_detail result_t txn_savepoint_record(
+    txn_t *tx, page_t *page, bool new_page);
+implementation_detail void txn_savepoint_free_all(
+    txn_state_t *state);
+// end::txn_savepoint_api[]
+
+// tag::free_space_index_api[]
+// used by the write txn to skip the parts of the bitmap that can't
+// fit an allocation, built from the bitmap when it is first needed
+implementation_detail result_t free_space_index_search(
+    txn_t *tx, bitmap_search_state_t *search, bool *found);
+// changed is how many of the count pages from page_num were flipped
+implementation_detail void free_space_index_update(txn_t *tx,
+    uint64_t page_num, uint64_t count, uint64_t changed, bool busy);
+// the changes of a txn that was rolled back, or of a shipped log
+implementation_detail void free_space_index_discard(
+    txn_state_t *state);
+implementation_detail void free_space_index_destroy(db_state_t *db);
+// end::free_space_index_api[]
+
+// tag::free_space_extents_api[]
+// free ranges by size class, used before searching the bitmap when
+// one is near the hint. Fed by freed pages & rebuilt from the bitmap
+// when they are stale
+implementation_detail result_t free_space_extents_take(
+    txn_t *tx, bitmap_search_state_t *search, bool *found);
+implementation_detail void free_space_extents_add(txn_t *tx,
+    uint64_t *bitmap, uint64_t bitmap_size, uint64_t page_num,
+    uint64_t count);
+implementation_detail void free_space_extents_discard(
+    txn_state_t *state);
+implementation_detail void free_space_extents_destroy(db_state_t *db);
+// end::free_space_extents_api[]
+
+// tag::wal_dictionary_api[]
+implementation_detail void wal_dictionary_add_sample(
+    db_state_t *db, void *start, size_t size);
+implementation_detail struct ZSTD_DDict_s *wal_dictionary_find(
+    wal_state_t *wal, uint64_t page_num);
+implementation_detail result_t wal_dictionary_get(
+    db_t *db, uint64_t page_num, struct ZSTD_DDict_s **ddict);
+implementation_detail result_t wal_dictionary_open(db_t *db);
+implementation_detail void wal_dictionary_close(wal_state_t *wal);
+// end::wal_dictionary_api[]
+
 // varint
 // tag::varint_api[]
 uint32_t varint_get_length(uint64_t n);
@@ -25,6 +25,7 @@ typedef struct pal_file_handle {
   };
   char *filename;
   uint64_t size;
+  void *io_ring;  // only used by the io_uring backend
 } file_handle_t;
 
 // working with files
@@ -36,6 +37,7 @@ result_t pal_set_file_size(file_handle_t *handle,
 result_t pal_fsync(file_handle_t *handle);
 result_t pal_close_file(file_handle_t *handle);
 void defer_pal_close_file(struct cancel_defer *cd);
+result_t pal_file_exists(const char *path, bool *exists);
 
 // memory map
 result_t pal_mmap(file_handle_t *handle, uint64_t offset,
@@ -44,6 +46,15 @@ result_t pal_enable_writes(span_t *range);
 void defer_pal_disable_writes(cancel_defer_t *cd);
 result_t pal_unmap(span_t *range);
 void defer_pal_unmap(cancel_defer_t *cd);
+// maps the file from its start & holds the address space after it,
+// up to room bytes, for pal_mmap_grow. pal_unmap releases both
+result_t pal_mmap_with_room(file_handle_t *handle, uint64_t room,
+                            span_t *span);
+// grows the map at its current address, grown is false if there is
+// no room for it there
+result_t pal_mmap_grow(file_handle_t *handle, span_t *span,
+                       uint64_t new_size, bool *grown);
+result_t pal_mmap_shrink(span_t *span, uint64_t new_size);
 
 // reading and writing to a file
 result_t pal_write_file(file_handle_t *handle, uint64_t offset,
@@ -51,3 +62,23 @@ result_t pal_write_file(file_handle_t *handle, uint64_t offset,
 result_t pal_read_file(file_handle_t *handle, uint64_t offset,
                        void *buffer, size_t size);
 // end::pal_api[]
+
+// tag::pal_write_file_batch[]
+typedef struct pal_io_request {
+  uint64_t offset;
+  // written one after the other, starting at offset
+  span_t *buffers;
+  size_t number_of_buffers;
+} pal_io_request_t;
+
+// writes all the requests, if sync is set, the data is durable
+// once this returns, same as calling pal_fsync(). The requests and
+// their buffers may be modified by the call
+result_t pal_write_file_batch(file_handle_t *handle,
+                              pal_io_request_t *requests,
+                              size_t count, bool sync);
+// reads consecutive bytes at the offset to all the buffers, in order.
+// The request and its buffers may be modified by the call
+result_t pal_read_file_vectored(file_handle_t *handle,
+                                pal_io_request_t *request);
+// end::pal_write_file_batch[]